@@ -15,6 +15,8 @@
 #include "ali/ali_callback.h"
 #include "ali/ali_optional.h"
 
+#include <cmath>
+
 namespace Softphone
 {
 namespace EventHistory
@@ -44,6 +46,11 @@ namespace EventHistory
         ali::string             value;
     };
 
+    struct Paging;
+    struct StreamPaging;
+    class EventCursor;
+    class StreamCursor;
+
     //-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*
     struct FetchItem
     //-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*
@@ -80,7 +87,18 @@ namespace EventHistory
             items.swap(fr.items);
         }
 
-        int                         totalCount;
+        //-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*
+        bool hasTotalCount() const
+        //-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*
+        {
+            return totalCount >= 0;
+        }
+
+        /** @brief Cursor after the last item, to fetch the next page with
+          * @param paging The paging this result was fetched with */
+        EventCursor nextCursor(Paging const& paging) const;
+
+        int                         totalCount; // -1 if not counted
         ali::array<FetchItem>       items;
     };
 
@@ -207,7 +225,7 @@ namespace EventHistory
     struct Paging
     //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
     {
-        ali::optional<int>              offset; // prefer newerThan, olderThan, before or after
+        ali::optional<int>              offset; // prefer newerThan, olderThan, before, after or an EventCursor
         ali::optional<int>              limit;
         SortOrder::Type                 order{SortOrder::Descending};
         ali::optional<TimestampType>    newerThan; // inclusive
@@ -252,7 +270,24 @@ namespace EventHistory
             items.swap(fr.items);
         }
 
-        int                                 totalCount;
+        //-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*
+        bool hasTotalCount() const
+        //-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*
+        {
+            return totalCount >= 0;
+        }
+
+        /** @brief Cursor after the last item, to fetch the next page with
+          * @param paging The paging this result was fetched with */
+        StreamCursor nextCursor(StreamPaging const& paging) const;
+
+        /** @brief Cursor after the last item, to fetch the next page with
+          * @param paging The paging this result was fetched with
+          * @param previous The cursor this result was fetched from */
+        StreamCursor nextCursor(StreamPaging const& paging,
+                                StreamCursor const& previous) const;
+
+        int                                 totalCount; // -1 if not counted
         ali::array<StreamFetchItem>         items;
     };
 
@@ -292,12 +327,207 @@ namespace EventHistory
     struct StreamPaging
     //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
     {
-        ali::optional<int>                  offset;
+        ali::optional<int>                  offset; // prefer a StreamCursor
         ali::optional<int>                  limit;
 
         SortOrder::Type                     order{SortOrder::Descending};
     };
 
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class EventCursor
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Position after a page of events, for keyset paging
+      *
+      * Events are ordered by (timestamp, event ID). Instead of skipping
+      * Paging::offset events, the next page is bounded by Paging::before or
+      * Paging::after at the last event returned, so the storage seeks to it
+      * in its time index, and the page does not shift when events are added
+      * or deleted meanwhile. The cursor holds the last event, so deleting
+      * it does not invalidate the cursor.
+      *
+      * @code
+      * Paging paging;
+      * paging.limit = 50;
+      * FetchResult page;
+      * storage.fetchEvents(page, query, paging);
+      * EventCursor cursor = page.nextCursor(paging);
+      * ...
+      * if (!cursor.isEnd())
+      * {
+      *     Paging next = paging;
+      *     cursor.seek(next);
+      *     storage.fetchEvents(page, query, next);
+      *     cursor = page.nextCursor(next);
+      * }
+      * @endcode
+      */
+    {
+    public:
+        /** @brief Cursor before the first page */
+        EventCursor() = default;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        EventCursor(FetchResult const& result,
+                    Paging const& paging)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mOrder(paging.order)
+            , mEnd(paging.limit.is_null() || result.items.size() < *paging.limit)
+        {
+            if (!result.items.is_empty())
+                mLast = result.items.back().event;
+        }
+
+        /** @brief No more events after this cursor */
+        bool isEnd() const                          {return mEnd;}
+
+        /** @brief Last event of the page, null before the first page */
+        Event::Pointer const& getLastEvent() const  {return mLast;}
+
+        /** @brief Make @p paging fetch the page following the cursor
+          *
+          * Drops the offset and keeps the limit and time bounds. Apply to
+          * a copy of the paging the cursor was created with. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void seek(Paging & paging) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mLast.is_null())
+                return;
+
+            ali_assert(paging.order == mOrder);
+
+            paging.offset.reset();
+
+            if (paging.order == SortOrder::Ascending)
+                paging.after = mLast;
+            else
+                paging.before = mLast;
+        }
+
+    private:
+        Event::Pointer                      mLast;
+        SortOrder::Type                     mOrder{SortOrder::Descending};
+        bool                                mEnd{false};
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class StreamCursor
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Position after a page of streams, for keyset paging
+      *
+      * Streams are ordered by last activity (EventStream::getLastEventTimestamp)
+      * and key. Instead of skipping StreamPaging::offset streams, the next page
+      * is bounded by StreamQuery::lastActivityBefore or lastActivityAfter at
+      * the last activity of the last stream returned, and the streams already
+      * returned with that very same last activity are excluded by key.
+      *
+      * Used like EventCursor, except that seek() also narrows a copy of the
+      * query, and that the cursor a page was fetched from is passed on to
+      * StreamFetchResult::nextCursor.
+      */
+    {
+    public:
+        /** @brief Cursor before the first page */
+        StreamCursor() = default;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        StreamCursor(StreamFetchResult const& result,
+                     StreamPaging const& paging,
+                     StreamCursor const& previous)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mOrder(paging.order)
+            , mEnd(paging.limit.is_null() || result.items.size() < *paging.limit)
+        {
+            if (result.items.is_empty())
+                return;
+
+            double const last = result.items.back().stream->getLastEventTimestamp().value;
+
+            // A page full of streams with the same last activity
+            // continues the ties of the previous one.
+            if (!previous.mLastActivity.is_null() && previous.mLastActivity->value == last)
+                mTiedKeys = previous.mTiedKeys;
+
+            for (int i = result.items.size(); i > 0; --i)
+            {
+                EventStream const& stream = *result.items[i - 1].stream;
+
+                if (stream.getLastEventTimestamp().value != last)
+                    break;
+
+                mTiedKeys.insert(stream.key);
+            }
+
+            mLastActivity = TimestampType(last);
+        }
+
+        /** @brief No more streams after this cursor */
+        bool isEnd() const                          {return mEnd;}
+
+        /** @brief Make @p query and @p paging fetch the page following the cursor
+          *
+          * Drops the offset and keeps the limit and any tighter activity bounds.
+          * Apply to copies of the query and paging the cursor was created with. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void seek(StreamQuery & query,
+                  StreamPaging & paging) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mLastActivity.is_null())
+                return;
+
+            ali_assert(paging.order == mOrder);
+
+            paging.offset.reset();
+
+            query.withoutStreamKeys.insert(mTiedKeys.as_array());
+
+            // The bounds are exclusive, the cursor's last activity is not.
+            if (paging.order == SortOrder::Ascending)
+            {
+                double const bound = std::nextafter(mLastActivity->value, -HUGE_VAL);
+
+                if (query.lastActivityAfter.is_null() || query.lastActivityAfter->value < bound)
+                    query.lastActivityAfter = TimestampType(bound);
+            }
+            else
+            {
+                double const bound = std::nextafter(mLastActivity->value, HUGE_VAL);
+
+                if (query.lastActivityBefore.is_null() || bound < query.lastActivityBefore->value)
+                    query.lastActivityBefore = TimestampType(bound);
+            }
+        }
+
+    private:
+        ali::optional<TimestampType>        mLastActivity;
+        ali::array_set<ali::string>         mTiedKeys;
+        SortOrder::Type                     mOrder{SortOrder::Descending};
+        bool                                mEnd{false};
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    inline EventCursor FetchResult::nextCursor(Paging const& paging) const
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        return EventCursor(*this, paging);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    inline StreamCursor StreamFetchResult::nextCursor(StreamPaging const& paging) const
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        return StreamCursor(*this, paging, StreamCursor());
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    inline StreamCursor StreamFetchResult::nextCursor(StreamPaging const& paging,
+                                                      StreamCursor const& previous) const
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        return StreamCursor(*this, paging, previous);
+    }
+
     //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
     class Storage
     //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
@@ -0,0 +1,402 @@
+/*
+ *  EventHistory/TextIndex.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryTypes.h"
+#include "Softphone/Index/IndexQuery.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_map.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_string.h"
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class TextIndex
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Inverted index of the words in event texts
+      *
+      * Texts are split into words at anything but letters and digits. Words
+      * are lowercased and stripped of diacritics (Latin scripts; Greek and
+      * Cyrillic are only lowercased), so that "Žluťoučký" is found by
+      * "zlutoucky". Every word maps to the sorted IDs of the events that
+      * contain it; the words are sorted too, so that all words starting
+      * with a prefix form a single range.
+      *
+      * A search for several words finds the events containing all of them.
+      */
+    {
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Token
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::string     term;       ///< Folded word
+            int             start{0};   ///< Byte offset of the word in the text
+            int             end{0};     ///< Byte offset just past the word
+        };
+
+        /** @brief Add the words of a text to those of the event */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void add(EventIdType id,
+                 ali::string_const_ref text)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<Token> tokens;
+            tokenize(tokens, text);
+
+            if (tokens.is_empty())
+                return;
+
+            ali::array_set<ali::string> & terms = mDocuments[id];
+
+            for (int i = 0; i < tokens.size(); ++i)
+            {
+                if (terms.contains(tokens[i].term))
+                    continue;
+
+                terms.insert(tokens[i].term);
+                mPostings[tokens[i].term].insert(id);
+            }
+        }
+
+        /** @brief Remove all words of the event */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void remove(EventIdType id)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<ali::string> const* terms = mDocuments.find(id);
+            if (terms == nullptr)
+                return;
+
+            for (int i = 0; i < terms->size(); ++i)
+            {
+                ali::string const& term = terms->at(i);
+                ali::array_set<EventIdType> * ids = mPostings.find(term);
+                if (ids == nullptr)
+                    continue;
+
+                ids->erase(id);
+
+                if (ids->is_empty())
+                    mPostings.erase(term);
+            }
+
+            mDocuments.erase(id);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void clear()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mPostings.erase();
+            mDocuments.erase();
+        }
+
+        /** @brief Get number of distinct words */
+        int getTermCount() const        {return mPostings.size();}
+
+        /** @brief Get number of events with any words */
+        int getDocumentCount() const    {return mDocuments.size();}
+
+        /** @brief Find the events containing all words of @p text
+          * @param prefix Whether the words only need to start with the words of @p text */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void search(ali::array_set<EventIdType> & ids,
+                    ali::string_const_ref text,
+                    bool prefix = true) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ids.erase();
+
+            ali::array<Token> tokens;
+            tokenize(tokens, text);
+
+            if (tokens.is_empty())
+                return;
+
+            ali::array<ali::array_set<EventIdType>> matches;
+            int smallest = 0;
+
+            for (int i = 0; i < tokens.size(); ++i)
+            {
+                matches.push_back(ali::array_set<EventIdType>());
+                collect(matches.back(), tokens[i].term, prefix);
+
+                if (matches.back().is_empty())
+                    return;
+
+                if (matches.back().size() < matches[smallest].size())
+                    smallest = matches.size() - 1;
+            }
+
+            ali::array_set<EventIdType> const& candidates = matches[smallest];
+
+            for (int i = 0; i < candidates.size(); ++i)
+            {
+                bool all = true;
+
+                for (int j = 0; all && j < matches.size(); ++j)
+                    all = j == smallest || matches[j].contains(candidates[i]);
+
+                if (all)
+                    ids.insert(candidates[i]);
+            }
+        }
+
+        /** @brief Add spans of the words of @p text matching the words of @p query
+          *
+          * Span::term is the matching word of the query; positions are byte offsets. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void highlight(Index::Spans & spans,
+                              ali::string_const_ref field,
+                              ali::string_const_ref text,
+                              ali::string_const_ref query,
+                              bool prefix = true)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<Token> terms;
+            tokenize(terms, query);
+
+            if (terms.is_empty())
+                return;
+
+            ali::array<Token> tokens;
+            tokenize(tokens, text);
+
+            ali::string const key(field);
+
+            for (int i = 0; i < tokens.size(); ++i)
+            {
+                for (int j = 0; j < terms.size(); ++j)
+                {
+                    bool const match = prefix
+                        ? tokens[i].term.begins_with(terms[j].term)
+                        : tokens[i].term == terms[j].term;
+
+                    if (match)
+                    {
+                        spans[key].insert(Index::Span(terms[j].term, tokens[i].start, tokens[i].end));
+                        break;
+                    }
+                }
+            }
+        }
+
+        /** @brief Split UTF-8 text into folded words */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void tokenize(ali::array<Token> & tokens,
+                             ali::string_const_ref text)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            tokens.erase();
+
+            for (int i = 0; i < text.size(); )
+            {
+                int const start = i;
+                ali::uint32 c = decode(text, i);
+
+                if (!isWordCharacter(c))
+                    continue;
+
+                Token token;
+                token.start = start;
+                token.end = i;
+                fold(token.term, c);
+
+                while (token.end < text.size())
+                {
+                    c = decode(text, i);
+
+                    if (!isWordCharacter(c))
+                        break;
+
+                    fold(token.term, c);
+                    token.end = i;
+                }
+
+                tokens.push_back(token);
+            }
+        }
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void collect(ali::array_set<EventIdType> & ids,
+                     ali::string const& term,
+                     bool prefix) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// IDs of the events containing the term, or any word starting with it.
+        {
+            if (!prefix)
+            {
+                if (ali::array_set<EventIdType> const* found = mPostings.find(term))
+                    ids = *found;
+
+                return;
+            }
+
+            int const first = mPostings.index_of_lower_bound(term);
+            int last = first;
+
+            while (last < mPostings.size() && mPostings.at(last).first.begins_with(term))
+                ++last;
+
+            if (last - first == 1)
+            {
+                ids = mPostings.at(first).second;
+                return;
+            }
+
+            ali::array<EventIdType> all;
+
+            for (int i = first; i < last; ++i)
+            {
+                ali::array_set<EventIdType> const& postings = mPostings.at(i).second;
+
+                for (int j = 0; j < postings.size(); ++j)
+                    all.push_back(postings[j]);
+            }
+
+            all.mutable_ref().sort();
+
+            // Sorted, so every insert appends.
+            for (int i = 0; i < all.size(); ++i)
+                if (i == 0 || all[i] != all[i - 1])
+                    ids.insert(all[i]);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::uint32 decode(ali::string_const_ref text,
+                                  int & i)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Next UTF-8 code point; 0 for malformed sequences.
+        {
+            ali::uint32 c = static_cast<ali::uint8>(text[i++]);
+
+            if (c < 0x80)
+                return c;
+
+            int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+
+            if (n == 0)
+                return 0;
+
+            c &= 0x3F >> n;
+
+            for (; n > 0 && i < text.size(); --n, ++i)
+            {
+                ali::uint8 const b = static_cast<ali::uint8>(text[i]);
+
+                if ((b & 0xC0) != 0x80)
+                    return 0;
+
+                c = (c << 6) | (b & 0x3F);
+            }
+
+            return n == 0 ? c : 0;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool isWordCharacter(ali::uint32 c)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (c < 0x80)
+                return (c >= '0' && c <= '9')
+                    || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+
+            return c >= 0xC0
+                && c != 0xD7 && c != 0xF7                   // × ÷
+                && !(c >= 0x2000 && c <= 0x2BFF)            // punctuation, symbols
+                && !(c >= 0x3000 && c <= 0x303F)            // CJK punctuation
+                && !(c >= 0xFE00 && c <= 0xFE0F)            // variation selectors
+                && !(c >= 0xFF00 && c <= 0xFF0F)            // fullwidth punctuation
+                && c < 0x1F000;                             // emoji
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void fold(ali::string & term,
+                         ali::uint32 c)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Appends the lowercase, diacritic-free form of the code point.
+        {
+            // U+00C0 - U+017F; '*' marks ligatures.
+            static char const latin[] =
+                "aaaaaa*ceeeeiiiidnooooo_ouuuuy**aaaaaa*ceeeeiiiidnooooo_ouuuuy*y"
+                "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii**jjkkqlllllll"
+                "lllnnnnnnnnnoooooo**rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+
+            if (c < 0x80)
+            {
+                term.push_back(static_cast<char>(c >= 'A' && c <= 'Z' ? c + 0x20 : c));
+                return;
+            }
+
+            if (c >= 0xC0 && c < 0x180)
+            {
+                char const f = latin[c - 0xC0];
+
+                if (f != '*')
+                {
+                    term.push_back(f);
+                    return;
+                }
+
+                switch (c)
+                {
+                case 0xC6: case 0xE6:   term.push_back('a').push_back('e'); return;
+                case 0xDF:              term.push_back('s').push_back('s'); return;
+                case 0xDE: case 0xFE:   term.push_back('t').push_back('h'); return;
+                case 0x132: case 0x133: term.push_back('i').push_back('j'); return;
+                default:                term.push_back('o').push_back('e'); return;
+                }
+            }
+
+            if (c >= 0x410 && c <= 0x42F)           // Cyrillic А - Я
+                c += 0x20;
+            else if (c >= 0x400 && c <= 0x40F)      // Cyrillic Ѐ - Џ
+                c += 0x50;
+            else if (c >= 0x391 && c <= 0x3A9)      // Greek Α - Ω
+                c += 0x20;
+
+            encode(term, c);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void encode(ali::string & term,
+                           ali::uint32 c)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (c < 0x800)
+            {
+                term.push_back(static_cast<char>(0xC0 | (c >> 6)));
+            }
+            else if (c < 0x10000)
+            {
+                term.push_back(static_cast<char>(0xE0 | (c >> 12)));
+                term.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            }
+            else
+            {
+                term.push_back(static_cast<char>(0xF0 | (c >> 18)));
+                term.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+                term.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            }
+
+            term.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+
+    private:
+        ali::array_map<ali::string, ali::array_set<EventIdType>>    mPostings;
+        ali::array_map<EventIdType, ali::array_set<ali::string>>    mDocuments;
+    };
+}
+}
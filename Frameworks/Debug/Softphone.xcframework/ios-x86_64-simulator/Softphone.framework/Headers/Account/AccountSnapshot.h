@@ -0,0 +1,307 @@
+#pragma once
+
+#include "Softphone/Softphone.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_map.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_rcu_ptr.h"
+
+#if defined(SOFTPHONE_MULTIPLE_ACCOUNTS)
+
+namespace Softphone
+{
+namespace Account
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class Snapshot
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Immutable copy of the account list as returned by Instance::Registration
+      *
+      * Unlike the references returned by Instance::Registration::getAccount,
+      * everything returned from a snapshot stays valid and unchanged for the
+      * lifetime of the snapshot, whatever happens to the accounts meanwhile.
+      * Indexes are the account indexes at the time the snapshot was taken.
+      *
+      * The values looked up on every call, message or push are parsed from
+      * the account XML once, when the snapshot is taken; see Values.
+      */
+    {
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Values
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Parsed account values; see accountDefaults.xml for their meaning.
+        {
+            Type                type{Type::unknown()};
+            bool                enabled{false};
+            ali::xml::string    title;
+            ali::xml::string    username;
+            ali::xml::string    host;
+            ali::xml::string    transport;
+            bool                incomingDisabled{false};
+            bool                allowMessage{false};
+            bool                allowVideo{false};
+        };
+
+    public:
+        Snapshot() = default;
+
+        /** @brief Copies the current account list
+          *
+          * Must be called on the thread that modifies the accounts, so that it
+          * does not run concurrently with saveAccount or deleteAccount. */
+        explicit Snapshot(Instance::Registration const& registration)
+        {
+            int const count = registration.getAccountCount();
+
+            mIds.reserve(count);
+            mAccounts.reserve(count);
+            mValues.reserve(count);
+
+            mEnabledIndexes = registration.getEnabledAccountIndexes();
+
+            for (int i = 0; i < count; ++i)
+            {
+                mIds.push_back(registration.getAccountId(i));
+                mAccounts.push_back(registration.getAccount(i));
+                mValues.push_back(parse(mAccounts[i], mEnabledIndexes.contains(i)));
+                mIndexes.set(mIds[i], i);
+            }
+
+            ali::opt_string const defaultId = registration.getDefaultAccountId();
+
+            if (!defaultId.is_null())
+                mDefaultIndex = getAccountIndex(*defaultId);
+        }
+
+        /** @brief Get number of accounts */
+        int getAccountCount() const
+        {
+            return mIds.size();
+        }
+
+        /** @brief Get index of an account
+          * @retval -1 No such account ID */
+        int getAccountIndex(ali::string_const_ref accountId) const
+        {
+            int const* const index = mIndexes.find(accountId);
+            return index != nullptr ? *index : -1;
+        }
+
+        /** @brief Get account ID for an account index
+          * @param index Account index; @c 0 ≤ @p index < @ref getAccountCount */
+        ali::string_const_ref getAccountId(int index) const
+        {
+            return mIds[index];
+        }
+
+        /** @brief Get account XML
+          * @param index Account index; @c 0 ≤ @p index < @ref getAccountCount */
+        Xml const& getAccount(int index) const
+        {
+            return mAccounts[index];
+        }
+
+        /** @brief Get account XML
+          * @retval nullptr No such account */
+        Xml const* getAccount(ali::string_const_ref accountId) const
+        {
+            int const index = getAccountIndex(accountId);
+            if (index < 0)
+                return nullptr;
+            return &mAccounts[index];
+        }
+
+        /** @brief Get parsed values of an account
+          * @param index Account index; @c 0 ≤ @p index < @ref getAccountCount */
+        Values const& getValues(int index) const
+        {
+            return mValues[index];
+        }
+
+        /** @brief Get parsed values of an account
+          * @retval nullptr No such account */
+        Values const* getValues(ali::string_const_ref accountId) const
+        {
+            int const index = getAccountIndex(accountId);
+            if (index < 0)
+                return nullptr;
+            return &mValues[index];
+        }
+
+        /** @brief Get index of the default account
+          * @retval -1 No default account */
+        int getDefaultAccountIndex() const
+        {
+            return mDefaultIndex;
+        }
+
+        /** @brief Get indexes of all enabled accounts */
+        ali::array_set<int> const& getEnabledAccountIndexes() const
+        {
+            return mEnabledIndexes;
+        }
+
+        /** @brief Check if an account is enabled */
+        bool isAccountEnabled(int index) const
+        {
+            return mEnabledIndexes.contains(index);
+        }
+
+        /** @brief Check if both snapshots hold the same accounts */
+        bool isSameAs(Snapshot const& other) const
+        {
+            if (mIds != other.mIds
+                || mEnabledIndexes != other.mEnabledIndexes
+                || mDefaultIndex != other.mDefaultIndex)
+                return false;
+
+            for (int i = 0; i < mAccounts.size(); ++i)
+                if (mAccounts[i].get() != other.mAccounts[i].get())
+                    return false;
+
+            return true;
+        }
+
+    private:
+        static Values parse(Xml const& account, bool enabled)
+        {
+            using ali::operator""_s;
+
+            Values values;
+            values.type = account.getType();
+            values.enabled = enabled;
+            values.title = account.getString("title"_s);
+            values.username = account.getString("username"_s);
+            values.host = account.getString("host"_s);
+            values.transport = account.getString("transport"_s);
+            values.incomingDisabled = account.getString("incomingDisabled"_s) == "1"_s;
+            values.allowMessage = account.getString("allowMessage"_s) == "1"_s;
+            values.allowVideo = account.getString("allowVideo"_s) == "1"_s;
+            return values;
+        }
+
+    private:
+        ali::array<ali::string> mIds;
+        ali::array<Xml> mAccounts;
+        ali::array<Values> mValues;
+        ali::array_map<ali::string, int> mIndexes;
+        ali::array_set<int> mEnabledIndexes;
+        int mDefaultIndex{-1};
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class SnapshotPublisher
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Publishes account Snapshots for lock-free reading from any thread
+      *
+      * Threads that look accounts up on every call, message or push take
+      * get() instead of calling Instance::Registration. The writer thread
+      * modifies accounts through saveAccount / deleteAccount below, which
+      * publish a new snapshot once the SDK has finished merging the account,
+      * so readers never observe a partially saved account.
+      *
+      * Accounts changed by other means, e.g. by provisioning, are picked up
+      * by onAccountsChanged(), to be called from the app's
+      * Observer::onRegistrationStateChanged and Observer::onSettingsChanged:
+      *
+      * @code
+      * void onRegistrationStateChanged(ali::string const& accountId,
+      *                                 Registrator::State::Type state) override
+      * {
+      *     mAccounts.onAccountsChanged();
+      *     ...
+      * }
+      * @endcode
+      */
+    {
+    public:
+        typedef ali::rcu_ptr<Snapshot>::snapshot Pointer;
+
+        explicit SnapshotPublisher(Instance::Registration & registration)
+        : mRegistration(registration)
+        {
+            refresh();
+        }
+
+        /** @brief Current snapshot; lock-free, callable from any thread */
+        Pointer get() const
+        {
+            return mSnapshot.load();
+        }
+
+        /** @brief Increases by one with every published snapshot */
+        ali::int64 getVersion() const
+        {
+            return mSnapshot.version();
+        }
+
+        /** @brief Saves the account and publishes a new snapshot
+          * @see Instance::Registration::saveAccount */
+        ali::opt_string saveAccount(Xml & accountXML)
+        {
+            ali::opt_string const accountId = mRegistration.saveAccount(accountXML);
+
+            if (!accountId.is_null())
+                refresh();
+
+            return accountId;
+        }
+
+        /** @brief Deletes the account and publishes a new snapshot
+          * @see Instance::Registration::deleteAccount */
+        void deleteAccount(ali::string accountId)
+        {
+            mRegistration.deleteAccount(ali::move(accountId));
+            refresh();
+        }
+
+        /** @brief Moves the account and publishes a new snapshot
+          * @see Instance::Registration::moveAccount */
+        void moveAccount(int from, int to)
+        {
+            mRegistration.moveAccount(from, to);
+            refresh();
+        }
+
+        /** @brief Sets the default account and publishes a new snapshot
+          * @see Instance::Registration::setDefaultAccount */
+        void setDefaultAccount(ali::opt_string const& accountId)
+        {
+            mRegistration.setDefaultAccount(accountId);
+            refresh();
+        }
+
+        /** @brief Publishes a snapshot if the accounts differ from the current one
+          *
+          * The SDK delivers the notifications this is called from on the
+          * thread that modifies the accounts. Registration state changes
+          * that leave the accounts as they were publish nothing, so the
+          * version only changes with the accounts.
+          * @return true if a new snapshot was published */
+        bool onAccountsChanged()
+        {
+            Snapshot snapshot(mRegistration);
+
+            if (snapshot.isSameAs(*mSnapshot.load()))
+                return false;
+
+            mSnapshot.store(ali::move(snapshot));
+            return true;
+        }
+
+        /** @brief Publishes a snapshot of the current account list */
+        void refresh()
+        {
+            mSnapshot.store(Snapshot(mRegistration));
+        }
+
+    private:
+        Instance::Registration & mRegistration;
+        ali::rcu_ptr<Snapshot> mSnapshot;
+    };
+}
+}
+
+#endif
@@ -0,0 +1,492 @@
+/*
+ *  EventHistory/AsyncFetch.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_callback.h"
+#include "ali/ali_handle.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_shared_ptr.h"
+#include "ali/ali_thread_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct EventFetchTraits
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        typedef EventHistory::Query     Query;
+        typedef EventHistory::Paging    Paging;
+        typedef FetchResult             Result;
+        typedef FetchItem               Item;
+        typedef EventCursor             Cursor;
+
+        static Cursor next(Result const& result, Paging const& paging, Cursor const&)
+        {
+            return result.nextCursor(paging);
+        }
+
+        static void seek(Cursor const& cursor, Query &, Paging & paging)
+        {
+            cursor.seek(paging);
+        }
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct StreamFetchTraits
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        typedef StreamQuery             Query;
+        typedef StreamPaging            Paging;
+        typedef StreamFetchResult       Result;
+        typedef StreamFetchItem         Item;
+        typedef StreamCursor            Cursor;
+
+        static Cursor next(Result const& result, Paging const& paging, Cursor const& previous)
+        {
+            return result.nextCursor(paging, previous);
+        }
+
+        static void seek(Cursor const& cursor, Query & query, Paging & paging)
+        {
+            cursor.seek(query, paging);
+        }
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    template <typename Traits>
+    class AsyncFetcher
+        : public ali::noncopyable
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Fetches pages of events or streams on a thread pool
+      *
+      * fetch starts a listing with its first page; fetchNext continues with
+      * the page after the last one. Each page is read from the source in
+      * chunks of Options::chunkSize, using keyset cursors, and every chunk is
+      * passed to the callback as soon as it is read, so that the first rows
+      * can be shown before the page is complete. The last chunk of a page
+      * has Chunk::last set (and may be empty).
+      *
+      * With Options::prefetchNext, the following page is read right after
+      * the requested one and kept until fetchNext asks for it.
+      *
+      * Destroying the returned handle cancels the request: no chunk is
+      * delivered after that, and the destructor waits for the chunk being
+      * read, if any.
+      *
+      * Requests of one listing are queued and served in the order they were
+      * made, by a single pool task at a time, so a fetchNext made while the
+      * previous page is still being read continues after that page. A request
+      * made when the listing turns out to be at its end gets one empty chunk
+      * with Chunk::end set.
+      *
+      * The source is called on the pool threads, so it must be safe to call
+      * from any thread. Chunks are delivered through the dispatcher, which
+      * should run them on the thread consuming them (e.g. the main thread);
+      * without a dispatcher they are delivered on the pool thread.
+      */
+    {
+    public:
+        typedef typename Traits::Query      Query;
+        typedef typename Traits::Paging     Paging;
+        typedef typename Traits::Result     Result;
+        typedef typename Traits::Item       Item;
+
+        typedef ali::callback<Result(Query const&, Paging const&)> Source;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Chunk
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<Item>    items;
+            bool                last{false};    ///< Last chunk of the page
+            bool                end{false};     ///< No more pages after this one
+        };
+
+        typedef ali::callback<void(Chunk const&)> OnChunk;
+
+        /// Must run the given function, typically later on another thread.
+        typedef ali::callback<void(ali::callback<void()>)> Dispatcher;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Options
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int                 chunkSize{32};
+            bool                prefetchNext{false};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        AsyncFetcher(Source source,
+                     Dispatcher dispatcher = {},
+                     ali::thread_pool & pool = ali::thread_pool::shared())
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mSource(source)
+            , mDispatcher(dispatcher)
+            , mPool(pool)
+        {}
+
+        /** @brief Start a new listing and fetch its first page */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::auto_ptr<ali::handle> fetch(Query const& query,
+                                         Paging const& paging,
+                                         OnChunk onChunk,
+                                         Options const& options = {})
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mListing = ali::new_shared_ptr<Listing>();
+            mListing->source = mSource;
+            mListing->options = options;
+            mListing->query = query;
+            mListing->paging = paging;
+            mListing->pageLimit = paging.limit;
+
+            return submit(onChunk);
+        }
+
+        /** @brief Fetch the page after the last one of the listing
+          * @return null if the listing is at its end or there is none */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::auto_ptr<ali::handle> fetchNext(OnChunk onChunk)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (isEnd())
+                return ali::auto_ptr<ali::handle>();
+
+            return submit(onChunk);
+        }
+
+        /** @brief Whether the last page served so far was the last one
+          *
+          * Requests still queued or being read are not taken into account. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool isEnd() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mListing.is_null())
+                return true;
+
+            std::lock_guard<std::mutex> const lock(mListing->mutex);
+            return mListing->atEnd;
+        }
+
+    private:
+        typedef typename Traits::Cursor     Cursor;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Request
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            OnChunk             onChunk;
+            Dispatcher          dispatcher;
+            std::atomic<bool>   cancelled{false};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Listing
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Position of the listing, shared with its requests. The mutex guards
+        /// the queue and the members up to atEnd; the position below them is
+        /// only touched by the one task draining the queue.
+        {
+            Source              source;
+            Options             options;
+
+            std::mutex          mutex;
+            std::condition_variable served;     ///< Notified when current changes
+            ali::array<ali::shared_ptr<Request>> queue;
+            bool                draining{false};
+            Request const*      current{nullptr};
+            std::thread::id     drainer;        ///< Thread serving current
+            bool                atEnd{false};   ///< end && !prefetched after the last request served
+
+            Query               query;          ///< Positioned at the next chunk to read
+            Paging              paging;
+            ali::optional<int>  pageLimit;      ///< Paging::limit of the listing
+            Cursor              cursor;
+            bool                end{false};
+            bool                prefetched{false};
+            bool                pageComplete{false};
+            ali::array<Item>    page;           ///< The prefetched page, or its part read before cancelling
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        class Handle
+            : public ali::handle
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+        public:
+            Handle(ali::shared_ptr<Listing> listing,
+                   ali::shared_ptr<Request> request)
+                : mListing(listing)
+                , mRequest(request)
+            {}
+
+            virtual ~Handle()
+            {
+                mRequest->cancelled.store(true, std::memory_order_release);
+
+                // A queued request is skipped when its turn comes; wait only
+                // if it is being served, and not from within its own chunk.
+                Request const* const request = mRequest.get();
+                std::thread::id const self = std::this_thread::get_id();
+                std::unique_lock<std::mutex> lock(mListing->mutex);
+
+                mListing->served.wait(lock, [this, request, self]
+                {
+                    return mListing->current != request || mListing->drainer == self;
+                });
+            }
+
+        private:
+            ali::shared_ptr<Listing>    mListing;
+            ali::shared_ptr<Request>    mRequest;
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::auto_ptr<ali::handle> submit(OnChunk onChunk)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::shared_ptr<Request> request = ali::new_shared_ptr<Request>();
+            request->onChunk = onChunk;
+            request->dispatcher = mDispatcher;
+
+            ali::shared_ptr<Listing> listing = mListing;
+            bool start = false;
+
+            {
+                std::lock_guard<std::mutex> const lock(listing->mutex);
+                listing->queue.push_back(request);
+                start = !listing->draining;
+                listing->draining = true;
+            }
+
+            // One task per listing at a time; it never waits for another
+            // task, which a pool task must not do.
+            if (start)
+                mPool.post([listing] { drain(*listing); });
+
+            return ali::new_auto_ptr<Handle>(listing, request);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void drain(Listing & listing)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Serves the queued requests in order until the queue is empty.
+        {
+            for (;;)
+            {
+                ali::shared_ptr<Request> request;
+
+                {
+                    std::lock_guard<std::mutex> const lock(listing.mutex);
+
+                    if (listing.queue.is_empty())
+                    {
+                        listing.draining = false;
+                        return;
+                    }
+
+                    request = listing.queue.front();
+                    listing.queue.erase_front();
+                    listing.current = request.get();
+                    listing.drainer = std::this_thread::get_id();
+                }
+
+                if (!request->cancelled.load(std::memory_order_acquire))
+                    serve(listing, request);
+
+                {
+                    std::lock_guard<std::mutex> const lock(listing.mutex);
+                    listing.current = nullptr;
+                    listing.drainer = std::thread::id();
+                    listing.atEnd = listing.end && !listing.prefetched;
+                }
+
+                listing.served.notify_all();
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void serve(Listing & listing,
+                          ali::shared_ptr<Request> const& request)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (listing.end && !listing.prefetched)
+            {
+                Chunk chunk;
+                chunk.last = true;
+                chunk.end = true;
+                deliver(request, chunk);
+                return;
+            }
+
+            int remaining = listing.pageLimit.is_null() ? -1 : ali::maxi(0, *listing.pageLimit);
+
+            if (listing.prefetched)
+            {
+                listing.prefetched = false;
+
+                if (!deliverPage(listing, request))
+                    return;
+
+                if (remaining > 0)
+                    remaining = ali::maxi(0, remaining - listing.page.size());
+
+                listing.page.erase();
+            }
+
+            if (!listing.pageComplete && !readPage(listing, request, remaining, false))
+                return;
+
+            if (listing.options.prefetchNext && !listing.end
+                && !request->cancelled.load(std::memory_order_acquire))
+            {
+                remaining = listing.pageLimit.is_null() ? -1 : ali::maxi(0, *listing.pageLimit);
+
+                listing.prefetched = true;
+                listing.pageComplete = readPage(listing, request, remaining, true);
+            }
+            else
+            {
+                listing.pageComplete = false;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool deliverPage(Listing & listing,
+                                ali::shared_ptr<Request> const& request)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Delivers the prefetched page; the last chunk only if the page is complete.
+        /// @return false if the request was cancelled
+        {
+            int const chunkSize = ali::maxi(1, listing.options.chunkSize);
+            int const size = listing.page.size();
+
+            for (int i = 0; i < size || (i == 0 && listing.pageComplete); i += chunkSize)
+            {
+                Chunk chunk;
+                chunk.items.reserve(ali::mini(chunkSize, size - i));
+
+                for (int j = i; j < size && j < i + chunkSize; ++j)
+                    chunk.items.push_back(listing.page[j]);
+
+                chunk.last = listing.pageComplete && i + chunkSize >= size;
+                chunk.end = chunk.last && listing.end;
+
+                if (!deliver(request, chunk))
+                    return false;
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool readPage(Listing & listing,
+                             ali::shared_ptr<Request> const& request,
+                             int remaining,
+                             bool keep)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Reads the rest of a page, @p remaining items or all if negative, in
+        /// chunks, and delivers them, or keeps them as the prefetched page.
+        /// @return false if the request was cancelled before the page was read
+        {
+            int const chunkSize = ali::maxi(1, listing.options.chunkSize);
+
+            for (;;)
+            {
+                if (request->cancelled.load(std::memory_order_acquire))
+                    return false;
+
+                Paging paging = listing.paging;
+                paging.limit = remaining < 0 ? chunkSize : ali::mini(chunkSize, remaining);
+
+                Result const result = listing.source(listing.query, paging);
+
+                listing.cursor = Traits::next(result, paging, listing.cursor);
+                Traits::seek(listing.cursor, listing.query, listing.paging);
+                listing.end = listing.cursor.isEnd();
+
+                if (remaining > 0)
+                    remaining = ali::maxi(0, remaining - result.items.size());
+
+                Chunk chunk;
+                chunk.last = listing.end || remaining == 0;
+                chunk.end = listing.end;
+
+                if (keep)
+                {
+                    listing.page.reserve(listing.page.size() + result.items.size());
+
+                    for (int i = 0; i < result.items.size(); ++i)
+                        listing.page.push_back(result.items[i]);
+                }
+                else
+                {
+                    chunk.items = result.items;
+
+                    if (!deliver(request, chunk))
+                        return false;
+                }
+
+                if (chunk.last)
+                    return true;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool deliver(ali::shared_ptr<Request> const& request,
+                            Chunk const& chunk)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// @return false if the request was cancelled
+        {
+            if (request->cancelled.load(std::memory_order_acquire))
+                return false;
+
+            if (request->dispatcher.is_null())
+            {
+                request->onChunk(chunk);
+            }
+            else
+            {
+                ali::shared_ptr<Chunk> const copy = ali::new_shared_ptr<Chunk>(chunk);
+
+                request->dispatcher([request, copy]
+                {
+                    if (!request->cancelled.load(std::memory_order_acquire))
+                        request->onChunk(*copy);
+                });
+            }
+
+            return true;
+        }
+
+    private:
+        Source                      mSource;
+        Dispatcher                  mDispatcher;
+        ali::thread_pool &          mPool;
+        ali::shared_ptr<Listing>    mListing;
+    };
+
+    /// Fetches events page by page, e.g. Instance::Events::fetch wrapped in a Source.
+    typedef AsyncFetcher<EventFetchTraits>  AsyncEventFetcher;
+
+    /// Fetches event streams page by page.
+    typedef AsyncFetcher<StreamFetchTraits> AsyncStreamFetcher;
+}
+}
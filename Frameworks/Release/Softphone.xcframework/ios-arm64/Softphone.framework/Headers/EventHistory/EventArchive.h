@@ -0,0 +1,895 @@
+/*
+ *  EventHistory/EventArchive.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_callback.h"
+#include "ali/ali_filesystem2.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_printf.h"
+#include "ali/ali_string.h"
+#include "ali/ali_xml_binary.h"
+#include "ali/ali_xml_parser2_interface.h"
+#include "ali/ali_xml_tree2.h"
+#include "ali/ali_xml_writer.h"
+
+#include <cmath>
+
+namespace ali
+{
+namespace file_archive
+{
+    struct data_source;
+}
+}
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class BloomFilter
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Set of strings that may report false positives, but no false negatives
+      *
+      * With 10 bits per item, about 1% of the strings not in the set are
+      * reported as possibly present. An empty filter (default constructed
+      * or failed to parse) knows nothing and reports every string. */
+    {
+    public:
+        BloomFilter() = default;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        BloomFilter(int items,
+                    int bitsPerItem)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const bits = ali::maxi(64, items * bitsPerItem);
+
+            mWords.resize((bits + 31) / 32, 0);
+            mHashes = ali::maxi(1, ali::mini(16, static_cast<int>(bitsPerItem * 0.69 + 0.5)));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool isEmpty() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mWords.is_empty();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int getHashCount() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mHashes;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void add(ali::string_const_ref item)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (isEmpty())
+                return;
+
+            ali::uint64 const hash = hashOf(item);
+            ali::uint32 const bits = static_cast<ali::uint32>(mWords.size()) * 32;
+
+            for (int i = 0; i < mHashes; ++i)
+            {
+                ali::uint32 const bit = position(hash, i, bits);
+                mWords[bit / 32] |= ali::uint32(1) << (bit % 32);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool mightContain(ali::string_const_ref item) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (isEmpty())
+                return true;
+
+            ali::uint64 const hash = hashOf(item);
+            ali::uint32 const bits = static_cast<ali::uint32>(mWords.size()) * 32;
+
+            for (int i = 0; i < mHashes; ++i)
+            {
+                ali::uint32 const bit = position(hash, i, bits);
+
+                if ((mWords[bit / 32] & (ali::uint32(1) << (bit % 32))) == 0)
+                    return false;
+            }
+
+            return true;
+        }
+
+        /** @brief The bits as hex digits, for storing next to getHashCount */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::string format() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            static char const digits[] = "0123456789abcdef";
+
+            ali::string str;
+
+            for (int i = 0; i < mWords.size(); ++i)
+                for (int shift = 28; shift >= 0; shift -= 4)
+                    str.push_back(digits[(mWords[i] >> shift) & 0xf]);
+
+            return str;
+        }
+
+        /** @brief Restore a filter from format and getHashCount; leaves it empty on failure */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool parse(ali::string_const_ref str,
+                   int hashes)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mWords.erase();
+            mHashes = 0;
+
+            if (str.is_empty() || str.size() % 8 != 0 || hashes < 1)
+                return false;
+
+            ali::array<ali::uint32> words;
+            words.resize(str.size() / 8, 0);
+
+            for (int i = 0; i < str.size(); ++i)
+            {
+                char const c = str[i];
+                ali::uint32 digit;
+
+                if (c >= '0' && c <= '9')
+                    digit = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    digit = c - 'a' + 10;
+                else
+                    return false;
+
+                words[i / 8] = (words[i / 8] << 4) | digit;
+            }
+
+            mWords.swap(words);
+            mHashes = hashes;
+            return true;
+        }
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::uint64 hashOf(ali::string_const_ref item)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// 64-bit FNV-1a.
+        {
+            ali::uint64 hash = 14695981039346656037ull;
+
+            for (int i = 0; i < item.size(); ++i)
+            {
+                hash ^= static_cast<unsigned char>(item[i]);
+                hash *= 1099511628211ull;
+            }
+
+            return hash;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::uint32 position(ali::uint64 hash,
+                                    int i,
+                                    ali::uint32 bits)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Double hashing: the i-th probe is h1 + i * h2, h2 odd.
+        {
+            ali::uint32 const h1 = static_cast<ali::uint32>(hash);
+            ali::uint32 const h2 = static_cast<ali::uint32>(hash >> 32) | 1;
+
+            return (h1 + static_cast<ali::uint32>(i) * h2) % bits;
+        }
+
+    private:
+        ali::array<ali::uint32>     mWords;
+        int                         mHashes{0};
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct ArchiveQuery
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        ali::optional<TimestampType>    newerThan; // inclusive
+        ali::optional<TimestampType>    olderThan; // exclusive
+        ali::opt_string                 streamKey;
+        ali::opt_string                 remoteUser; // exact generic URI
+        ali::optional<int>              limit;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct ArchivedEvent
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        EventIdType                 eventId{0};
+        TimestampType               timestamp;
+        ali::string                 streamKey;
+        ali::array<ali::string>     remoteUsers;        ///< Generic URIs
+        ali::xml::tree              data;               ///< As written by EventArchive::Encoder
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct ArchiveSegment
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Summary of one segment file, kept in the archive's manifest */
+    {
+        ali::string                 file;               ///< Name within the archive directory
+        long long                   partition{0};       ///< Timestamp divided by the partition span
+        TimestampType               from;               ///< Oldest event, inclusive
+        TimestampType               to;                 ///< Newest event, inclusive
+        int                         events{0};
+        ali::array_set<ali::string> streamKeys;
+        BloomFilter                 remoteUsers;
+
+        /** @brief Whether the segment can hold events matching @p query */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool mayMatch(ArchiveQuery const& query) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (!query.newerThan.is_null() && to.value < query.newerThan->value)
+                return false;
+
+            if (!query.olderThan.is_null() && from.value >= query.olderThan->value)
+                return false;
+
+            if (!query.streamKey.is_null() && !streamKeys.contains(*query.streamKey))
+                return false;
+
+            if (!query.remoteUser.is_null() && !remoteUsers.mightContain(*query.remoteUser))
+                return false;
+
+            return true;
+        }
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class EventArchive
+        : public ali::noncopyable
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Cold tier for old event history
+      *
+      * archive moves the events older than Options::maxAge out of a
+      * storage into segment files, one or more per time partition (by
+      * default 30 days), so that the storage's indexes, and the cost of
+      * its queries, depend on the recent history only.
+      *
+      * Segments are written once, as binary XML snapshots (see
+      * ali::xml::save_binary, whose string table stores every repeated
+      * stream key, URI and attribute key once), and never modified; an
+      * archive run that finds more old events for a partition that already
+      * has a segment adds another one. The manifest, rewritten atomically
+      * after every segment, keeps a summary of each: its time range, its
+      * stream keys and a bloom filter of its remote users. find reads only
+      * the segments whose summary can match the query.
+      *
+      * The events themselves are stored as written by the Encoder; the
+      * archive only keeps the fields it filters on (ID, timestamp, stream
+      * key and remote users) next to them. Events are deleted from the
+      * storage once their segments and the manifest have been saved; if
+      * that fails they stay in the storage and are archived again later,
+      * which find tolerates by returning every event ID once.
+      *
+      * Not thread-safe; use from the thread owning the storage.
+      */
+    {
+    public:
+        /// Write the event into the tree; false to keep it in the storage
+        /// (e.g. an event type the application does not archive).
+        typedef ali::callback<bool(Event const&, ali::xml::tree &)> Encoder;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Options
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            double          maxAge{180 * 86400.0};          ///< Seconds events stay in the storage
+            double          partitionSpan{30 * 86400.0};    ///< Seconds of history per partition
+            int             bitsPerRemoteUser{10};          ///< Bloom filter size
+            int             batchSize{512};                 ///< Events fetched from the storage at once
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Metrics
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int             segments{0};            ///< In the manifest
+            ali::int64      events{0};              ///< Stored in all segments, counting an event
+                                                    ///< archived again (see above) once per copy
+            ali::int64      segmentsRead{0};        ///< By find, since created
+            ali::int64      segmentsSkipped{0};     ///< By find thanks to the summaries, since created
+        };
+
+        /** @brief Open the archive in @p directory, which must exist
+          *
+          * Reads the manifest, if there is one. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        EventArchive(ali::filesystem2::path const& directory,
+                     Encoder encoder)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mDirectory(directory)
+            , mEncoder(encoder)
+        {
+            loadManifest();
+        }
+
+        /** @brief Applies to the following archive runs; existing segments keep their partitions */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void setOptions(Options const& options)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mOptions = options;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Options const& getOptions() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mOptions;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Metrics const& getMetrics() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mMetrics;
+        }
+
+        /** @brief Summaries of all segments, oldest first */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::array<ArchiveSegment> const& getSegments() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mSegments;
+        }
+
+        /** @brief Move the events older than Options::maxAge before @p now out of @p storage
+          *
+          * Events are read oldest first, Options::batchSize at a time, and
+          * written out a partition at a time; only the events of the
+          * current partition are held in memory. The archived events are
+          * deleted from the storage in one call at the end, which
+          * MemoryStorage handles in one sweep of its indexes.
+          *
+          * @return The number of events archived */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int archive(Storage & storage,
+                    TimestampType now)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            Query query;
+            query.olderThan = TimestampType(now.value - mOptions.maxAge);
+
+            Paging paging;
+            paging.limit = ali::maxi(1, mOptions.batchSize);
+            paging.order = SortOrder::Ascending;
+
+            Pending pending;
+            ali::array_set<EventIdType> archived;
+            bool failed = false;
+
+            while (!failed)
+            {
+                FetchResult page;
+
+                if (!storage.fetchEvents(page, query, paging))
+                    break;
+
+                for (int i = 0; i < page.items.size() && !failed; ++i)
+                {
+                    Event const& event = *page.items[i].event;
+                    long long const partition = partitionOf(event.getTimestamp());
+
+                    if (pending.events > 0 && partition != pending.partition)
+                        failed = !flush(pending, archived);
+
+                    ali::xml::tree data("data"_s);
+
+                    if (failed || !mEncoder(event, data))
+                        continue;
+
+                    pending.add(event, partition, data);
+                }
+
+                EventCursor const cursor = page.nextCursor(paging);
+
+                if (cursor.isEnd())
+                    break;
+
+                cursor.seek(paging);
+            }
+
+            if (!failed && pending.events > 0)
+                flush(pending, archived);
+
+            if (!archived.is_empty())
+                storage.deleteEvents(archived);
+
+            return archived.size();
+        }
+
+        /** @brief Append the archived events matching @p query, oldest first
+          *
+          * Reads only the segments whose summary may match; a query by
+          * remote user reads, on average, one in a hundred segments without
+          * that user besides those with it.
+          *
+          * @return The number of events appended */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int find(ali::array<ArchivedEvent> & result,
+                 ArchiveQuery const& query) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const limit = query.limit.is_null() ? -1 : ali::maxi(0, *query.limit);
+
+            ali::array<ArchivedEvent> found;
+            ali::array_set<EventIdType> seen;
+
+            for (int i = 0; i < mSegments.size() && limit != 0; ++i)
+            {
+                ArchiveSegment const& segment = mSegments[i];
+
+                // Segments are ordered by their oldest event, so none of the
+                // rest has anything older than the events found so far.
+                if (limit > 0 && found.size() >= limit
+                    && segment.from.value >= found[limit - 1].timestamp.value)
+                    break;
+
+                if (!segment.mayMatch(query))
+                {
+                    ++mMetrics.segmentsSkipped;
+                    continue;
+                }
+
+                ++mMetrics.segmentsRead;
+
+                readSegment(found, seen, segment, query);
+
+                if (limit > 0 && found.size() >= limit)
+                {
+                    sortByTime(found);
+                    found.erase(limit, found.size() - limit);
+                }
+            }
+
+            sortByTime(found);
+
+            for (int i = 0; i < found.size(); ++i)
+            {
+                result.push_back(ArchivedEvent());
+                swap(result.back(), found[i]);
+            }
+
+            return found.size();
+        }
+
+        /** @brief Add the manifest and all segment files to @p writer, e.g. for a backup
+          *
+          * @p writer is an ali::file_archive::tar::writer; a template so that
+          * only callers of exportTo need to include ali/ali_file_archive.h. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        template<typename Writer, typename DataSource = ali::file_archive::data_source>
+        void exportTo(Writer & writer) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            writer.add_file(manifestName(), DataSource::external_file(pathOf(manifestName())));
+
+            for (int i = 0; i < mSegments.size(); ++i)
+                writer.add_file(mSegments[i].file, DataSource::external_file(pathOf(mSegments[i].file)));
+        }
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Pending
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Segment being filled by archive.
+        {
+            long long                   partition{0};
+            int                         events{0};
+            ali::xml::tree              tree;
+            ali::array<EventIdType>     ids;
+            ali::array_set<ali::string> streamKeys;
+            ali::array_set<ali::string> remoteUsers;
+            double                      from{0};
+            double                      to{0};
+
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            void add(Event const& event,
+                     long long eventPartition,
+                     ali::xml::tree & data)
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            {
+                using ali::operator""_s;
+
+                double const time = event.getTimestamp().value;
+
+                if (events == 0)
+                {
+                    partition = eventPartition;
+                    from = to = time;
+                }
+
+                from = ali::mini(from, time);
+                to = ali::maxi(to, time);
+                ++events;
+
+                ali::xml::tree & node = tree.nodes.add("event"_s);
+                node.attrs.set("id"_s, static_cast<long long>(event.getEventId()));
+                node.attrs.set("time"_s, toMicros(time));
+                node.attrs.set("stream"_s, event.getStreamKey());
+
+                for (int i = 0; i < event.getRemoteUserCount(); ++i)
+                {
+                    ali::string const& uri = event.getRemoteUser(i).getGenericUri();
+
+                    if (uri.is_empty())
+                        continue;
+
+                    node.nodes.add("remote"_s, uri);
+                    remoteUsers.insert(uri);
+                }
+
+                node.nodes.add_swap(data);
+
+                ids.push_back(event.getEventId());
+                streamKeys.insert(event.getStreamKey());
+            }
+
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            void clear()
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            {
+                events = 0;
+                tree.nodes.erase();
+                ids.erase();
+                streamKeys.erase();
+                remoteUsers.erase();
+                from = to = 0;
+            }
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool flush(Pending & pending,
+                   ali::array_set<EventIdType> & archived)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Write the pending segment and add it to the manifest.
+        {
+            using ali::operator""_s;
+
+            ArchiveSegment segment;
+            ali::printf_append(segment.file, "segment-%{}-%{}.bin"_s, pending.partition, mNextSequence);
+            segment.partition = pending.partition;
+            segment.from = TimestampType(pending.from);
+            segment.to = TimestampType(pending.to);
+            segment.events = pending.events;
+            segment.streamKeys.swap(pending.streamKeys);
+            segment.remoteUsers = BloomFilter(pending.remoteUsers.size(), mOptions.bitsPerRemoteUser);
+
+            for (int i = 0; i < pending.remoteUsers.size(); ++i)
+                segment.remoteUsers.add(pending.remoteUsers[i]);
+
+            pending.tree.name = "segment"_s;
+            pending.tree.attrs.set("partition"_s, pending.partition);
+            pending.tree.attrs.set("from"_s, toMicros(pending.from));
+            pending.tree.attrs.set("to"_s, toMicros(pending.to));
+
+            bool const saved = ali::xml::save_binary(pending.tree, pathOf(segment.file));
+
+            ++mNextSequence;
+
+            if (saved)
+            {
+                insertSegment(segment);
+
+                if (saveManifest())
+                {
+                    for (int i = 0; i < pending.ids.size(); ++i)
+                        archived.insert(pending.ids[i]);
+                }
+                else
+                {
+                    // Without the manifest entry the segment is not part of
+                    // the archive; its events stay in the storage.
+                    eraseSegment(segment.file);
+                    ali::filesystem2::file::try_remove(pathOf(segment.file));
+                    pending.clear();
+                    return false;
+                }
+            }
+
+            pending.clear();
+            return saved;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void readSegment(ali::array<ArchivedEvent> & found,
+                         ali::array_set<EventIdType> & seen,
+                         ArchiveSegment const& segment,
+                         ArchiveQuery const& query) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            ali::xml::tree tree;
+
+            if (!ali::xml::load_binary(tree, pathOf(segment.file)))
+                return;
+
+            for (int i = 0; i < tree.nodes.size(); ++i)
+            {
+                ali::xml::tree & node = tree.nodes[i];
+
+                if (node.name != "event"_s)
+                    continue;
+
+                long long id = 0;
+                long long micros = 0;
+
+                auto const* idAttr = node.attrs.find("id"_s);
+                auto const* timeAttr = node.attrs.find("time"_s);
+
+                if (idAttr == nullptr || !idAttr->parse_value(id)
+                    || timeAttr == nullptr || !timeAttr->parse_value(micros))
+                    continue;
+
+                double const time = fromMicros(micros);
+
+                if (!query.newerThan.is_null() && time < query.newerThan->value)
+                    continue;
+
+                if (!query.olderThan.is_null() && time >= query.olderThan->value)
+                    continue;
+
+                auto const* streamAttr = node.attrs.find("stream"_s);
+                ali::string streamKey;
+
+                if (streamAttr != nullptr)
+                    streamKey = streamAttr->value;
+
+                if (!query.streamKey.is_null() && streamKey != *query.streamKey)
+                    continue;
+
+                ArchivedEvent event;
+                bool withRemoteUser = query.remoteUser.is_null();
+
+                for (int j = 0; j < node.nodes.size(); ++j)
+                {
+                    ali::xml::tree & child = node.nodes[j];
+
+                    if (child.name == "remote"_s)
+                    {
+                        event.remoteUsers.push_back(ali::string(child.data));
+
+                        if (!withRemoteUser && event.remoteUsers.back() == *query.remoteUser)
+                            withRemoteUser = true;
+                    }
+                    else if (child.name == "data"_s)
+                    {
+                        event.data.swap(child);
+                    }
+                }
+
+                EventIdType const eventId = static_cast<EventIdType>(id);
+
+                if (!withRemoteUser || seen.contains(eventId))
+                    continue;
+
+                seen.insert(eventId);
+
+                event.eventId = eventId;
+                event.timestamp = TimestampType(time);
+                event.streamKey.swap(streamKey);
+
+                found.push_back(ArchivedEvent());
+                swap(found.back(), event);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void insertSegment(ArchiveSegment const& segment)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Keeps mSegments ordered by their oldest event.
+        {
+            int i = mSegments.size();
+
+            while (i > 0 && segment.from.value < mSegments[i - 1].from.value)
+                --i;
+
+            mSegments.insert(i, segment);
+
+            mMetrics.segments = mSegments.size();
+            mMetrics.events += segment.events;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void eraseSegment(ali::string const& file)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            for (int i = 0; i < mSegments.size(); ++i)
+            {
+                if (mSegments[i].file != file)
+                    continue;
+
+                mMetrics.events -= mSegments[i].events;
+                mSegments.erase(i);
+                break;
+            }
+
+            mMetrics.segments = mSegments.size();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void loadManifest()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            ali::xml::tree manifest;
+
+            if (!ali::xml::load(manifest, pathOf(manifestName())))
+                return;
+
+            long long value = 0;
+
+            if (auto const* next = manifest.attrs.find("next"_s))
+                if (next->parse_value(value))
+                    mNextSequence = value;
+
+            for (int i = 0; i < manifest.nodes.size(); ++i)
+            {
+                ali::xml::tree const& node = manifest.nodes[i];
+
+                if (node.name != "segment"_s)
+                    continue;
+
+                ArchiveSegment segment;
+                long long from = 0;
+                long long to = 0;
+                long long events = 0;
+
+                auto const* file = node.attrs.find("file"_s);
+
+                if (file == nullptr || file->value.is_empty())
+                    continue;
+
+                segment.file = file->value;
+
+                if (auto const* attr = node.attrs.find("partition"_s))
+                    attr->parse_value(segment.partition);
+
+                if (auto const* attr = node.attrs.find("from"_s))
+                    attr->parse_value(from);
+
+                if (auto const* attr = node.attrs.find("to"_s))
+                    attr->parse_value(to);
+
+                if (auto const* attr = node.attrs.find("events"_s))
+                    attr->parse_value(events);
+
+                segment.from = TimestampType(fromMicros(from));
+                segment.to = TimestampType(fromMicros(to));
+                segment.events = static_cast<int>(events);
+
+                for (int j = 0; j < node.nodes.size(); ++j)
+                {
+                    ali::xml::tree const& child = node.nodes[j];
+
+                    if (child.name == "stream"_s)
+                    {
+                        segment.streamKeys.insert(ali::string(child.data));
+                    }
+                    else if (child.name == "remote-users"_s)
+                    {
+                        int hashes = 0;
+
+                        if (auto const* attr = child.attrs.find("hashes"_s))
+                            attr->parse_value(hashes);
+
+                        // An unreadable filter is left empty, which matches everyone.
+                        segment.remoteUsers.parse(child.data, hashes);
+                    }
+                }
+
+                insertSegment(segment);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool saveManifest() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            ali::xml::tree manifest("event-archive"_s);
+            manifest.attrs.set("next"_s, mNextSequence);
+
+            for (int i = 0; i < mSegments.size(); ++i)
+            {
+                ArchiveSegment const& segment = mSegments[i];
+
+                ali::xml::tree & node = manifest.nodes.add("segment"_s);
+                node.attrs.set("file"_s, segment.file);
+                node.attrs.set("partition"_s, segment.partition);
+                node.attrs.set("from"_s, toMicros(segment.from.value));
+                node.attrs.set("to"_s, toMicros(segment.to.value));
+                node.attrs.set("events"_s, static_cast<long long>(segment.events));
+
+                for (int j = 0; j < segment.streamKeys.size(); ++j)
+                    node.nodes.add("stream"_s, segment.streamKeys[j]);
+
+                if (!segment.remoteUsers.isEmpty())
+                {
+                    ali::xml::tree & users = node.nodes.add("remote-users"_s, segment.remoteUsers.format());
+                    users.attrs.set("hashes"_s, static_cast<long long>(segment.remoteUsers.getHashCount()));
+                }
+            }
+
+            return ali::xml::save_atomically(manifest, pathOf(manifestName()));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::filesystem2::path pathOf(ali::string const& name) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::filesystem2::path path(mDirectory);
+            path /= name;
+            return path;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        long long partitionOf(TimestampType const& timestamp) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return static_cast<long long>(std::floor(timestamp.value / ali::maxi(mOptions.partitionSpan, 1.0)));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void sortByTime(ali::array<ArchivedEvent> & events)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Insertion sort; the segments are mostly read in time order already.
+        {
+            for (int i = 1; i < events.size(); ++i)
+                for (int j = i; j > 0 && events[j].timestamp.value < events[j - 1].timestamp.value; --j)
+                    swap(events[j], events[j - 1]);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void swap(ArchivedEvent & a,
+                         ArchivedEvent & b)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::swap_by_copy(a.eventId, b.eventId);
+            ali::swap_by_copy(a.timestamp, b.timestamp);
+            a.streamKey.swap(b.streamKey);
+            a.remoteUsers.swap(b.remoteUsers);
+            a.data.swap(b.data);
+        }
+
+        /// Timestamps are stored as whole microseconds.
+        static long long toMicros(double seconds)       {return std::llround(seconds * 1e6);}
+        static double fromMicros(long long micros)      {return micros / 1e6;}
+
+        static ali::string manifestName()               {using ali::operator""_s; return "manifest.xml"_s;}
+
+    private:
+        ali::filesystem2::path              mDirectory;
+        Encoder                             mEncoder;
+        Options                             mOptions;
+
+        ali::array<ArchiveSegment>          mSegments;
+        long long                           mNextSequence{0};
+        mutable Metrics                     mMetrics;
+    };
+}
+}
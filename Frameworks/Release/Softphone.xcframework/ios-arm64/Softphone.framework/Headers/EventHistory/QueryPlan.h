@@ -0,0 +1,246 @@
+/*
+ *  EventHistory/QueryPlan.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_printf.h"
+#include "ali/ali_string.h"
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct QueryPlan
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief How a storage evaluates a Query
+      *
+      * The candidates come from a single access path (the driving index);
+      * the remaining conditions of the query are checked on each candidate
+      * in the order of filters, cheapest and most selective first, so that
+      * most candidates are rejected by the first filter or two.
+      *
+      * A plan depends only on the shape of the query (see shapeOf), not on
+      * the values it looks for, so it can be reused for all queries of the
+      * same shape, e.g. every chat or call log page.
+      */
+    {
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        enum class Access
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            EventIds,           ///< Look up Query::eventIds
+            Stream,             ///< Time index of Query::streamKey
+            Time,               ///< Time index of all events
+            Kind,               ///< Events of the matching types and directions
+            Attribute,          ///< Events with the attribute, Query::withAttributes[attribute]
+            RemoteUser          ///< Events with a remote user matching Query::withRemoteUser
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        enum class Filter
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            StreamKey,
+            EventIds,
+            Kind,               ///< eventType and directionMask
+            AccountId,
+            Hidden,
+            Attribute,          ///< Query::withAttributes[attribute]
+            WithoutAttributes,
+            Attachments,        ///< Both event attachment attribute sets
+            RemoteUser
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Step
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Filter          filter{Filter::StreamKey};
+            int             attribute{-1};
+            double          selectivity{1};     ///< Estimated fraction of candidates passing
+            int             cost{1};            ///< Relative cost of the check
+
+            /// Cost per rejected candidate; steps run in increasing rank.
+            double rank() const {return cost / ali::maxi(1 - selectivity, 1e-3);}
+        };
+
+        Access              access{Access::Time};
+        int                 attribute{-1};      ///< For Access::Attribute
+        ali::string         attributeKey;       ///< For Access::Attribute
+        bool                ordered{true};      ///< Candidates come in time order
+        int                 estimate{0};        ///< Estimated number of candidates
+        int                 events{0};          ///< Number of events when planned
+        ali::array<Step>    filters;
+
+        /** @brief Add a filter step, keeping the steps ordered by rank */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void addFilter(Filter filter,
+                       double selectivity,
+                       int cost,
+                       int attribute = -1)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Step step;
+            step.filter = filter;
+            step.attribute = attribute;
+            step.selectivity = ali::maxi(0.0, ali::mini(selectivity, 1.0));
+            step.cost = cost;
+
+            int i = filters.size();
+
+            while (i > 0 && step.rank() < filters[i - 1].rank())
+                --i;
+
+            filters.insert(i, step);
+        }
+
+        /** @brief Whether the plan, made for @p planned events, still fits @p current events
+          *
+          * The estimates are considered stale once the number of events
+          * has halved or doubled. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool isCurrent(int current) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const slack = 64;
+            return current <= 2 * events + slack && events <= 2 * current + slack;
+        }
+
+        /** @brief Key under which plans for queries like @p query can be cached
+          *
+          * Includes which conditions are set, the event type, the direction
+          * mask and the attribute keys, but no other values. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::string shapeOf(Query const& query)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            ali::string shape;
+
+            if (!query.streamKey.is_null())
+                shape.append("s"_s);
+
+            if (!query.eventType.is_null())
+                ali::printf_append(shape, "t%{}"_s, static_cast<int>(*query.eventType));
+
+            if (!query.directionMask.is_null())
+                ali::printf_append(shape, "d%{}"_s, *query.directionMask);
+
+            if (!query.newerThan.is_null())
+                shape.append("n"_s);
+
+            if (!query.olderThan.is_null())
+                shape.append("o"_s);
+
+            if (!query.eventIds.is_empty())
+                shape.append("i"_s);
+
+            if (!query.accountId.is_null())
+                shape.append("a"_s);
+
+            if (!query.hidden.is_null())
+                shape.append("h"_s);
+
+            for (int i = 0; i < query.withAttributes.size(); ++i)
+                shape.append("+"_s).append(query.withAttributes[i].key);
+
+            for (int i = 0; i < query.withoutAttributes.size(); ++i)
+                shape.append("-"_s).append(query.withoutAttributes[i].key);
+
+            if (!query.withEventAttachmentAttributes.is_empty()
+                || !query.withEventAttachmentAttributesStartingWith.is_empty())
+                shape.append("e"_s);
+
+            if (!query.withRemoteUser.prefix.is_empty() || !query.withRemoteUser.pattern.is_empty())
+                shape.append("r"_s);
+
+            return shape;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::string_literal nameOf(Access access)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            switch (access)
+            {
+            case Access::EventIds:  return "event IDs"_s;
+            case Access::Stream:    return "stream index"_s;
+            case Access::Kind:      return "type and direction index"_s;
+            case Access::Attribute: return "attribute index"_s;
+            case Access::RemoteUser: return "remote user index"_s;
+            default:                return "time index"_s;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::string_literal nameOf(Filter filter)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            switch (filter)
+            {
+            case Filter::StreamKey:         return "stream key"_s;
+            case Filter::EventIds:          return "event IDs"_s;
+            case Filter::Kind:              return "type and direction"_s;
+            case Filter::AccountId:         return "account"_s;
+            case Filter::Hidden:            return "hidden"_s;
+            case Filter::Attribute:         return "attribute"_s;
+            case Filter::WithoutAttributes: return "without attributes"_s;
+            case Filter::Attachments:       return "attachment attributes"_s;
+            default:                        return "remote user"_s;
+            }
+        }
+
+        /** @brief EXPLAIN-like description, one line for the access path and one per filter
+          *
+          * @p query supplies the attribute keys; pass the query the plan was made for. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::string explain(Query const& query) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            ali::string str;
+
+            ali::printf_append(str, "scan %{}"_s, nameOf(access));
+
+            if (access == Access::Attribute)
+                ali::printf_append(str, " '%{}'"_s, attributeKey);
+
+            ali::printf_append(str, ", ~%{} of %{} events, %{}\n"_s, estimate, events,
+                               ordered ? "in time order"_s : "sorted afterwards"_s);
+
+            double rows = estimate;
+
+            for (int i = 0; i < filters.size(); ++i)
+            {
+                Step const& step = filters[i];
+
+                ali::printf_append(str, "  filter %{}"_s, nameOf(step.filter));
+
+                if (step.filter == Filter::Attribute
+                    && step.attribute >= 0 && step.attribute < query.withAttributes.size())
+                    ali::printf_append(str, " '%{}'"_s, query.withAttributes[step.attribute].key);
+
+                rows *= step.selectivity;
+
+                ali::printf_append(str, ", cost %{}, ~%{} left\n"_s, step.cost, static_cast<int>(rows + 0.5));
+            }
+
+            return str;
+        }
+    };
+}
+}
@@ -0,0 +1,435 @@
+/*
+ *  EventHistory/AttachmentCollector.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_callback.h"
+#include "ali/ali_filesystem2.h"
+#include "ali/ali_handle.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_string.h"
+#include "ali/ali_thread_pool.h"
+#include "ali/ali_xml_parser2_interface.h"
+#include "ali/ali_xml_tree2.h"
+#include "ali/ali_xml_writer.h"
+
+#include <atomic>
+#include <chrono>
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class AttachmentCollector
+        : public ali::noncopyable
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Removes the files of deleted attachments in the background
+      *
+      * Drains Storage::fetchDeletedAttachments a batch at a time instead of
+      * leaving it to the application. Every call to tick, made periodically
+      * (e.g. once a second) on the thread owning the storage, applies the
+      * result of the previous batch and, unless it is still running, starts
+      * the next one on the thread pool. A batch removes at most
+      * Budget::filesPerTick files and stops early once it used up its share
+      * of Budget::bytesPerSecond; the attachments it did not get to stay in
+      * the storage for a later batch. Only attachments whose files are gone
+      * are cleaned from the storage.
+      *
+      * Attachments whose files could not be removed are skipped from then
+      * on, until retryFailed. They and the totals are saved to the state file
+      * after every batch, so a collector created after a restart continues
+      * where the last one stopped.
+      */
+    {
+    public:
+        /// Local file of an attachment; false if it has none (e.g. it is a URL),
+        /// in which case the attachment is just cleaned from the storage.
+        typedef ali::callback<bool(DeletedAttachment const&, ali::filesystem2::path &)> Resolver;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Budget
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int             filesPerTick{64};
+            ali::int64      bytesPerSecond{64 << 20};       ///< 0 means unlimited
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Metrics
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int             backlog{0};             ///< Attachments waiting, as of the last fetch
+            bool            backlogIsExact{true};   ///< Otherwise backlog is a lower bound
+            int             failed{0};              ///< Attachments skipped since their removal failed
+            ali::int64      files{0};               ///< Reclaimed so far, including previous runs
+            ali::int64      bytes{0};               ///< Reclaimed so far, including previous runs
+            double          filesPerSecond{0};      ///< Recent reclaim rate
+            double          bytesPerSecond{0};      ///< Recent reclaim rate
+            ali::int64      batches{0};             ///< Batches applied by this collector
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        AttachmentCollector(Storage & storage,
+                            Resolver resolver,
+                            ali::filesystem2::path const& statePath,
+                            ali::thread_pool & pool = ali::thread_pool::shared())
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mStorage(storage)
+            , mResolver(resolver)
+            , mStatePath(statePath)
+            , mPool(pool)
+        {
+            loadState();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ~AttachmentCollector()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            // Cancels the batch, or waits for it if it is running.
+            mTask.reset();
+
+            if (!mBatch.is_null() && mBatch->done.load(std::memory_order_acquire))
+                apply();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void setBudget(Budget const& budget)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mBudget = budget;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Budget const& getBudget() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mBudget;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Metrics const& getMetrics() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mMetrics;
+        }
+
+        /** @brief Whether no batch is running and nothing was left over by the last fetch */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool isIdle() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mBatch.is_null() && mMetrics.backlog == 0;
+        }
+
+        /** @brief Try again the attachments whose removal failed */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void retryFailed()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mFailed.erase();
+            mMetrics.failed = 0;
+            saveState();
+        }
+
+        /** @brief Apply the finished batch and start the next one
+          *
+          * Must be called on the thread the storage is used on.
+          * @return false if there is nothing left to collect */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool tick()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Clock::time_point const now = Clock::now();
+
+            refill(now);
+
+            if (!mBatch.is_null())
+            {
+                if (!mBatch->done.load(std::memory_order_acquire))
+                    return true;
+
+                mTask.reset();
+                apply();
+            }
+
+            return start();
+        }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        enum class Outcome
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Pending,            ///< Not attempted, the byte budget ran out
+            Removed,
+            Missing,            ///< No such file, nothing to do
+            NoFile,             ///< The attachment has no local file
+            Failed
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Item
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            DeletedAttachment           attachment;
+            ali::filesystem2::path      path;
+            Outcome                     outcome{Outcome::Pending};
+            ali::int64                  bytes{0};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Batch
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Owned by the pool thread from start until done is set.
+        {
+            ali::array<Item>            items;
+            ali::int64                  allowance{0};   ///< Bytes it may remove; < 0 for unlimited
+            ali::int64                  used{0};
+            std::atomic<bool>           done{false};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void run(Batch & batch)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Runs on the pool; touches nothing but the batch.
+        {
+            for (int i = 0; i < batch.items.size(); ++i)
+            {
+                Item & item = batch.items[i];
+
+                if (item.outcome == Outcome::NoFile)
+                    continue;
+
+                if (batch.allowance >= 0 && batch.used >= batch.allowance)
+                    break;
+
+                ali::filesystem2::file::get_size_result const size
+                    = ali::filesystem2::file::try_get_size(item.path);
+
+                if (size.is_not_found())
+                {
+                    item.outcome = Outcome::Missing;
+                    continue;
+                }
+
+                ali::filesystem2::file::remove_result const removed
+                    = ali::filesystem2::file::try_remove(item.path);
+
+                if (removed.is_success())
+                {
+                    item.outcome = Outcome::Removed;
+                    item.bytes = size.is_success() ? size.size() : 0;
+                    batch.used += item.bytes;
+                }
+                else
+                {
+                    item.outcome = removed.is_not_found() ? Outcome::Missing : Outcome::Failed;
+                }
+            }
+
+            batch.done.store(true, std::memory_order_release);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void refill(Clock::time_point now)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Token bucket holding at most one second worth of bytes.
+        {
+            double const seconds = mLastRefill == Clock::time_point()
+                ? 1.0
+                : std::chrono::duration<double>(now - mLastRefill).count();
+
+            mLastRefill = now;
+
+            if (mBudget.bytesPerSecond <= 0)
+                return;
+
+            mAllowance = ali::mini(mBudget.bytesPerSecond,
+                mAllowance + static_cast<ali::int64>(seconds * mBudget.bytesPerSecond));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool start()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const limit = ali::maxi(1, mBudget.filesPerTick);
+
+            if (mBudget.bytesPerSecond > 0 && mAllowance <= 0)
+                return true;
+
+            ali::array<DeletedAttachment> deleted;
+
+            if (!mStorage.fetchDeletedAttachments(deleted, limit + mFailed.size()))
+                return false;
+
+            mMetrics.backlogIsExact = deleted.size() < limit + mFailed.size();
+
+            ali::auto_ptr<Batch> batch = ali::new_auto_ptr<Batch>();
+            mMetrics.backlog = 0;
+
+            for (int i = 0; i < deleted.size(); ++i)
+            {
+                if (mFailed.contains(deleted[i].value))
+                    continue;
+
+                ++mMetrics.backlog;
+
+                if (batch->items.size() == limit)
+                    continue;
+
+                Item item;
+                item.attachment = deleted[i];
+
+                if (!mResolver.is_null() && !mResolver(item.attachment, item.path))
+                    item.outcome = Outcome::NoFile;
+
+                batch->items.push_back(item);
+            }
+
+            if (batch->items.is_empty())
+                return false;
+
+            batch->allowance = mBudget.bytesPerSecond > 0 ? mAllowance : -1;
+
+            Batch * const b = batch.get();
+            mBatch = ali::move(batch);
+            mTask = mPool.submit([b] { run(*b); }, ali::task_priority::background);
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void apply()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Cleans the collected attachments from the storage and updates the metrics.
+        {
+            ali::auto_ptr<Batch> batch = ali::move(mBatch);
+
+            int files = 0;
+
+            for (int i = 0; i < batch->items.size(); ++i)
+            {
+                Item const& item = batch->items[i];
+
+                switch (item.outcome)
+                {
+                case Outcome::Removed:
+                case Outcome::Missing:
+                case Outcome::NoFile:
+                    mStorage.cleanDeletedAttachment(item.attachment);
+                    ++files;
+                    mMetrics.bytes += item.bytes;
+                    --mMetrics.backlog;
+                    break;
+                case Outcome::Failed:
+                    mFailed.insert(item.attachment.value);
+                    --mMetrics.backlog;
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            mMetrics.backlog = ali::maxi(0, mMetrics.backlog);
+            mMetrics.files += files;
+            mMetrics.failed = mFailed.size();
+            ++mMetrics.batches;
+
+            if (batch->allowance >= 0)
+                mAllowance -= batch->used;
+
+            Clock::time_point const now = Clock::now();
+
+            if (mLastApply != Clock::time_point())
+            {
+                double const seconds = ali::maxi(1e-3,
+                    std::chrono::duration<double>(now - mLastApply).count());
+
+                // Moving average over the last few batches.
+                double const weight = 0.25;
+
+                mMetrics.filesPerSecond += weight * (files / seconds - mMetrics.filesPerSecond);
+                mMetrics.bytesPerSecond += weight * (batch->used / seconds - mMetrics.bytesPerSecond);
+            }
+
+            mLastApply = now;
+
+            saveState();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void loadState()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::xml::tree state;
+
+            if (!ali::xml::load(state, mStatePath))
+                return;
+
+            using ali::operator""_s;
+
+            long long value = 0;
+
+            if (auto const* files = state.attrs.find("files"_s))
+                if (files->parse_value(value))
+                    mMetrics.files = value;
+
+            if (auto const* bytes = state.attrs.find("bytes"_s))
+                if (bytes->parse_value(value))
+                    mMetrics.bytes = value;
+
+            for (int i = 0; i < state.nodes.size(); ++i)
+                if (state.nodes[i].name == "failed"_s)
+                    mFailed.insert(ali::string(state.nodes[i].data));
+
+            mMetrics.failed = mFailed.size();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void saveState() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            using ali::operator""_s;
+
+            ali::xml::tree state("attachment-collector"_s);
+            state.attrs.set("files"_s, static_cast<long long>(mMetrics.files));
+            state.attrs.set("bytes"_s, static_cast<long long>(mMetrics.bytes));
+
+            for (int i = 0; i < mFailed.size(); ++i)
+                state.nodes.add("failed"_s, mFailed[i]);
+
+            ali::xml::save_atomically(state, mStatePath);
+        }
+
+    private:
+        Storage &                           mStorage;
+        Resolver                            mResolver;
+        ali::filesystem2::path              mStatePath;
+        ali::thread_pool &                  mPool;
+
+        Budget                              mBudget;
+        Metrics                             mMetrics;
+        ali::array_set<ali::string>         mFailed;
+
+        ali::int64                          mAllowance{0};
+        Clock::time_point                   mLastRefill;
+        Clock::time_point                   mLastApply;
+
+        ali::auto_ptr<Batch>                mBatch;
+        ali::auto_ptr<ali::handle>          mTask;      // after mBatch, so that it goes first
+    };
+}
+}
@@ -0,0 +1,270 @@
+/*
+ *  EventHistory/ChangeCoalescer.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+
+#include "ali/ali_array_map.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_callback.h"
+#include "ali/ali_integer.h"
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class ChangeCoalescer
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Merges bursts of event history change notifications into one delta.
+      *
+      * Feed it from Observer::onEventsChanged, or attach() it to a Storage
+      * to collect its change callbacks. The first change after a delivery asks
+      * the scheduler to call flush() once the latency budget has elapsed;
+      * everything that arrives in the meantime is merged:
+      *
+      *  - eventIds and streamKeys are united,
+      *  - stream key changes are chained (a -> b followed by b -> c gives a -> c),
+      *  - a set that grows over its cap is dropped and reported as many.
+      *
+      * All methods must be called on the thread notifications are delivered on,
+      * and the scheduler must call flush() on that thread too.
+      */
+    {
+    public:
+        typedef ali::callback<void(ChangedEvents const& events,
+                                   ChangedStreams const& streams)> Delivery;
+
+        /** @brief Must arrange for flush() to be called after the given number of milliseconds */
+        typedef ali::callback<void(int delayMs)> Scheduler;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Settings
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int latencyBudgetMs{16};
+            int maxEventIds{512};
+            int maxStreamKeys{128};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Counters
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::int64 received{0};     ///< Notifications passed to add()
+            ali::int64 coalesced{0};    ///< Notifications merged into an already pending delta
+            ali::int64 delivered{0};    ///< Deltas passed to the delivery callback
+            ali::int64 capped{0};       ///< Deltas whose eventIds or streamKeys were replaced by many
+        };
+
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ChangeCoalescer(Delivery delivery,
+                        Scheduler scheduler)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mDelivery(delivery)
+            , mScheduler(scheduler)
+        {}
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ChangeCoalescer(Delivery delivery,
+                        Scheduler scheduler,
+                        Settings const& settings)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mDelivery(delivery)
+            , mScheduler(scheduler)
+            , mSettings(settings)
+        {}
+
+        ChangeCoalescer(ChangeCoalescer const&) = delete;
+        ChangeCoalescer& operator=(ChangeCoalescer const&) = delete;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ~ChangeCoalescer()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            detach();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void attach(Storage & storage)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            detach();
+
+            mStorage = &storage;
+            mStorage->wantChangeCallback(this, [this](Storage & s)
+            {
+                add(s.getChangedEvents(), s.getChangedEventStreams());
+            });
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void detach()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mStorage != nullptr)
+                mStorage->cancelChangeCallback(this);
+
+            mStorage = nullptr;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void add(ChangedEvents const& events,
+                 ChangedStreams const& streams)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ++mCounters.received;
+
+            if (mPending)
+                ++mCounters.coalesced;
+
+            mergeEvents(events);
+            mergeStreams(streams);
+
+            if (!mPending)
+            {
+                mPending = true;
+                mScheduler(mSettings.latencyBudgetMs);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void flush()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Delivers the pending delta, if any. Safe to call at any time,
+        /// e.g. before a view that needs fresh data appears.
+        {
+            if (!mPending)
+                return;
+
+            mPending = false;
+
+            ChangedEvents events;
+            ChangedStreams streams;
+            ali::swap(events.many, mEvents.many);
+            events.eventIds.swap(mEvents.eventIds);
+            ali::swap(streams.many, mStreams.many);
+            streams.streamKeys.swap(mStreams.streamKeys);
+            streams.streamKeyChanges.swap(mStreams.streamKeyChanges);
+
+            if (mCapped)
+                ++mCounters.capped;
+
+            mCapped = false;
+
+            ++mCounters.delivered;
+
+            // The delivery callback may add() more changes.
+            mDelivery(events, streams);
+        }
+
+        bool isPending() const {return mPending;}
+
+        Counters const& counters() const {return mCounters;}
+
+        Settings const& settings() const {return mSettings;}
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void mergeEvents(ChangedEvents const& events)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mEvents.many)
+                return;
+
+            if (events.many
+                || mEvents.eventIds.size() + events.eventIds.size() > mSettings.maxEventIds)
+            {
+                if (!events.many)
+                    mCapped = true;
+
+                mEvents.many = true;
+                mEvents.eventIds.erase();
+                return;
+            }
+
+            mEvents.eventIds.insert(events.eventIds.as_array());
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void mergeStreams(ChangedStreams const& streams)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            // Renames are kept even when the key set is capped,
+            // observers need them to re-key their own state.
+            for (int i = 0; i < streams.streamKeyChanges.size(); ++i)
+                chainStreamKeyChange(streams.streamKeyChanges.at(i).first,
+                                     streams.streamKeyChanges.at(i).second);
+
+            if (mStreams.many)
+                return;
+
+            if (streams.many)
+            {
+                mStreams.many = true;
+                mStreams.streamKeys.erase();
+                return;
+            }
+
+            mStreams.streamKeys.insert(streams.streamKeys.as_array());
+
+            if (mStreams.streamKeys.size() > mSettings.maxStreamKeys)
+            {
+                mCapped = true;
+                mStreams.many = true;
+                mStreams.streamKeys.erase();
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void chainStreamKeyChange(ali::string const& oldKey,
+                                  ali::string const& newKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_map<ali::string, ali::string> changes;
+            bool chained = false;
+
+            for (int i = 0; i < mStreams.streamKeyChanges.size(); ++i)
+            {
+                ali::string const& from = mStreams.streamKeyChanges.at(i).first;
+                ali::string const& to = mStreams.streamKeyChanges.at(i).second;
+
+                if (to == oldKey)
+                {
+                    chained = true;
+
+                    if (from != newKey)
+                        changes.set(from, newKey);
+                }
+                else
+                {
+                    changes.set(from, to);
+                }
+            }
+
+            if (!chained)
+                changes.set(oldKey, newKey);
+
+            mStreams.streamKeyChanges.swap(changes);
+        }
+
+    private:
+        Delivery                mDelivery;
+        Scheduler               mScheduler;
+        Settings                mSettings;
+        Storage *               mStorage{nullptr};
+
+        bool                    mPending{false};
+        bool                    mCapped{false};
+        ChangedEvents           mEvents;
+        ChangedStreams          mStreams;
+        Counters                mCounters;
+    };
+}
+}
@@ -0,0 +1,245 @@
+/*
+ *  EventHistory/EventCache.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+
+#include "ali/ali_callback.h"
+#include "ali/ali_hash_cache.h"
+#include "ali/ali_integer.h"
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class EventCache
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Bounded cache of loaded events and streams for Storage implementations
+      *
+      * Keeps the most recently used events and streams referenced, so that a
+      * storage does not build them again from its backing store on every fetch.
+      * Lookups, inserts and removals take constant time; removed events are
+      * parked on a separate list and purgeRemoved() only visits those.
+      *
+      * With a memory budget set, the least recently used entries are dropped
+      * once the estimated size of the cached objects exceeds it. Dropping an
+      * entry only releases the cache's reference; the object stays alive while
+      * anybody else holds it.
+      *
+      * fetch() reports whether the event came from the cache in
+      * FetchItem::cached and counts hits and misses.
+      */
+    {
+    public:
+        typedef ali::callback<Event::Pointer(EventIdType id)> EventLoader;
+        typedef ali::hash_cache_statistics Statistics;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Settings
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::int64 maxEventBytes{0};    ///< 0 for unbounded
+            ali::int64 maxStreamBytes{0};   ///< 0 for unbounded
+        };
+
+    public:
+        EventCache() = default;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        explicit EventCache(Settings const& settings)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : mEvents(settings.maxEventBytes)
+            , mStreams(settings.maxStreamBytes)
+        {}
+
+        EventCache(EventCache const&) = delete;
+        EventCache& operator=(EventCache const&) = delete;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void setSettings(Settings const& settings)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mEvents.set_budget(settings.maxEventBytes);
+            mStreams.set_budget(settings.maxStreamBytes);
+        }
+
+        // events
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Event::Pointer findEvent(EventIdType id)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Event::Pointer const* event = mEvents.find(id);
+            return event == nullptr ? Event::Pointer() : *event;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        FetchItem fetch(EventIdType id,
+                        EventLoader const& load)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Returns the cached event, or loads and caches it.
+        /// The item's event is null if the loader finds nothing.
+        {
+            if (Event::Pointer const* event = mEvents.find(id))
+                return FetchItem(*event, true);
+
+            Event::Pointer event = load(id);
+
+            if (!event.is_null())
+                insertEvent(event);
+
+            return FetchItem(event, false);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void insertEvent(Event::Pointer const& event)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Also call after an event has been saved, so that its size is re-estimated.
+        {
+            ali_assert(event->getEventId() != 0);
+            mEvents.insert(event->getEventId(), event, estimateBytes(*event));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool markEventRemoved(EventIdType id)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mEvents.mark_removed(id);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void eraseEvent(EventIdType id)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mEvents.erase(id);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        template <typename Fun>
+        void forEachEvent(Fun fun)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Calls fun(Event &) for every cached event that is not removed.
+        {
+            mEvents.for_each([&fun](EventIdType, Event::Pointer & event)
+            {
+                fun(*event);
+            });
+        }
+
+        // streams
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        EventStream::Pointer findStream(ali::string_const_ref key)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            EventStream::Pointer const* stream = mStreams.find(key);
+            return stream == nullptr ? EventStream::Pointer() : *stream;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void insertStream(EventStream::Pointer const& stream)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mStreams.insert(stream->key, stream, estimateBytes(*stream));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool markStreamRemoved(ali::string_const_ref key)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mStreams.mark_removed(key);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void eraseStream(ali::string_const_ref key)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mStreams.erase(key);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        template <typename Fun>
+        void forEachStream(Fun fun)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mStreams.for_each([&fun](ali::string const&, EventStream::Pointer & stream)
+            {
+                fun(*stream);
+            });
+        }
+
+        // both
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int purgeRemoved()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Erases removed events and streams; returns their number.
+        {
+            return mEvents.purge_removed() + mStreams.purge_removed();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void clear()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mEvents.erase();
+            mStreams.erase();
+        }
+
+        int getEventCount() const {return mEvents.size();}
+        int getStreamCount() const {return mStreams.size();}
+
+        ali::int64 getEventBytes() const {return mEvents.cost();}
+        ali::int64 getStreamBytes() const {return mStreams.cost();}
+
+        Statistics const& getEventStatistics() const {return mEvents.stats();}
+        Statistics const& getStreamStatistics() const {return mStreams.stats();}
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::int64 estimateBytes(Event const& event)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::int64 bytes = sizeof(Event)
+                + event.getStreamKey().size()
+                + event.getAccountId().size()
+                + event.getRemoteUserCount() * static_cast<ali::int64>(sizeof(RemoteUser))
+                + event.getEventAttachmentCount() * static_cast<ali::int64>(sizeof(EventAttachment));
+
+            for (int i = 0; i < event.getAttributeCount(); ++i)
+            {
+                auto const& attr = event.getFullAttribute(i);
+                bytes += sizeof(attr) + attr.first.size() + attr.second.value.size();
+            }
+
+            return bytes;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::int64 estimateBytes(EventStream const& stream)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::int64 bytes = sizeof(EventStream)
+                + stream.key.size()
+                + stream.getStreamPartyCount() * static_cast<ali::int64>(sizeof(StreamParty));
+
+            for (int i = 0; i < stream.getAttributeCount(); ++i)
+            {
+                auto const& attr = stream.getFullAttribute(i);
+                bytes += sizeof(attr) + attr.first.size() + attr.second.value.size();
+            }
+
+            return bytes;
+        }
+
+    private:
+        ali::hash_cache<EventIdType, Event::Pointer>        mEvents;
+        ali::hash_cache<ali::string, EventStream::Pointer>  mStreams;
+    };
+}
+}
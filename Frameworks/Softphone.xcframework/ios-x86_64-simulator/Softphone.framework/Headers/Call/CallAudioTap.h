@@ -0,0 +1,144 @@
+#pragma once
+
+#include "Softphone/Call/CallAudioHook.h"
+#include "ali/ali_spsc_ring.h"
+#include <atomic>
+
+namespace Call
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    template <typename Key>
+    class AudioTap
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Moves audio delivered to RemoteAudioHook / LocalAudioHook off the
+      * real-time audio thread.
+      *
+      * hook() returns a callback suitable for
+      * Instance::VoiceUnitMonitor::subscribeCallRemoteAudio (RemoteAudioTap) or
+      * subscribeCallLocalAudio (LocalAudioTap). It only copies the samples into
+      * a lock-free ring and always returns KeepData, so it never blocks the audio
+      * thread. Another thread periodically calls drain() to process the audio
+      * in place, without further copies.
+      *
+      * When the consumer falls behind, whole buffers are dropped and counted
+      * by droppedSamples(). Keys are copied into preallocated slots; for
+      * LocalAudioTap a group id longer than ali::string's inline capacity is
+      * the only thing that can allocate on the audio thread.
+      */
+    {
+    public:
+        typedef ali::callback<VoiceUnitMonitor::ProcessingResult(Key const& key,
+                                                                 int samplingRate, short const* data, int len)> Hook;
+
+        typedef ali::callback<void(Key const& key,
+                                   int samplingRate, short const* data, int len)> Consumer;
+
+        /** @brief Constructor
+          * @param sampleCapacity Samples buffered between drain() calls, rounded up to a power of two
+          * @param bufferCapacity Hook invocations buffered between drain() calls, rounded up to a power of two
+          */
+        explicit AudioTap(int sampleCapacity = 64 * 1024, int bufferCapacity = 256)
+        : mSamples(sampleCapacity)
+        , mBuffers(bufferCapacity)
+        {}
+
+        AudioTap(AudioTap const&) = delete;
+        AudioTap& operator=(AudioTap const&) = delete;
+
+        /** @brief Returns the callback to subscribe; the tap must outlive the subscription */
+        Hook hook()
+        {
+            return [this](Key const& key, int samplingRate, short const* data, int len)
+            {
+                return push(key, samplingRate, data, len);
+            };
+        }
+
+        /** @brief Producer side, called on the audio thread */
+        VoiceUnitMonitor::ProcessingResult push(Key const& key, int samplingRate, short const* data, int len)
+        {
+            if (len <= 0)
+                return VoiceUnitMonitor::ProcessingResult::KeepData;
+
+            typename ali::spsc_ring<Buffer>::spans const buffers(mBuffers.write_spans());
+            typename ali::spsc_ring<short>::spans const samples(mSamples.write_spans());
+
+            if (buffers.is_empty() || samples.size() < len)
+            {
+                mDroppedSamples.fetch_add(len, std::memory_order_relaxed);
+                return VoiceUnitMonitor::ProcessingResult::KeepData;
+            }
+
+            mSamples.write(ali::array_const_ref<short>(data, len));
+
+            Buffer& b = buffers.first[0];
+            b.key = key;
+            b.samplingRate = samplingRate;
+            b.len = len;
+            mBuffers.produce(1);
+
+            return VoiceUnitMonitor::ProcessingResult::KeepData;
+        }
+
+        /** @brief Consumer side, passes everything buffered so far to the consumer
+          * @return Number of hook invocations processed
+          *
+          * Samples that wrapped around the end of the ring are passed in two calls.
+          **/
+        int drain(Consumer const& consumer)
+        {
+            int processed = 0;
+
+            for (;;)
+            {
+                typename ali::spsc_ring<Buffer>::spans const buffers(mBuffers.read_spans());
+
+                if (buffers.is_empty())
+                    break;
+
+                Buffer& b = buffers.first[0];
+
+                typename ali::spsc_ring<short>::spans const samples(mSamples.read_spans());
+
+                int const first = ali::mini(b.len, samples.first.size());
+
+                consumer(b.key, b.samplingRate, samples.first.data(), first);
+
+                if (first < b.len)
+                    consumer(b.key, b.samplingRate, samples.second.data(), b.len - first);
+
+                mSamples.consume(b.len);
+
+                b.key = Key();
+                mBuffers.consume(1);
+
+                ++processed;
+            }
+
+            return processed;
+        }
+
+        /** @brief Samples dropped because drain() was not called often enough */
+        ali::int64 droppedSamples() const
+        {
+            return mDroppedSamples.load(std::memory_order_relaxed);
+        }
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Buffer
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Key key;
+            int samplingRate{0};
+            int len{0};
+        };
+
+        ali::spsc_ring<short> mSamples;
+        ali::spsc_ring<Buffer> mBuffers;
+        std::atomic<ali::int64> mDroppedSamples{0};
+    };
+
+    typedef AudioTap<Softphone::EventHistory::CallEvent::Pointer> RemoteAudioTap;
+    typedef AudioTap<ali::string> LocalAudioTap;
+}
@@ -0,0 +1,2582 @@
+/*
+ *  EventHistory/MemoryStorage.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+#include "Softphone/EventHistory/QueryPlan.h"
+#include "Softphone/EventHistory/RemoteUserIndex.h"
+#include "Softphone/EventHistory/TextIndex.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_map.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_callback.h"
+#include "ali/ali_hash_cache.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_string.h"
+#include "ali/ali_utility.h"
+
+#include <chrono>
+#include <set>
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class MemoryStorage
+        : public Storage
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Event history kept entirely in memory
+      *
+      * Reference implementation of Storage for tests, tools and ephemeral
+      * (e.g. incognito) histories. Every field of Query, Paging, StreamQuery
+      * and StreamPaging is honoured. Besides the primary hash map by event ID,
+      * the events are indexed by
+      *
+      *  - time (timestamp, event ID), globally and per stream,
+      *  - event type and direction,
+      *  - attribute key and value,
+      *  - remote user address (see RemoteUserIndex),
+      *
+      * all of them sorted arrays searched by bisection. A query starts from
+      * whichever index yields the fewest candidates and checks the remaining
+      * conditions on those only, most selective and cheapest first; see
+      * QueryPlan and explain. Plans are cached by query shape (up to 64)
+      * and replanned when the number of events halves or doubles.
+      *
+      * The words of message subjects and bodies are kept in a TextIndex for
+      * searchEvents.
+      *
+      * Streams are kept in order of last activity in a balanced tree, and a
+      * stream is moved in O(log n) as its last event changes, so
+      * fetchEventStreams walks the streams
+      * in page order, starting at the activity bounds of the query, instead
+      * of sorting them; without the total count, the chat list's first N
+      * streams cost N matches.
+      *
+      * Unread counts consider incoming, non-hidden events newer than the
+      * stream's last seen timestamp. They are maintained per stream, per
+      * account and in total as events are saved and deleted and streams
+      * are marked as seen, rather than recounted by queries.
+      *
+      * Bulk writes (saveEvents, saveEventStreams or any writes grouped in
+      * a Transaction) post the change callbacks and refresh the touched
+      * streams once per batch instead of once per object. Deleted events
+      * leave the time indexes in one sweep per index rather than one by
+      * one; deleteEventsInBatches and deleteEventStreamsInBatches also
+      * report them in compact batches, see RemovedEvents.
+      */
+    {
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        explicit MemoryStorage(bool useLegacyStream = false)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : Storage(useLegacyStream)
+        {}
+
+        using Storage::saveEvent;
+        using Storage::saveEventStream;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool fetchEvents(FetchResult & result,
+                                 Query const& query,
+                                 Paging const& paging = {}) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<TimeKey> keys;
+            collectEvents(keys, query);
+
+            result.totalCount = keys.size();
+            pageEvents(result, keys, paging);
+            return true;
+        }
+
+        /** @brief Fetch events, counting all matching ones only if @p countTotal
+          *
+          * Without the count, FetchResult::totalCount is -1, and pages of a
+          * stream or of the whole history are read straight off the time index
+          * from Paging::before / after (see EventCursor) up to the limit,
+          * instead of collecting every matching event first. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool fetchEvents(FetchResult & result,
+                         Query const& query,
+                         Paging const& paging,
+                         bool countTotal) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (countTotal)
+                return fetchEvents(result, query, paging);
+
+            Range range(query);
+            range.paging(paging);
+
+            result.totalCount = -1;
+
+            QueryPlan const plan = planFor(query, range);
+            TimeIndex const* index = sortedIndex(query, plan);
+
+            if (index == nullptr)
+            {
+                ali::array<TimeKey> keys;
+                collectEvents(keys, query, range);
+                pageEvents(result, keys, paging);
+                return true;
+            }
+
+            result.items.erase();
+
+            int const begin = range.lowerIndex(*index);
+            int const end = range.upperIndex(*index);
+
+            int skip = paging.offset.is_null() ? 0 : ali::maxi(0, *paging.offset);
+            int const limit = paging.limit.is_null() ? end - begin : ali::maxi(0, *paging.limit);
+
+            for (int i = 0; i < end - begin && result.items.size() < limit; ++i)
+            {
+                TimeKey const& key = (*index)[paging.order == SortOrder::Ascending
+                    ? begin + i : end - 1 - i];
+
+                Record const* record = mEvents.peek(key.id);
+
+                if (record == nullptr || !matches(*record, query, plan))
+                    continue;
+
+                if (skip > 0)
+                    --skip;
+                else
+                    result.items.push_back(FetchItem(record->event, true));
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool saveEvent(Event & event) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (event.isRemoved() || event.isBeingRemoved())
+                return false;
+
+            EventIdType id = event.getEventId();
+
+            if (id == 0)
+            {
+                id = ++mLastEventId;
+                setEventId(event, id);
+            }
+            else if (id > mLastEventId)
+            {
+                mLastEventId = id;
+            }
+
+            ali::string oldStreamKey;
+            Record record{Event::Pointer(&event)};
+
+            if (Record * old = mEvents.peek(id))
+            {
+                oldStreamKey = old->streamKey;
+
+                // Index the new state first so that attachments
+                // kept by the event are not reported as deleted.
+                addAttachmentReferences(record);
+                releaseAttachmentReferences(*old);
+                unindex(*old, false);
+            }
+            else
+            {
+                addAttachmentReferences(record);
+            }
+
+            index(record);
+
+            ali::string const streamKey = record.streamKey;
+            mEvents.insert(id, ali::move(record));
+
+            setStored(event);
+
+            if (!streamKey.is_empty())
+                ensureStream(streamKey);
+
+            if (!oldStreamKey.is_empty() && oldStreamKey != streamKey)
+                touchStream(oldStreamKey);
+
+            if (!streamKey.is_empty())
+                touchStream(streamKey);
+
+            setEventChanged(id);
+            changed();
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual int getEventCount(Query const& query) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<TimeKey> keys;
+            collectEvents(keys, query);
+            return keys.size();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual int getUnreadEventCount(StreamQuery const& query) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Constant time for all streams, proportional to the number of keys
+        /// for withStreamKeys alone; other queries check every stream.
+        {
+            bool const onlyKeys = query.withoutStreamKeys.is_empty()
+                && query.lastActivityAfter.is_null()
+                && query.lastActivityBefore.is_null()
+                && query.withParties.is_empty()
+                && query.withAttributes.is_empty()
+                && query.withoutAttributes.is_empty()
+                && query.state == StreamQuery::StreamState::Any;
+
+            if (onlyKeys && query.withStreamKeys.is_empty())
+                return mUnreadTotal;
+
+            int count = 0;
+
+            if (onlyKeys)
+            {
+                for (int i = 0; i < query.withStreamKeys.size(); ++i)
+                    if (mStreams.find(query.withStreamKeys[i]) != nullptr)
+                        count += getStreamUnreadEventCount(query.withStreamKeys[i]);
+
+                return count;
+            }
+
+            for (int i = 0; i < mStreams.size(); ++i)
+            {
+                EventStream const& stream = *mStreams.at(i).second;
+
+                if (matches(stream, query))
+                    count += getStreamUnreadEventCount(stream.key);
+            }
+
+            return count;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int getStreamUnreadEventCount(ali::string_const_ref streamKey) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const* count = mUnreadByStream.find(streamKey);
+            return count != nullptr ? *count : 0;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int getAccountUnreadEventCount(ali::string_const_ref accountId) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const* count = mUnreadByAccount.find(accountId);
+            return count != nullptr ? *count : 0;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int getTotalUnreadEventCount() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mUnreadTotal;
+        }
+
+        /** @brief Recount all unread events and compare with the maintained counters
+          *
+          * For tests; takes time proportional to the number of events.
+          * Outside of a Transaction, also checks EventStream::getUnreadCount. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool checkUnreadCounters() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_map<ali::string, int> byStream;
+            ali::array_map<ali::string, int> byAccount;
+            int total = 0;
+            bool ok = true;
+
+            for (int i = 0; i < mTimeIndex.size(); ++i)
+            {
+                Record const& record = *mEvents.peek(mTimeIndex[i].id);
+                bool const unread = isUnread(record);
+
+                ok = ok && record.unread == unread;
+
+                if (!unread)
+                    continue;
+
+                ++byStream[record.streamKey];
+                ++byAccount[record.accountId];
+                ++total;
+            }
+
+            ok = ok && total == mUnreadTotal
+                && byStream == mUnreadByStream
+                && byAccount == mUnreadByAccount;
+
+            for (int i = 0; ok && mTransactionDepth == 0 && i < mStreams.size(); ++i)
+                ok = mStreams.at(i).second->getUnreadCount()
+                    == getStreamUnreadEventCount(mStreams.at(i).first);
+
+            return ok;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool changeStreamKey(ali::string const& currentStreamKey,
+                                     ali::string const &newStreamKey) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (currentStreamKey == newStreamKey || newStreamKey.is_empty())
+                return false;
+
+            EventStream::Pointer const* current = mStreams.find(currentStreamKey);
+            if (current == nullptr)
+                return false;
+
+            EventStream::Pointer const oldStream = *current;
+
+            if (mStreams.find(newStreamKey) == nullptr)
+            {
+                EventStream::Pointer stream = createEventStream(newStreamKey);
+
+                for (int i = 0; i < oldStream->getStreamPartyCount(); ++i)
+                    stream->addStreamParty(oldStream->getStreamParty(i));
+
+                for (int i = 0; i < oldStream->getAttributeCount(); ++i)
+                    stream->setFullAttribute(oldStream->getFullAttribute(i).first,
+                                             oldStream->getFullAttribute(i).second);
+
+                stream->setOpen(oldStream->isOpen());
+                setLastSeenTimestamp(*stream, oldStream->getLastSeenTimestamp());
+                setStored(*stream);
+                addStream(stream);
+                applyLastSeen(*stream);
+            }
+
+            ali::array<EventIdType> ids;
+            collectStreamEventIds(ids, currentStreamKey);
+
+            for (int i = 0; i < ids.size(); ++i)
+            {
+                Record & record = *mEvents.peek(ids[i]);
+
+                unindex(record, false);
+                resetStreamKey(*record.event, newStreamKey);
+                record.snapshot();
+                index(record);
+            }
+
+            if (Event::Pointer const* draft = mDrafts.find(currentStreamKey))
+            {
+                Event::Pointer const event = *draft;
+                mDrafts.erase(currentStreamKey);
+                resetStreamKey(*event, newStreamKey);
+                mDrafts.set(newStreamKey, event);
+            }
+
+            changeStreamKeyOfCachedEvents(currentStreamKey, newStreamKey);
+
+            eraseStream(currentStreamKey);
+            mSeenUntil.erase(currentStreamKey);
+            setRemoved(*oldStream, true);
+
+            touchStream(newStreamKey);
+
+            setEventStreamKeyChanged(currentStreamKey, newStreamKey);
+            setManyEventsChanged();
+            changed();
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool fetchEventStreams(StreamFetchResult & result,
+                                       StreamQuery const& query,
+                                       StreamPaging const& paging = {}) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return fetchEventStreams(result, query, paging, true);
+        }
+
+        /** @brief Fetch streams, counting all matching ones only if @p countTotal
+          *
+          * Without the count, StreamFetchResult::totalCount is -1, and the
+          * streams are checked only up to the end of the page, so the first
+          * N streams take time proportional to N (plus those skipped as not
+          * matching). Combine with a StreamCursor. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool fetchEventStreams(StreamFetchResult & result,
+                               StreamQuery const& query,
+                               StreamPaging const& paging,
+                               bool countTotal) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const offset = paging.offset.is_null() ? 0 : ali::maxi(0, *paging.offset);
+            int const limit = paging.limit.is_null() ? static_cast<int>(mActivityIndex.size()) : ali::maxi(0, *paging.limit);
+            bool const ascending = paging.order == SortOrder::Ascending;
+
+            ActivityIndex::const_iterator begin;
+            ActivityIndex::const_iterator end;
+            activityRange(begin, end, query);
+
+            result.items.erase();
+
+            int matching = 0;
+
+            for (ActivityIndex::const_iterator it = ascending ? begin : end; it != (ascending ? end : begin);)
+            {
+                if (!countTotal && result.items.size() == limit)
+                    break;
+
+                EventStream * stream = ascending ? (it++)->stream : (--it)->stream;
+
+                if (!matches(*stream, query))
+                    continue;
+
+                if (matching++ >= offset && result.items.size() < limit)
+                    result.items.push_back(StreamFetchItem(EventStream::Pointer(stream), true));
+            }
+
+            result.totalCount = countTotal ? matching : -1;
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool saveEventStream(EventStream & eventStream) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (eventStream.isRemoved())
+                return false;
+
+            if (mStreams.find(eventStream.key) == nullptr)
+                addStream(EventStream::Pointer(&eventStream));
+
+            setStored(eventStream);
+
+            // The last seen timestamp may have moved.
+            applyLastSeen(**mStreams.find(eventStream.key));
+            touchStream(eventStream.key);
+
+            setEventStreamChanged(eventStream.key);
+            changed();
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool moveEventToStream(Event::Pointer event,
+                                       EventStream::Pointer & newStream) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (event.is_null() || newStream.is_null())
+                return false;
+
+            Record * record = mEvents.peek(event->getEventId());
+            if (record == nullptr)
+                return false;
+
+            ali::string const oldStreamKey = record->streamKey;
+            if (oldStreamKey == newStream->key)
+                return true;
+
+            if (mStreams.find(newStream->key) == nullptr)
+            {
+                setStored(*newStream);
+                addStream(newStream);
+                applyLastSeen(*newStream);
+            }
+
+            unindex(*record, false);
+            resetStreamKey(*event, newStream->key);
+            record->snapshot();
+            index(*record);
+
+            if (!oldStreamKey.is_empty())
+                touchStream(oldStreamKey);
+
+            touchStream(newStream->key);
+
+            setEventChanged(event->getEventId());
+            changed();
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual int getStreamCount(StreamQuery const& query) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ActivityIndex::const_iterator begin;
+            ActivityIndex::const_iterator end;
+            activityRange(begin, end, query);
+
+            int count = 0;
+
+            for (ActivityIndex::const_iterator it = begin; it != end; ++it)
+                if (matches(*it->stream, query))
+                    ++count;
+
+            return count;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool deleteEventStream(ali::string const& streamKey) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (!removeStream(streamKey))
+                return false;
+
+            changed();
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool deleteEventStreams(StreamQuery const& query) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<ali::string> keys;
+
+            for (int i = 0; i < mStreams.size(); ++i)
+                if (matches(*mStreams.at(i).second, query))
+                    keys.push_back(mStreams.at(i).first);
+
+            for (int i = 0; i < keys.size(); ++i)
+                removeStream(keys[i]);
+
+            if (!keys.is_empty())
+            {
+                changed();
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool deleteAllEvents() override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            for (int i = mTimeIndex.size(); i > 0; --i)
+                removeEvent(mTimeIndex[i - 1].id);
+
+            while (!mStreams.is_empty())
+            {
+                EventStream::Pointer const stream = mStreams.at(mStreams.size() - 1).second;
+                eraseStream(stream->key);
+                setRemoved(*stream, true);
+            }
+
+            mSeenUntil.erase();
+
+            mDrafts.erase();
+            mPlans.erase();
+
+            setManyEventsChanged();
+            setManyEventStreamsChanged();
+            changed();
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool deleteEvents(ali::array_set<EventIdType> const& ids) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return removeEvents(ids.as_array());
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool deleteEvents(Query const& query) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array<TimeKey> keys;
+            collectEvents(keys, query);
+
+            ali::array<EventIdType> ids;
+            ids.reserve(keys.size());
+
+            for (int i = 0; i < keys.size(); ++i)
+                ids.push_back(keys[i].id);
+
+            return removeEvents(ids);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool fetchDeletedAttachments(ali::array<DeletedAttachment> & result,
+                                             int limit) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            result.erase();
+
+            for (int i = mDeletedHead; i < mDeletedAttachments.size()
+                     && (limit <= 0 || result.size() < limit); ++i)
+                if (!mDeletedAttachments[i].cleaned)
+                    result.push_back(mDeletedAttachments[i].attachment);
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool cleanDeletedAttachment(Attribute::Type type,
+                                            ali::string const& value) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Attachments are cleaned in about the order they are fetched, so the
+        /// search from the head is short; the cleaned ones are only marked, and
+        /// dropped in one pass once they make up half of the queue.
+        {
+            for (int i = mDeletedHead; i < mDeletedAttachments.size(); ++i)
+            {
+                DeletedEntry & entry = mDeletedAttachments[i];
+
+                if (entry.cleaned
+                    || entry.attachment.type != type
+                    || entry.attachment.value != value)
+                    continue;
+
+                entry.cleaned = true;
+                ++mDeletedCleaned;
+
+                while (mDeletedHead < mDeletedAttachments.size()
+                       && mDeletedAttachments[mDeletedHead].cleaned)
+                    ++mDeletedHead;
+
+                if (2 * mDeletedCleaned > mDeletedAttachments.size())
+                {
+                    mDeletedAttachments.erase_if([](DeletedEntry const& e) {return e.cleaned;});
+                    mDeletedHead = 0;
+                    mDeletedCleaned = 0;
+                }
+
+                return true;
+            }
+
+            return false;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool cleanDeletedAttachments() override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mDeletedAttachments.erase();
+            mDeletedHead = 0;
+            mDeletedCleaned = 0;
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual Event::Pointer fetchDraftEvent(ali::opt_string const& streamKey) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Event::Pointer const* draft = mDrafts.find(draftKey(streamKey));
+            return draft == nullptr ? Event::Pointer() : *draft;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool fetchDraftEvents(FetchResult & result) const override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            result.totalCount = mDrafts.size();
+            result.items.erase();
+
+            for (int i = 0; i < mDrafts.size(); ++i)
+                result.items.push_back(FetchItem(mDrafts.at(i).second, true));
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool saveDraftEvent(Event & event) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Drafts keep their storage status, so that releasing them
+        /// does not save them as regular events.
+        {
+            mDrafts.set(event.getStreamKey(), Event::Pointer(&event));
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        virtual bool deleteDraftEvent(ali::opt_string const& streamKey) override
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mDrafts.erase(draftKey(streamKey)) != 0;
+        }
+
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct BatchStatistics
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Transactions committed with at least one write.
+        {
+            ali::int64      batches{0};
+            ali::int64      writes{0};
+            ali::int64      lastWrites{0};
+            ali::int64      lastMicroseconds{0};
+            ali::int64      maxMicroseconds{0};
+            ali::int64      totalMicroseconds{0};
+        };
+
+        typedef ali::callback<void(BatchStatistics const&)> OnBatchCallback;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        class Transaction
+            : public ali::noncopyable
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /** @brief Groups writes to a MemoryStorage
+          *
+          * Until the outermost transaction commits (explicitly or when it goes
+          * out of scope), the storage records changed events and streams but
+          * neither posts change callbacks nor recomputes the last event and
+          * unread count of the touched streams; both happen once at commit.
+          * Events are visible to fetches as soon as they are saved. There is
+          * no rollback. Transactions nest.
+          */
+        {
+        public:
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            explicit Transaction(MemoryStorage & storage)
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+                : mStorage(&storage)
+            {
+                mStorage->beginTransaction();
+            }
+
+            ~Transaction()
+            {
+                commit();
+            }
+
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            void commit()
+            //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            {
+                if (mStorage == nullptr)
+                    return;
+
+                mStorage->commitTransaction();
+                mStorage = nullptr;
+            }
+
+        private:
+            MemoryStorage *     mStorage;
+        };
+
+        /** @brief Save events in one transaction
+          *
+          * New events get consecutive IDs in the order given.
+          * @return false if any of the events could not be saved */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool saveEvents(ali::array_ref<Event::Pointer> events)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Transaction transaction(*this);
+
+            for (int i = 0; i < events.size(); ++i)
+            {
+                Event const& event = *events[i];
+
+                if (event.getEventId() > mLastEventId)
+                    mLastEventId = event.getEventId();
+            }
+
+            EventIdType nextId = mLastEventId;
+
+            for (int i = 0; i < events.size(); ++i)
+            {
+                Event & event = *events[i];
+
+                if (event.getEventId() == 0 && !event.isRemoved() && !event.isBeingRemoved())
+                    setEventId(event, ++nextId);
+            }
+
+            mLastEventId = nextId;
+
+            bool ok = true;
+
+            for (int i = 0; i < events.size(); ++i)
+                ok = saveEvent(*events[i]) && ok;
+
+            return ok;
+        }
+
+        /** @brief Save streams in one transaction
+          * @return false if any of the streams could not be saved */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool saveEventStreams(ali::array_ref<EventStream::Pointer> streams)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Transaction transaction(*this);
+
+            bool ok = true;
+
+            for (int i = 0; i < streams.size(); ++i)
+                ok = saveEventStream(*streams[i]) && ok;
+
+            return ok;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        BatchStatistics const& getBatchStatistics() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mBatchStatistics;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void resetBatchStatistics()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mBatchStatistics = BatchStatistics{};
+        }
+
+        /** @brief Called after every committed batch with the updated statistics */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void setBatchCallback(OnBatchCallback cb)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mBatchCallback = cb;
+        }
+
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct RemovedEvents
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// One batch of events deleted by deleteEventsInBatches.
+        {
+            ali::array<EventIdType>         eventIds;
+            ali::array_set<ali::string>     streamKeys;     ///< Streams the events belonged to
+            ali::array<DeletedAttachment>   attachments;    ///< No longer referenced, queued for fetchDeletedAttachments
+        };
+
+        typedef ali::callback<void(RemovedEvents const&)> OnEventsRemovedCallback;
+
+        /** @brief Called for every batch of events deleted by deleteEventsInBatches
+          * or deleteEventStreamsInBatches */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void wantEventsRemovedCallback(void const* key, OnEventsRemovedCallback cb)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mEventsRemovedCallbacks[key] = cb;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void cancelEventsRemovedCallback(void const* key)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mEventsRemovedCallbacks.erase(key);
+        }
+
+        /** @brief Delete the events matching @p query, @p batchSize at a time
+          *
+          * Meant for retention policies deleting many events at once. Each
+          * batch is taken off the query plan's driving index where the last
+          * one stopped (see nextBatch), swept out of the indexes together and
+          * reported to the OnEventsRemovedCallback as IDs, streams and
+          * attachments no longer referenced, so the memory used depends on
+          * the batch size rather than on the number of events deleted. The change callbacks get ChangedEvents::many instead of
+          * every ID, once for the whole deletion. The attachment files are
+          * left to the attachment collector.
+          *
+          * @return number of events deleted */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int deleteEventsInBatches(Query const& query,
+                                  int batchSize = 1024)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Transaction transaction(*this);
+
+            Range range(query);
+            QueryPlan const plan = planFor(query, range);
+            EventIdType lastId = 0;
+
+            RemovedEvents removed;
+            int count = 0;
+
+            for (;;)
+            {
+                removed.eventIds.erase();
+                removed.streamKeys.erase();
+                removed.attachments.erase();
+
+                if (!nextBatch(removed.eventIds, query, plan, range, lastId, ali::maxi(1, batchSize)))
+                    break;
+
+                int const attachments = mDeletedAttachments.size();
+                int const erased = eraseEvents(removed.eventIds, removed.streamKeys, false);
+
+                if (erased == 0)
+                    break;
+
+                count += erased;
+
+                for (int i = attachments; i < mDeletedAttachments.size(); ++i)
+                    removed.attachments.push_back(mDeletedAttachments[i].attachment);
+
+                for (int i = 0; i < removed.streamKeys.size(); ++i)
+                    touchStream(removed.streamKeys[i]);
+
+                for (int i = 0; i < mEventsRemovedCallbacks.size(); ++i)
+                    mEventsRemovedCallbacks.at(i).second(removed);
+            }
+
+            if (count != 0)
+            {
+                setManyEventsChanged();
+                changed();
+            }
+
+            return count;
+        }
+
+        /** @brief Delete the streams matching @p query with their events,
+          * deleting the events as deleteEventsInBatches does
+          * @return number of events deleted */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int deleteEventStreamsInBatches(StreamQuery const& query,
+                                        int batchSize = 1024)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Transaction transaction(*this);
+
+            ali::array<ali::string> keys;
+
+            for (int i = 0; i < mStreams.size(); ++i)
+                if (matches(*mStreams.at(i).second, query))
+                    keys.push_back(mStreams.at(i).first);
+
+            int count = 0;
+
+            for (int i = 0; i < keys.size(); ++i)
+            {
+                Query events;
+                events.streamKey = keys[i];
+                count += deleteEventsInBatches(events, batchSize);
+
+                removeStream(keys[i]);
+            }
+
+            if (!keys.is_empty())
+                changed();
+
+            return count;
+        }
+
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct TextFetchResult
+            : public FetchResult
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            /// Matching words of the subject and body, by attribute key, for each item
+            ali::array<Index::Spans>    spans;
+        };
+
+        /** @brief Fetch message events whose subject or body contain all words of @p text
+          *
+          * Words are matched case- and diacritic-insensitively, as prefixes
+          * unless @p prefix is false, using the text index kept up to date as
+          * events are saved and deleted. The remaining conditions of @p query
+          * and @p paging apply as in fetchEvents. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool searchEvents(TextFetchResult & result,
+                          ali::string_const_ref text,
+                          Query const& query = {},
+                          Paging const& paging = {},
+                          bool prefix = true) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            result.items.erase();
+            result.spans.erase();
+            result.totalCount = 0;
+
+            ali::array_set<EventIdType> ids;
+            mText.search(ids, text, prefix);
+
+            Query narrowed(query);
+
+            if (narrowed.eventIds.is_empty())
+                narrowed.eventIds = ids;
+            else
+                narrowed.eventIds.erase_if([&](EventIdType id){ return !ids.contains(id); });
+
+            if (narrowed.eventIds.is_empty())
+                return true;
+
+            if (!fetchEvents(result, narrowed, paging))
+                return false;
+
+            for (int i = 0; i < result.items.size(); ++i)
+            {
+                Event const& event = *result.items[i].event;
+
+                result.spans.push_back(Index::Spans());
+
+                TextIndex::highlight(result.spans.back(), MessageEvent::Attributes::subject,
+                                     event.getAttribute(MessageEvent::Attributes::subject), text, prefix);
+                TextIndex::highlight(result.spans.back(), MessageEvent::Attributes::body,
+                                     event.getAttribute(MessageEvent::Attributes::body), text, prefix);
+            }
+
+            return true;
+        }
+
+        /** @brief Get the text index, e.g. for its size */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        TextIndex const& getTextIndex() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mText;
+        }
+
+        /** @brief Get the remote user index, e.g. to find events by a suffix or wildcard
+          * pattern of the address, which Query::RemoteUser cannot express */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        RemoteUserIndex const& getRemoteUserIndex() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mRemoteUsers;
+        }
+
+        /** @brief Get the plan fetchEvents, getEventCount and deleteEvents would use for @p query
+          *
+          * QueryPlan::explain describes it. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        QueryPlan explain(Query const& query,
+                          Paging const& paging = {}) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Range range(query);
+            range.paging(paging);
+
+            return planFor(query, range);
+        }
+
+        /** @brief Get hits and misses of the plan cache */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::hash_cache_statistics const& getPlanCacheStatistics() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mPlans.stats();
+        }
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct TimeKey
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Position of an event in time; the ID breaks ties.
+        {
+            TimeKey() = default;
+
+            TimeKey(double timestamp, EventIdType id)
+                : timestamp(timestamp)
+                , id(id)
+            {}
+
+            explicit TimeKey(Event const& event)
+                : timestamp(event.getTimestamp().value)
+                , id(event.getEventId())
+            {}
+
+            friend int compare(TimeKey const& a, TimeKey const& b)
+            {
+                using ali::compare;
+                int const c = compare(a.timestamp, b.timestamp);
+                return c != 0 ? c : compare(a.id, b.id);
+            }
+
+            friend void swap(TimeKey & a, TimeKey & b)
+            {
+                ali::swap(a.timestamp, b.timestamp);
+                ali::swap(a.id, b.id);
+            }
+
+            double          timestamp{};
+            EventIdType     id{};
+        };
+
+        using TimeIndex = ali::array_set<TimeKey>;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct ActivityKey
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Position of a stream by last activity; the key breaks ties.
+        {
+            ActivityKey() = default;
+
+            explicit ActivityKey(double lastActivity)
+                : lastActivity(lastActivity)
+            {}
+
+            explicit ActivityKey(EventStream & stream)
+                : lastActivity(stream.getLastEventTimestamp().value)
+                , key(stream.key)
+                , stream(&stream)
+            {}
+
+            friend int compare(ActivityKey const& a, ActivityKey const& b)
+            {
+                using ali::compare;
+                int const c = compare(a.lastActivity, b.lastActivity);
+                return c != 0 ? c : compare(a.key, b.key);
+            }
+
+            friend bool operator<(ActivityKey const& a, ActivityKey const& b)
+            {
+                return compare(a, b) < 0;
+            }
+
+            double          lastActivity{};
+            ali::string     key;
+            EventStream *   stream{nullptr};    ///< Owned by mStreams
+        };
+
+        /// A tree rather than a sorted array: every new event moves its
+        /// stream, and shifting the array made that O(number of streams).
+        using ActivityIndex = std::set<ActivityKey>;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Range
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Half-open interval [lower, upper) of time keys.
+        {
+            Range() = default;
+
+            explicit Range(Query const& query)
+            {
+                newerThan(query.newerThan);
+                olderThan(query.olderThan);
+            }
+
+            void paging(Paging const& paging)
+            {
+                newerThan(paging.newerThan);
+                olderThan(paging.olderThan);
+
+                if (!paging.after.is_null())
+                    after(TimeKey(*paging.after));
+
+                if (!paging.before.is_null())
+                    before(TimeKey(*paging.before));
+            }
+
+            void newerThan(ali::optional<TimestampType> const& t)   // inclusive
+            {
+                if (!t.is_null())
+                    after(TimeKey(t->value, 0), true);
+            }
+
+            void olderThan(ali::optional<TimestampType> const& t)   // exclusive
+            {
+                if (!t.is_null())
+                    before(TimeKey(t->value, 0));
+            }
+
+            void after(TimeKey const& key, bool inclusive = false)
+            {
+                TimeKey const k(key.timestamp, inclusive ? key.id : key.id + 1);
+
+                if (!hasLower || compare(lower, k) < 0)
+                    lower = k;
+
+                hasLower = true;
+            }
+
+            void before(TimeKey const& key)
+            {
+                if (!hasUpper || compare(key, upper) < 0)
+                    upper = key;
+
+                hasUpper = true;
+            }
+
+            template <typename Keys>
+            int lowerIndex(Keys const& keys) const
+            {
+                return hasLower ? indexOfLowerBound(keys, lower) : 0;
+            }
+
+            template <typename Keys>
+            int upperIndex(Keys const& keys) const
+            {
+                return hasUpper
+                    ? ali::maxi(lowerIndex(keys), indexOfLowerBound(keys, upper))
+                    : keys.size();
+            }
+
+            template <typename Keys>
+            int size(Keys const& keys) const
+            {
+                return upperIndex(keys) - lowerIndex(keys);
+            }
+
+            bool contains(TimeKey const& key) const
+            {
+                return (!hasLower || compare(lower, key) <= 0)
+                    && (!hasUpper || compare(key, upper) < 0);
+            }
+
+            static int indexOfLowerBound(TimeIndex const& keys, TimeKey const& key)
+            {
+                return keys.index_of_lower_bound(key);
+            }
+
+            static int indexOfLowerBound(ali::array<TimeKey> const& keys, TimeKey const& key)
+            {
+                int first = 0;
+                int count = keys.size();
+
+                while (count > 0)
+                {
+                    int const half = count / 2;
+
+                    if (compare(keys[first + half], key) < 0)
+                    {
+                        first += half + 1;
+                        count -= half + 1;
+                    }
+                    else
+                    {
+                        count = half;
+                    }
+                }
+
+                return first;
+            }
+
+            TimeKey     lower;
+            TimeKey     upper;
+            bool        hasLower{false};
+            bool        hasUpper{false};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Record
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// A stored event together with the values it was indexed under,
+        /// so that it can be removed from the indexes after it changed.
+        {
+            Record() = default;
+
+            explicit Record(Event::Pointer event)
+                : event(event)
+            {
+                snapshot();
+            }
+
+            void snapshot()
+            {
+                time = TimeKey(*event);
+                streamKey = event->getStreamKey();
+                accountId = event->getAccountId();
+                kind = kindOf(event->eventType, event->getDirection());
+
+                attributes.erase();
+                attachments.erase();
+                remoteUsers.erase();
+
+                for (int i = 0; i < event->getRemoteUserCount(); ++i)
+                    remoteUsers.push_back(event->getRemoteUser(i).getGenericUri());
+
+                for (int i = 0; i < event->getAttributeCount(); ++i)
+                {
+                    auto const& attr = event->getFullAttribute(i);
+                    attributes.push_back(ali::make_pair(attr.first, attr.second.value));
+                    addAttachment(attr.second);
+                }
+
+                for (int i = 0; i < event->getEventAttachmentCount(); ++i)
+                {
+                    EventAttachment const& attachment = event->getEventAttachment(i);
+
+                    for (int j = 0; j < attachment.getAttributeCount(); ++j)
+                        addAttachment(attachment.getFullAttribute(j).second);
+                }
+            }
+
+            void addAttachment(Attribute::Value const& value)
+            {
+                if ((value.type & Attribute::Attachment) != 0 && !value.value.is_empty())
+                    attachments.push_back(DeletedAttachment(
+                        static_cast<Attribute::Type>(value.type), value.value));
+            }
+
+            Event::Pointer                                      event;
+            TimeKey                                             time;
+            ali::string                                         streamKey;
+            ali::string                                         accountId;
+            int                                                 kind{};
+            ali::array<ali::pair<ali::string, ali::string>>     attributes;
+            ali::array<DeletedAttachment>                       attachments;
+            ali::array<ali::string>                             remoteUsers;
+            bool                                                unread{false};  // counted as unread
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct AttachmentReference
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Attribute::Type     type{Attribute::Attachment};
+            int                 count{};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct DeletedEntry
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            DeletedAttachment   attachment;
+            bool                cleaned{false};
+        };
+
+        using AttributeIndex = ali::array_map<ali::string,
+                                   ali::array_map<ali::string, ali::array_set<EventIdType>>>;
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static int kindOf(EventType::Type type,
+                          Direction::Type direction)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return static_cast<int>(type) * (Direction::all + 1)
+                + (static_cast<int>(direction) & Direction::all);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matchesKind(int kind,
+                                Query const& query)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int const type = kind / (Direction::all + 1);
+            int const direction = kind % (Direction::all + 1);
+
+            return (query.eventType.is_null() || *query.eventType == type)
+                && (query.directionMask.is_null() || (*query.directionMask & direction) != 0);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::string draftKey(ali::opt_string const& streamKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return streamKey.is_null() ? ali::string() : *streamKey;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        template <typename T>
+        static bool matches(T const& object,
+                            Query::Attr const& attr)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (!object.hasAttribute(attr.key))
+                return false;
+
+            return attr.values.is_empty()
+                || attr.values.contains(object.getAttribute(attr.key));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        template <typename T>
+        static bool matches(T const& object,
+                            ali::array_set<Query::Attr> const& withAttributes,
+                            ali::array_set<Query::Attr> const& withoutAttributes)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            for (int i = 0; i < withAttributes.size(); ++i)
+                if (!matches(object, withAttributes[i]))
+                    return false;
+
+            for (int i = 0; i < withoutAttributes.size(); ++i)
+                if (matches(object, withoutAttributes[i]))
+                    return false;
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matchesPrefix(EventAttachment const& attachment,
+                                  Query::Attr const& attr)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (!attachment.hasAttribute(attr.key))
+                return false;
+
+            if (attr.values.is_empty())
+                return true;
+
+            ali::string const& value = attachment.getAttribute(attr.key);
+
+            for (int i = 0; i < attr.values.size(); ++i)
+                if (value.begins_with(attr.values[i]))
+                    return true;
+
+            return false;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matchesAttachments(Event const& event,
+                                       Query const& query)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Some attachment must match all the attributes, for each of the two sets.
+        {
+            if (!query.withEventAttachmentAttributes.is_empty())
+            {
+                bool found = false;
+
+                for (int i = 0; i < event.getEventAttachmentCount() && !found; ++i)
+                    found = matches(event.getEventAttachment(i),
+                                    query.withEventAttachmentAttributes, {});
+
+                if (!found)
+                    return false;
+            }
+
+            if (!query.withEventAttachmentAttributesStartingWith.is_empty())
+            {
+                auto const& attrs = query.withEventAttachmentAttributesStartingWith;
+                bool found = false;
+
+                for (int i = 0; i < event.getEventAttachmentCount() && !found; ++i)
+                {
+                    found = true;
+
+                    for (int j = 0; j < attrs.size() && found; ++j)
+                        found = matchesPrefix(event.getEventAttachment(i), attrs[j]);
+                }
+
+                if (!found)
+                    return false;
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matchesRemoteUser(Event const& event,
+                                      Query::RemoteUser const& remoteUser)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (remoteUser.prefix.is_empty() && remoteUser.pattern.is_empty())
+                return true;
+
+            for (int i = 0; i < event.getRemoteUserCount(); ++i)
+            {
+                ali::string const& uri = event.getRemoteUser(i).getGenericUri();
+
+                if (uri.begins_with(remoteUser.prefix)
+                    && (remoteUser.pattern.is_empty()
+                        || uri.find(remoteUser.pattern) != ali::string::npos))
+                    return true;
+            }
+
+            return false;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matches(Record const& record,
+                            Query const& query,
+                            QueryPlan const& plan)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Checks the conditions the plan's access path does not guarantee, in the plan's order.
+        {
+            Event const& event = *record.event;
+
+            for (int i = 0; i < plan.filters.size(); ++i)
+            {
+                QueryPlan::Step const& step = plan.filters[i];
+                bool ok = true;
+
+                switch (step.filter)
+                {
+                case QueryPlan::Filter::StreamKey:
+                    ok = record.streamKey == *query.streamKey;
+                    break;
+                case QueryPlan::Filter::EventIds:
+                    ok = query.eventIds.contains(record.time.id);
+                    break;
+                case QueryPlan::Filter::Kind:
+                    ok = matchesKind(record.kind, query);
+                    break;
+                case QueryPlan::Filter::AccountId:
+                    ok = record.accountId == *query.accountId;
+                    break;
+                case QueryPlan::Filter::Hidden:
+                    ok = event.isHidden() == *query.hidden;
+                    break;
+                case QueryPlan::Filter::Attribute:
+                    ok = matches(event, query.withAttributes[step.attribute]);
+                    break;
+                case QueryPlan::Filter::WithoutAttributes:
+                    ok = matches(event, {}, query.withoutAttributes);
+                    break;
+                case QueryPlan::Filter::Attachments:
+                    ok = matchesAttachments(event, query);
+                    break;
+                case QueryPlan::Filter::RemoteUser:
+                    ok = matchesRemoteUser(event, query.withRemoteUser);
+                    break;
+                }
+
+                if (!ok)
+                    return false;
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matches(EventStream const& stream,
+                            StreamQuery const& query)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (!query.withStreamKeys.is_empty() && !query.withStreamKeys.contains(stream.key))
+                return false;
+
+            if (query.withoutStreamKeys.contains(stream.key))
+                return false;
+
+            double const lastActivity = stream.getLastEventTimestamp().value;
+
+            if (!query.lastActivityAfter.is_null() && !(lastActivity > query.lastActivityAfter->value))
+                return false;
+
+            if (!query.lastActivityBefore.is_null() && !(lastActivity < query.lastActivityBefore->value))
+                return false;
+
+            if (!query.withParties.is_empty())
+            {
+                bool found = false;
+
+                for (int i = 0; i < stream.getStreamPartyCount() && !found; ++i)
+                    found = query.withParties.contains(stream.getStreamParty(i).genericUri);
+
+                if (!found)
+                    return false;
+            }
+
+            if (!matches(stream, query.withAttributes, query.withoutAttributes))
+                return false;
+
+            switch (query.state)
+            {
+            case StreamQuery::StreamState::OnlyOpen:
+                return stream.isOpen();
+            case StreamQuery::StreamState::OnlyClosed:
+                return !stream.isOpen();
+            default:
+                return true;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void collectEvents(ali::array<TimeKey> & keys,
+                           Query const& query) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Sorted time keys of all events matching the query.
+        {
+            collectEvents(keys, query, Range(query));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void collectEvents(ali::array<TimeKey> & keys,
+                           Query const& query,
+                           Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Sorted time keys of the events matching the query within the range.
+        {
+            keys.erase();
+
+            QueryPlan const plan = planFor(query, range);
+            ali::array<TimeKey> candidates;
+
+            // Candidates from the driving index...
+            switch (plan.access)
+            {
+            case QueryPlan::Access::EventIds:
+                for (int i = 0; i < query.eventIds.size(); ++i)
+                    if (Record const* record = mEvents.peek(query.eventIds[i]))
+                        candidates.push_back(record->time);
+                break;
+            case QueryPlan::Access::Stream:
+                if (TimeIndex const* index = mStreamIndex.find(*query.streamKey))
+                    appendRange(candidates, *index, range);
+                break;
+            case QueryPlan::Access::Kind:
+                appendKinds(candidates, query, range);
+                break;
+            case QueryPlan::Access::Attribute:
+                appendAttribute(candidates, query.withAttributes[plan.attribute], range);
+                break;
+            case QueryPlan::Access::RemoteUser:
+                appendRemoteUsers(candidates, query.withRemoteUser, range);
+                break;
+            default:
+                appendRange(candidates, mTimeIndex, range);
+                break;
+            }
+
+            // ...filtered by all the other conditions.
+            for (int i = 0; i < candidates.size(); ++i)
+            {
+                Record const* record = mEvents.peek(candidates[i].id);
+
+                if (record != nullptr && range.contains(record->time) && matches(*record, query, plan))
+                    keys.push_back(record->time);
+            }
+
+            if (!plan.ordered)
+                keys.mutable_ref().sort();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool nextBatch(ali::array<EventIdType> & ids,
+                       Query const& query,
+                       QueryPlan const& plan,
+                       Range & range,
+                       EventIdType & lastId,
+                       int limit) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Appends up to @p limit events matching the query, taking candidates
+        /// off the plan's driving index @p limit at a time: in time order past
+        /// the lower bound of @p range from the time indexes, in ID order past
+        /// @p lastId from the others. Both move past every candidate looked at,
+        /// so the candidates that do not match are not looked at again.
+        /// @return false once no candidates are left
+        {
+            ali::array<TimeKey> keys;
+            ali::array_set<EventIdType> candidates;
+
+            while (ids.size() < limit)
+            {
+                int const want = limit - ids.size();
+
+                keys.erase();
+                candidates.erase();
+
+                switch (plan.access)
+                {
+                case QueryPlan::Access::EventIds:
+                    RemoteUserIndex::takeAfter(candidates, query.eventIds, lastId, want);
+                    break;
+                case QueryPlan::Access::Kind:
+                    for (int i = 0; i < mKindIndex.size(); ++i)
+                        if (matchesKind(mKindIndex.at(i).first, query))
+                            appendRange(keys, mKindIndex.at(i).second, range, want);
+
+                    keys.mutable_ref().sort();
+
+                    if (keys.size() > want)
+                        keys.erase_back(keys.size() - want);
+                    break;
+                case QueryPlan::Access::Attribute:
+                    if (auto const* values = mAttributeIndex.find(plan.attributeKey))
+                    {
+                        Query::Attr const& attr = query.withAttributes[plan.attribute];
+
+                        for (int i = 0; i < values->size(); ++i)
+                            if (attr.values.is_empty() || attr.values.contains(values->at(i).first))
+                                RemoteUserIndex::takeAfter(candidates, values->at(i).second, lastId, want);
+                    }
+                    break;
+                case QueryPlan::Access::RemoteUser:
+                    mRemoteUsers.findAfter(candidates, query.withRemoteUser.prefix,
+                                           query.withRemoteUser.pattern, lastId, want);
+                    break;
+                default:
+                    if (TimeIndex const* index = sortedIndex(query, plan))
+                        appendRange(keys, *index, range, want);
+                    break;
+                }
+
+                if (keys.is_empty() && candidates.is_empty())
+                    return !ids.is_empty();
+
+                for (int i = 0; i < keys.size(); ++i)
+                {
+                    Record const* record = mEvents.peek(keys[i].id);
+
+                    if (record != nullptr && matches(*record, query, plan))
+                        ids.push_back(keys[i].id);
+                }
+
+                for (int i = 0; i < candidates.size(); ++i)
+                {
+                    Record const* record = mEvents.peek(candidates[i]);
+
+                    if (record != nullptr && range.contains(record->time) && matches(*record, query, plan))
+                        ids.push_back(candidates[i]);
+                }
+
+                if (!keys.is_empty())
+                    range.after(keys.back());
+
+                if (!candidates.is_empty())
+                    lastId = candidates.back();
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        TimeIndex const* sortedIndex(Query const& query,
+                                     QueryPlan const& plan) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// The plan's driving index if it is a single time index, which can
+        /// then be walked in order; null otherwise.
+        {
+            switch (plan.access)
+            {
+            case QueryPlan::Access::Stream:
+                return mStreamIndex.find(*query.streamKey);
+            case QueryPlan::Access::Time:
+                return &mTimeIndex;
+            default:
+                return nullptr;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void pageEvents(FetchResult & result,
+                        ali::array<TimeKey> const& keys,
+                        Paging const& paging) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Fills the result with the page of the sorted keys.
+        {
+            result.items.erase();
+
+            Range range;
+            range.paging(paging);
+
+            int begin = range.lowerIndex(keys);
+            int end = range.upperIndex(keys);
+
+            int const offset = paging.offset.is_null() ? 0 : ali::maxi(0, *paging.offset);
+            int const limit = paging.limit.is_null() ? end - begin : ali::maxi(0, *paging.limit);
+
+            if (paging.order == SortOrder::Ascending)
+            {
+                begin = ali::mini(begin + offset, end);
+                end = ali::mini(end, begin + limit);
+
+                for (int i = begin; i < end; ++i)
+                    result.items.push_back(FetchItem(mEvents.peek(keys[i].id)->event, true));
+            }
+            else
+            {
+                end = ali::maxi(end - offset, begin);
+                begin = ali::maxi(begin, end - limit);
+
+                for (int i = end; i > begin; --i)
+                    result.items.push_back(FetchItem(mEvents.peek(keys[i - 1].id)->event, true));
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void activityRange(ActivityIndex::const_iterator & begin,
+                           ActivityIndex::const_iterator & end,
+                           StreamQuery const& query) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// The [begin, end) of the activity index within the query's exclusive activity bounds.
+        {
+            ActivityKey const lower(query.lastActivityAfter.is_null() ? -HUGE_VAL
+                : std::nextafter(query.lastActivityAfter->value, HUGE_VAL));
+            ActivityKey const upper(query.lastActivityBefore.is_null() ? HUGE_VAL
+                : query.lastActivityBefore->value);
+
+            begin = query.lastActivityAfter.is_null() ? mActivityIndex.begin() : mActivityIndex.lower_bound(lower);
+            end = query.lastActivityBefore.is_null() ? mActivityIndex.end() : mActivityIndex.lower_bound(upper);
+
+            if (!(lower < upper))
+                end = begin;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        QueryPlan planFor(Query const& query,
+                          Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// The cached plan for the query's shape, planned anew if missing or stale.
+        {
+            ali::string const shape = QueryPlan::shapeOf(query);
+
+            if (QueryPlan const* cached = mPlans.find(shape))
+                if (cached->isCurrent(mTimeIndex.size()))
+                    return *cached;
+
+            return mPlans.insert(shape, plan(query, range));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        QueryPlan plan(Query const& query,
+                       Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Picks the index yielding the fewest candidates, counting those that
+        /// are not in time order twice since they must be sorted, and orders
+        /// the remaining conditions by their estimated selectivity and cost.
+        {
+            QueryPlan plan;
+            plan.events = mTimeIndex.size();
+
+            int const total = range.size(mTimeIndex);
+            double const all = ali::maxi(total, 1);
+
+            int const streamCount = query.streamKey.is_null() ? total
+                : streamEventCount(*query.streamKey, range);
+            bool const byKind = !query.eventType.is_null() || !query.directionMask.is_null();
+            int const kindCount = byKind ? kindEventCount(query, range) : total;
+            int const remoteUserCount = query.withRemoteUser.prefix.is_empty()
+                && query.withRemoteUser.pattern.is_empty() ? -1
+                : mRemoteUsers.count(query.withRemoteUser.prefix, query.withRemoteUser.pattern);
+
+            // Access path
+            plan.estimate = total;
+
+            if (!query.eventIds.is_empty())
+            {
+                plan.access = QueryPlan::Access::EventIds;
+                plan.estimate = query.eventIds.size();
+                plan.ordered = false;
+            }
+            else
+            {
+                int cost = total;
+
+                if (!query.streamKey.is_null() && streamCount <= cost)
+                {
+                    plan.access = QueryPlan::Access::Stream;
+                    plan.estimate = cost = streamCount;
+                }
+
+                if (byKind && 2 * kindCount < cost)
+                {
+                    plan.access = QueryPlan::Access::Kind;
+                    plan.estimate = kindCount;
+                    plan.ordered = false;
+                    cost = 2 * kindCount;
+                }
+
+                for (int i = 0; i < query.withAttributes.size(); ++i)
+                {
+                    int const count = attributeCount(query.withAttributes[i]);
+
+                    if (2 * count < cost)
+                    {
+                        plan.access = QueryPlan::Access::Attribute;
+                        plan.attribute = i;
+                        plan.attributeKey = query.withAttributes[i].key;
+                        plan.estimate = count;
+                        plan.ordered = false;
+                        cost = 2 * count;
+                    }
+                }
+
+                if (remoteUserCount >= 0 && 2 * remoteUserCount < cost)
+                {
+                    plan.access = QueryPlan::Access::RemoteUser;
+                    plan.estimate = remoteUserCount;
+                    plan.ordered = false;
+                    cost = 2 * remoteUserCount;
+                }
+            }
+
+            // Filters for whatever the access path does not guarantee. The plan
+            // is reused for other values of the shape's ranges, so a condition
+            // every candidate meets now is still checked.
+            if (!query.streamKey.is_null() && plan.access != QueryPlan::Access::Stream)
+                plan.addFilter(QueryPlan::Filter::StreamKey, streamCount / all, 1);
+
+            if (!query.eventIds.is_empty() && plan.access != QueryPlan::Access::EventIds)
+                plan.addFilter(QueryPlan::Filter::EventIds, query.eventIds.size() / all, 2);
+
+            if (byKind && plan.access != QueryPlan::Access::Kind)
+                plan.addFilter(QueryPlan::Filter::Kind, kindCount / all, 1);
+
+            if (!query.hidden.is_null())
+                plan.addFilter(QueryPlan::Filter::Hidden, 0.5, 1);
+
+            if (!query.accountId.is_null())
+                plan.addFilter(QueryPlan::Filter::AccountId, 0.5, 2);
+
+            for (int i = 0; i < query.withAttributes.size(); ++i)
+                if (plan.access != QueryPlan::Access::Attribute || plan.attribute != i)
+                    plan.addFilter(QueryPlan::Filter::Attribute,
+                                   attributeCount(query.withAttributes[i]) / all, 3, i);
+
+            if (!query.withoutAttributes.is_empty())
+                plan.addFilter(QueryPlan::Filter::WithoutAttributes, 0.9, 3 * query.withoutAttributes.size());
+
+            if (!query.withEventAttachmentAttributes.is_empty()
+                || !query.withEventAttachmentAttributesStartingWith.is_empty())
+                plan.addFilter(QueryPlan::Filter::Attachments, 0.5, 8);
+
+            if (remoteUserCount >= 0 && plan.access != QueryPlan::Access::RemoteUser)
+                plan.addFilter(QueryPlan::Filter::RemoteUser, remoteUserCount / all, 8);
+
+            return plan;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int streamEventCount(ali::string const& streamKey,
+                             Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            TimeIndex const* index = mStreamIndex.find(streamKey);
+            return index == nullptr ? 0 : range.size(*index);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int kindEventCount(Query const& query,
+                           Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int count = 0;
+
+            for (int i = 0; i < mKindIndex.size(); ++i)
+                if (matchesKind(mKindIndex.at(i).first, query))
+                    count += range.size(mKindIndex.at(i).second);
+
+            return count;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int attributeCount(Query::Attr const& attr) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            auto const* values = mAttributeIndex.find(attr.key);
+            if (values == nullptr)
+                return 0;
+
+            int count = 0;
+
+            for (int i = 0; i < values->size(); ++i)
+                if (attr.values.is_empty() || attr.values.contains(values->at(i).first))
+                    count += values->at(i).second.size();
+
+            return count;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void appendRange(ali::array<TimeKey> & keys,
+                                TimeIndex const& index,
+                                Range const& range,
+                                int limit = ali::meta::integer::max_value<int>::result)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// The first @p limit keys of the index within the range.
+        {
+            int const begin = range.lowerIndex(index);
+            int const end = ali::mini(range.upperIndex(index), begin + ali::mini(limit, index.size()));
+
+            for (int i = begin; i < end; ++i)
+                keys.push_back(index[i]);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void appendKinds(ali::array<TimeKey> & keys,
+                         Query const& query,
+                         Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            for (int i = 0; i < mKindIndex.size(); ++i)
+                if (matchesKind(mKindIndex.at(i).first, query))
+                    appendRange(keys, mKindIndex.at(i).second, range);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void appendAttribute(ali::array<TimeKey> & keys,
+                             Query::Attr const& attr,
+                             Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            auto const* values = mAttributeIndex.find(attr.key);
+            if (values == nullptr)
+                return;
+
+            for (int i = 0; i < values->size(); ++i)
+            {
+                if (!attr.values.is_empty() && !attr.values.contains(values->at(i).first))
+                    continue;
+
+                ali::array_set<EventIdType> const& ids = values->at(i).second;
+
+                for (int j = 0; j < ids.size(); ++j)
+                {
+                    Record const* record = mEvents.peek(ids[j]);
+
+                    if (record != nullptr && range.contains(record->time))
+                        keys.push_back(record->time);
+                }
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void appendRemoteUsers(ali::array<TimeKey> & keys,
+                               Query::RemoteUser const& remoteUser,
+                               Range const& range) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<EventIdType> ids;
+            mRemoteUsers.find(ids, remoteUser.prefix, remoteUser.pattern);
+
+            for (int i = 0; i < ids.size(); ++i)
+            {
+                Record const* record = mEvents.peek(ids[i]);
+
+                if (record != nullptr && range.contains(record->time))
+                    keys.push_back(record->time);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void collectStreamEventIds(ali::array<EventIdType> & ids,
+                                   ali::string const& streamKey) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            TimeIndex const* index = mStreamIndex.find(streamKey);
+            if (index == nullptr)
+                return;
+
+            ids.reserve(ids.size() + index->size());
+
+            for (int i = 0; i < index->size(); ++i)
+                ids.push_back(index->at(i).id);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void index(Record & record)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mTimeIndex.insert(record.time);
+
+            countUnread(record, isUnread(record));
+
+            if (!record.streamKey.is_empty())
+                mStreamIndex[record.streamKey].insert(record.time);
+
+            mKindIndex[record.kind].insert(record.time);
+
+            for (int i = 0; i < record.attributes.size(); ++i)
+            {
+                ali::string const& key = record.attributes[i].first;
+
+                mAttributeIndex[key][record.attributes[i].second].insert(record.time.id);
+
+                if (key == MessageEvent::Attributes::subject || key == MessageEvent::Attributes::body)
+                    mText.add(record.time.id, record.attributes[i].second);
+            }
+
+            for (int i = 0; i < record.remoteUsers.size(); ++i)
+                mRemoteUsers.add(record.time.id, record.remoteUsers[i]);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void unindex(Record & record,
+                     bool releaseAttachments)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mTimeIndex.erase(record.time);
+
+            if (TimeIndex * index = mStreamIndex.find(record.streamKey))
+            {
+                index->erase(record.time);
+
+                if (index->is_empty())
+                    mStreamIndex.erase(record.streamKey);
+            }
+
+            if (TimeIndex * index = mKindIndex.find(record.kind))
+            {
+                index->erase(record.time);
+
+                if (index->is_empty())
+                    mKindIndex.erase(record.kind);
+            }
+
+            unindexValues(record, releaseAttachments);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void unindexValues(Record & record,
+                           bool releaseAttachments)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Everything but the time indexes.
+        {
+            countUnread(record, false);
+
+            for (int i = 0; i < record.attributes.size(); ++i)
+            {
+                ali::string const& key = record.attributes[i].first;
+                auto * values = mAttributeIndex.find(key);
+                if (values == nullptr)
+                    continue;
+
+                ali::string const& value = record.attributes[i].second;
+                auto * ids = values->find(value);
+                if (ids == nullptr)
+                    continue;
+
+                ids->erase(record.time.id);
+
+                if (ids->is_empty())
+                    values->erase(value);
+
+                if (values->is_empty())
+                    mAttributeIndex.erase(key);
+            }
+
+            mText.remove(record.time.id);
+
+            for (int i = 0; i < record.remoteUsers.size(); ++i)
+                mRemoteUsers.remove(record.time.id, record.remoteUsers[i]);
+
+            if (releaseAttachments)
+                releaseAttachmentReferences(record);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void addAttachmentReferences(Record const& record)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            for (int i = 0; i < record.attachments.size(); ++i)
+            {
+                AttachmentReference & ref = mAttachmentReferences[record.attachments[i].value];
+                ref.type = record.attachments[i].type;
+                ++ref.count;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void releaseAttachmentReferences(Record const& record)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Unreferenced attachments become available via fetchDeletedAttachments.
+        {
+            for (int i = 0; i < record.attachments.size(); ++i)
+            {
+                ali::string const& value = record.attachments[i].value;
+                AttachmentReference * ref = mAttachmentReferences.find(value);
+
+                if (ref == nullptr || --ref->count > 0)
+                    continue;
+
+                mDeletedAttachments.push_back(DeletedEntry{DeletedAttachment(ref->type, value)});
+                mAttachmentReferences.erase(value);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        double seenUntil(ali::string const& streamKey) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// The last seen timestamp the unread flags of the stream's events reflect.
+        {
+            double const* seen = mSeenUntil.find(streamKey);
+            return seen != nullptr ? *seen : TimestampType().value;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool isUnread(Record const& record) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Event const& event = *record.event;
+
+            return !record.streamKey.is_empty()
+                && event.getDirection() == Direction::Incoming
+                && !event.isHidden()
+                && record.time.timestamp > seenUntil(record.streamKey);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void countUnread(Record & record,
+                         bool unread)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Sets the unread flag of the record, updating the counters.
+        {
+            if (record.unread == unread)
+                return;
+
+            record.unread = unread;
+
+            int const delta = unread ? 1 : -1;
+
+            if ((mUnreadByStream[record.streamKey] += delta) == 0)
+                mUnreadByStream.erase(record.streamKey);
+
+            if ((mUnreadByAccount[record.accountId] += delta) == 0)
+                mUnreadByAccount.erase(record.accountId);
+
+            mUnreadTotal += delta;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void applyLastSeen(EventStream const& stream)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Updates the unread flags of the events between the previous
+        /// and the current last seen timestamp of the stream.
+        {
+            double const seen = stream.getLastSeenTimestamp().value;
+            double const previous = seenUntil(stream.key);
+
+            if (seen == previous)
+                return;
+
+            mSeenUntil.set(stream.key, seen);
+
+            TimeIndex const* index = mStreamIndex.find(stream.key);
+            if (index == nullptr)
+                return;
+
+            double const from = ali::mini(seen, previous);
+            double const to = ali::maxi(seen, previous);
+
+            for (int i = index->index_of_lower_bound(TimeKey(from, 0));
+                 i < index->size() && index->at(i).timestamp <= to; ++i)
+            {
+                if (index->at(i).timestamp == from)
+                    continue;
+
+                Record & record = *mEvents.peek(index->at(i).id);
+                countUnread(record, isUnread(record));
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void ensureStream(ali::string const& streamKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mStreams.find(streamKey) != nullptr)
+                return;
+
+            EventStream::Pointer stream = createEventStream(streamKey);
+            setStored(*stream);
+            addStream(stream);
+            applyLastSeen(*stream);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void refreshStream(ali::string const& streamKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Recomputes the last event of the stream and copies its unread count.
+        {
+            EventStream::Pointer const* stream = mStreams.find(streamKey);
+            if (stream == nullptr)
+                return;
+
+            EventStream & s = **stream;
+            EventIdType lastEventId = 0;
+            TimestampType lastEventTimestamp;
+            int const unread = getStreamUnreadEventCount(streamKey);
+
+            if (TimeIndex const* index = mStreamIndex.find(streamKey))
+            {
+                for (int i = index->size(); i > 0; --i)
+                {
+                    Event const& event = *mEvents.peek(index->at(i - 1).id)->event;
+
+                    if (!event.isHidden())
+                    {
+                        lastEventId = event.getEventId();
+                        lastEventTimestamp = event.getTimestamp();
+                        break;
+                    }
+                }
+            }
+
+            bool const changed = s.getLastEventId() != lastEventId
+                || s.getUnreadCount() != unread
+                || s.getLastEventTimestamp().value != lastEventTimestamp.value;
+
+            if (s.getLastEventTimestamp().value != lastEventTimestamp.value)
+            {
+                mActivityIndex.erase(ActivityKey(s));
+                setLastEventTimestamp(s, lastEventTimestamp);
+                mActivityIndex.insert(ActivityKey(s));
+            }
+
+            setLastEventId(s, lastEventId);
+            setUnreadCount(s, unread);
+
+            if (!s.isRemoved())
+                setStored(s);
+
+            if (changed)
+                setEventStreamChanged(streamKey);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void removeEvent(EventIdType id)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Record * record = mEvents.peek(id);
+            if (record == nullptr)
+                return;
+
+            Event::Pointer const event = record->event;
+
+            unindex(*record, true);
+            mEvents.erase(id);
+
+            setRemoved(*event, true);
+            setEventChanged(id);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool removeEvents(ali::array_const_ref<EventIdType> ids)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<ali::string> streamKeys;
+            int const removed = eraseEvents(ids, streamKeys, true);
+
+            for (int i = 0; i < streamKeys.size(); ++i)
+                touchStream(streamKeys[i]);
+
+            if (removed != 0)
+            {
+                changed();
+            }
+
+            return true;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int eraseEvents(ali::array_const_ref<EventIdType> ids,
+                        ali::array_set<ali::string> & streamKeys,
+                        bool markChanged)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Removes the events, sweeping each time index they are in once
+        /// instead of erasing them one by one; adds their streams to
+        /// @p streamKeys without refreshing them.
+        /// @return number of events removed
+        {
+            ali::array<EventIdType> sorted;
+            sorted.reserve(ids.size());
+
+            for (int i = 0; i < ids.size(); ++i)
+                sorted.push_back(ids[i]);
+
+            sorted.mutable_ref().sort();
+
+            ali::array_set<EventIdType> doomed;
+            ali::array_set<int> kinds;
+            ali::array_set<ali::string> streams;
+
+            for (int i = 0; i < sorted.size(); ++i)
+            {
+                if (i != 0 && sorted[i] == sorted[i - 1])
+                    continue;
+
+                Record * record = mEvents.peek(sorted[i]);
+                if (record == nullptr)
+                    continue;
+
+                // Sorted, so every insert appends.
+                doomed.insert(sorted[i]);
+                kinds.insert(record->kind);
+
+                if (!record->streamKey.is_empty())
+                    streams.insert(record->streamKey);
+
+                unindexValues(*record, true);
+            }
+
+            if (doomed.is_empty())
+                return 0;
+
+            auto const isDoomed = [&doomed](TimeKey const& key) {return doomed.contains(key.id);};
+
+            mTimeIndex.erase_if(isDoomed);
+
+            for (int i = 0; i < streams.size(); ++i)
+            {
+                TimeIndex * index = mStreamIndex.find(streams[i]);
+                if (index == nullptr)
+                    continue;
+
+                index->erase_if(isDoomed);
+
+                if (index->is_empty())
+                    mStreamIndex.erase(streams[i]);
+
+                streamKeys.insert(streams[i]);
+            }
+
+            for (int i = 0; i < kinds.size(); ++i)
+            {
+                TimeIndex * index = mKindIndex.find(kinds[i]);
+                if (index == nullptr)
+                    continue;
+
+                index->erase_if(isDoomed);
+
+                if (index->is_empty())
+                    mKindIndex.erase(kinds[i]);
+            }
+
+            for (int i = 0; i < doomed.size(); ++i)
+            {
+                Event::Pointer const event = mEvents.peek(doomed[i])->event;
+                mEvents.erase(doomed[i]);
+
+                setRemoved(*event, true);
+
+                if (markChanged)
+                    setEventChanged(doomed[i]);
+            }
+
+            return doomed.size();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void beginTransaction()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (mTransactionDepth++ == 0)
+            {
+                mTransactionStart = std::chrono::steady_clock::now();
+                mTransactionWrites = 0;
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void commitTransaction()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali_assert(mTransactionDepth > 0);
+
+            if (--mTransactionDepth != 0)
+                return;
+
+            ali::array_set<ali::string> streamKeys;
+            streamKeys.swap(mPendingStreams);
+
+            for (int i = 0; i < streamKeys.size(); ++i)
+                refreshStream(streamKeys[i]);
+
+            if (mTransactionWrites != 0)
+            {
+                postChangeCallbacks();
+                recordBatch(mTransactionWrites, mTransactionStart);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void recordBatch(int writes,
+                         std::chrono::steady_clock::time_point start)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Latency from the beginning of the transaction to the end of its commit.
+        {
+            ali::int64 const us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+            ++mBatchStatistics.batches;
+            mBatchStatistics.writes += writes;
+            mBatchStatistics.lastWrites = writes;
+            mBatchStatistics.lastMicroseconds = us;
+            mBatchStatistics.totalMicroseconds += us;
+            mBatchStatistics.maxMicroseconds = ali::maxi(mBatchStatistics.maxMicroseconds, us);
+
+            if (!mBatchCallback.is_null())
+                mBatchCallback(mBatchStatistics);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void changed()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Ends a write; posts the change callbacks unless in a transaction.
+        {
+            increaseLastModified();
+
+            if (mTransactionDepth != 0)
+            {
+                ++mTransactionWrites;
+                return;
+            }
+
+            postChangeCallbacks();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void touchStream(ali::string const& streamKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Refreshes the stream now, or at commit if in a transaction.
+        {
+            if (mTransactionDepth != 0)
+                mPendingStreams.insert(streamKey);
+            else
+                refreshStream(streamKey);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void addStream(EventStream::Pointer const& stream)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mStreams.set(stream->key, stream);
+            mActivityIndex.insert(ActivityKey(*stream));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void eraseStream(ali::string const& streamKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            EventStream::Pointer const* found = mStreams.find(streamKey);
+            if (found == nullptr)
+                return;
+
+            mActivityIndex.erase(ActivityKey(**found));
+            mStreams.erase(streamKey);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool removeStream(ali::string const& streamKey)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Removes the stream with all its events and its draft.
+        {
+            EventStream::Pointer const* found = mStreams.find(streamKey);
+            if (found == nullptr)
+                return false;
+
+            EventStream::Pointer const stream = *found;
+
+            ali::array<EventIdType> ids;
+            collectStreamEventIds(ids, streamKey);
+
+            ali::array_set<ali::string> streamKeys;
+
+            if (eraseEvents(ids, streamKeys, false) != 0)
+                setManyEventsChanged();
+
+            mDrafts.erase(streamKey);
+            eraseStream(streamKey);
+            mSeenUntil.erase(streamKey);
+            setRemoved(*stream, true);
+
+            setEventStreamChanged(streamKey);
+            return true;
+        }
+
+    private:
+        EventIdType                                         mLastEventId{0};
+
+        ali::hash_cache<EventIdType, Record>                mEvents;
+        ali::array_map<ali::string, EventStream::Pointer>   mStreams;
+        ali::array_map<ali::string, Event::Pointer>         mDrafts;
+        ActivityIndex                                       mActivityIndex;
+
+        TimeIndex                                           mTimeIndex;
+        ali::array_map<ali::string, TimeIndex>              mStreamIndex;
+        ali::array_map<int, TimeIndex>                      mKindIndex;
+        AttributeIndex                                      mAttributeIndex;
+        TextIndex                                           mText;
+        RemoteUserIndex                                     mRemoteUsers;
+        mutable ali::hash_cache<ali::string, QueryPlan>     mPlans{64};
+
+        ali::array_map<ali::string, AttachmentReference>    mAttachmentReferences;
+        ali::array<DeletedEntry>                            mDeletedAttachments;   ///< In the order deleted
+        int                                                 mDeletedHead{0};       ///< Entries before are all cleaned
+        int                                                 mDeletedCleaned{0};    ///< Cleaned entries not yet dropped
+
+        int                                                 mTransactionDepth{0};
+        int                                                 mTransactionWrites{0};
+        std::chrono::steady_clock::time_point               mTransactionStart;
+        ali::array_set<ali::string>                         mPendingStreams;
+        BatchStatistics                                     mBatchStatistics;
+        OnBatchCallback                                     mBatchCallback;
+        ali::array_map<void const*, OnEventsRemovedCallback> mEventsRemovedCallbacks;
+
+        ali::array_map<ali::string, double>                 mSeenUntil;
+        ali::array_map<ali::string, int>                    mUnreadByStream;
+        ali::array_map<ali::string, int>                    mUnreadByAccount;
+        int                                                 mUnreadTotal{0};
+    };
+}
+}
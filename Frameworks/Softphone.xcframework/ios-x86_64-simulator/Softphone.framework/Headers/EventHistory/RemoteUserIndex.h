@@ -0,0 +1,568 @@
+/*
+ *  EventHistory/RemoteUserIndex.h
+ *  libsoftphone
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#pragma once
+
+#include "Softphone/EventHistory/EventHistoryTypes.h"
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_map.h"
+#include "ali/ali_array_set.h"
+#include "ali/ali_string.h"
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class RemoteUserIndex
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /** @brief Index of the remote user addresses of events
+      *
+      * Maps every address (RemoteUser::getGenericUri) to the sorted IDs of
+      * the events with it. The addresses are sorted, so that all addresses
+      * starting with a prefix form a single range; all their suffixes are
+      * kept sorted as well, so that the addresses ending with or containing
+      * a string are found the same way. A lookup takes a bisection plus
+      * time proportional to the number of matching addresses.
+      *
+      * A suffix is kept as a position in a table of the addresses, not as a
+      * copy of the text. The suffixes of new addresses are sorted and merged
+      * in by the next lookup, and those of removed addresses are dropped
+      * once they make up half of the index, so a batch of changes costs one
+      * pass over the index instead of one per suffix.
+      *
+      * Addresses are indexed as they are; use normalizeNumber on what the
+      * user typed before searching for a number.
+      */
+    {
+    public:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        enum class Match
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Exact,
+            Prefix,
+            Suffix,
+            Contains,
+            Wildcard        ///< '*' matches any string, '?' any single character
+        };
+
+        /** @brief Add an address of the event */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void add(EventIdType id,
+                 ali::string const& address)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (address.is_empty())
+                return;
+
+            Address & entry = mAddresses[address];
+
+            if (entry.slot < 0)
+            {
+                entry.slot = newSlot(address);
+
+                for (int i = 0; i < address.size(); ++i)
+                    mPending.push_back(Suffix(entry.slot, i));
+            }
+
+            entry.ids.insert(id);
+        }
+
+        /** @brief Remove an address of the event */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void remove(EventIdType id,
+                    ali::string const& address)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Address * entry = mAddresses.find(address);
+            if (entry == nullptr)
+                return;
+
+            entry->ids.erase(id);
+
+            if (!entry->ids.is_empty())
+                return;
+
+            // Its suffixes are skipped until prepare drops them.
+            mSlots[entry->slot].live = false;
+            mDeadSuffixes += address.size();
+
+            mAddresses.erase(address);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void clear()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            mAddresses.erase();
+            mSlots.erase();
+            mFreeSlots.erase();
+            mSuffixes.erase();
+            mPending.erase();
+            mDeadSuffixes = 0;
+        }
+
+        /** @brief Get number of distinct addresses */
+        int getAddressCount() const     {return mAddresses.size();}
+
+        /** @brief Find the addresses matching @p text */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void findAddresses(ali::array_set<ali::string> & addresses,
+                           ali::string const& text,
+                           Match match) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            addresses.erase();
+
+            switch (match)
+            {
+            case Match::Exact:
+                if (mAddresses.find(text) != nullptr)
+                    addresses.insert(text);
+                break;
+            case Match::Prefix:
+                for (int i = mAddresses.index_of_lower_bound(text);
+                     i < mAddresses.size() && mAddresses.at(i).first.begins_with(text); ++i)
+                    addresses.insert(mAddresses.at(i).first);
+                break;
+            case Match::Suffix:
+            case Match::Contains:
+                prepare();
+
+                for (int i = lowerBound(text); i < mSuffixes.size(); ++i)
+                {
+                    ali::string_const_ref const rest = textOf(mSuffixes[i]);
+
+                    if (!rest.begins_with_n(text.ref()))
+                        break;
+
+                    if ((match == Match::Contains || rest.size() == text.size())
+                        && mSlots[mSuffixes[i].slot].live)
+                        addresses.insert(mSlots[mSuffixes[i].slot].address);
+                }
+                break;
+            case Match::Wildcard:
+                findWildcard(addresses, text);
+                break;
+            }
+        }
+
+        /** @brief Find the events with an address matching @p text */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void find(ali::array_set<EventIdType> & ids,
+                  ali::string const& text,
+                  Match match) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<ali::string> addresses;
+            findAddresses(addresses, text, match);
+            collect(ids, addresses);
+        }
+
+        /** @brief Find the events matching Query::RemoteUser
+          *
+          * Those with an address starting with @p prefix and containing
+          * @p pattern, either of which may be empty. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void find(ali::array_set<EventIdType> & ids,
+                  ali::string const& prefix,
+                  ali::string const& pattern) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<ali::string> addresses;
+            findAddresses(addresses, prefix, pattern);
+            collect(ids, addresses);
+        }
+
+        /** @brief Find the events matching Query::RemoteUser with an ID above @p after
+          *
+          * Adds them to @p ids, keeping only the @p limit smallest, so that
+          * all the matches can be walked in batches without collecting them
+          * at once; see find. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void findAfter(ali::array_set<EventIdType> & ids,
+                       ali::string const& prefix,
+                       ali::string const& pattern,
+                       EventIdType after,
+                       int limit) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<ali::string> addresses;
+            findAddresses(addresses, prefix, pattern);
+
+            for (int i = 0; i < addresses.size(); ++i)
+                takeAfter(ids, mAddresses.find(addresses[i])->ids, after, limit);
+        }
+
+        /** @brief Add the IDs in @p from above @p after to @p ids, keeping only the @p limit smallest */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void takeAfter(ali::array_set<EventIdType> & ids,
+                              ali::array_set<EventIdType> const& from,
+                              EventIdType after,
+                              int limit)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            for (int i = from.index_of_lower_bound(after + 1); i < from.size(); ++i)
+            {
+                if (ids.size() >= limit && !(from[i] < ids.back()))
+                    break;
+
+                ids.insert(from[i]);
+
+                if (ids.size() > limit)
+                    ids.erase_back();
+            }
+        }
+
+        /** @brief Count the events matching Query::RemoteUser, see find */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int count(ali::string const& prefix,
+                  ali::string const& pattern) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Events with several matching addresses count once for each.
+        {
+            ali::array_set<ali::string> addresses;
+            findAddresses(addresses, prefix, pattern);
+
+            int count = 0;
+
+            for (int i = 0; i < addresses.size(); ++i)
+                count += mAddresses.find(addresses[i])->ids.size();
+
+            return count;
+        }
+
+        /** @brief Strip the separators people type in phone numbers
+          *
+          * "+420 (604) 123-456" becomes "+420604123456". Text with anything
+          * else than digits, '+', '*', '#' and separators (spaces, '-', '.',
+          * '/', '(' and ')') is not a number and is returned unchanged. */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static ali::string normalizeNumber(ali::string const& text)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::string number;
+
+            for (int i = 0; i < text.size(); ++i)
+            {
+                char const c = text[i];
+
+                if ((c >= '0' && c <= '9') || c == '+' || c == '*' || c == '#')
+                    number.push_back(c);
+                else if (c != ' ' && c != '-' && c != '.' && c != '/' && c != '(' && c != ')')
+                    return text;
+            }
+
+            return number;
+        }
+
+        /** @brief Whether @p address matches the wildcard @p pattern */
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool matchesWildcard(ali::string const& address,
+                                    ali::string const& pattern)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            int a = 0;
+            int p = 0;
+            int star = -1;      // Position after the last '*' seen
+            int resume = 0;     // Where its match continues in the address
+
+            while (a < address.size())
+            {
+                if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == address[a]))
+                {
+                    ++a;
+                    ++p;
+                }
+                else if (p < pattern.size() && pattern[p] == '*')
+                {
+                    star = ++p;
+                    resume = a;
+                }
+                else if (star >= 0)
+                {
+                    p = star;
+                    a = ++resume;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            while (p < pattern.size() && pattern[p] == '*')
+                ++p;
+
+            return p == pattern.size();
+        }
+
+    private:
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Address
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ali::array_set<EventIdType> ids;
+            int                         slot{-1};   ///< Index into mSlots
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Slot
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// An address the suffixes point into. A removed address keeps its
+        /// text until prepare drops its suffixes, as they are sorted by it.
+        {
+            ali::string     address;
+            bool            live{false};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        struct Suffix
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Suffix() = default;
+
+            Suffix(int slot, int start)
+                : slot(slot)
+                , start(start)
+            {}
+
+            friend void swap(Suffix & a, Suffix & b)
+            {
+                ali::swap(a.slot, b.slot);
+                ali::swap(a.start, b.start);
+            }
+
+            int             slot{0};
+            int             start{0};
+        };
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::string_const_ref textOf(Suffix const& suffix) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return mSlots[suffix.slot].address.ref().ref_right(suffix.start);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int compareSuffixes(Suffix const& a,
+                            Suffix const& b) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// By text; the slot breaks ties.
+        {
+            int const c = textOf(a).compare(textOf(b));
+
+            if (c != 0)
+                return c;
+
+            return a.slot < b.slot ? -1 : a.slot > b.slot ? 1 : 0;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int lowerBound(ali::string const& text) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Index of the first suffix not less than @p text.
+        {
+            int first = 0;
+            int last = mSuffixes.size();
+
+            while (first < last)
+            {
+                int const middle = first + (last - first) / 2;
+
+                if (textOf(mSuffixes[middle]).compare(text.ref()) < 0)
+                    first = middle + 1;
+                else
+                    last = middle;
+            }
+
+            return first;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int newSlot(ali::string const& address)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Slot slot;
+            slot.address = address;
+            slot.live = true;
+
+            if (mFreeSlots.is_empty())
+            {
+                mSlots.push_back(slot);
+                return mSlots.size() - 1;
+            }
+
+            int const index = mFreeSlots.back();
+            mFreeSlots.erase_back();
+            mSlots[index] = slot;
+            return index;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void prepare() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Merges the pending suffixes into the index in one pass, dropping
+        /// those of removed addresses; the slots of these can be reused then.
+        {
+            if (mPending.is_empty() && 2 * mDeadSuffixes <= mSuffixes.size())
+                return;
+
+            ali::array<Suffix> pending;
+            pending.reserve(mPending.size());
+
+            for (int i = 0; i < mPending.size(); ++i)
+                if (mSlots[mPending[i].slot].live)
+                    pending.push_back(mPending[i]);
+
+            pending.mutable_ref().sort([this](Suffix const& a, Suffix const& b)
+            {
+                return compareSuffixes(a, b);
+            });
+
+            ali::array<Suffix> merged;
+            merged.reserve(mSuffixes.size() + pending.size());
+
+            int i = 0;
+            int j = 0;
+
+            while (i < mSuffixes.size() || j < pending.size())
+            {
+                if (i < mSuffixes.size() && !mSlots[mSuffixes[i].slot].live)
+                    ++i;
+                else if (j == pending.size()
+                         || (i < mSuffixes.size() && compareSuffixes(mSuffixes[i], pending[j]) < 0))
+                    merged.push_back(mSuffixes[i++]);
+                else
+                    merged.push_back(pending[j++]);
+            }
+
+            mSuffixes.swap(merged);
+            mPending.erase();
+            mDeadSuffixes = 0;
+
+            for (int k = 0; k < mSlots.size(); ++k)
+            {
+                if (!mSlots[k].live && !mSlots[k].address.is_empty())
+                {
+                    mSlots[k].address.erase();
+                    mFreeSlots.push_back(k);
+                }
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void findAddresses(ali::array_set<ali::string> & addresses,
+                           ali::string const& prefix,
+                           ali::string const& pattern) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Starts from the prefix range, or from the addresses containing the pattern.
+        {
+            if (prefix.is_empty())
+            {
+                findAddresses(addresses, pattern, Match::Contains);
+                return;
+            }
+
+            findAddresses(addresses, prefix, Match::Prefix);
+
+            if (pattern.is_empty())
+                return;
+
+            for (int i = addresses.size(); i > 0; --i)
+                if (addresses[i - 1].find(pattern) == ali::string::npos)
+                    addresses.erase(addresses[i - 1]);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void findWildcard(ali::array_set<ali::string> & addresses,
+                          ali::string const& pattern) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Narrows the candidates by the longest literal part of the pattern,
+        /// anchored at the start if the pattern starts with it.
+        {
+            int best = 0;
+            int bestSize = 0;
+
+            for (int i = 0; i < pattern.size();)
+            {
+                int j = i;
+
+                while (j < pattern.size() && pattern[j] != '*' && pattern[j] != '?')
+                    ++j;
+
+                if (j - i > bestSize)
+                {
+                    best = i;
+                    bestSize = j - i;
+                }
+
+                i = j + 1;
+            }
+
+            ali::array_set<ali::string> candidates;
+
+            if (bestSize == 0)
+            {
+                for (int i = 0; i < mAddresses.size(); ++i)
+                    candidates.insert(mAddresses.at(i).first);
+            }
+            else
+            {
+                ali::string const literal(pattern, best, bestSize);
+                findAddresses(candidates, literal, best == 0 ? Match::Prefix : Match::Contains);
+            }
+
+            for (int i = 0; i < candidates.size(); ++i)
+                if (matchesWildcard(candidates[i], pattern))
+                    addresses.insert(candidates[i]);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void collect(ali::array_set<EventIdType> & ids,
+                     ali::array_set<ali::string> const& addresses) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ids.erase();
+
+            if (addresses.size() == 1)
+            {
+                ids = mAddresses.find(addresses[0])->ids;
+                return;
+            }
+
+            ali::array<EventIdType> all;
+
+            for (int i = 0; i < addresses.size(); ++i)
+            {
+                ali::array_set<EventIdType> const& found = mAddresses.find(addresses[i])->ids;
+
+                for (int j = 0; j < found.size(); ++j)
+                    all.push_back(found[j]);
+            }
+
+            all.mutable_ref().sort();
+
+            // Sorted, so every insert appends.
+            for (int i = 0; i < all.size(); ++i)
+                if (i == 0 || all[i] != all[i - 1])
+                    ids.insert(all[i]);
+        }
+
+    private:
+        ali::array_map<ali::string, Address>    mAddresses;
+
+        // Brought up to date by prepare, also on lookups.
+        mutable ali::array<Slot>                mSlots;
+        mutable ali::array<int>                 mFreeSlots;
+        mutable ali::array<Suffix>              mSuffixes;      ///< Sorted
+        mutable ali::array<Suffix>              mPending;       ///< Added since the last prepare
+        mutable int                             mDeadSuffixes{0};   ///< Of removed addresses, in either array
+    };
+}
+}
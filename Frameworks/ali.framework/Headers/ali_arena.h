@@ -0,0 +1,284 @@
+/*
+ *  ali_arena.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_debug.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_meta.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_utility.h"
+
+namespace ali
+{
+
+// ******************************************************************
+class arena : public ali::noncopyable
+// ******************************************************************
+//  Monotonic allocator for request-scoped data.
+//
+//  Memory is carved sequentially from large blocks and is never
+//  returned piecemeal; reset() releases everything at once and
+//  keeps the most recent block for the next request.
+//
+//  Nothing allocates from an arena implicitly. Containers opt in
+//  through ali::arena_allocator, which makes the arena part of
+//  their type, so only code that names it uses it:
+//
+//      ali::arena a;
+//      for ( ;; )
+//      {
+//          {
+//              std::vector<entry, ali::arena_allocator<entry>>
+//                  entries{ali::arena_allocator<entry>{a}};
+//              process(message, entries);
+//          }
+//          a.reset();
+//      }
+//
+//  Objects allocated from an arena must be destroyed before the
+//  arena is reset or destroyed. The arena is not thread-safe.
+// ******************************************************************
+{
+public:     //  Class
+    static int const alignment = 16;
+    static int const default_block_size = 16 * 1024;
+
+    // **************************************************************
+    struct statistics
+    // **************************************************************
+    {
+        int         allocations{};
+            //  Requests served since the last reset.
+        int         deallocations{};
+            //  Requests given back since the last reset (no-ops).
+        ali::int64  bytes{};
+            //  Bytes handed out since the last reset.
+        int         blocks{};
+            //  Blocks currently owned by the arena.
+        int         block_allocations{};
+            //  Heap allocations made by the arena over its lifetime.
+    };
+
+public:     //  Methods
+    explicit arena( int block_size = default_block_size )
+    :   _block_size{block_size}
+    {
+        ali_assert(_block_size > 0);
+    }
+
+    ~arena( void )
+    {
+        release_blocks(nullptr);
+    }
+
+    void* allocate( int size )
+    {
+        ali_assert(size >= 0);
+
+        int const aligned{round_up(size)};
+
+        if ( _head == nullptr || _head->size - _used < aligned )
+            add_block(aligned);
+
+        void* const p{_head->begin() + _used};
+
+        _used += aligned;
+
+        ++_stats.allocations;
+        _stats.bytes += size;
+
+        return p;
+    }
+
+    void deallocate( void* p ) noexcept
+    {
+        ali_assert(p == nullptr || owns(p));
+
+        if ( p != nullptr )
+            ++_stats.deallocations;
+    }
+
+    bool owns( void const* p ) const noexcept
+    {
+        for ( block const* b = _head; b != nullptr; b = b->next )
+            if ( b->contains(p) )
+                return true;
+
+        return false;
+    }
+
+    void reset( void )
+        //  Invalidates all memory handed out by this arena.
+    {
+        if ( _head != nullptr )
+            release_blocks(_head);
+
+        _used = 0;
+
+        _stats.allocations = 0;
+        _stats.deallocations = 0;
+        _stats.bytes = 0;
+        _stats.blocks = _head != nullptr ? 1 : 0;
+    }
+
+    statistics const& stats( void ) const
+    {
+        return _stats;
+    }
+
+private:    //  Struct
+    struct block
+    {
+        block*  next;
+        int     size;
+
+        ali::uint8* begin( void )
+        {
+            return reinterpret_cast<ali::uint8*>(this)
+                + header_size();
+        }
+
+        bool contains( void const* p ) const
+        {
+            ali::uint8 const* const first{
+                reinterpret_cast<ali::uint8 const*>(this)
+                    + header_size()};
+
+            return first <= p && p < first + size;
+        }
+
+        static int header_size( void )
+        {
+            return arena::round_up(sizeof(block));
+        }
+    };
+
+private:    //  Methods
+    static int round_up( int size )
+    {
+        return (size + alignment - 1) & ~(alignment - 1);
+    }
+
+    void add_block( int min_size )
+    {
+        int const size{ali::maxi(min_size, _block_size)};
+
+        block* const b{reinterpret_cast<block*>(
+            ali::new_auto_ptr<ali::uint8[]>(
+                block::header_size() + size).release())};
+
+        b->next = _head;
+        b->size = size;
+
+        _head = b;
+        _used = 0;
+
+        ++_stats.blocks;
+        ++_stats.block_allocations;
+    }
+
+    void release_blocks( block* keep )
+    {
+        block* b{_head};
+
+        while ( b != nullptr )
+        {
+            block* const next{b->next};
+
+            if ( b != keep )
+                ali::auto_ptr<ali::uint8[]>{
+                    reinterpret_cast<ali::uint8*>(b)};
+
+            b = next;
+        }
+
+        _head = keep;
+
+        if ( _head != nullptr )
+            _head->next = nullptr;
+    }
+
+private:    //  Data members
+    block*      _head{};
+    int         _used{};
+    int         _block_size;
+    statistics  _stats{};
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+template <typename T>
+class arena_allocator
+// ******************************************************************
+//  Standard allocator drawing from an ali::arena. deallocate only
+//  counts the request; the memory comes back with arena::reset().
+// ******************************************************************
+{
+    static_assert(alignof(T) <= arena::alignment,
+        "arena blocks are not aligned for T");
+
+public:     //  Typedefs
+    using value_type = T;
+
+public:     //  Methods
+    explicit arena_allocator( arena& a ) noexcept
+    :   _arena{&a}
+    {}
+
+    template <typename U>
+    arena_allocator( arena_allocator<U> const& b ) noexcept
+    :   _arena{b._arena}
+    {}
+
+    T* allocate( size_t n )
+    {
+        ali_assert(n <= static_cast<size_t>(
+            meta::integer::max_value<int>::result) / sizeof(T));
+
+        return static_cast<T*>(_arena->allocate(
+            static_cast<int>(n * sizeof(T))));
+    }
+
+    void deallocate( T* p, size_t ) noexcept
+    {
+        _arena->deallocate(p);
+    }
+
+    arena& get_arena( void ) const noexcept
+    {
+        return *_arena;
+    }
+
+    template <typename U>
+    friend bool operator==(
+        arena_allocator const& a,
+        arena_allocator<U> const& b ) noexcept
+    {
+        return a._arena == &b.get_arena();
+    }
+
+    template <typename U>
+    friend bool operator!=(
+        arena_allocator const& a,
+        arena_allocator<U> const& b ) noexcept
+    {
+        return !(a == b);
+    }
+
+private:    //  Data members
+    arena*  _arena;
+
+    template <typename>
+    friend class arena_allocator;
+};
+
+}   //  namespace ali
@@ -1,4 +1,5 @@
 #pragma once
+#include "ali/ali_integer.h"
 #include <atomic>
 
 namespace ali
@@ -7,40 +8,184 @@ namespace ali
 namespace atomic
 {
 
+//  Every operation takes an optional std::memory_order.
+//  The default is sequentially consistent, as before; pass
+//  std::memory_order_relaxed for pure statistics that do not
+//  publish any other data.
+
 // ******************************************************************
-class counter
+template <typename T>
+class basic_counter
 // ******************************************************************
 {
 public:
-    constexpr counter( int value = 0 ) noexcept
+    constexpr basic_counter( T value = 0 ) noexcept
     :   _value{value}
     {}
 
-    counter( counter const& ) = delete;
-    counter& operator=( counter const& ) = delete;
+    basic_counter( basic_counter const& ) = delete;
+    basic_counter& operator=( basic_counter const& ) = delete;
+
+    T get( std::memory_order order
+                = std::memory_order_seq_cst ) const noexcept
+    {
+        return _value.load(order);
+    }
+
+    void set( T value, std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+    {
+        _value.store(value, order);
+    }
+
+    T dec( std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+        //  Returns the new value.
+    {
+        return _value.fetch_sub(1, order) - 1;
+    }
 
-    int get( void ) const noexcept
+    T inc( std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+        //  Returns the new value.
     {
-        return _value.load();
+        return _value.fetch_add(1, order) + 1;
     }
 
-    int dec( void ) noexcept
+    T add( T n, std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+        //  Returns the new value.
     {
-        return --_value;
+        return _value.fetch_add(n, order) + n;
     }
 
-    int inc( void ) noexcept
+    T exchange( T value, std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+        //  Returns the previous value.
     {
-        return ++_value;
+        return _value.exchange(value, order);
     }
 
-    bool compare_exchange( int& expected, int desired ) noexcept
+    bool compare_exchange( T& expected, T desired ) noexcept
     {
         return _value.compare_exchange_strong(expected, desired);
     }
 
+    bool compare_exchange(
+        T& expected, T desired,
+        std::memory_order success,
+        std::memory_order failure ) noexcept
+    {
+        return _value.compare_exchange_strong(
+            expected, desired, success, failure);
+    }
+
+private:    //  Data members
+    std::atomic<T>  _value;
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+class counter : public basic_counter<int>
+// ******************************************************************
+{
+public:
+    using basic_counter<int>::basic_counter;
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+class counter64 : public basic_counter<ali::int64>
+// ******************************************************************
+//  For totals that can exceed 2^31, e.g. octet counts.
+// ******************************************************************
+{
+public:
+    using basic_counter<ali::int64>::basic_counter;
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+template <int _shard_count = 16>
+class sharded_counter
+// ******************************************************************
+//  Write-mostly 64-bit counter for hot statistics updated from
+//  many threads at once, e.g. per-packet traffic counts.
+//
+//  Each thread adds to one of several cache-line sized shards,
+//  so concurrent writers rarely touch the same line; get() sums
+//  the shards and is correspondingly slower. All operations are
+//  relaxed: the sum is exact once writers have quiesced, and
+//  only approximate while they are running.
+// ******************************************************************
+{
+public:     //  Class
+    static int const cache_line_size = 128;
+
+public:
+    sharded_counter( void ) noexcept {}
+
+    sharded_counter( sharded_counter const& ) = delete;
+    sharded_counter& operator=( sharded_counter const& ) = delete;
+
+    void add( ali::int64 n ) noexcept
+    {
+        _shards[thread_slot() % _shard_count].value.fetch_add(
+            n, std::memory_order_relaxed);
+    }
+
+    void inc( void ) noexcept
+    {
+        add(1);
+    }
+
+    ali::int64 get( void ) const noexcept
+    {
+        ali::int64 sum{};
+
+        for ( int i = 0; i != _shard_count; ++i )
+            sum += _shards[i].value.load(std::memory_order_relaxed);
+
+        return sum;
+    }
+
+    ali::int64 reset( void ) noexcept
+        //  Returns the value before the reset. Additions
+        //  racing with the reset are counted either before
+        //  or after it, never lost.
+    {
+        ali::int64 sum{};
+
+        for ( int i = 0; i != _shard_count; ++i )
+            sum += _shards[i].value.exchange(
+                0, std::memory_order_relaxed);
+
+        return sum;
+    }
+
+private:    //  Struct
+    struct alignas(cache_line_size) shard
+    {
+        std::atomic<ali::int64> value{};
+    };
+
+private:    //  Methods
+    static unsigned thread_slot( void ) noexcept
+    {
+        static std::atomic<unsigned> next{};
+        static thread_local unsigned const slot{
+            next.fetch_add(1, std::memory_order_relaxed)};
+        return slot;
+    }
+
 private:    //  Data members
-    std::atomic<int>    _value;
+    shard   _shards[_shard_count];
 };
 
 // ******************************************************************
@@ -59,11 +204,24 @@ public:
     pointer( pointer const& ) = delete;
     pointer& operator=( pointer const& ) = delete;
 
-    T* get( void ) const noexcept
+    T* get( std::memory_order order
+                = std::memory_order_seq_cst ) const noexcept
     {
-        return _value.load();
+        return _value.load(order);
     }
-    
+
+    void set( T* value, std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+    {
+        _value.store(value, order);
+    }
+
+    T* exchange( T* value, std::memory_order order
+                = std::memory_order_seq_cst ) noexcept
+    {
+        return _value.exchange(value, order);
+    }
+
     bool compare_and_set( T* expected, T* desired ) noexcept
         //  Deprecated.
     {
@@ -75,6 +233,15 @@ public:
         return _value.compare_exchange_strong(expected, desired);
     }
 
+    bool compare_exchange(
+        T*& expected, T* desired,
+        std::memory_order success,
+        std::memory_order failure ) noexcept
+    {
+        return _value.compare_exchange_strong(
+            expected, desired, success, failure);
+    }
+
 private:    //  Data members
     std::atomic<T*> _value;
 };
@@ -75,6 +75,19 @@ inline void const* most_derived_object( T const* ptr )
     }
 }
 
+// ******************************************************************
+template <typename T>
+inline T* allocated( T* p, size_t size ) noexcept
+// ******************************************************************
+//  Reports the allocation to ali::memory_profiler when built
+//  with ALI_TRACEMEMORY.
+// ******************************************************************
+{
+    ALI_IF_TRACEMEMORY(memory_profiler::allocated(p, size));
+    (void) size;
+    return p;
+}
+
 }   //  namespace hidden
 
 // ******************************************************************
@@ -89,6 +102,9 @@ inline void delete_scalar( T* ptr ) noexcept
             typeid(T).name(),
             meta::is_polymorphic<T>::result));
 
+    ALI_IF_TRACEMEMORY(memory_profiler::deallocated(
+        hidden::most_derived_object(ptr)));
+
     delete ptr;
 }
 
@@ -102,6 +118,8 @@ inline void delete_array( T* arr ) noexcept
         else debug::deleting_dynamic_object(
             arr, typeid(T[]).name(), false));
 
+    ALI_IF_TRACEMEMORY(memory_profiler::deallocated(arr));
+
     delete[] arr;
 }
 
@@ -567,12 +585,14 @@ inline ali::auto_ptr<T> new_auto_ptr(
 #ifndef ALI_TRACK_DYNAMIC_OBJECTS
 
     return ali::auto_ptr<T>{out_of_memory_if_null(
-        new T{ali::forward<Params>(params)...}, ALI_HERE)};
+        allocated(new T{ali::forward<Params>(params)...}, sizeof(T)),
+        ALI_HERE)};
 
 #else   //  ALI_TRACK_DYNAMIC_OBJECTS
 
     ali::auto_ptr<T> temp{out_of_memory_if_null(
-        new T{ali::forward<Params>(params)...}, ALI_HERE)};
+        allocated(new T{ali::forward<Params>(params)...}, sizeof(T)),
+        ALI_HERE)};
 
     debug::created_dynamic_object(
         temp.get(), sizeof(T), typeid(T).name(),
@@ -591,12 +611,12 @@ inline ali::auto_ptr<T[]> new_auto_arr( size_t size )
 #ifndef ALI_TRACK_DYNAMIC_OBJECTS
 
     return ali::auto_ptr<T[]>{out_of_memory_if_null(
-        new T[size], ALI_HERE)};
+        allocated(new T[size], sizeof(T) * size), ALI_HERE)};
 
 #else   //  ALI_TRACK_DYNAMIC_OBJECTS
 
     ali::auto_ptr<T[]> temp{out_of_memory_if_null(
-        new T[size], ALI_HERE)};
+        allocated(new T[size], sizeof(T) * size), ALI_HERE)};
 
     debug::created_dynamic_object(
         temp.get(), sizeof(T) * size,
@@ -1026,14 +1046,18 @@ private:    //  Struct
 
             return private_auto_ptr_factory::auto_ptr<T>{
                 out_of_memory_if_null(
-                    new T{ali::forward<Params>(params)...},
+                    ali::hidden::allocated(
+                        new T{ali::forward<Params>(params)...},
+                        sizeof(T)),
                     ALI_HERE)};
 
 #else   //  ALI_TRACK_DYNAMIC_OBJECTS
 
             private_auto_ptr_factory::auto_ptr<T> temp{
                 out_of_memory_if_null(
-                    new T{ali::forward<Params>(params)...},
+                    ali::hidden::allocated(
+                        new T{ali::forward<Params>(params)...},
+                        sizeof(T)),
                     ALI_HERE)};
 
             debug::created_dynamic_object(
@@ -1051,12 +1075,14 @@ private:    //  Struct
 #ifndef ALI_TRACK_DYNAMIC_OBJECTS
 
             return private_auto_ptr_factory::auto_ptr<T[]>{
-                out_of_memory_if_null(new T[size], ALI_HERE)};
+                out_of_memory_if_null(ali::hidden::allocated(
+                    new T[size], sizeof(T) * size), ALI_HERE)};
 
 #else   //  ALI_TRACK_DYNAMIC_OBJECTS
 
             private_auto_ptr_factory::auto_ptr<T[]> temp{
-                out_of_memory_if_null(new T[size], ALI_HERE)};
+                out_of_memory_if_null(ali::hidden::allocated(
+                    new T[size], sizeof(T) * size), ALI_HERE)};
 
             debug::created_dynamic_object(
                 temp.get(), sizeof(T) * size,
@@ -1102,6 +1128,9 @@ private:    //  Methods
                 typeid(T).name(),
                 meta::is_polymorphic<T>::result));
 
+        ALI_IF_TRACEMEMORY(memory_profiler::deallocated(
+            ali::hidden::most_derived_object(ptr)));
+
         delete ptr;
     }
 
@@ -1113,6 +1142,8 @@ private:    //  Methods
             else debug::deleting_dynamic_object(
                 arr, typeid(T[]).name(), false));
 
+        ALI_IF_TRACEMEMORY(memory_profiler::deallocated(arr));
+
         delete[] arr;
     }
 
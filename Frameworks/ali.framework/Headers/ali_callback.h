@@ -44,24 +44,48 @@ public:
 // ******************************************************************
 // ******************************************************************
 
-}   //  namespace hidden
+// ******************************************************************
+template <typename signature,
+          int _capacity,
+          bool _copyable,
+          typename derived>
+class basic_callback;
+// ******************************************************************
 
 // ******************************************************************
 template <typename return_type,
-          typename... param_types>
-class callback<return_type(param_types...)>
+          typename... param_types,
+          int _capacity,
+          bool _copyable,
+          typename derived>
+class basic_callback<return_type(param_types...), _capacity, _copyable, derived>
+// ******************************************************************
+//  Common implementation of callback, sized_callback and
+//  unique_callback. Callables up to _capacity bytes are stored
+//  in place, larger ones on the heap.
+//
+//  Define ALI_CALLBACK_WARN_ON_HEAP to get a compile-time warning
+//  for every callable that does not fit in place.
 // ******************************************************************
 {
     using in_place_buffer
         = ali::in_place_buffer<
-            4 * sizeof(void*),
+            _capacity,
             alignof(hidden::unknown_fun)>;
 
     using in_place_version = meta::define_bool_result<true>;
     using heap_version = meta::define_bool_result<false>;
+
+    using copyable_version = meta::define_bool_result<true>;
+    using move_only_version = meta::define_bool_result<false>;
+
+public:     //  Class
+    static int const capacity = _capacity;
+
     template <typename T>
     using is_in_place = meta::define_bool_result<
-        (in_place_buffer::size >= sizeof(T))>;
+        (in_place_buffer::size >= sizeof(T)
+            && in_place_buffer::alignment >= alignof(T))>;
 
 protected:    // Struct
     // ******************************************************************
@@ -71,6 +95,7 @@ protected:    // Struct
     public:
         virtual return_type call( param_types... params ) const = 0;
         virtual basic_fun* clone( in_place_buffer& buf ) const = 0;
+            //  Never called on move-only callbacks.
         virtual basic_fun* move( in_place_buffer& buf ) = 0;
         virtual void destroy( in_place_buffer& buf ) = 0;
 
@@ -142,10 +167,13 @@ protected:    // Struct
             in_place_version )
         // ******************************************************************
         {
-            return &buf.emplace<member_fun>(obj, fun);
+            return &buf.template emplace<member_fun>(obj, fun);
         }
 
         // ******************************************************************
+#ifdef  ALI_CALLBACK_WARN_ON_HEAP
+        [[deprecated("callable does not fit in place, it will be heap-allocated")]]
+#endif
         static basic_fun* create(
             in_place_buffer&,
             object_type* obj, member_type fun,
@@ -163,7 +191,7 @@ protected:    // Struct
         // ******************************************************************
         {
             basic_fun* const result{
-                &buf.emplace<member_fun>(_obj, _fun)};
+                &buf.template emplace<member_fun>(_obj, _fun)};
 
             this->~member_fun();
 
@@ -185,7 +213,7 @@ protected:    // Struct
             in_place_version )
         // ******************************************************************
         {
-            ali_assert(this == buf.begin<member_fun>());
+            ali_assert(this == buf.template begin<member_fun>());
 
             this->~member_fun();
         }
@@ -196,7 +224,7 @@ protected:    // Struct
             heap_version )
         // ******************************************************************
         {
-            ali_assert(this != buf.begin<void>());
+            ali_assert(this != buf.template begin<void>());
 
             private_auto_ptr_factory<member_fun>::delete_scalar(this);
         }
@@ -234,7 +262,7 @@ protected:    // Struct
             in_place_buffer& buf ) const override
         // ******************************************************************
         {
-            return create(buf, _fun);
+            return clone(buf, meta::define_bool_result<_copyable>{});
         }
 
         // ******************************************************************
@@ -269,10 +297,13 @@ protected:    // Struct
             in_place_version )
         // ******************************************************************
         {
-            return &buf.emplace<other_fun>(ali::move(fun));
+            return &buf.template emplace<other_fun>(ali::move(fun));
         }
 
         // ******************************************************************
+#ifdef  ALI_CALLBACK_WARN_ON_HEAP
+        [[deprecated("callable does not fit in place, it will be heap-allocated")]]
+#endif
         static basic_fun* create(
             in_place_buffer&,
             function_type fun,
@@ -283,6 +314,26 @@ protected:    // Struct
                 new_auto_ptr(ali::move(fun)).release();
         }
 
+        // ******************************************************************
+        basic_fun* clone(
+            in_place_buffer& buf,
+            copyable_version ) const
+        // ******************************************************************
+        {
+            return create(buf, _fun);
+        }
+
+        // ******************************************************************
+        basic_fun* clone(
+            in_place_buffer&,
+            move_only_version ) const
+        // ******************************************************************
+        {
+            ali_assert(false);
+
+            return nullptr;
+        }
+
         // ******************************************************************
         basic_fun* move(
             in_place_buffer& buf,
@@ -290,7 +341,7 @@ protected:    // Struct
         // ******************************************************************
         {
             basic_fun* const result{
-                &buf.emplace<other_fun>(ali::move(_fun))};
+                &buf.template emplace<other_fun>(ali::move(_fun))};
 
             this->~other_fun();
 
@@ -312,7 +363,7 @@ protected:    // Struct
             in_place_version )
         // ******************************************************************
         {
-            ali_assert(this == buf.begin<other_fun>());
+            ali_assert(this == buf.template begin<other_fun>());
 
             this->~other_fun();
         }
@@ -323,7 +374,7 @@ protected:    // Struct
             heap_version )
         // ******************************************************************
         {
-            ali_assert(this != buf.begin<void>());
+            ali_assert(this != buf.template begin<void>());
 
             private_auto_ptr_factory<other_fun>::delete_scalar(this);
         }
@@ -336,62 +387,111 @@ protected:    // Struct
 
 public:     // Methods
     // ******************************************************************
-    callback( ali::nullptr_type = nullptr )
+    template <typename function_type>
+    derived& assign( function_type fun )
     // ******************************************************************
-    {}
+    {
+        reset();
+
+        _fun = other_fun<function_type>::create(_buf, ali::move(fun));
+
+        return self();
+    }
+
+    // ******************************************************************
+    template <typename object_type, typename member_type>
+    derived& assign( object_type* obj, member_type fun )
+    // ******************************************************************
+    {
+        ali_assert(obj != nullptr);
+
+        reset();
+
+        _fun = member_fun<object_type, member_type>::create(_buf, obj, fun);
+
+        return self();
+    }
 
     // ******************************************************************
     template <typename function_type>
-    callback( function_type fun )
+    derived& assign_in_place( function_type fun )
+    // ******************************************************************
+    //  Same as assign, but refuses to compile if the callable
+    //  would be heap-allocated.
     // ******************************************************************
     {
-        assign(ali::move(fun));
+        static_assert(is_in_place<other_fun<function_type>>::result,
+                      "callable does not fit into the callback's in-place buffer; increase the capacity");
+
+        return assign(ali::move(fun));
     }
 
     // ******************************************************************
-    template <typename object_type, typename member_type>
-    callback( object_type* obj, member_type fun )
+    derived& reset( void )
     // ******************************************************************
     {
-        assign(obj, fun);
+        if ( _fun != nullptr )
+        {
+            _fun->destroy(_buf);
+            _fun = nullptr;
+        }
+        return self();
     }
 
     // ******************************************************************
-    callback( callback const& b )
+    return_type operator()( param_types... params ) const
     // ******************************************************************
     {
-        operator=(b);
+        ali_assert(_fun != nullptr);
+        return _fun->call(ali::forward<param_types>(params)...);
     }
 
     // ******************************************************************
-    callback( callback&& b )
+    bool is_null( void ) const
     // ******************************************************************
     {
-        operator=(ali::move(b));
+        return _fun == nullptr;
     }
 
     // ******************************************************************
-    template <typename other_return_type,
-              typename... other_param_types>
-    callback( callback<other_return_type(other_param_types...)> const& b )
+    friend bool is_null( derived const& a )
     // ******************************************************************
     {
-        static_assert(sizeof...(param_types) == sizeof...(other_param_types),
-                      "ali::callback can be created from another ali::callback only when both have the same number of arguments");
-        assign(b);
+        return a.is_null();
     }
 
     // ******************************************************************
-    ~callback( void )
+    bool operator==( ali::nullptr_type ) const
+    // ******************************************************************
+    {
+        return is_null();
+    }
+
+    // ******************************************************************
+    bool operator!=( ali::nullptr_type ) const
+    // ******************************************************************
+    {
+        return !is_null();
+    }
+
+protected:  //  Methods
+    // ******************************************************************
+    basic_callback( void ) {}
+    // ******************************************************************
+
+    // ******************************************************************
+    ~basic_callback( void )
     // ******************************************************************
     {
         reset();
     }
 
     // ******************************************************************
-    callback& operator=( callback const& b )
+    void copy_from( basic_callback const& b )
     // ******************************************************************
     {
+        ali_static_assert(_copyable);
+
         if ( _fun != b._fun )
         {
             reset();
@@ -399,12 +499,10 @@ public:     // Methods
             if ( b._fun != nullptr )
                 _fun = b._fun->clone(_buf);
         }
-
-        return *this;
     }
 
     // ******************************************************************
-    callback& operator=( callback&& b )
+    void move_from( basic_callback&& b )
     // ******************************************************************
     {
         if ( _fun != b._fun )
@@ -418,87 +516,235 @@ public:     // Methods
                 b._fun = nullptr;
             }
         }
+    }
 
-        return *this;
+private:    //  Methods
+    // ******************************************************************
+    derived& self( void )
+    // ******************************************************************
+    {
+        return static_cast<derived&>(*this);
     }
 
+private:    //  Data members
+    in_place_buffer _buf{};
+    basic_fun*      _fun{};
+};
+
+// ******************************************************************
+// ******************************************************************
+
+}   //  namespace hidden
+
+// ******************************************************************
+template <typename return_type,
+          typename... param_types>
+class callback<return_type(param_types...)>
+    : public hidden::basic_callback<
+        return_type(param_types...),
+        hidden::default_callback_capacity,
+        true,
+        callback<return_type(param_types...)>>
+// ******************************************************************
+{
+public:     // Methods
+    // ******************************************************************
+    callback( ali::nullptr_type = nullptr )
+    // ******************************************************************
+    {}
+
     // ******************************************************************
     template <typename function_type>
-    callback& assign( function_type fun )
+    callback( function_type fun )
     // ******************************************************************
     {
-        reset();
+        this->assign(ali::move(fun));
+    }
 
-        _fun = other_fun<function_type>::create(_buf, ali::move(fun));
+    // ******************************************************************
+    template <typename object_type, typename member_type>
+    callback( object_type* obj, member_type fun )
+    // ******************************************************************
+    {
+        this->assign(obj, fun);
+    }
 
-        return *this;
+    // ******************************************************************
+    callback( callback const& b )
+    // ******************************************************************
+    {
+        operator=(b);
     }
 
     // ******************************************************************
-    template <typename object_type, typename member_type>
-    callback& assign( object_type* obj, member_type fun )
+    callback( callback&& b )
     // ******************************************************************
     {
-        ali_assert(obj != nullptr);
+        operator=(ali::move(b));
+    }
 
-        reset();
+    // ******************************************************************
+    template <typename other_return_type,
+              typename... other_param_types>
+    callback( callback<other_return_type(other_param_types...)> const& b )
+    // ******************************************************************
+    {
+        static_assert(sizeof...(param_types) == sizeof...(other_param_types),
+                      "ali::callback can be created from another ali::callback only when both have the same number of arguments");
+        this->assign(b);
+    }
 
-        _fun = member_fun<object_type, member_type>::create(_buf, obj, fun);
+    // ******************************************************************
+    callback& operator=( callback const& b )
+    // ******************************************************************
+    {
+        this->copy_from(b);
 
         return *this;
     }
 
     // ******************************************************************
-    callback& reset( void )
+    callback& operator=( callback&& b )
     // ******************************************************************
     {
-        if ( _fun != nullptr )
-        {
-            _fun->destroy(_buf);
-            _fun = nullptr;
-        }
+        this->move_from(ali::move(b));
+
         return *this;
     }
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+template <typename return_type,
+          typename... param_types,
+          int _capacity>
+class sized_callback<return_type(param_types...), _capacity>
+    : public hidden::basic_callback<
+        return_type(param_types...),
+        _capacity,
+        true,
+        sized_callback<return_type(param_types...), _capacity>>
+// ******************************************************************
+//  Like callback, with an in-place buffer of the given size, e.g.
+//  for captures that do not fit the default four pointers.
+// ******************************************************************
+{
+public:     // Methods
+    // ******************************************************************
+    sized_callback( ali::nullptr_type = nullptr )
+    // ******************************************************************
+    {}
 
     // ******************************************************************
-    return_type operator()( param_types... params ) const
+    template <typename function_type>
+    sized_callback( function_type fun )
     // ******************************************************************
     {
-        ali_assert(_fun != nullptr);
-        return _fun->call(ali::forward<param_types>(params)...);
+        this->assign(ali::move(fun));
     }
 
     // ******************************************************************
-    bool is_null( void ) const
+    template <typename object_type, typename member_type>
+    sized_callback( object_type* obj, member_type fun )
     // ******************************************************************
     {
-        return _fun == nullptr;
+        this->assign(obj, fun);
     }
 
     // ******************************************************************
-    friend bool is_null( callback const& a )
+    sized_callback( sized_callback const& b )
     // ******************************************************************
     {
-        return a.is_null();
+        operator=(b);
     }
 
     // ******************************************************************
-    bool operator==( ali::nullptr_type ) const
+    sized_callback( sized_callback&& b )
     // ******************************************************************
     {
-        return is_null();
+        operator=(ali::move(b));
     }
 
     // ******************************************************************
-    bool operator!=( ali::nullptr_type ) const
+    sized_callback& operator=( sized_callback const& b )
     // ******************************************************************
     {
-        return !is_null();
+        this->copy_from(b);
+
+        return *this;
     }
 
-private:    //  Data members
-    in_place_buffer _buf{};
-    basic_fun*      _fun{};
+    // ******************************************************************
+    sized_callback& operator=( sized_callback&& b )
+    // ******************************************************************
+    {
+        this->move_from(ali::move(b));
+
+        return *this;
+    }
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+template <typename return_type,
+          typename... param_types,
+          int _capacity>
+class unique_callback<return_type(param_types...), _capacity>
+    : public hidden::basic_callback<
+        return_type(param_types...),
+        _capacity,
+        false,
+        unique_callback<return_type(param_types...), _capacity>>
+// ******************************************************************
+//  Move-only callback; accepts callables that cannot be copied,
+//  e.g. lambdas capturing an auto_ptr.
+// ******************************************************************
+{
+public:     // Methods
+    // ******************************************************************
+    unique_callback( ali::nullptr_type = nullptr )
+    // ******************************************************************
+    {}
+
+    // ******************************************************************
+    template <typename function_type>
+    unique_callback( function_type fun )
+    // ******************************************************************
+    {
+        this->assign(ali::move(fun));
+    }
+
+    // ******************************************************************
+    template <typename object_type, typename member_type>
+    unique_callback( object_type* obj, member_type fun )
+    // ******************************************************************
+    {
+        this->assign(obj, fun);
+    }
+
+    unique_callback( unique_callback const& ) = delete;
+
+    // ******************************************************************
+    unique_callback( unique_callback&& b )
+    // ******************************************************************
+    {
+        operator=(ali::move(b));
+    }
+
+    unique_callback& operator=( unique_callback const& ) = delete;
+
+    // ******************************************************************
+    unique_callback& operator=( unique_callback&& b )
+    // ******************************************************************
+    {
+        this->move_from(ali::move(b));
+
+        return *this;
+    }
 };
 
 }
@@ -3,9 +3,30 @@
 namespace ali
 {
 
+namespace hidden
+{
+
+// ******************************************************************
+int const default_callback_capacity = 4 * sizeof(void*);
+// ******************************************************************
+
+}   //  namespace hidden
+
 // ******************************************************************
 template <typename signature>
 class callback;
 // ******************************************************************
 
+// ******************************************************************
+template <typename signature,
+          int _capacity>
+class sized_callback;
+// ******************************************************************
+
+// ******************************************************************
+template <typename signature,
+          int _capacity = hidden::default_callback_capacity>
+class unique_callback;
+// ******************************************************************
+
 }   //  namespace ali
@@ -0,0 +1,452 @@
+/*
+ *  ali_hash_cache.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_utils.h"
+#include "ali/ali_debug.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_utility.h"
+#include <type_traits>
+
+namespace ali
+{
+
+// ******************************************************************
+struct hash_cache_hasher
+// ******************************************************************
+{
+    template <typename Int>
+    typename std::enable_if<std::is_integral<Int>::value, ali::uint32>::type
+        operator()( Int value ) const
+    {
+        //  SplitMix64 finalizer.
+        ali::uint64 x{static_cast<ali::uint64>(value)};
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return static_cast<ali::uint32>(x ^ (x >> 31));
+    }
+
+    ali::uint32 operator()( string_const_ref value ) const
+    {
+        //  FNV-1a.
+        ali::uint32 h{2166136261u};
+
+        for ( int i = 0; i != value.size(); ++i )
+        {
+            h ^= static_cast<ali::uint8>(value[i]);
+            h *= 16777619u;
+        }
+
+        return h;
+    }
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+struct hash_cache_statistics
+// ******************************************************************
+{
+    ali::int64  hits{};
+    ali::int64  misses{};
+    ali::int64  evicted{};
+    ali::int64  purged{};
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+template <typename K, typename T, typename hasher = hash_cache_hasher>
+class hash_cache : public ali::noncopyable
+// ******************************************************************
+//  Hash-indexed map with a recency list, for caching objects
+//  that are expensive to load, e.g. event history records.
+//
+//  find, insert, erase and mark_removed take constant time on
+//  average; nothing is ever shifted. Every live entry sits on
+//  the recency list (most recently used first) or, once marked
+//  removed, on the removed list, so that purge_removed costs
+//  only as much as there is to purge and for_each never visits
+//  removed entries.
+//
+//  Every entry has a cost, 1 by default. When a budget is set,
+//  insert evicts the least recently used entries until the total
+//  cost fits; removed entries are dropped before live ones.
+//  A budget of 0 means unbounded.
+//
+//  find counts hits and misses; peek and contains do not and
+//  leave the recency order alone.
+// ******************************************************************
+{
+public:     //  Class
+    using statistics = hash_cache_statistics;
+
+public:     //  Methods
+    explicit hash_cache( ali::int64 budget = 0 )
+    :   _budget{budget}
+    {}
+
+    int size( void ) const
+        //  Live and removed entries.
+    {
+        return _size;
+    }
+
+    bool is_empty( void ) const
+    {
+        return _size == 0;
+    }
+
+    ali::int64 cost( void ) const
+    {
+        return _cost;
+    }
+
+    ali::int64 budget( void ) const
+    {
+        return _budget;
+    }
+
+    void set_budget( ali::int64 budget )
+    {
+        _budget = budget;
+        shrink(-1);
+    }
+
+    statistics const& stats( void ) const
+    {
+        return _stats;
+    }
+
+    void reset_stats( void )
+    {
+        _stats = statistics{};
+    }
+
+    template <typename U>
+    T* find( U const& key )
+        //  Returns nullptr if there is no such live entry.
+        //  A hit makes the entry the most recently used one.
+    {
+        int const i{locate(key)};
+
+        if ( i < 0 || _nodes[i].removed )
+        {
+            ++_stats.misses;
+            return nullptr;
+        }
+
+        ++_stats.hits;
+
+        unlink(i);
+        link_front(_lru, i);
+
+        return &_nodes[i].value;
+    }
+
+    template <typename U>
+    T* peek( U const& key )
+    {
+        int const i{locate(key)};
+        return i < 0 || _nodes[i].removed ? nullptr : &_nodes[i].value;
+    }
+
+    template <typename U>
+    T const* peek( U const& key ) const
+    {
+        int const i{locate(key)};
+        return i < 0 || _nodes[i].removed ? nullptr : &_nodes[i].value;
+    }
+
+    template <typename U>
+    bool contains( U const& key ) const
+    {
+        return peek(key) != nullptr;
+    }
+
+    T& insert( K const& key, T value, ali::int64 cost = 1 )
+        //  Inserts or replaces the entry, makes it the most
+        //  recently used one and evicts others to fit the budget.
+    {
+        int i{locate(key)};
+
+        if ( i < 0 )
+        {
+            if ( (_size + 1) * 4 > _buckets.size() * 3 )
+                rehash(_buckets.is_empty() ? 16 : 2 * _buckets.size());
+
+            i = allocate();
+            _nodes[i].key = key;
+
+            ali::uint32 const b{bucket(key)};
+            _nodes[i].next_in_bucket = _buckets[b];
+            _buckets[b] = i;
+
+            ++_size;
+        }
+        else
+        {
+            _cost -= _nodes[i].cost;
+            unlink(i);
+        }
+
+        _nodes[i].value = ali::move(value);
+        _nodes[i].cost = cost;
+        _nodes[i].removed = false;
+        _cost += cost;
+
+        link_front(_lru, i);
+
+        shrink(i);
+
+        return _nodes[i].value;
+    }
+
+    template <typename U>
+    bool mark_removed( U const& key )
+        //  Hides the entry from find and for_each until
+        //  it is erased by purge_removed or eviction.
+    {
+        int const i{locate(key)};
+
+        if ( i < 0 || _nodes[i].removed )
+            return false;
+
+        unlink(i);
+        _nodes[i].removed = true;
+        link_front(_removed, i);
+
+        return true;
+    }
+
+    int purge_removed( void )
+        //  Returns the number of erased entries.
+    {
+        int n{};
+
+        while ( _removed.first >= 0 )
+        {
+            release(_removed.first);
+            ++n;
+        }
+
+        _stats.purged += n;
+
+        return n;
+    }
+
+    template <typename U>
+    bool erase( U const& key )
+    {
+        int const i{locate(key)};
+
+        if ( i < 0 )
+            return false;
+
+        release(i);
+
+        return true;
+    }
+
+    void erase( void )
+    {
+        _nodes.erase();
+        _buckets.erase();
+        _free = -1;
+        _lru = list{};
+        _removed = list{};
+        _size = 0;
+        _cost = 0;
+    }
+
+    template <typename Fun>
+    void for_each( Fun fun )
+        //  Visits live entries, most recently used first,
+        //  as fun(K const&, T&). fun must not modify the cache.
+    {
+        for ( int i = _lru.first; i >= 0; i = _nodes[i].next )
+            fun(static_cast<K const&>(_nodes[i].key), _nodes[i].value);
+    }
+
+    template <typename Fun>
+    void for_each( Fun fun ) const
+    {
+        for ( int i = _lru.first; i >= 0; i = _nodes[i].next )
+            fun(_nodes[i].key, static_cast<T const&>(_nodes[i].value));
+    }
+
+private:    //  Struct
+    struct node
+    {
+        K               key{};
+        T               value{};
+        ali::int64      cost{};
+        int             next_in_bucket{-1};
+            //  Also links free nodes.
+        int             prev{-1};
+        int             next{-1};
+        bool            removed{};
+        bool            used{};
+    };
+
+    struct list
+    {
+        int     first{-1};
+        int     last{-1};
+    };
+
+private:    //  Methods
+    template <typename U>
+    ali::uint32 bucket( U const& key ) const
+    {
+        return hasher{}(key) & static_cast<ali::uint32>(_buckets.size() - 1);
+    }
+
+    template <typename U>
+    int locate( U const& key ) const
+    {
+        if ( _buckets.is_empty() )
+            return -1;
+
+        for ( int i = _buckets[bucket(key)]; i >= 0; i = _nodes[i].next_in_bucket )
+            if ( _nodes[i].key == key )
+                return i;
+
+        return -1;
+    }
+
+    int allocate( void )
+    {
+        if ( _free < 0 )
+        {
+            _nodes.push_back(node{});
+            _nodes.back().used = true;
+            return _nodes.size() - 1;
+        }
+
+        int const i{_free};
+        _free = _nodes[i].next_in_bucket;
+        _nodes[i].used = true;
+        return i;
+    }
+
+    void release( int i )
+    {
+        int* link{&_buckets[bucket(_nodes[i].key)]};
+
+        while ( *link != i )
+            link = &_nodes[*link].next_in_bucket;
+
+        *link = _nodes[i].next_in_bucket;
+
+        unlink(i);
+
+        _cost -= _nodes[i].cost;
+        --_size;
+
+        //  Destroy the value now, it may hold references.
+        _nodes[i] = node{};
+        _nodes[i].next_in_bucket = _free;
+        _free = i;
+    }
+
+    void rehash( int buckets )
+    {
+        ali_assert((buckets & (buckets - 1)) == 0);
+
+        _buckets.erase();
+        _buckets.reserve(buckets);
+
+        for ( int b = 0; b != buckets; ++b )
+            _buckets.push_back(-1);
+
+        for ( int i = 0; i != _nodes.size(); ++i )
+        {
+            if ( !_nodes[i].used )
+                continue;
+
+            ali::uint32 const b{bucket(_nodes[i].key)};
+            _nodes[i].next_in_bucket = _buckets[b];
+            _buckets[b] = i;
+        }
+    }
+
+    list& owner( int i )
+    {
+        return _nodes[i].removed ? _removed : _lru;
+    }
+
+    void unlink( int i )
+    {
+        list& l = owner(i);
+        node& n = _nodes[i];
+
+        if ( n.prev >= 0 )
+            _nodes[n.prev].next = n.next;
+        else
+            l.first = n.next;
+
+        if ( n.next >= 0 )
+            _nodes[n.next].prev = n.prev;
+        else
+            l.last = n.prev;
+
+        n.prev = n.next = -1;
+    }
+
+    void link_front( list& l, int i )
+    {
+        _nodes[i].prev = -1;
+        _nodes[i].next = l.first;
+
+        if ( l.first >= 0 )
+            _nodes[l.first].prev = i;
+        else
+            l.last = i;
+
+        l.first = i;
+    }
+
+    void shrink( int keep )
+        //  Evicts entries other than keep (-1 for none)
+        //  until the cost fits the budget.
+    {
+        if ( _budget <= 0 )
+            return;
+
+        while ( _cost > _budget && _removed.last >= 0 )
+        {
+            release(_removed.last);
+            ++_stats.purged;
+        }
+
+        while ( _cost > _budget && _lru.last >= 0 && _lru.last != keep )
+        {
+            release(_lru.last);
+            ++_stats.evicted;
+        }
+    }
+
+private:    //  Data members
+    ali::array<node>    _nodes{};
+    ali::array<int>     _buckets{};
+    int                 _free{-1};
+    list                _lru{};
+    list                _removed{};
+    int                 _size{};
+    ali::int64          _cost{};
+    ali::int64          _budget;
+    statistics          _stats{};
+};
+
+}   //  namespace ali
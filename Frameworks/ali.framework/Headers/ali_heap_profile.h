@@ -0,0 +1,294 @@
+/*
+ *  ali_heap_profile.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_backtrace.h"
+#include "ali/ali_memory_profiler.h"
+#include "ali/ali_string.h"
+
+namespace ali
+{
+
+namespace heap_profile
+{
+
+namespace hidden
+{
+
+// ******************************************************************
+inline ali::string& append_decimal( ali::string& out, ali::int64 value )
+// ******************************************************************
+{
+    char digits[24];
+    int n = 0;
+
+    ali::uint64 v{value < 0
+        ? 0 - static_cast<ali::uint64>(value)
+        : static_cast<ali::uint64>(value)};
+
+    do digits[n++] = static_cast<char>('0' + v % 10);
+    while ( (v /= 10) != 0 );
+
+    if ( value < 0 )
+        out.push_back('-');
+
+    while ( n != 0 )
+        out.push_back(digits[--n]);
+
+    return out;
+}
+
+// ******************************************************************
+inline ali::string& append_fixed3( ali::string& out, double value )
+// ******************************************************************
+//  Non-negative value with three decimal places.
+// ******************************************************************
+{
+    ali::int64 const milli{static_cast<ali::int64>(value * 1000 + 0.5)};
+
+    append_decimal(out, milli / 1000).push_back('.');
+
+    out.push_back(static_cast<char>('0' + milli / 100 % 10));
+    out.push_back(static_cast<char>('0' + milli / 10 % 10));
+    out.push_back(static_cast<char>('0' + milli % 10));
+
+    return out;
+}
+
+// ******************************************************************
+inline ali::string& append_address( ali::string& out, void const* p )
+// ******************************************************************
+{
+    char digits[2 * sizeof(uintptr_t)];
+    int n = 0;
+
+    uintptr_t v{reinterpret_cast<uintptr_t>(p)};
+
+    do digits[n++] = "0123456789abcdef"[v % 16];
+    while ( (v /= 16) != 0 );
+
+    out.push_back('0');
+    out.push_back('x');
+
+    while ( n != 0 )
+        out.push_back(digits[--n]);
+
+    return out;
+}
+
+// ******************************************************************
+inline ali::string& append_json_string(
+    ali::string& out, string_const_ref str )
+// ******************************************************************
+{
+    out.push_back('"');
+
+    for ( int i = 0; i != str.size(); ++i )
+    {
+        char const c{str[i]};
+
+        if ( c == '"' || c == '\\' )
+        {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if ( static_cast<unsigned char>(c) < 0x20 )
+        {
+            out.push_back('\\');
+            out.push_back('u');
+            out.push_back('0');
+            out.push_back('0');
+            out.push_back("0123456789abcdef"[(c >> 4) & 0xf]);
+            out.push_back("0123456789abcdef"[c & 0xf]);
+        }
+        else
+        {
+            out.push_back(c);
+        }
+    }
+
+    out.push_back('"');
+
+    return out;
+}
+
+// ******************************************************************
+inline ali::string& append_counts(
+    ali::string& out,
+    ali::int64 live_count, ali::int64 live_bytes,
+    ali::int64 alloc_count, ali::int64 alloc_bytes )
+// ******************************************************************
+//  "live_count: live_bytes [alloc_count: alloc_bytes]"
+// ******************************************************************
+{
+    using ali::operator""_s;
+
+    append_decimal(out, live_count).append(": "_s);
+    append_decimal(out, live_bytes).append(" ["_s);
+    append_decimal(out, alloc_count).append(": "_s);
+    append_decimal(out, alloc_bytes).push_back(']');
+
+    return out;
+}
+
+}   //  namespace hidden
+
+// ******************************************************************
+inline ali::string& to_pprof(
+    ali::string& out,
+    ali::memory_profiler const& profiler
+        = ali::memory_profiler::instance() )
+// ******************************************************************
+//  Appends the sampled heap in the text format read by pprof
+//  (heap_v2, with the sampling period so pprof scales the values
+//  itself). Frames are raw return addresses; no MAPPED_LIBRARIES
+//  section is written, so symbolize them against the dSYM of the
+//  exact build, e.g. by passing the binary to pprof.
+// ******************************************************************
+{
+    using ali::operator""_s;
+
+    ali::int64 live_count{}, live_bytes{}, alloc_count{}, alloc_bytes{};
+
+    profiler.for_each_site(
+        [&] ( ali::memory_profiler::site const& s )
+        {
+            live_count += s.live_count;
+            live_bytes += s.live_bytes;
+            alloc_count += s.alloc_count;
+            alloc_bytes += s.alloc_bytes;
+        });
+
+    out.append("heap profile: "_s);
+    hidden::append_counts(
+        out, live_count, live_bytes, alloc_count, alloc_bytes);
+    out.append(" @ heap_v2/"_s);
+    hidden::append_decimal(out, profiler.sample_period());
+    out.push_back('\n');
+
+    profiler.for_each_site(
+        [&out] ( ali::memory_profiler::site const& s )
+        {
+            hidden::append_counts(
+                out, s.live_count, s.live_bytes,
+                s.alloc_count, s.alloc_bytes);
+            out.append(" @"_s);
+
+            for ( int i = 0; i != s.depth; ++i )
+            {
+                out.push_back(' ');
+                hidden::append_address(out, s.frames[i]);
+            }
+
+            out.push_back('\n');
+        });
+
+    return out;
+}
+
+// ******************************************************************
+inline ali::string& to_json(
+    ali::string& out,
+    bool resolve_symbols = false,
+    ali::memory_profiler const& profiler
+        = ali::memory_profiler::instance() )
+// ******************************************************************
+//  Appends the sampled heap as a JSON object:
+//
+//      {"sample_period":524288,"samples":..,"dropped":..,
+//       "sites":[{"live_bytes":..,"live_count":..,
+//                 "alloc_bytes":..,"alloc_count":..,
+//                 "scale":1.03,"frames":["0x1f2e..",..],
+//                 "symbols":[..]},..]}
+//
+//  Byte and count values are sampled; multiply them by the site's
+//  scale to estimate the real totals. Symbols are only present
+//  when resolve_symbols is set, which is slow and may allocate
+//  a lot; prefer resolving offline for large profiles.
+// ******************************************************************
+{
+    using ali::operator""_s;
+
+    ali::int64 const period{profiler.sample_period()};
+    ali::memory_profiler::totals const t{profiler.stats()};
+
+    out.append("{\"sample_period\":"_s);
+    hidden::append_decimal(out, period);
+    out.append(",\"samples\":"_s);
+    hidden::append_decimal(out, t.samples);
+    out.append(",\"dropped\":"_s);
+    hidden::append_decimal(out, t.dropped);
+    out.append(",\"sites\":["_s);
+
+    bool first = true;
+
+    profiler.for_each_site(
+        [&] ( ali::memory_profiler::site const& s )
+        {
+            if ( !first )
+                out.push_back(',');
+
+            first = false;
+
+            //  Scale by the site's cumulative average size;
+            //  it is the better estimate of the typical block.
+            double const scale{ali::memory_profiler::scale(
+                s.alloc_bytes, s.alloc_count, period)};
+
+            out.append("{\"live_bytes\":"_s);
+            hidden::append_decimal(out, s.live_bytes);
+            out.append(",\"live_count\":"_s);
+            hidden::append_decimal(out, s.live_count);
+            out.append(",\"alloc_bytes\":"_s);
+            hidden::append_decimal(out, s.alloc_bytes);
+            out.append(",\"alloc_count\":"_s);
+            hidden::append_decimal(out, s.alloc_count);
+            out.append(",\"scale\":"_s);
+            hidden::append_fixed3(out, scale);
+            out.append(",\"frames\":["_s);
+
+            for ( int i = 0; i != s.depth; ++i )
+            {
+                if ( i != 0 )
+                    out.push_back(',');
+
+                out.push_back('"');
+                hidden::append_address(out, s.frames[i]);
+                out.push_back('"');
+            }
+
+            out.push_back(']');
+
+            if ( resolve_symbols )
+            {
+                out.append(",\"symbols\":["_s);
+
+                for ( int i = 0; i != s.depth; ++i )
+                {
+                    if ( i != 0 )
+                        out.push_back(',');
+
+                    hidden::append_json_string(
+                        out, ali::backtrace::resolve(s.frames[i]));
+                }
+
+                out.push_back(']');
+            }
+
+            out.push_back('}');
+        });
+
+    out.append("]}"_s);
+
+    return out;
+}
+
+}   //  namespace heap_profile
+
+}   //  namespace ali
@@ -0,0 +1,501 @@
+/*
+ *  ali_memory_profiler.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_backtrace.h"
+#include "ali/ali_integer.h"
+#include <atomic>
+#include <cmath>
+#include <new>
+#include <stdint.h>
+
+//  Kept free of ali containers and strings: this header is pulled
+//  into ali_new.h when ALI_TRACEMEMORY is defined, and the profiler
+//  must never allocate through the hooks it implements.
+//  See ali_heap_profile.h for the JSON and pprof writers.
+
+namespace ali
+{
+
+// ******************************************************************
+class memory_profiler
+// ******************************************************************
+//  Sampling allocation profiler.
+//
+//  When the library is built with ALI_TRACEMEMORY defined, every
+//  allocation made through ali::new_auto_ptr / new_auto_arr and
+//  every matching delete_scalar / delete_array is reported here.
+//
+//  Allocations are sampled by bytes: on average one allocation
+//  per sample_period() bytes allocated is recorded, each with
+//  a call stack captured by ali::backtrace::fill. Unsampled
+//  allocations cost a thread-local subtraction; unsampled frees
+//  cost one relaxed atomic load while nothing sampled is live,
+//  otherwise a short lookup in one of the pointer-sharded tables.
+//
+//  Samples are aggregated per call site (distinct stack). Each
+//  site keeps sampled live and cumulative bytes and counts;
+//  scale() gives the factor that extrapolates them to the whole
+//  population the same way pprof does for heap_v2 profiles.
+// ******************************************************************
+{
+public:     //  Class
+    static int const max_depth = 32;
+    static int const max_sites = 4096;
+    static int const shard_count = 16;
+    static int const shard_capacity = 4096;
+    static ali::int64 const default_sample_period = 512 * 1024;
+
+    // **************************************************************
+    struct site
+    // **************************************************************
+    {
+        void*       frames[max_depth];
+        int         depth;
+        ali::int64  live_bytes;
+        ali::int64  live_count;
+        ali::int64  alloc_bytes;
+        ali::int64  alloc_count;
+            //  All values are sampled, i.e. not scaled.
+    };
+
+    // **************************************************************
+    struct totals
+    // **************************************************************
+    {
+        ali::int64  samples{};
+        ali::int64  live_samples{};
+        ali::int64  sites{};
+        ali::int64  dropped{};
+            //  Samples not recorded because a table was full.
+    };
+
+public:     //  Methods
+    static memory_profiler& instance( void )
+    {
+        //  Intentionally leaked, allocations are reported
+        //  until the very end of the process.
+        static memory_profiler* const profiler{new memory_profiler};
+        return *profiler;
+    }
+
+    static void allocated( void const* p, size_t size ) noexcept
+    {
+        if ( p == nullptr )
+            return;
+
+        memory_profiler& self = instance();
+
+        ali::int64 const period{
+            self._period.load(std::memory_order_relaxed)};
+
+        if ( period == 0 )
+            return;
+
+        thread_state& state = local_state();
+
+        state.countdown -= static_cast<ali::int64>(size);
+
+        if ( state.countdown > 0 )
+            return;
+
+        state.countdown = state.next_interval(period);
+
+        self.record(p, static_cast<ali::int64>(size));
+    }
+
+    static void deallocated( void const* p ) noexcept
+    {
+        if ( p == nullptr )
+            return;
+
+        memory_profiler& self = instance();
+
+        if ( self._live_samples.load(std::memory_order_relaxed) == 0 )
+            return;
+
+        self.erase(p);
+    }
+
+    ali::int64 sample_period( void ) const
+    {
+        return _period.load(std::memory_order_relaxed);
+    }
+
+    void set_sample_period( ali::int64 period )
+        //  1 records every allocation, 0 stops sampling.
+        //  Samples taken so far are kept.
+    {
+        _period.store(period < 0 ? 0 : period,
+            std::memory_order_relaxed);
+    }
+
+    static double scale( ali::int64 bytes, ali::int64 count,
+                         ali::int64 period )
+        //  Inverse probability of sampling an allocation of
+        //  the average size of the given samples.
+    {
+        if ( count == 0 || period <= 1 )
+            return 1.0;
+
+        double const average{
+            static_cast<double>(bytes) / static_cast<double>(count)};
+
+        return 1.0 / (1.0 - std::exp(-average / period));
+    }
+
+    totals stats( void ) const
+    {
+        totals t{};
+        t.samples = _samples.load(std::memory_order_relaxed);
+        t.live_samples = _live_samples.load(std::memory_order_relaxed);
+        t.sites = _site_count.load(std::memory_order_acquire);
+        t.dropped = _dropped.load(std::memory_order_relaxed);
+        return t;
+    }
+
+    template <typename Visitor>
+    void for_each_site( Visitor visitor ) const
+        //  Calls visitor(site const&) with a consistent-enough
+        //  copy of every site recorded so far. The visitor is free
+        //  to allocate; no profiler lock is held during the call.
+    {
+        int const n{static_cast<int>(
+            _site_count.load(std::memory_order_acquire))};
+
+        for ( int i = 0; i != n; ++i )
+        {
+            site_slot const& slot = _sites[_site_order[i]];
+
+            site s;
+            s.depth = slot.depth;
+
+            for ( int j = 0; j != s.depth; ++j )
+                s.frames[j] = slot.frames[j];
+
+            s.live_bytes = slot.live_bytes.load(std::memory_order_relaxed);
+            s.live_count = slot.live_count.load(std::memory_order_relaxed);
+            s.alloc_bytes = slot.alloc_bytes.load(std::memory_order_relaxed);
+            s.alloc_count = slot.alloc_count.load(std::memory_order_relaxed);
+
+            visitor(static_cast<site const&>(s));
+        }
+    }
+
+private:    //  Struct
+    struct site_slot
+    {
+        ali::uint64             hash;
+        int                     depth;
+        void*                   frames[max_depth];
+        std::atomic<ali::int64> live_bytes;
+        std::atomic<ali::int64> live_count;
+        std::atomic<ali::int64> alloc_bytes;
+        std::atomic<ali::int64> alloc_count;
+    };
+
+    struct record
+    {
+        void const* ptr;
+        ali::int64  size;
+        int         site;
+    };
+
+    struct shard
+    {
+        std::atomic_flag    lock = ATOMIC_FLAG_INIT;
+        int                 size{};
+        record              records[shard_capacity]{};
+    };
+
+    struct thread_state
+    {
+        thread_state( void )
+        :   rng{reinterpret_cast<uintptr_t>(this)
+                ^ 0x9e3779b97f4a7c15ull}
+        {
+            countdown = next_interval(
+                memory_profiler::instance().sample_period());
+        }
+
+        ali::int64 next_interval( ali::int64 period )
+            //  Exponentially distributed, so that sampling is
+            //  a Poisson process over allocated bytes and does not
+            //  alias with periodic allocation patterns.
+        {
+            if ( period <= 1 )
+                return period;
+
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+
+            double const u{
+                static_cast<double>((rng >> 11) + 1) / 9007199254740993.0};
+
+            return static_cast<ali::int64>(-std::log(u) * period) + 1;
+        }
+
+        ali::uint64 rng;
+        ali::int64  countdown{};
+    };
+
+    class lock_guard
+    {
+    public:
+        explicit lock_guard( std::atomic_flag& flag )
+        :   _flag(flag)
+        {
+            while ( _flag.test_and_set(std::memory_order_acquire) )
+                ;
+        }
+
+        ~lock_guard( void )
+        {
+            _flag.clear(std::memory_order_release);
+        }
+
+    private:
+        std::atomic_flag&   _flag;
+    };
+
+private:    //  Methods
+    memory_profiler( void )
+    :   _sites{static_cast<site_slot*>(
+            ::operator new(sizeof(site_slot) * max_sites))},
+        _shards{new shard[shard_count]}
+    {
+        for ( int i = 0; i != max_sites; ++i )
+        {
+            site_slot& s = *new (_sites + i) site_slot;
+            s.hash = 0;
+            s.depth = 0;
+            s.live_bytes.store(0, std::memory_order_relaxed);
+            s.live_count.store(0, std::memory_order_relaxed);
+            s.alloc_bytes.store(0, std::memory_order_relaxed);
+            s.alloc_count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    memory_profiler( memory_profiler const& );
+    memory_profiler& operator=( memory_profiler const& );
+
+    static thread_state& local_state( void )
+    {
+        static thread_local thread_state state{};
+        return state;
+    }
+
+    static ali::uint64 hash_of( void const* p )
+    {
+        ali::uint64 h{reinterpret_cast<uintptr_t>(p)};
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static ali::uint64 hash_of( void* const* frames, int depth )
+    {
+        ali::uint64 h{0xcbf29ce484222325ull};
+
+        for ( int i = 0; i != depth; ++i )
+        {
+            h ^= reinterpret_cast<uintptr_t>(frames[i]);
+            h *= 0x100000001b3ull;
+        }
+
+        return h == 0 ? 1 : h;
+    }
+
+    void record( void const* p, ali::int64 size ) noexcept
+    {
+        void* frames[max_depth];
+
+        int depth{ali::backtrace::fill(frames, max_depth, 2)};
+
+        if ( depth < 0 )
+            depth = 0;
+
+        int const s{find_site(frames, depth)};
+
+        _samples.fetch_add(1, std::memory_order_relaxed);
+
+        if ( s < 0 )
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        site_slot& slot = _sites[s];
+
+        slot.alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+        slot.alloc_count.fetch_add(1, std::memory_order_relaxed);
+
+        ali::uint64 const h{hash_of(p)};
+        shard& sh = _shards[h % shard_count];
+
+        {
+            lock_guard const lock{sh.lock};
+
+            if ( 2 * sh.size >= shard_capacity )
+            {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            int i{static_cast<int>((h / shard_count) % shard_capacity)};
+
+            while ( sh.records[i].ptr != nullptr
+                &&  sh.records[i].ptr != p )
+                i = (i + 1) % shard_capacity;
+
+            if ( sh.records[i].ptr == p )
+            {
+                //  The previous block at this address was released
+                //  without going through ali; forget it.
+                site_slot& stale = _sites[sh.records[i].site];
+                stale.live_bytes.fetch_sub(
+                    sh.records[i].size, std::memory_order_relaxed);
+                stale.live_count.fetch_sub(1, std::memory_order_relaxed);
+                _live_samples.fetch_sub(1, std::memory_order_relaxed);
+            }
+            else
+            {
+                ++sh.size;
+            }
+
+            sh.records[i].ptr = p;
+            sh.records[i].size = size;
+            sh.records[i].site = s;
+
+            slot.live_bytes.fetch_add(size, std::memory_order_relaxed);
+            slot.live_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        _live_samples.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void erase( void const* p ) noexcept
+    {
+        ali::uint64 const h{hash_of(p)};
+        shard& sh = _shards[h % shard_count];
+
+        lock_guard const lock{sh.lock};
+
+        int i{static_cast<int>((h / shard_count) % shard_capacity)};
+
+        while ( sh.records[i].ptr != p )
+        {
+            if ( sh.records[i].ptr == nullptr )
+                return;
+
+            i = (i + 1) % shard_capacity;
+        }
+
+        site_slot& slot = _sites[sh.records[i].site];
+
+        slot.live_bytes.fetch_sub(
+            sh.records[i].size, std::memory_order_relaxed);
+        slot.live_count.fetch_sub(1, std::memory_order_relaxed);
+
+        //  Backward-shift deletion keeps probe sequences intact
+        //  without tombstones.
+        for ( int j = (i + 1) % shard_capacity;
+              sh.records[j].ptr != nullptr;
+              j = (j + 1) % shard_capacity )
+        {
+            int const home{static_cast<int>(
+                (hash_of(sh.records[j].ptr) / shard_count)
+                    % shard_capacity)};
+
+            bool const movable{i <= j
+                ? (home <= i || home > j)
+                : (home <= i && home > j)};
+
+            if ( movable )
+            {
+                sh.records[i] = sh.records[j];
+                i = j;
+            }
+        }
+
+        sh.records[i].ptr = nullptr;
+        --sh.size;
+
+        _live_samples.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    int find_site( void* const* frames, int depth ) noexcept
+        //  Returns -1 if the site table is full.
+    {
+        ali::uint64 const h{hash_of(frames, depth)};
+
+        lock_guard const lock{_sites_lock};
+
+        for ( int n = 0, i = static_cast<int>(h % max_sites);
+              n != max_sites; ++n, i = (i + 1) % max_sites )
+        {
+            site_slot& s = _sites[i];
+
+            if ( s.hash == 0 )
+            {
+                if ( 2 * _site_count.load(std::memory_order_relaxed)
+                        >= max_sites )
+                    return -1;
+
+                s.hash = h;
+                s.depth = depth;
+
+                for ( int j = 0; j != depth; ++j )
+                    s.frames[j] = frames[j];
+
+                ali::int64 const k{
+                    _site_count.load(std::memory_order_relaxed)};
+
+                _site_order[k] = i;
+
+                _site_count.store(k + 1, std::memory_order_release);
+
+                return i;
+            }
+
+            if ( s.hash == h && same_frames(s, frames, depth) )
+                return i;
+        }
+
+        return -1;
+    }
+
+    static bool same_frames(
+        site_slot const& s, void* const* frames, int depth )
+    {
+        if ( s.depth != depth )
+            return false;
+
+        for ( int i = 0; i != depth; ++i )
+            if ( s.frames[i] != frames[i] )
+                return false;
+
+        return true;
+    }
+
+private:    //  Data members
+    std::atomic<ali::int64> _period{default_sample_period};
+    std::atomic<ali::int64> _live_samples{};
+    std::atomic<ali::int64> _samples{};
+    std::atomic<ali::int64> _dropped{};
+    std::atomic<ali::int64> _site_count{};
+    std::atomic_flag        _sites_lock = ATOMIC_FLAG_INIT;
+    site_slot*              _sites;
+    int                     _site_order[max_sites]{};
+    shard*                  _shards;
+};
+
+}   //  namespace ali
@@ -0,0 +1,406 @@
+/*
+ *  ali_mpmc_queue.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_array_utils.h"
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_debug.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_time_forward.h"
+#include "ali/ali_typed_number.h"
+#include "ali/ali_utility.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace ali
+{
+
+// ******************************************************************
+template <typename T>
+class mpmc_queue : public ali::noncopyable
+// ******************************************************************
+//  Bounded queue for any number of producer and consumer threads,
+//  e.g. application threads posting events to the SDK thread.
+//
+//  The try_ variants are lock-free (D. Vyukov's bounded MPMC
+//  queue): every slot carries a sequence number telling whether
+//  it is ready to be written or read in the current lap, so
+//  producers and consumers only contend on their own end's index
+//  and never on each other's.
+//
+//  The blocking and timed variants spin briefly and then sleep;
+//  the mutex is only touched when somebody actually sleeps.
+//
+//  The capacity is rounded up to a power of two. Elements are
+//  move-assigned into and out of preallocated slots, so T must
+//  be default constructible; a popped slot keeps the moved-from
+//  value until it is reused.
+// ******************************************************************
+{
+public:     //  Class
+    static int const cache_line_size = 128;
+
+public:     //  Methods
+    explicit mpmc_queue( int capacity )
+    :   _capacity{round_up(capacity)},
+        _cells{ali::new_auto_ptr<cell[]>(_capacity)}
+    {
+        for ( int i = 0; i != _capacity; ++i )
+            _cells[i].sequence.store(
+                static_cast<ali::uint32>(i),
+                std::memory_order_relaxed);
+    }
+
+    int capacity( void ) const
+    {
+        return _capacity;
+    }
+
+    int size( void ) const
+        //  Approximate when other threads are active.
+    {
+        ali::int32 const n{static_cast<ali::int32>(
+            _push.value.load(std::memory_order_acquire)
+                - _pop.value.load(std::memory_order_acquire))};
+
+        return ali::maxi(0, ali::mini(n, _capacity));
+    }
+
+    bool is_empty( void ) const
+    {
+        return size() == 0;
+    }
+
+    //  Producers
+
+    template <typename U>
+    bool try_push( U&& value )
+        //  Returns false and leaves value untouched
+        //  if the queue is full.
+    {
+        if ( !push_slot(ali::forward<U>(value)) )
+            return false;
+
+        wake(_waiting_consumers, _not_empty, 1);
+
+        return true;
+    }
+
+    template <typename U>
+    void push( U&& value )
+        //  Blocks while the queue is full.
+    {
+        wait(_waiting_producers, _not_full,
+            [this, &value] { return push_slot(ali::forward<U>(value)); },
+            nullptr);
+
+        wake(_waiting_consumers, _not_empty, 1);
+    }
+
+    template <typename U>
+    bool push_for( U&& value, ali::time::milliseconds timeout )
+        //  Returns false and leaves value untouched if the queue
+        //  stayed full for the whole timeout.
+    {
+        deadline const d{std::chrono::steady_clock::now()
+            + std::chrono::milliseconds{timeout.value}};
+
+        if ( !wait(_waiting_producers, _not_full,
+                [this, &value] { return push_slot(ali::forward<U>(value)); },
+                &d) )
+            return false;
+
+        wake(_waiting_consumers, _not_empty, 1);
+
+        return true;
+    }
+
+    //  Consumers
+
+    bool try_pop( T& value )
+    {
+        return try_pop_bulk(array_ref<T>{&value, 1}) != 0;
+    }
+
+    int try_pop_bulk( array_ref<T> values )
+        //  Pops as many elements as are ready, up to
+        //  values.size(), in one step, and returns their number.
+    {
+        int const n{pop_slots(values)};
+
+        wake(_waiting_producers, _not_full, n);
+
+        return n;
+    }
+
+    void pop( T& value )
+        //  Blocks while the queue is empty.
+    {
+        wait(_waiting_consumers, _not_empty,
+            [this, &value] {
+                return pop_slots(array_ref<T>{&value, 1}) != 0; },
+            nullptr);
+
+        wake(_waiting_producers, _not_full, 1);
+    }
+
+    bool pop_for( T& value, ali::time::milliseconds timeout )
+        //  Returns false if the queue stayed empty
+        //  for the whole timeout.
+    {
+        deadline const d{std::chrono::steady_clock::now()
+            + std::chrono::milliseconds{timeout.value}};
+
+        if ( !wait(_waiting_consumers, _not_empty,
+                [this, &value] {
+                    return pop_slots(array_ref<T>{&value, 1}) != 0; },
+                &d) )
+            return false;
+
+        wake(_waiting_producers, _not_full, 1);
+
+        return true;
+    }
+
+    int pop_bulk( array_ref<T> values )
+        //  Blocks until at least one element is available,
+        //  then pops up to values.size() without waiting
+        //  for more.
+    {
+        ali_assert(!values.is_empty());
+
+        int n{};
+
+        wait(_waiting_consumers, _not_empty,
+            [this, values, &n] {
+                return (n = pop_slots(values)) != 0; },
+            nullptr);
+
+        wake(_waiting_producers, _not_full, n);
+
+        return n;
+    }
+
+    int pop_bulk_for( array_ref<T> values, ali::time::milliseconds timeout )
+    {
+        ali_assert(!values.is_empty());
+
+        deadline const d{std::chrono::steady_clock::now()
+            + std::chrono::milliseconds{timeout.value}};
+
+        int n{};
+
+        wait(_waiting_consumers, _not_empty,
+            [this, values, &n] {
+                return (n = pop_slots(values)) != 0; },
+            &d);
+
+        wake(_waiting_producers, _not_full, n);
+
+        return n;
+    }
+
+private:    //  Struct
+    using deadline = std::chrono::steady_clock::time_point;
+
+    struct cell
+    {
+        std::atomic<ali::uint32>    sequence{};
+        T                           value{};
+    };
+
+    struct alignas(cache_line_size) index
+    {
+        std::atomic<ali::uint32>    value{};
+    };
+
+private:    //  Methods
+    static int round_up( int capacity )
+    {
+        ali_assert(0 < capacity && capacity <= (1 << 30));
+
+        int c = 2;
+
+        while ( c < capacity )
+            c <<= 1;
+
+        return c;
+    }
+
+    ali::uint32 mask( void ) const
+    {
+        return static_cast<ali::uint32>(_capacity - 1);
+    }
+
+    template <typename U>
+    bool push_slot( U&& value )
+    {
+        ali::uint32 pos{_push.value.load(std::memory_order_relaxed)};
+
+        for ( ;; )
+        {
+            cell& c = _cells[pos & mask()];
+
+            ali::int32 const dif{static_cast<ali::int32>(
+                c.sequence.load(std::memory_order_acquire) - pos)};
+
+            if ( dif == 0 )
+            {
+                if ( _push.value.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed) )
+                {
+                    c.value = ali::forward<U>(value);
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    break;
+                }
+            }
+            else if ( dif < 0 )
+            {
+                return false;
+            }
+            else
+            {
+                pos = _push.value.load(std::memory_order_relaxed);
+            }
+        }
+
+        return true;
+    }
+
+    int pop_slots( array_ref<T> values )
+    {
+        if ( values.is_empty() )
+            return 0;
+
+        ali::uint32 pos{_pop.value.load(std::memory_order_relaxed)};
+        int n{};
+
+        for ( ;; )
+        {
+            //  Count the ready slots following pos; they cannot
+            //  change until somebody claims them by moving _pop.
+            n = 0;
+
+            while ( n != values.size() && ready(pos + n) == 0 )
+                ++n;
+
+            if ( n == 0 )
+            {
+                if ( ready(pos) < 0 )
+                    return 0;
+
+                //  Another consumer got ahead of us.
+                pos = _pop.value.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if ( _pop.value.compare_exchange_weak(
+                    pos, pos + n, std::memory_order_relaxed) )
+                break;
+        }
+
+        for ( int i = 0; i != n; ++i )
+        {
+            cell& c = _cells[(pos + i) & mask()];
+
+            values[i] = ali::move(c.value);
+            c.sequence.store(
+                pos + i + _capacity,
+                std::memory_order_release);
+        }
+
+        return n;
+    }
+
+    ali::int32 ready( ali::uint32 pos ) const
+        //  0 when the slot at pos holds an element
+        //  for this lap, < 0 when it is still empty.
+    {
+        return static_cast<ali::int32>(
+            _cells[pos & mask()].sequence.load(
+                std::memory_order_acquire) - (pos + 1));
+    }
+
+    void wake(
+        std::atomic<int>& waiting,
+        std::condition_variable& cv,
+        int n )
+        //  n elements (or slots) became available.
+    {
+        if ( n == 0 )
+            return;
+
+        //  Pairs with the fence in wait(), so that either the
+        //  sleeper sees our change or we see the sleeper.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if ( waiting.load(std::memory_order_relaxed) != 0 )
+        {
+            std::lock_guard<std::mutex> const lock{_mutex};
+
+            if ( n == 1 )
+                cv.notify_one();
+            else
+                cv.notify_all();
+        }
+    }
+
+    template <typename Attempt>
+    bool wait(
+        std::atomic<int>& waiting,
+        std::condition_variable& cv,
+        Attempt attempt,
+        deadline const* d )
+    {
+        for ( int spin = 0; spin != 64; ++spin )
+            if ( attempt() )
+                return true;
+
+        std::unique_lock<std::mutex> lock{_mutex};
+
+        waiting.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool done{};
+
+        for ( ;; )
+        {
+            if ( (done = attempt()) )
+                break;
+
+            if ( d == nullptr )
+                cv.wait(lock);
+            else if ( cv.wait_until(lock, *d) == std::cv_status::timeout )
+            {
+                done = attempt();
+                break;
+            }
+        }
+
+        waiting.fetch_sub(1, std::memory_order_relaxed);
+
+        return done;
+    }
+
+private:    //  Data members
+    int                         _capacity;
+    ali::auto_ptr<cell[]>       _cells;
+    index                       _push{};
+    index                       _pop{};
+    std::atomic<int>            _waiting_producers{};
+    std::atomic<int>            _waiting_consumers{};
+    std::mutex                  _mutex{};
+    std::condition_variable     _not_empty{};
+    std::condition_variable     _not_full{};
+};
+
+}   //  namespace ali
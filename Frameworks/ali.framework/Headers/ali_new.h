@@ -27,6 +27,9 @@ void operator delete[]( void* p );
 #ifdef ALI_TRACEMEMORY
 
 #include "ali/ali_location.h"
+#include "ali/ali_memory_profiler.h"
+
+#define ALI_IF_TRACEMEMORY(...) __VA_ARGS__
 
 namespace ali
 {
@@ -43,9 +46,9 @@ void set_new_info( void* p, unsigned size, const ali::location &loc );
 // ~~~ operator* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //
 template <class T>
-T* operator<<( const ali::location &loc, T* p )
+T* operator<<( const ali::location &, T* p )
 {
-    ali::set_new_info(p, sizeof(T), info.file, info.line);
+    ali::memory_profiler::allocated(p, sizeof(T));
     return p;
 }
 
@@ -59,6 +62,10 @@ T* operator<<( const ali::location &loc, T* p )
 //#define new (ALI_HERE << (new))
 
 
+#else   //  !ALI_TRACEMEMORY
+
+#define ALI_IF_TRACEMEMORY(...)
+
 #endif // ALI_TRACEMEMORY
 
 
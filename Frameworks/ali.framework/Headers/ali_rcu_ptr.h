@@ -0,0 +1,235 @@
+/*
+ *  ali_rcu_ptr.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_debug.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_shared_ptr_intrusive.h"
+#include "ali/ali_utility.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace ali
+{
+
+// ******************************************************************
+template <typename T>
+class rcu_ptr : public ali::noncopyable
+// ******************************************************************
+//  Read-copy-update cell holding an immutable T.
+//
+//  Readers call load() and get a reference-counted snapshot
+//  they may keep as long as they like; it never changes under
+//  them. Writers build a complete new value and publish it with
+//  store() or update(); readers see either the old or the new
+//  value, never anything in between.
+//
+//      ali::rcu_ptr<config> _config;
+//
+//      //  Any thread, never blocks.
+//      ali::rcu_ptr<config>::snapshot const c{_config.load()};
+//      use(c->timeout);
+//
+//      //  Writer.
+//      _config.update([] ( config& c ) { c.timeout = 30; });
+//
+//  Readers only touch a few atomic counters. Writers are
+//  serialized and, after publishing, wait for readers that are
+//  in the middle of load() to take their reference; the old value
+//  is destroyed when its last snapshot goes away.
+// ******************************************************************
+{
+    struct node;
+
+public:     //  Class
+    // **************************************************************
+    class snapshot
+    // **************************************************************
+    {
+    public:
+        snapshot( void ) = default;
+
+        T const& operator*( void ) const
+        {
+            ali_assert(!is_null());
+            return _node->value;
+        }
+
+        T const* operator->( void ) const
+        {
+            ali_assert(!is_null());
+            return &_node->value;
+        }
+
+        T const* get( void ) const
+        {
+            return is_null() ? nullptr : &_node->value;
+        }
+
+        bool is_null( void ) const
+        {
+            return _node.is_null();
+        }
+
+        ali::int64 version( void ) const
+            //  0 for a null snapshot, otherwise increases
+            //  by one with every store into the cell.
+        {
+            return is_null() ? 0 : _node->version;
+        }
+
+    private:
+        explicit snapshot( node const* n )
+        :   _node{n}
+        {}
+
+    private:    //  Data members
+        ali::shared_ptr_intrusive<node const>   _node{};
+
+        friend class rcu_ptr;
+    };
+
+public:     //  Methods
+    rcu_ptr( void ) = default;
+
+    explicit rcu_ptr( T value )
+    {
+        store(ali::move(value));
+    }
+
+    ~rcu_ptr( void )
+    {
+        if ( node const* const n = _current.load() )
+            n->release();
+    }
+
+    snapshot load( void ) const
+        //  Lock-free.
+    {
+        for ( ;; )
+        {
+            ali::int64 const epoch{_epoch.load()};
+            std::atomic<int>& readers = _readers[epoch & 1].value;
+
+            readers.fetch_add(1);
+
+            if ( _epoch.load() != epoch )
+            {
+                //  A writer flipped the epoch meanwhile and may
+                //  not wait for us; start over on the new one.
+                readers.fetch_sub(1);
+                continue;
+            }
+
+            snapshot s{_current.load()};
+
+            readers.fetch_sub(1);
+
+            return s;
+        }
+    }
+
+    ali::int64 store( T value )
+        //  Returns the version of the published value.
+    {
+        std::lock_guard<std::mutex> const lock{_write_mutex};
+
+        return publish(ali::move(value));
+    }
+
+    template <typename Mutate>
+    ali::int64 update( Mutate mutate )
+        //  Copies the current value (or starts from
+        //  a default-constructed one if there is none),
+        //  lets mutate modify the copy and publishes it.
+        //  Concurrent updates are serialized, none is lost.
+    {
+        std::lock_guard<std::mutex> const lock{_write_mutex};
+
+        node const* const n{_current.load()};
+
+        T value{n != nullptr ? n->value : T{}};
+
+        mutate(value);
+
+        return publish(ali::move(value));
+    }
+
+    ali::int64 version( void ) const
+    {
+        node const* const n{_current.load()};
+        return n != nullptr ? n->version : 0;
+    }
+
+private:    //  Struct
+    struct node
+    {
+        node( T&& value, ali::int64 version )
+        :   value{ali::move(value)},
+            version{version}
+        {}
+
+        void retain( void ) const
+        {
+            refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release( void ) const
+        {
+            if ( refs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+                ali::delete_scalar(const_cast<node*>(this));
+        }
+
+        T const                     value;
+        ali::int64 const            version;
+        mutable std::atomic<int>    refs{1};
+            //  One held by the cell while current.
+    };
+
+    struct alignas(128) reader_count
+    {
+        std::atomic<int>    value{};
+    };
+
+private:    //  Methods
+    ali::int64 publish( T&& value )
+        //  Must hold _write_mutex.
+    {
+        node const* const n{_current.load()};
+
+        ali::int64 const version{n != nullptr ? n->version + 1 : 1};
+
+        node const* const old{_current.exchange(
+            ali::new_auto_ptr<node>(ali::move(value), version).release())};
+
+        //  Readers that entered load() before the flip may
+        //  still be about to take a reference to old;
+        //  wait for them before dropping the cell's one.
+        ali::int64 const epoch{_epoch.fetch_add(1)};
+
+        while ( _readers[epoch & 1].value.load() != 0 )
+            std::this_thread::yield();
+
+        if ( old != nullptr )
+            old->release();
+
+        return version;
+    }
+
+private:    //  Data members
+    std::atomic<node const*>    _current{};
+    std::atomic<ali::int64>     _epoch{};
+    mutable reader_count        _readers[2]{};
+    std::mutex                  _write_mutex{};
+};
+
+}   //  namespace ali
@@ -4,6 +4,7 @@
 #include "ali/ali_attribute.h"
 #include "ali/ali_auto_ptr.h"
 #include "ali/ali_in_place_buffer.h"
+#include "ali/ali_slab_pool.h"
 
 namespace ali
 {
@@ -29,15 +30,19 @@ public:
     void inc_strong_ref( void )
     {
         ALI_IF_DEBUG(auto const rc =)
-            _strong_ref.inc();
+            _strong_ref.inc(std::memory_order_relaxed);
         ali_assert(rc > 1);
     }
 
     bool inc_strong_ref_if_not_zero( void )
     {
-        for ( auto count = _strong_ref.get(); count != 0; )
+        for ( auto count = _strong_ref.get(std::memory_order_relaxed);
+              count != 0; )
         {
-            if ( _strong_ref.compare_exchange(count, count + 1) )
+            if ( _strong_ref.compare_exchange(
+                    count, count + 1,
+                    std::memory_order_acq_rel,
+                    std::memory_order_relaxed) )
                 return true;
             //  Here, count contains the new "initial" value.
         }
@@ -47,7 +52,7 @@ public:
 
     void dec_strong_ref( void )
     {
-        auto const rc = _strong_ref.dec();
+        auto const rc = _strong_ref.dec(std::memory_order_acq_rel);
 
         ali_assert(rc >= 0);
 
@@ -62,13 +67,13 @@ public:
     void inc_weak_ref( void )
     {
         ALI_IF_DEBUG(auto const rc =)
-            _weak_ref.inc();
+            _weak_ref.inc(std::memory_order_relaxed);
         ali_assert(rc > 1);
     }
 
     void dec_weak_ref( void )
     {
-        auto const rc = _weak_ref.dec();
+        auto const rc = _weak_ref.dec(std::memory_order_acq_rel);
 
         ali_assert(rc >= 0);
 
@@ -163,6 +168,35 @@ private:    //  Data members
 // ******************************************************************
 // ******************************************************************
 
+// ******************************************************************
+template <typename T>
+class pooled_shared_info : public in_place_shared_info<T>
+// ******************************************************************
+//  Allocated from ali::slab_pool. The deleting destructor is
+//  virtual, so the block goes back to the pool it came from
+//  whichever code releases the last reference.
+// ******************************************************************
+{
+    static_assert(alignof(T) <= slab_pool::granularity,
+        "slab_pool blocks are not aligned for T");
+
+public:
+    using in_place_shared_info<T>::in_place_shared_info;
+
+    static void* operator new( size_t size )
+    {
+        return slab_pool::instance().allocate(static_cast<int>(size));
+    }
+
+    static void operator delete( void* p, size_t size ) noexcept
+    {
+        slab_pool::instance().deallocate(p, static_cast<int>(size));
+    }
+};
+
+// ******************************************************************
+// ******************************************************************
+
 }   //  namespace hidden
 
 // ******************************************************************
@@ -571,6 +605,10 @@ private:    // Data members
 
     template <typename U, typename... Params>
     friend shared_ptr<U> new_shared_ptr( Params&&... params );
+
+    template <typename U, typename... Params>
+    friend shared_ptr<U> new_shared_ptr(
+        slab_pooled_t, Params&&... params );
 };
 
 // ******************************************************************
@@ -869,6 +907,20 @@ inline ali::shared_ptr<T> new_shared_ptr( Params&&... params )
             ali::forward<Params>(params)...)};
 }
 
+// ******************************************************************
+template <typename T, typename... Params>
+inline ali::shared_ptr<T> new_shared_ptr(
+    slab_pooled_t, Params&&... params )
+// ******************************************************************
+//  See ali::slab_pooled.
+// ******************************************************************
+{
+    return ali::shared_ptr<T>{
+        ali::auto_ptr<hidden::in_place_shared_info<T>>{
+            new_auto_ptr<hidden::pooled_shared_info<T>>(
+                ali::forward<Params>(params)...)}};
+}
+
 // ******************************************************************
 // ******************************************************************
 
@@ -0,0 +1,305 @@
+/*
+ *  ali_slab_pool.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_debug.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include <atomic>
+#include <new>
+
+namespace ali
+{
+
+// ******************************************************************
+class slab_pool : public ali::noncopyable
+// ******************************************************************
+//  Size-class allocator for small, frequently created objects.
+//
+//  Each size class carves fixed-size blocks out of large slabs.
+//  Every thread keeps a small cache of free blocks per class and
+//  exchanges them with the shared free list in batches, so the
+//  common allocate/deallocate path touches no shared state.
+//
+//  Slabs are never returned to the system; the pool only grows
+//  to the peak number of live objects.
+// ******************************************************************
+{
+public:     //  Class
+    static int const granularity = 16;
+    static int const max_size = 512;
+    static int const class_count = 16;
+    static int const slab_size = 16 * 1024;
+    static int const batch_size = 32;
+
+    // **************************************************************
+    struct statistics
+    // **************************************************************
+    {
+        int         block_size{};
+        ali::int64  allocations{};
+        ali::int64  deallocations{};
+        ali::int64  slabs{};
+        ali::int64  blocks{};
+            //  Blocks carved from slabs so far.
+
+        ali::int64 live( void ) const
+        {
+            return allocations - deallocations;
+        }
+    };
+
+public:     //  Methods
+    static slab_pool& instance( void )
+    {
+        //  Intentionally leaked, thread caches may be flushed
+        //  after static destructors have run.
+        static slab_pool* const pool{new slab_pool};
+        return *pool;
+    }
+
+    static int class_of( int size )
+        //  Returns -1 if the size is not pooled.
+    {
+        ali_assert(size > 0);
+
+        if ( size <= 128 )
+            return (size - 1) / 16;
+        else if ( size <= 256 )
+            return 8 + (size - 129) / 32;
+        else if ( size <= max_size )
+            return 12 + (size - 257) / 64;
+        else
+            return -1;
+    }
+
+    static int block_size_of( int idx )
+    {
+        ali_assert(0 <= idx && idx < class_count);
+
+        return idx < 8 ? (idx + 1) * 16
+            : idx < 12 ? 128 + (idx - 7) * 32
+            : 256 + (idx - 11) * 64;
+    }
+
+    void* allocate( int size )
+    {
+        int const idx{class_of(size)};
+
+        if ( idx < 0 )
+        {
+            _heap_allocations.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(size);
+        }
+
+        _classes[idx].allocations.fetch_add(
+            1, std::memory_order_relaxed);
+
+        thread_cache& cache = local_cache();
+
+        if ( cache.heads[idx] == nullptr )
+            refill(cache, idx);
+
+        free_block* const b{cache.heads[idx]};
+
+        cache.heads[idx] = b->next;
+        --cache.counts[idx];
+
+        return b;
+    }
+
+    void deallocate( void* p, int size ) noexcept
+    {
+        if ( p == nullptr )
+            return;
+
+        int const idx{class_of(size)};
+
+        if ( idx < 0 )
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        _classes[idx].deallocations.fetch_add(
+            1, std::memory_order_relaxed);
+
+        thread_cache& cache = local_cache();
+
+        free_block* const b{static_cast<free_block*>(p)};
+
+        b->next = cache.heads[idx];
+        cache.heads[idx] = b;
+
+        if ( ++cache.counts[idx] > 2 * batch_size )
+            drain(cache, idx, batch_size);
+    }
+
+    statistics stats( int idx ) const
+    {
+        ali_assert(0 <= idx && idx < class_count);
+
+        size_class const& c = _classes[idx];
+
+        statistics s{};
+        s.block_size = block_size_of(idx);
+        s.allocations = c.allocations.load(std::memory_order_relaxed);
+        s.deallocations = c.deallocations.load(std::memory_order_relaxed);
+        s.slabs = c.slabs.load(std::memory_order_relaxed);
+        s.blocks = c.blocks.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    ali::int64 heap_allocations( void ) const
+        //  Requests too large to be pooled.
+    {
+        return _heap_allocations.load(std::memory_order_relaxed);
+    }
+
+private:    //  Struct
+    struct free_block
+    {
+        free_block* next;
+    };
+
+    struct size_class
+    {
+        std::atomic_flag        lock = ATOMIC_FLAG_INIT;
+        free_block*             head{};
+        ali::uint8*             carve{};
+        int                     carve_left{};
+        std::atomic<ali::int64> allocations{};
+        std::atomic<ali::int64> deallocations{};
+        std::atomic<ali::int64> slabs{};
+        std::atomic<ali::int64> blocks{};
+    };
+
+    struct thread_cache
+    {
+        ~thread_cache( void )
+        {
+            for ( int i = 0; i != class_count; ++i )
+                slab_pool::instance().drain(*this, i, counts[i]);
+        }
+
+        free_block* heads[class_count]{};
+        int         counts[class_count]{};
+    };
+
+    class lock_guard
+    {
+    public:
+        explicit lock_guard( std::atomic_flag& flag )
+        :   _flag(flag)
+        {
+            while ( _flag.test_and_set(std::memory_order_acquire) )
+                ;
+        }
+
+        ~lock_guard( void )
+        {
+            _flag.clear(std::memory_order_release);
+        }
+
+    private:
+        std::atomic_flag&   _flag;
+    };
+
+private:    //  Methods
+    slab_pool( void ) {}
+
+    static thread_cache& local_cache( void )
+    {
+        static thread_local thread_cache cache{};
+        return cache;
+    }
+
+    void refill( thread_cache& cache, int idx )
+    {
+        size_class& c = _classes[idx];
+        int const block_size{block_size_of(idx)};
+
+        lock_guard const lock{c.lock};
+
+        for ( int i = 0; i != batch_size; ++i )
+        {
+            free_block* b{c.head};
+
+            if ( b != nullptr )
+            {
+                c.head = b->next;
+            }
+            else
+            {
+                if ( c.carve_left == 0 )
+                {
+                    c.carve = static_cast<ali::uint8*>(
+                        ::operator new(slab_size));
+                    c.carve_left = slab_size / block_size;
+                    c.slabs.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                b = reinterpret_cast<free_block*>(c.carve);
+                c.carve += block_size;
+                --c.carve_left;
+                c.blocks.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            b->next = cache.heads[idx];
+            cache.heads[idx] = b;
+            ++cache.counts[idx];
+        }
+    }
+
+    void drain( thread_cache& cache, int idx, int n ) noexcept
+    {
+        if ( n == 0 )
+            return;
+
+        size_class& c = _classes[idx];
+
+        lock_guard const lock{c.lock};
+
+        for ( ; n != 0; --n )
+        {
+            free_block* const b{cache.heads[idx]};
+
+            cache.heads[idx] = b->next;
+            --cache.counts[idx];
+
+            b->next = c.head;
+            c.head = b;
+        }
+    }
+
+private:    //  Data members
+    size_class              _classes[class_count];
+    std::atomic<ali::int64> _heap_allocations{};
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+struct slab_pooled_t {};
+// ******************************************************************
+//  Makes ali::new_shared_ptr put the object and its control block
+//  in one block from ali::slab_pool:
+//
+//      auto node = ali::new_shared_ptr<tree_node>(
+//          ali::slab_pooled, key, value);
+//
+//  Only the code instantiating it uses the pool; objects the
+//  prebuilt libraries allocate are not affected. Keep it to types
+//  the caller's own code creates.
+// ******************************************************************
+
+constexpr slab_pooled_t slab_pooled{};
+
+}   //  namespace ali
@@ -0,0 +1,319 @@
+/*
+ *  ali_spsc_ring.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_array_utils.h"
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_debug.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_utility.h"
+#include <atomic>
+
+namespace ali
+{
+
+namespace hidden
+{
+
+// ******************************************************************
+template <typename T, int _capacity>
+class spsc_ring_storage
+// ******************************************************************
+{
+public:
+    ali_static_assert(_capacity > 0);
+    ali_static_assert((_capacity & (_capacity - 1)) == 0);
+        //  Must be a power of two.
+
+    T* begin( void )
+    {
+        return _begin;
+    }
+
+    static int capacity( void )
+    {
+        return _capacity;
+    }
+
+private:    //  Data members
+    T   _begin[_capacity];
+};
+
+// ******************************************************************
+template <typename T>
+class spsc_ring_storage<T, 0>
+// ******************************************************************
+{
+public:
+    explicit spsc_ring_storage( int capacity )
+        //  Rounded up to the nearest power of two.
+    :   _capacity{round_up(capacity)},
+        _begin{ali::new_auto_ptr<T[]>(_capacity)}
+    {}
+
+    T* begin( void )
+    {
+        return _begin.get();
+    }
+
+    int capacity( void ) const
+    {
+        return _capacity;
+    }
+
+private:    //  Methods
+    static int round_up( int capacity )
+    {
+        ali_assert(0 < capacity && capacity <= (1 << 30));
+
+        int c = 1;
+
+        while ( c < capacity )
+            c <<= 1;
+
+        return c;
+    }
+
+private:    //  Data members
+    int                 _capacity;
+    ali::auto_ptr<T[]>  _begin;
+};
+
+}   //  namespace hidden
+
+// ******************************************************************
+template <typename T, int _capacity = 0>
+class spsc_ring : private hidden::spsc_ring_storage<T, _capacity>
+// ******************************************************************
+//  Wait-free queue for exactly one producer thread and exactly
+//  one consumer thread, e.g. a real-time audio callback handing
+//  samples to an analytics thread.
+//
+//  Unlike circular_buffer, both ends may run concurrently:
+//  the indices are published with release and observed with
+//  acquire semantics and live on separate cache lines, so neither
+//  side ever blocks or bounces the other's line on the fast path.
+//
+//  The capacity is a power of two (rounded up for the dynamic
+//  variant) so positions wrap with a mask.
+//
+//  Both ends expose their free/filled region as at most two
+//  contiguous spans, so data can be produced or consumed in place:
+//
+//      ali::spsc_ring<short>::spans const s{ring.write_spans()};
+//      n = fill(s.first);
+//      if ( n == s.first.size() ) n += fill(s.second);
+//      ring.produce(n);
+//
+//  Elements are not destroyed on consume; they are overwritten
+//  by later writes.
+// ******************************************************************
+{
+    using storage = hidden::spsc_ring_storage<T, _capacity>;
+
+public:     //  Class
+    static int const cache_line_size = 128;
+        //  Large enough for both 64 and 128 byte lines
+        //  (Apple arm64 cores use the latter).
+
+    // **************************************************************
+    struct spans
+    // **************************************************************
+    {
+        array_ref<T>    first{};
+        array_ref<T>    second{};
+
+        int size( void ) const
+        {
+            return first.size() + second.size();
+        }
+
+        bool is_empty( void ) const
+        {
+            return first.is_empty();
+        }
+    };
+
+public:     //  Methods
+    using storage::storage;
+
+    spsc_ring( spsc_ring const& ) = delete;
+    spsc_ring& operator=( spsc_ring const& ) = delete;
+
+    using storage::capacity;
+
+    int size( void ) const
+        //  Exact only when called from either end's thread;
+        //  may be stale by the time it returns.
+    {
+        return static_cast<int>(
+            _write.value.load(std::memory_order_acquire)
+                - _read.value.load(std::memory_order_acquire));
+    }
+
+    bool is_empty( void ) const
+    {
+        return size() == 0;
+    }
+
+    //  Producer
+
+    spans write_spans( void )
+        //  Returns all currently free space.
+    {
+        ali::uint32 const w{_write.value.load(std::memory_order_relaxed)};
+
+        _write.cached = _read.value.load(std::memory_order_acquire);
+
+        return make_spans(w, capacity() - static_cast<int>(
+            w - _write.cached));
+    }
+
+    spsc_ring& produce( int n )
+        //  Publishes n elements written into write_spans().
+    {
+        ali::uint32 const w{_write.value.load(std::memory_order_relaxed)};
+
+        ali_assert(0 <= n);
+        ali_assert(n <= capacity() - static_cast<int>(w - _write.cached));
+
+        _write.value.store(w + n, std::memory_order_release);
+
+        return *this;
+    }
+
+    bool try_push_back( T const& t )
+    {
+        ali::uint32 const w{_write.value.load(std::memory_order_relaxed)};
+
+        if ( static_cast<int>(w - _write.cached) == capacity() )
+        {
+            _write.cached = _read.value.load(std::memory_order_acquire);
+
+            if ( static_cast<int>(w - _write.cached) == capacity() )
+                return false;
+        }
+
+        this->begin()[w & mask()] = t;
+
+        _write.value.store(w + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    int write( array_const_ref<T> data )
+        //  Copies as much of data as fits and returns
+        //  the number of elements written.
+    {
+        spans const s{write_spans()};
+
+        int const n{ali::mini(data.size(), s.size())};
+        int const n1{ali::mini(n, s.first.size())};
+
+        s.first.copy(0, data.ref(0, n1));
+        s.second.copy(0, data.ref(n1, n - n1));
+
+        produce(n);
+
+        return n;
+    }
+
+    //  Consumer
+
+    spans read_spans( void )
+        //  Returns all currently available elements.
+    {
+        ali::uint32 const r{_read.value.load(std::memory_order_relaxed)};
+
+        _read.cached = _write.value.load(std::memory_order_acquire);
+
+        return make_spans(r, static_cast<int>(_read.cached - r));
+    }
+
+    spsc_ring& consume( int n )
+        //  Releases n elements obtained from read_spans().
+    {
+        ali::uint32 const r{_read.value.load(std::memory_order_relaxed)};
+
+        ali_assert(0 <= n);
+        ali_assert(n <= static_cast<int>(_read.cached - r));
+
+        _read.value.store(r + n, std::memory_order_release);
+
+        return *this;
+    }
+
+    bool try_pop_front( T& t )
+    {
+        ali::uint32 const r{_read.value.load(std::memory_order_relaxed)};
+
+        if ( _read.cached == r )
+        {
+            _read.cached = _write.value.load(std::memory_order_acquire);
+
+            if ( _read.cached == r )
+                return false;
+        }
+
+        t = this->begin()[r & mask()];
+
+        _read.value.store(r + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    int read( array_ref<T> data )
+        //  Copies up to data.size() elements out and returns
+        //  the number of elements read.
+    {
+        spans const s{read_spans()};
+
+        int const n{ali::mini(data.size(), s.size())};
+        int const n1{ali::mini(n, s.first.size())};
+
+        data.copy(0, s.first.ref(0, n1));
+        data.copy(n1, s.second.ref(0, n - n1));
+
+        consume(n);
+
+        return n;
+    }
+
+private:    //  Struct
+    struct alignas(cache_line_size) index
+    {
+        std::atomic<ali::uint32>    value{};
+            //  Owned (written) by one end, read by the other.
+        ali::uint32                 cached{};
+            //  Owner's last observation of the other end's index,
+            //  refreshed only when it appears to limit progress.
+    };
+
+private:    //  Methods
+    ali::uint32 mask( void ) const
+    {
+        return static_cast<ali::uint32>(capacity() - 1);
+    }
+
+    spans make_spans( ali::uint32 pos, int n )
+    {
+        int const offset{static_cast<int>(pos & mask())};
+        int const n1{ali::mini(n, capacity() - offset)};
+
+        return spans{
+            array_ref<T>{this->begin() + offset, n1},
+            array_ref<T>{this->begin(), n - n1}};
+    }
+
+private:    //  Data members
+    index   _write{};
+    index   _read{};
+};
+
+}   //  namespace ali
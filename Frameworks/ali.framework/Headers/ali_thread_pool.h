@@ -0,0 +1,476 @@
+/*
+ *  ali_thread_pool.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_auto_ptr.h"
+#include "ali/ali_callback.h"
+#include "ali/ali_debug.h"
+#include "ali/ali_handle.h"
+#include "ali/ali_integer.h"
+#include "ali/ali_noncopyable.h"
+#include "ali/ali_utility.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace ali
+{
+
+// ******************************************************************
+struct task_priority
+// ******************************************************************
+{
+    enum type
+    {
+        background,
+            //  Log flushing, indexing, cleanup.
+        normal,
+        high
+            //  Work somebody is waiting for, e.g. a query
+            //  whose result is about to be displayed.
+    };
+
+    static int const count = 3;
+
+    task_priority( type value )
+    :   value{value}
+    {}
+
+    type value;
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+class thread_pool : public ali::noncopyable
+// ******************************************************************
+//  Work-stealing executor meant to be shared by all background
+//  work (archive writing, indexing, history queries, log
+//  flushing) instead of each subsystem spawning its own threads.
+//
+//  Every worker owns one deque per priority. Tasks submitted
+//  from a worker go to the back of its own deque and are taken
+//  from there LIFO; tasks submitted from other threads are spread
+//  round-robin. An idle worker steals from the front of the other
+//  workers' deques. Higher priorities are always drained, locally
+//  and by stealing, before lower ones are looked at.
+//
+//  submit returns an ali::handle; destroying it cancels the task
+//  if it has not started yet, or waits for it to finish if it is
+//  running on another thread. This makes it safe for the task to
+//  reference the owner of the handle:
+//
+//      _pending = ali::thread_pool::shared().submit(
+//          [this] { rebuild_index(); },
+//          ali::task_priority::background);
+//
+//  Tasks must not block on other tasks of the same pool, and
+//  handles must not outlive the pool that issued them.
+// ******************************************************************
+{
+public:     //  Class
+    using task_function = ali::unique_callback<void( void )>;
+
+    // **************************************************************
+    struct statistics
+    // **************************************************************
+    {
+        ali::int64  submitted{};
+        ali::int64  executed{};
+        ali::int64  cancelled{};
+        ali::int64  stolen{};
+            //  Executed by a worker other than the one
+            //  it was queued on.
+    };
+
+public:     //  Methods
+    explicit thread_pool( int workers = 0 )
+        //  0 means one worker per core.
+    :   _size{workers > 0 ? workers : default_size()},
+        _workers{ali::new_auto_ptr<worker[]>(_size)}
+    {
+        for ( int i = 0; i != _size; ++i )
+            _workers[i].thread = std::thread{
+                [this, i] { run(i); }};
+    }
+
+    ~thread_pool( void )
+        //  Tasks that have not started are cancelled.
+    {
+        {
+            std::lock_guard<std::mutex> const lock{_mutex};
+            _stopping.store(true);
+        }
+
+        _wake.notify_all();
+
+        for ( int i = 0; i != _size; ++i )
+            _workers[i].thread.join();
+
+        for ( int i = 0; i != _size; ++i )
+            for ( int p = 0; p != task_priority::count; ++p )
+                while ( task* const t = _workers[i].queues[p].pop_back() )
+                {
+                    int pending{task::pending};
+
+                    if ( t->state.compare_exchange_strong(
+                            pending, task::cancelled) )
+                        _cancelled.fetch_add(1, std::memory_order_relaxed);
+
+                    t->release();
+                }
+    }
+
+    static thread_pool& shared( void )
+        //  Sized to the core count. Intentionally leaked,
+        //  so that it outlives every static object using it.
+    {
+        static thread_pool* const pool{new thread_pool};
+        return *pool;
+    }
+
+    int size( void ) const
+    {
+        return _size;
+    }
+
+    ali::auto_ptr<ali::handle> submit(
+        task_function fun,
+        task_priority priority = task_priority::normal )
+    {
+        task* const t{ali::new_auto_ptr<task>(
+            ali::move(fun), 2).release()};
+
+        enqueue(t, priority);
+
+        return ali::new_auto_ptr<task_handle>(*this, t);
+    }
+
+    void post(
+        task_function fun,
+        task_priority priority = task_priority::normal )
+        //  Fire and forget; cannot be cancelled.
+    {
+        enqueue(ali::new_auto_ptr<task>(
+            ali::move(fun), 1).release(), priority);
+    }
+
+    bool is_worker_thread( void ) const
+    {
+        return current().pool == this;
+    }
+
+    statistics stats( void ) const
+    {
+        statistics s{};
+        s.submitted = _submitted.load(std::memory_order_relaxed);
+        s.executed = _executed.load(std::memory_order_relaxed);
+        s.cancelled = _cancelled.load(std::memory_order_relaxed);
+        s.stolen = _stolen.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:    //  Struct
+    struct task
+    {
+        enum : int { pending, running, done, cancelled };
+
+        task( task_function fun, int refs )
+        :   fun{ali::move(fun)},
+            refs{refs}
+        {}
+
+        void release( void )
+        {
+            if ( refs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+                ali::delete_scalar(this);
+        }
+
+        task_function       fun;
+        std::atomic<int>    refs;
+        std::atomic<int>    state{pending};
+        std::atomic<bool>   awaited{false};
+    };
+
+    class task_deque
+    {
+    public:
+        task_deque( void ) {}
+
+        task_deque( task_deque const& ) = delete;
+        task_deque& operator=( task_deque const& ) = delete;
+
+        void push_back( task* t )
+        {
+            if ( _size == _capacity )
+                grow();
+
+            _begin[(_head + _size) & (_capacity - 1)] = t;
+            ++_size;
+        }
+
+        task* pop_back( void )
+        {
+            if ( _size == 0 )
+                return nullptr;
+
+            --_size;
+            return _begin[(_head + _size) & (_capacity - 1)];
+        }
+
+        task* pop_front( void )
+        {
+            if ( _size == 0 )
+                return nullptr;
+
+            task* const t{_begin[_head]};
+            _head = (_head + 1) & (_capacity - 1);
+            --_size;
+            return t;
+        }
+
+    private:
+        void grow( void )
+        {
+            int const capacity{_capacity == 0 ? 16 : 2 * _capacity};
+
+            ali::auto_ptr<task*[]> b{
+                ali::new_auto_ptr<task*[]>(capacity)};
+
+            for ( int i = 0; i != _size; ++i )
+                b[i] = _begin[(_head + i) & (_capacity - 1)];
+
+            _begin = ali::move(b);
+            _capacity = capacity;
+            _head = 0;
+        }
+
+    private:
+        ali::auto_ptr<task*[]>  _begin{};
+        int                     _capacity{};
+        int                     _head{};
+        int                     _size{};
+    };
+
+    struct alignas(128) worker
+    {
+        class lock_guard
+        {
+        public:
+            explicit lock_guard( worker& w )
+            :   _flag(w.lock)
+            {
+                while ( _flag.test_and_set(std::memory_order_acquire) )
+                    std::this_thread::yield();
+            }
+
+            ~lock_guard( void )
+            {
+                _flag.clear(std::memory_order_release);
+            }
+
+        private:
+            std::atomic_flag&   _flag;
+        };
+
+        std::atomic_flag    lock = ATOMIC_FLAG_INIT;
+        task_deque          queues[task_priority::count];
+        std::thread         thread{};
+    };
+
+    struct context
+    {
+        thread_pool const*  pool;
+        int                 index;
+        task const*         running;
+    };
+
+    class task_handle : public ali::handle
+    {
+    public:
+        task_handle( thread_pool& pool, task* t )
+        :   _pool(pool),
+            _task{t}
+        {}
+
+        virtual ~task_handle( void ) override
+        {
+            _pool.cancel_or_wait(_task);
+        }
+
+    private:
+        thread_pool&    _pool;
+        task*           _task;
+    };
+
+private:    //  Methods
+    static int default_size( void )
+    {
+        return ali::maxi(1, static_cast<int>(
+            std::thread::hardware_concurrency()));
+    }
+
+    static context& current( void )
+    {
+        static thread_local context c{};
+        return c;
+    }
+
+    void enqueue( task* t, task_priority priority )
+    {
+        context const& c = current();
+
+        int const i{c.pool == this
+            ? c.index
+            : static_cast<int>(
+                _next.fetch_add(1, std::memory_order_relaxed)
+                    % static_cast<unsigned>(_size))};
+
+        {
+            worker::lock_guard const lock{_workers[i]};
+            _workers[i].queues[priority.value].push_back(t);
+        }
+
+        _submitted.fetch_add(1, std::memory_order_relaxed);
+
+        //  Pairs with the check in run(), so that either the
+        //  sleeper sees the task or we see the sleeper.
+        _queued.fetch_add(1);
+
+        if ( _sleeping.load() != 0 )
+        {
+            std::lock_guard<std::mutex> const lock{_mutex};
+            _wake.notify_one();
+        }
+    }
+
+    task* find_task( int self )
+    {
+        for ( int p = task_priority::count - 1; p >= 0; --p )
+        {
+            {
+                worker::lock_guard const lock{_workers[self]};
+
+                if ( task* const t = _workers[self].queues[p].pop_back() )
+                    return t;
+            }
+
+            for ( int k = 1; k != _size; ++k )
+            {
+                worker& victim = _workers[(self + k) % _size];
+
+                worker::lock_guard const lock{victim};
+
+                if ( task* const t = victim.queues[p].pop_front() )
+                {
+                    _stolen.fetch_add(1, std::memory_order_relaxed);
+                    return t;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    void run( int self )
+    {
+        context& c = current();
+        c.pool = this;
+        c.index = self;
+
+        while ( !_stopping.load(std::memory_order_relaxed) )
+        {
+            if ( task* const t = find_task(self) )
+            {
+                _queued.fetch_sub(1, std::memory_order_relaxed);
+                execute(c, t);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock{_mutex};
+
+            if ( _stopping.load() )
+                return;
+
+            _sleeping.fetch_add(1);
+
+            if ( _queued.load() == 0 )
+                _wake.wait(lock);
+
+            _sleeping.fetch_sub(1);
+        }
+    }
+
+    void execute( context& c, task* t )
+    {
+        int pending{task::pending};
+
+        if ( t->state.compare_exchange_strong(pending, task::running) )
+        {
+            c.running = t;
+            t->fun();
+            t->fun = nullptr;
+                //  Release captured state before anyone waiting
+                //  in cancel_or_wait is woken up.
+            c.running = nullptr;
+
+            t->state.store(task::done);
+
+            if ( t->awaited.load() )
+            {
+                std::lock_guard<std::mutex> const lock{_mutex};
+                _done.notify_all();
+            }
+
+            _executed.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        t->release();
+    }
+
+    void cancel_or_wait( task* t )
+    {
+        int state{task::pending};
+
+        if ( t->state.compare_exchange_strong(state, task::cancelled) )
+        {
+            _cancelled.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if ( state == task::running && current().running != t )
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+
+            t->awaited.store(true);
+
+            _done.wait(lock, [t] {
+                return t->state.load() == task::done; });
+        }
+
+        t->release();
+    }
+
+private:    //  Data members
+    int                         _size;
+    ali::auto_ptr<worker[]>     _workers;
+    std::mutex                  _mutex{};
+    std::condition_variable     _wake{};
+    std::condition_variable     _done{};
+    std::atomic<bool>           _stopping{false};
+    std::atomic<int>            _sleeping{};
+    std::atomic<ali::int64>     _queued{};
+    std::atomic<unsigned>       _next{};
+    std::atomic<ali::int64>     _submitted{};
+    std::atomic<ali::int64>     _executed{};
+    std::atomic<ali::int64>     _cancelled{};
+    std::atomic<ali::int64>     _stolen{};
+};
+
+}   //  namespace ali
@@ -0,0 +1,580 @@
+/*
+ *  ali_xml_binary.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_array.h"
+#include "ali/ali_array_map.h"
+#include "ali/ali_filesystem2.h"
+#include "ali/ali_string.h"
+#include "ali/ali_time.h"
+#include "ali/ali_xml_parser2_interface.h"
+#include "ali/ali_xml_tree2.h"
+
+namespace ali
+{
+
+namespace xml
+{
+
+namespace binary
+{
+
+// ******************************************************************
+//  Snapshot layout, all integers are little endian uint32 unless
+//  stated otherwise:
+//
+//      header:     "AXB1", version, int64 source mtime,
+//                  int64 source size, string count, node count,
+//                  attribute count, string data size
+//      strings:    string count * { offset, length }
+//      nodes:      node count * { name, data, first attribute,
+//                  attribute count, first child, child count }
+//      attributes: attribute count * { name, value }
+//      string data
+//
+//  Nodes are stored breadth-first, so children of every node form
+//  a contiguous range. Node 0 is the root. Names, data and values
+//  are indices into the string table; strings are deduplicated and
+//  stored decoded, so walking a snapshot never touches the parser.
+// ******************************************************************
+
+// ******************************************************************
+struct format
+// ******************************************************************
+{
+    static ali::uint32 const magic = 0x31425841;    //  "AXB1"
+    static ali::uint32 const version = 1;
+
+    static int const header_size = 40;
+    static int const string_entry_size = 8;
+    static int const node_entry_size = 24;
+    static int const attribute_entry_size = 8;
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+struct source_stamp
+// ******************************************************************
+//  Identifies the text file a snapshot was built from.
+//  A snapshot is stale once the stamp of its source changes.
+// ******************************************************************
+{
+    static source_stamp of( ali::filesystem2::path const& path )
+    {
+        source_stamp stamp{};
+
+        ali::filesystem2::file::get_size_result const size{
+            ali::filesystem2::file::try_get_size(path)};
+
+        if ( !size.is_success() )
+            return stamp;
+
+        stamp.last_modified
+            = ali::filesystem2::last_modified(path).value.value;
+        stamp.size = size.size();
+
+        return stamp;
+    }
+
+    bool is_empty( void ) const
+    {
+        return last_modified == 0 && size == 0;
+    }
+
+    friend bool operator==( source_stamp const& a, source_stamp const& b )
+    {
+        return  a.last_modified == b.last_modified
+            &&  a.size == b.size;
+    }
+
+    friend bool operator!=( source_stamp const& a, source_stamp const& b )
+    {
+        return !(a == b);
+    }
+
+    ali::int64  last_modified{};
+    ali::int64  size{};
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+class view
+// ******************************************************************
+//  Read-only walker over a snapshot held in any contiguous memory,
+//  e.g. a blob read in one go or a memory-mapped file.
+//  The view does not own the memory.
+// ******************************************************************
+{
+public:     //  Class
+    class node;
+
+public:     //  Methods
+    explicit view( blob_const_ref data )
+    :   _data{data}
+    {
+        _valid = validate();
+    }
+
+    bool is_valid( void ) const
+    {
+        return _valid;
+    }
+
+    source_stamp stamp( void ) const
+    {
+        ali_assert(_valid);
+
+        source_stamp stamp{};
+        stamp.last_modified = static_cast<ali::int64>(
+            _data.int64_le_at(8));
+        stamp.size = static_cast<ali::int64>(
+            _data.int64_le_at(16));
+        return stamp;
+    }
+
+    int string_count( void ) const
+    {
+        return _string_count;
+    }
+
+    int node_count( void ) const
+    {
+        return _node_count;
+    }
+
+    int attribute_count( void ) const
+    {
+        return _attribute_count;
+    }
+
+    inline node root( void ) const;
+
+    string_const_ref string_at( int idx ) const
+    {
+        ali_assert(0 <= idx && idx < _string_count);
+
+        int const pos{_strings + idx * format::string_entry_size};
+
+        return _data.ref(
+            _string_data + u32(pos),
+            u32(pos + 4)).as_string();
+    }
+
+private:    //  Methods
+    int u32( int pos ) const
+    {
+        return static_cast<int>(_data.int32_le_at(pos));
+    }
+
+    int node_field( int idx, int field ) const
+    {
+        return u32(_nodes + idx * format::node_entry_size + field * 4);
+    }
+
+    int attribute_field( int idx, int field ) const
+    {
+        return u32(_attributes
+            + idx * format::attribute_entry_size + field * 4);
+    }
+
+    bool validate( void )
+    {
+        if ( _data.size() < format::header_size
+            || _data.int32_le_at(0) != format::magic
+            || _data.int32_le_at(4) != format::version )
+            return false;
+
+        ali::uint32 const max{static_cast<ali::uint32>(
+            meta::integer::max_value<int>::result)};
+
+        if ( _data.int32_le_at(24) > max / format::string_entry_size
+            || _data.int32_le_at(28) > max / format::node_entry_size
+            || _data.int32_le_at(32) > max / format::attribute_entry_size
+            || _data.int32_le_at(36) > max )
+            return false;
+
+        _string_count = u32(24);
+        _node_count = u32(28);
+        _attribute_count = u32(32);
+
+        ali::int64 const string_data_size{u32(36)};
+
+        ali::int64 const nodes{format::header_size
+            + static_cast<ali::int64>(_string_count)
+                * format::string_entry_size};
+        ali::int64 const attributes{nodes
+            + static_cast<ali::int64>(_node_count)
+                * format::node_entry_size};
+        ali::int64 const string_data{attributes
+            + static_cast<ali::int64>(_attribute_count)
+                * format::attribute_entry_size};
+
+        if ( _node_count == 0
+            || string_data + string_data_size != _data.size() )
+            return false;
+
+        _strings = format::header_size;
+        _nodes = static_cast<int>(nodes);
+        _attributes = static_cast<int>(attributes);
+        _string_data = static_cast<int>(string_data);
+
+        for ( int i = 0; i != _string_count; ++i )
+        {
+            int const pos{_strings + i * format::string_entry_size};
+
+            if ( static_cast<ali::int64>(_data.int32_le_at(pos))
+                    + _data.int32_le_at(pos + 4) > string_data_size )
+                return false;
+        }
+
+        //  Children and attributes must be laid out exactly as
+        //  format_snapshot does, which also rules out cycles and
+        //  shared subtrees in corrupted files.
+        ali::int64 next_child{1};
+        ali::int64 next_attribute{0};
+
+        for ( int i = 0; i != _node_count; ++i )
+        {
+            if ( !is_string_index(node_field(i, 0))
+                || !is_string_index(node_field(i, 1))
+                || node_field(i, 2) != next_attribute
+                || node_field(i, 3) < 0
+                || node_field(i, 4) != next_child
+                || node_field(i, 5) < 0 )
+                return false;
+
+            next_attribute += node_field(i, 3);
+            next_child += node_field(i, 5);
+
+            if ( next_attribute > _attribute_count
+                || next_child > _node_count )
+                return false;
+        }
+
+        if ( next_attribute != _attribute_count
+            || next_child != _node_count )
+            return false;
+
+        for ( int i = 0; i != _attribute_count; ++i )
+        {
+            if ( !is_string_index(attribute_field(i, 0))
+                || !is_string_index(attribute_field(i, 1)) )
+                return false;
+        }
+
+        return true;
+    }
+
+    bool is_string_index( int idx ) const
+    {
+        return 0 <= idx && idx < _string_count;
+    }
+
+private:    //  Data members
+    blob_const_ref  _data;
+    bool            _valid{false};
+    int             _string_count{};
+    int             _node_count{};
+    int             _attribute_count{};
+    int             _strings{};
+    int             _nodes{};
+    int             _attributes{};
+    int             _string_data{};
+
+};
+
+// ******************************************************************
+class view::node
+// ******************************************************************
+{
+public:
+    node( view const& v, int idx )
+    :   _view(&v),
+        _idx{idx}
+    {
+        ali_assert(0 <= _idx && _idx < _view->_node_count);
+    }
+
+    string_const_ref name( void ) const
+    {
+        return _view->string_at(_view->node_field(_idx, 0));
+    }
+
+    string_const_ref data( void ) const
+    {
+        return _view->string_at(_view->node_field(_idx, 1));
+    }
+
+    int attribute_count( void ) const
+    {
+        return _view->node_field(_idx, 3);
+    }
+
+    string_const_ref attribute_name( int i ) const
+    {
+        return _view->string_at(_view->attribute_field(
+            attribute_index(i), 0));
+    }
+
+    string_const_ref attribute_value( int i ) const
+    {
+        return _view->string_at(_view->attribute_field(
+            attribute_index(i), 1));
+    }
+
+    int child_count( void ) const
+    {
+        return _view->node_field(_idx, 5);
+    }
+
+    node child( int i ) const
+    {
+        ali_assert(0 <= i && i < child_count());
+
+        return node{*_view, _view->node_field(_idx, 4) + i};
+    }
+
+private:    //  Methods
+    int attribute_index( int i ) const
+    {
+        ali_assert(0 <= i && i < attribute_count());
+
+        return _view->node_field(_idx, 2) + i;
+    }
+
+private:    //  Data members
+    view const* _view;
+    int         _idx;
+};
+
+// ******************************************************************
+inline view::node view::root( void ) const
+// ******************************************************************
+{
+    ali_assert(_valid);
+
+    return node{*this, 0};
+}
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+inline blob& format_snapshot(
+    blob& out,
+    tree const& root,
+    source_stamp const& stamp = source_stamp{} )
+// ******************************************************************
+//  Appends the snapshot of the given tree to out.
+// ******************************************************************
+{
+    ali::array_map<ali::string, int> index{};
+    ali::array<ali::string const*> strings{};
+
+    auto const intern = [&index, &strings] ( xml::string const& str )
+    {
+        ali::string const key{str};
+
+        if ( int const* const idx = index.find(key) )
+            return *idx;
+
+        int const idx{strings.size()};
+        index.set(key, idx);
+        strings.push_back(nullptr);
+        return idx;
+    };
+
+    ali::array<tree const*> queue{};
+    blob nodes{};
+    blob attributes{};
+    int attribute_count{};
+
+    queue.push_back(&root);
+
+    for ( int i = 0; i != queue.size(); ++i )
+    {
+        tree const& t = *queue[i];
+
+        nodes.append_int32_le(intern(t.name));
+        nodes.append_int32_le(intern(t.data));
+        nodes.append_int32_le(attribute_count);
+        nodes.append_int32_le(t.attrs.size());
+        nodes.append_int32_le(queue.size());
+        nodes.append_int32_le(t.nodes.size());
+
+        for ( int j = 0; j != t.attrs.size(); ++j )
+        {
+            attributes.append_int32_le(intern(t.attrs[j].name));
+            attributes.append_int32_le(intern(t.attrs[j].value));
+        }
+
+        attribute_count += t.attrs.size();
+
+        for ( int j = 0; j != t.nodes.size(); ++j )
+            queue.push_back(&t.nodes[j]);
+    }
+
+    for ( int i = 0; i != index.size(); ++i )
+        strings[index.at(i).second] = &index.at(i).first;
+
+    blob string_table{};
+    blob string_data{};
+
+    for ( int i = 0; i != strings.size(); ++i )
+    {
+        string_table.append_int32_le(string_data.size());
+        string_table.append_int32_le(strings[i]->size());
+        string_data.append(strings[i]->as_blob());
+    }
+
+    out.append_int32_le(format::magic);
+    out.append_int32_le(format::version);
+    out.append_int64_le(static_cast<ali::uint64>(stamp.last_modified));
+    out.append_int64_le(static_cast<ali::uint64>(stamp.size));
+    out.append_int32_le(strings.size());
+    out.append_int32_le(queue.size());
+    out.append_int32_le(attribute_count);
+    out.append_int32_le(string_data.size());
+    out.append(string_table);
+    out.append(nodes);
+    out.append(attributes);
+    out.append(string_data);
+
+    return out;
+}
+
+// ******************************************************************
+inline void to_tree( tree& t, view::node const& n )
+// ******************************************************************
+{
+    t.name = n.name();
+    t.data = n.data();
+
+    for ( int i = 0; i != n.attribute_count(); ++i )
+        t.attrs[n.attribute_name(i)].set_value(n.attribute_value(i));
+
+    for ( int i = 0; i != n.child_count(); ++i )
+        to_tree(t.nodes.add(), n.child(i));
+}
+
+}   //  namespace binary
+
+// ******************************************************************
+inline bool load_binary(
+    tree& root,
+    ali::filesystem2::path const& path,
+    binary::source_stamp const& expected = binary::source_stamp{} )
+// ******************************************************************
+//  Fails if the snapshot is missing, corrupted, or, unless the
+//  expected stamp is empty, built from a different source file.
+// ******************************************************************
+{
+    ali::filesystem2::file::auto_handle h{
+        ali::filesystem2::file::try_open(path,
+            ali::filesystem2::file::open_mode
+                ::open_existing::access_read::value)};
+
+    if ( h.is_null() )
+        return false;
+
+    blob data{};
+
+    if ( !ali::filesystem2::file::non_owning_deserializer{h}
+            .read_all(data) )
+        return false;
+
+    binary::view const v{data};
+
+    if ( !v.is_valid()
+        || (!expected.is_empty() && v.stamp() != expected) )
+        return false;
+
+    tree t{};
+    binary::to_tree(t, v.root());
+    root = ali::move(t);
+
+    return true;
+}
+
+// ******************************************************************
+inline bool save_binary(
+    tree const& root,
+    ali::filesystem2::path const& path,
+    binary::source_stamp const& stamp = binary::source_stamp{} )
+// ******************************************************************
+//  Replaces the snapshot atomically via a sibling temporary file.
+// ******************************************************************
+{
+    using ali::operator""_s;
+
+    blob data{};
+    binary::format_snapshot(data, root, stamp);
+
+    ali::tstring temp_name{path.format_platform_string()};
+    temp_name.append(ALI_T(".tmp"_s));
+
+    ali::filesystem2::path const temp{temp_name};
+
+    ali::filesystem2::file::auto_handle h{
+        ali::filesystem2::file::try_open(temp,
+            ali::filesystem2::file::open_mode
+                ::create_always::access_write::value)};
+
+    if ( h.is_null() )
+        return false;
+
+    bool success = h->write(data) == data.size();
+
+    success = ali::filesystem2::file::try_close(
+        ali::move(h)).is_success() && success;
+
+    if ( success )
+        success = ali::filesystem2::file::try_move(
+            temp, path,
+            ali::filesystem2::file::overwrite::yes).is_success();
+
+    if ( !success )
+        ali::filesystem2::file::try_remove(temp);
+
+    return success;
+}
+
+// ******************************************************************
+inline bool load_with_snapshot(
+    tree& root,
+    ali::filesystem2::path const& source,
+    ali::filesystem2::path const& snapshot )
+// ******************************************************************
+//  Loads the snapshot when it matches the current source file,
+//  otherwise parses the text and refreshes the snapshot.
+//  Failure to refresh the snapshot is not an error.
+// ******************************************************************
+{
+    binary::source_stamp const stamp{
+        binary::source_stamp::of(source)};
+
+    if ( !stamp.is_empty() && load_binary(root, snapshot, stamp) )
+        return true;
+
+    if ( !xml::load(root, source) )
+        return false;
+
+    if ( !stamp.is_empty() )
+        save_binary(root, snapshot, stamp);
+
+    return true;
+}
+
+}   //  namespace xml
+
+}   //  namespace ali
@@ -45,6 +45,10 @@ class openxcap_string_from_tree;
 class openxcap_pretty_string_from_tree;
 // ******************************************************************
 
+// ******************************************************************
+class writer;
+// ******************************************************************
+
 // ******************************************************************
 class encoded;
 // ******************************************************************
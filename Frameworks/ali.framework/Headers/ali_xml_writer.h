@@ -0,0 +1,413 @@
+/*
+ *  ali_xml_writer.h
+ *  ali Library
+ *
+ *  Copyright (c) 2010 - 2018 Acrobits, s.r.o. All rights reserved.
+ *
+ */
+
+#pragma once
+
+#include "ali/ali_array.h"
+#include "ali/ali_filesystem2.h"
+#include "ali/ali_serializer.h"
+#include "ali/ali_string.h"
+#include "ali/ali_xml_tree2.h"
+
+namespace ali
+{
+
+namespace xml
+{
+
+// ******************************************************************
+struct layout
+// ******************************************************************
+{
+    enum type
+    {
+        compact,
+            //  Same output as string_from_tree.
+        pretty,
+            //  Same output as pretty_string_from_tree.
+        openxcap,
+            //  Same output as openxcap_string_from_tree.
+        openxcap_pretty
+            //  Same output as openxcap_pretty_string_from_tree.
+    };
+
+    layout( type value )
+    :   value{value}
+    {}
+
+    bool is_pretty( void ) const
+    {
+        return value == pretty || value == openxcap_pretty;
+    }
+
+    bool allows_short_empty_tags( void ) const
+    {
+        return value == compact || value == pretty;
+    }
+
+    type value;
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+class writer
+// ******************************************************************
+//  Streams XML text directly into a serializer through a bounded
+//  internal buffer, so the whole document is never materialized
+//  in memory. Can be fed a whole tree or SAX-like events:
+//
+//      w.start_element("a"_s);
+//      w.attribute("x"_s, "1"_s);
+//      w.data("text"_s);
+//      w.end_element();
+//
+//  Once the serializer refuses to accept data, the writer becomes
+//  bad and ignores all further input; check is_good() after
+//  flush().
+// ******************************************************************
+{
+public:     //  Class
+    static int const buffer_size = 4096;
+
+public:     //  Methods
+    explicit writer(
+        ali::serializer& out,
+        xml::layout layout = xml::layout::compact,
+        int indent_step = 2,
+        int indent = 0 )
+    :   _out(out),
+        _layout{layout},
+        _indent_step{indent_step},
+        _indent{indent}
+    {
+        ali_assert(_indent_step >= 0);
+        ali_assert(_indent >= 0);
+    }
+
+    ~writer( void )
+    {
+        flush();
+    }
+
+    bool is_good( void ) const
+    {
+        return _good;
+    }
+
+    int depth( void ) const
+    {
+        return _open.size();
+    }
+
+    writer& start_element( string_const_ref name )
+    {
+        ali_assert(!name.is_empty());
+
+        close_start_tag();
+
+        if ( _layout.is_pretty() )
+            new_line(_open.size());
+
+        put('<');
+        put(name);
+
+        _open.push_back(element{name});
+
+        return *this;
+    }
+
+    writer& attribute(
+        string_const_ref name,
+        string_const_ref value )
+    {
+        ali_assert(!_open.is_empty());
+        ali_assert(_open.back().start_tag_open);
+
+        put(' ');
+        put(name);
+        put('=');
+        put('"');
+        put_encoded(value);
+        put('"');
+
+        return *this;
+    }
+
+    writer& data( string_const_ref text )
+    {
+        ali_assert(!_open.is_empty());
+
+        if ( text.is_empty() )
+            return *this;
+
+        close_start_tag();
+
+        put_encoded(text);
+
+        _open.back().has_data = true;
+
+        return *this;
+    }
+
+    writer& end_element( void )
+    {
+        ali_assert(!_open.is_empty());
+
+        element& e = _open.back();
+
+        if ( e.start_tag_open && _layout.allows_short_empty_tags() )
+        {
+            put(' ');
+            put('/');
+            put('>');
+        }
+        else
+        {
+            close_start_tag();
+
+            if ( e.has_children && _layout.is_pretty() )
+                new_line(_open.size() - 1);
+
+            put('<');
+            put('/');
+            put(e.name);
+            put('>');
+        }
+
+        _open.erase_back();
+
+        if ( !_open.is_empty() )
+            _open.back().has_children = true;
+
+        return *this;
+    }
+
+    writer& write( tree const& t )
+    {
+        if ( t.name.is_empty() )
+            return write(t.nodes);
+
+        start_element(t.name);
+
+        for ( int i = 0; i != t.attrs.size(); ++i )
+            attribute(t.attrs[i].name, t.attrs[i].value);
+
+        data(t.data);
+
+        write(t.nodes);
+
+        return end_element();
+    }
+
+    writer& write( trees const& t )
+    {
+        for ( int i = 0; i != t.size(); ++i )
+            write(t[i]);
+
+        return *this;
+    }
+
+    bool flush( void )
+    {
+        if ( _good && _used != 0 )
+            _good = _out.write_exact(
+                string_const_ref{_buf, _used}.as_blob());
+
+        _used = 0;
+
+        return _good;
+    }
+
+private:    //  Struct
+    struct element
+    {
+        explicit element( string_const_ref name )
+        :   name{name}
+        {}
+
+        ali::string name;
+        bool        start_tag_open{true};
+        bool        has_data{false};
+        bool        has_children{false};
+    };
+
+private:    //  Methods
+    writer( writer const& );
+    writer& operator=( writer const& );
+
+    void close_start_tag( void )
+    {
+        if ( _open.is_empty() || !_open.back().start_tag_open )
+            return;
+
+        put('>');
+
+        _open.back().start_tag_open = false;
+    }
+
+    void new_line( int level )
+    {
+        if ( _started )
+            put('\n');
+
+        for ( int i = _indent + level * _indent_step; i > 0; --i )
+            put(' ');
+    }
+
+    void put( char c )
+    {
+        _started = true;
+
+        if ( _used == buffer_size )
+            flush();
+
+        _buf[_used++] = c;
+    }
+
+    void put( string_const_ref str )
+    {
+        _started = true;
+
+        for ( int pos = 0; pos != str.size(); )
+        {
+            if ( _used == buffer_size )
+                flush();
+
+            int const n = ali::mini(str.size() - pos, buffer_size - _used);
+
+            string_ref{_buf, buffer_size}.copy(_used, str.ref(pos, n));
+
+            _used += n;
+            pos += n;
+        }
+    }
+
+    void put_encoded( string_const_ref str )
+    {
+        int from = 0;
+
+        for ( int i = 0; i != str.size(); ++i )
+        {
+            string_const_ref const e{entity(str[i])};
+
+            if ( e.is_empty() )
+                continue;
+
+            put(str.ref(from, i - from));
+            put(e);
+
+            from = i + 1;
+        }
+
+        put(str.ref_not_front(from));
+    }
+
+    static string_const_ref entity( char c )
+    {
+        using ali::operator""_s;
+
+        switch ( c )
+        {
+        case '&':   return "&amp;"_s;
+        case '<':   return "&lt;"_s;
+        case '>':   return "&gt;"_s;
+        case '"':   return "&quot;"_s;
+        case '\'':  return "&apos;"_s;
+        default:    return string_const_ref{};
+        }
+    }
+
+private:    //  Data members
+    ali::serializer&        _out;
+    xml::layout             _layout;
+    int                     _indent_step{};
+    int                     _indent{};
+    ali::array<element>     _open{};
+    int                     _used{};
+    bool                    _good{true};
+    bool                    _started{false};
+    char                    _buf[buffer_size];
+};
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+inline bool write(
+    ali::serializer& out,
+    tree const& root,
+    xml::layout layout = xml::layout::compact )
+// ******************************************************************
+{
+    xml::writer w{out, layout};
+
+    w.write(root);
+
+    return w.flush();
+}
+
+// ******************************************************************
+// ******************************************************************
+
+// ******************************************************************
+inline bool save_atomically(
+    tree const& root,
+    ali::filesystem2::path const& path,
+    xml::layout layout = xml::layout::compact )
+// ******************************************************************
+//  Streams the tree into a sibling temporary file which then
+//  replaces the target in a single rename, so readers never see
+//  a partially written document.
+//  Unlike save, memory usage does not depend on the tree size.
+// ******************************************************************
+{
+    using ali::operator""_s;
+
+    ali::tstring temp_name{path.format_platform_string()};
+    temp_name.append(ALI_T(".tmp"_s));
+
+    ali::filesystem2::path const temp{temp_name};
+
+    ali::filesystem2::file::auto_handle h{
+        ali::filesystem2::file::try_open(temp,
+            ali::filesystem2::file::open_mode
+                ::create_always::access_write::value)};
+
+    if ( h.is_null() )
+        return false;
+
+    bool success = false;
+
+    {
+        ali::filesystem2::file::non_owning_serializer out{h};
+
+        success = xml::write(out, root, layout);
+    }
+
+    if ( success )
+        h->flush();
+
+    success = ali::filesystem2::file::try_close(
+        ali::move(h)).is_success() && success;
+
+    if ( success )
+        success = ali::filesystem2::file::try_move(
+            temp, path,
+            ali::filesystem2::file::overwrite::yes).is_success();
+
+    if ( !success )
+        ali::filesystem2::file::try_remove(temp);
+
+    return success;
+}
+
+}   //  namespace xml
+
+}   //  namespace ali
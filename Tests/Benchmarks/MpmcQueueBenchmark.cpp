@@ -0,0 +1,161 @@
+/*
+ *  Benchmarks/MpmcQueueBenchmark.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+//  Compares ali::mpmc_queue with a mutex and condition variable
+//  guarded deque when 1 to 32 producer threads post to a single
+//  consumer, the pattern of application threads posting to the
+//  SDK thread. Both mpmc_queue columns use 1024 slots; the
+//  consumer takes one message per call (pop) or drains up to
+//  64 at once (pop_bulk):
+//
+//    cmake --build _gate_build --target MpmcQueueBenchmark
+//    _gate_build/MpmcQueueBenchmark [messages per run]
+
+#include "ali/ali_mpmc_queue.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class LockedQueue
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// The baseline: one lock around an unbounded deque.
+    {
+    public:
+        void push(long value)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mValues.push_back(value);
+            }
+
+            mReady.notify_one();
+        }
+
+        void pop(long& value)
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mReady.wait(lock, [this] { return !mValues.empty(); });
+            value = mValues.front();
+            mValues.pop_front();
+        }
+
+    private:
+        std::mutex mMutex;
+        std::condition_variable mReady;
+        std::deque<long> mValues;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    template <typename Queue, typename Pop>
+    double run(Queue& queue,
+               Pop pop,
+               int producers,
+               long messages)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// pop(values) blocks until it has received at least one message and
+    /// returns how many it stored. Returns the wall-clock nanoseconds per
+    /// message, or a negative value when the consumer did not receive
+    /// every message exactly once.
+    {
+        long const perProducer = messages / producers;
+        long const total = perProducer * producers;
+        long sum = 0;
+
+        auto const start = std::chrono::steady_clock::now();
+
+        std::thread consumer([&]
+        {
+            long values[64];
+
+            for (long received = 0; received != total;)
+            {
+                int const n = pop(values);
+
+                for (int i = 0; i != n; ++i)
+                    sum += values[i];
+
+                received += n;
+            }
+        });
+
+        std::vector<std::thread> workers;
+
+        for (int p = 0; p != producers; ++p)
+            workers.emplace_back([&queue, perProducer]
+            {
+                for (long i = 1; i <= perProducer; ++i)
+                    queue.push(i);
+            });
+
+        for (auto& worker : workers)
+            worker.join();
+
+        consumer.join();
+
+        std::chrono::duration<double, std::nano> const elapsed
+            = std::chrono::steady_clock::now() - start;
+
+        if (sum != producers * (perProducer * (perProducer + 1) / 2))
+            return -1;
+
+        return elapsed.count() / total;
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main(int argc, char** argv)
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    long const messages = argc > 1 ? std::atol(argv[1]) : 2000000;
+
+    std::printf("%d hardware threads, %ld messages per run, ns per message\n",
+                int(std::thread::hardware_concurrency()), messages);
+    std::printf("%10s %12s %12s %12s\n", "producers", "locked", "pop", "pop_bulk");
+
+    for (int producers = 1; producers <= 32; producers *= 2)
+    {
+        LockedQueue locked;
+        ali::mpmc_queue<long> single(1024);
+        ali::mpmc_queue<long> bulk(1024);
+
+        double const lockedNs = run(locked, [&](long* values)
+        {
+            locked.pop(values[0]);
+            return 1;
+        }, producers, messages);
+
+        double const singleNs = run(single, [&](long* values)
+        {
+            single.pop(values[0]);
+            return 1;
+        }, producers, messages);
+
+        double const bulkNs = run(bulk, [&](long* values)
+        {
+            return bulk.pop_bulk(ali::array_ref<long>(values, 64));
+        }, producers, messages);
+
+        if (lockedNs < 0 || singleNs < 0 || bulkNs < 0)
+        {
+            std::printf("lost messages with %d producers\n", producers);
+            return 1;
+        }
+
+        std::printf("%10d %12.1f %12.1f %12.1f\n", producers, lockedNs, singleNs, bulkNs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ *  Benchmarks/ShardedCounterBenchmark.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+//  Compares ali::atomic::sharded_counter with a single shared
+//  ali::atomic::counter64 when 1 to 32 threads increment the same
+//  counter, the pattern of per-packet traffic statistics:
+//
+//    cmake --build _gate_build --target ShardedCounterBenchmark
+//    _gate_build/ShardedCounterBenchmark [increments per thread]
+
+#include "ali/ali_atomic_std.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    template <typename Increment>
+    double run(int threads,
+               long increments,
+               Increment increment)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Returns the wall-clock nanoseconds per increment, summed over all threads.
+    {
+        std::vector<std::thread> workers;
+        auto const start = std::chrono::steady_clock::now();
+
+        for (int t = 0; t != threads; ++t)
+            workers.emplace_back([&]
+            {
+                for (long i = 0; i != increments; ++i)
+                    increment();
+            });
+
+        for (auto& worker : workers)
+            worker.join();
+
+        std::chrono::duration<double, std::nano> const elapsed
+            = std::chrono::steady_clock::now() - start;
+
+        return elapsed.count() / (double(threads) * increments);
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main(int argc, char** argv)
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    long const increments = argc > 1 ? std::atol(argv[1]) : 2000000;
+
+    std::printf("%d hardware threads, %ld increments per thread, ns per increment\n",
+                int(std::thread::hardware_concurrency()), increments);
+    std::printf("%8s %12s %12s %12s\n", "threads", "seq_cst", "relaxed", "sharded");
+
+    for (int threads = 1; threads <= 32; threads *= 2)
+    {
+        ali::atomic::counter64 strict;
+        ali::atomic::counter64 relaxed;
+        ali::atomic::sharded_counter<> sharded;
+
+        double const strictNs = run(threads, increments, [&]
+        {
+            strict.add(1);
+        });
+
+        double const relaxedNs = run(threads, increments, [&]
+        {
+            relaxed.add(1, std::memory_order_relaxed);
+        });
+
+        double const shardedNs = run(threads, increments, [&]
+        {
+            sharded.inc();
+        });
+
+        long const expected = threads * increments;
+
+        if (strict.get() != expected
+            || relaxed.get() != expected
+            || sharded.get() != expected)
+        {
+            std::printf("lost increments with %d threads\n", threads);
+            return 1;
+        }
+
+        std::printf("%8d %12.2f %12.2f %12.2f\n", threads, strictNs, relaxedNs, shardedNs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,404 @@
+/*
+ *  EventHistory/AttachmentCollectorTests.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#include "Softphone/EventHistory/AttachmentCollector.h"
+#include "Softphone/EventHistory/MemoryStorage.h"
+#include "Softphone/EventHistory/MessageEvent.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+using namespace Softphone::EventHistory;
+using ali::operator""_s;
+
+namespace
+{
+    int sFailures = 0;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void check(bool ok,
+               char const* expression,
+               int line)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (ok)
+            return;
+
+        ++sFailures;
+        std::printf("  line %d: %s\n", line, expression);
+    }
+
+    #define CHECK(expression) check((expression), #expression, __LINE__)
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class TestStorage
+        : public MemoryStorage
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+    public:
+        using Storage::createEventStream;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct Collection
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// A storage whose deleted attachments name files in a temporary
+    /// directory; names starting with "url:" have no local file.
+    {
+        std::string                 directory;
+        TestStorage                 storage;
+        EventStream::Pointer        stream;
+        ali::array_set<EventIdType> ids;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Collection()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            char temp[] = "/tmp/attachment-collector-XXXXXX";
+            directory = ::mkdtemp(temp);
+
+            stream = TestStorage::createEventStream("s:a"_s);
+            storage.saveEventStream(*stream);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ~Collection()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            std::filesystem::remove_all(directory);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void attach(char const* name)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Saves an event referencing the attachment.
+        {
+            Event::Pointer event = MessageEvent::create();
+            event->setStream(stream);
+            event->setFullAttribute("file"_s,
+                Attribute::Value(Attribute::Attachment, ali::c_string_const_ref(name)));
+            storage.saveEvent(*event);
+            ids.insert(event->getEventId());
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void deleteEvents()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Queues every attachment for fetchDeletedAttachments.
+        {
+            storage.deleteEvents(ids);
+            ids.erase();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        std::string pathOf(char const* name) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return directory + "/" + name;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void writeFile(char const* name,
+                       int bytes) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            std::FILE* f = std::fopen(pathOf(name).c_str(), "wb");
+
+            for (int i = 0; i < bytes; ++i)
+                std::fputc('x', f);
+
+            std::fclose(f);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool exists(char const* name) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return std::filesystem::exists(pathOf(name));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int pending() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Attachments still queued in the storage.
+        {
+            ali::array<DeletedAttachment> deleted;
+            storage.fetchDeletedAttachments(deleted, 1000);
+            return deleted.size();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::filesystem2::path statePath() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return ali::filesystem2::path(ali::string(ali::c_string_const_ref(pathOf("state.xml").c_str())));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        AttachmentCollector::Resolver resolver() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            std::string const dir = directory;
+
+            return [dir](DeletedAttachment const& attachment, ali::filesystem2::path & path)
+            {
+                std::string const name(attachment.value.data(), attachment.value.size());
+
+                if (name.compare(0, 4, "url:") == 0)
+                    return false;
+
+                std::string const full = dir + "/" + name;
+                path = ali::filesystem2::path(ali::string(ali::c_string_const_ref(full.c_str())));
+                return true;
+            };
+        }
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    bool applyBatch(AttachmentCollector & collector)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Ticks until one more batch has been applied; the same tick
+    /// may start the next one.
+    {
+        ali::int64 const batches = collector.getMetrics().batches;
+        auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+        while (collector.getMetrics().batches == batches)
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+
+            collector.tick();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    bool drain(AttachmentCollector & collector)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Ticks until the collector has nothing left to do.
+    {
+        auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+        while (collector.tick())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testFilesPerTick()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        Collection c;
+
+        for (char const* name : {"a", "b", "c", "d", "e"})
+        {
+            c.writeFile(name, 10);
+            c.attach(name);
+        }
+
+        c.deleteEvents();
+        CHECK(c.pending() == 5);
+
+        AttachmentCollector collector(c.storage, c.resolver(), c.statePath());
+
+        AttachmentCollector::Budget budget;
+        budget.filesPerTick = 2;
+        budget.bytesPerSecond = 0;
+        collector.setBudget(budget);
+
+        // One batch takes two files and cleans only those from the storage.
+        CHECK(applyBatch(collector));
+        CHECK(collector.getMetrics().files == 2);
+        CHECK(collector.getMetrics().bytes == 20);
+        CHECK(c.pending() == 3);
+
+        CHECK(drain(collector));
+        CHECK(collector.getMetrics().files == 5);
+        CHECK(collector.getMetrics().bytes == 50);
+        CHECK(collector.getMetrics().batches == 3);
+        CHECK(collector.getMetrics().failed == 0);
+        CHECK(collector.isIdle());
+        CHECK(c.pending() == 0);
+
+        for (char const* name : {"a", "b", "c", "d", "e"})
+            CHECK(!c.exists(name));
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testBytesPerSecond()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        Collection c;
+
+        for (char const* name : {"a", "b", "c", "d"})
+        {
+            c.writeFile(name, 600);
+            c.attach(name);
+        }
+
+        c.deleteEvents();
+
+        AttachmentCollector collector(c.storage, c.resolver(), c.statePath());
+
+        AttachmentCollector::Budget budget;
+        budget.filesPerTick = 64;
+        budget.bytesPerSecond = 1000;
+        collector.setBudget(budget);
+
+        // The first batch may use one second worth of bytes; it stops
+        // after the file that goes over, and leaves the rest queued.
+        CHECK(applyBatch(collector));
+        CHECK(collector.getMetrics().files == 2);
+        CHECK(collector.getMetrics().bytes == 1200);
+        CHECK(c.pending() == 2);
+
+        // The overdraft has to be paid back before the next batch starts.
+        CHECK(collector.tick());
+        CHECK(c.exists("c"));
+        CHECK(c.exists("d"));
+        CHECK(!collector.isIdle());
+
+        auto const started = std::chrono::steady_clock::now();
+
+        CHECK(drain(collector));
+        CHECK(std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(100));
+        CHECK(collector.getMetrics().files == 4);
+        CHECK(collector.getMetrics().bytes == 2400);
+        CHECK(c.pending() == 0);
+        CHECK(!c.exists("c"));
+        CHECK(!c.exists("d"));
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testFailedItemsAndState()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        Collection c;
+
+        // "stuck" is a directory, which cannot be removed as a file.
+        c.writeFile("a", 10);
+        std::filesystem::create_directory(c.pathOf("stuck"));
+
+        for (char const* name : {"a", "stuck", "url:remote", "missing"})
+            c.attach(name);
+
+        c.deleteEvents();
+
+        AttachmentCollector::Budget budget;
+        budget.bytesPerSecond = 0;
+
+        {
+            AttachmentCollector collector(c.storage, c.resolver(), c.statePath());
+            collector.setBudget(budget);
+
+            // Without a state file the collector starts from scratch.
+            CHECK(collector.getMetrics().files == 0);
+
+            CHECK(drain(collector));
+
+            // The removed file, the attachment without a local file and the
+            // one whose file is already gone are cleaned; the failed one stays.
+            CHECK(collector.getMetrics().files == 3);
+            CHECK(collector.getMetrics().bytes == 10);
+            CHECK(collector.getMetrics().failed == 1);
+            CHECK(collector.isIdle());
+            CHECK(c.pending() == 1);
+            CHECK(c.exists("stuck"));
+
+            // It is skipped from then on.
+            ali::int64 const batches = collector.getMetrics().batches;
+            CHECK(!collector.tick());
+            CHECK(collector.getMetrics().batches == batches);
+        }
+
+        CHECK(std::filesystem::exists(c.pathOf("state.xml")));
+
+        {
+            // A new collector picks up the totals and the failed item.
+            AttachmentCollector collector(c.storage, c.resolver(), c.statePath());
+            collector.setBudget(budget);
+
+            CHECK(collector.getMetrics().files == 3);
+            CHECK(collector.getMetrics().bytes == 10);
+            CHECK(collector.getMetrics().failed == 1);
+            CHECK(!collector.tick());
+            CHECK(c.pending() == 1);
+
+            // Once the obstacle is gone, a retry collects it.
+            std::filesystem::remove(c.pathOf("stuck"));
+            c.writeFile("stuck", 5);
+
+            collector.retryFailed();
+            CHECK(collector.getMetrics().failed == 0);
+
+            CHECK(drain(collector));
+            CHECK(collector.getMetrics().files == 4);
+            CHECK(collector.getMetrics().bytes == 15);
+            CHECK(collector.getMetrics().failed == 0);
+            CHECK(c.pending() == 0);
+            CHECK(!c.exists("stuck"));
+        }
+
+        {
+            AttachmentCollector collector(c.storage, c.resolver(), c.statePath());
+
+            CHECK(collector.getMetrics().files == 4);
+            CHECK(collector.getMetrics().bytes == 15);
+            CHECK(collector.getMetrics().failed == 0);
+            CHECK(!collector.tick());
+        }
+
+        // A corrupt state file is ignored.
+        {
+            std::FILE* f = std::fopen(c.pathOf("state.xml").c_str(), "wb");
+            std::fputs("<attachment-collector files=\"4\"", f);
+            std::fclose(f);
+
+            AttachmentCollector collector(c.storage, c.resolver(), c.statePath());
+            CHECK(collector.getMetrics().files == 0);
+            CHECK(collector.getMetrics().failed == 0);
+        }
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main()
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    struct
+    {
+        char const* name;
+        void (*run)();
+    } const tests[] =
+    {
+        {"files per tick", testFilesPerTick},
+        {"bytes per second", testBytesPerSecond},
+        {"failed items and state", testFailedItemsAndState},
+    };
+
+    for (auto const& test : tests)
+    {
+        int const failures = sFailures;
+        test.run();
+        std::printf("%s %s\n", sFailures == failures ? "ok  " : "FAIL", test.name);
+    }
+
+    return sFailures == 0 ? 0 : 1;
+}
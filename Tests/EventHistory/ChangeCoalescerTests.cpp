@@ -0,0 +1,363 @@
+/*
+ *  EventHistory/ChangeCoalescerTests.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#include "Softphone/EventHistory/ChangeCoalescer.h"
+#include "Softphone/EventHistory/MemoryStorage.h"
+#include "Softphone/EventHistory/MessageEvent.h"
+
+#include <cstdio>
+#include <initializer_list>
+#include <vector>
+
+using namespace Softphone::EventHistory;
+using ali::operator""_s;
+
+namespace
+{
+    int sFailures = 0;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void check(bool ok,
+               char const* expression,
+               int line)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (ok)
+            return;
+
+        ++sFailures;
+        std::printf("  line %d: %s\n", line, expression);
+    }
+
+    #define CHECK(expression) check((expression), #expression, __LINE__)
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class TestStorage
+        : public MemoryStorage
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+    public:
+        using Storage::createEventStream;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct Harness
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// A coalescer whose scheduler only records the requested delays;
+    /// the test plays the timer by calling flush().
+    {
+        std::vector<int>            scheduled;
+        std::vector<ChangedEvents>  deliveredEvents;
+        std::vector<ChangedStreams> deliveredStreams;
+        ChangeCoalescer             coalescer;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        explicit Harness(ChangeCoalescer::Settings const& settings = ChangeCoalescer::Settings())
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+            : coalescer(
+                [this](ChangedEvents const& events, ChangedStreams const& streams)
+                {
+                    deliveredEvents.push_back(events);
+                    deliveredStreams.push_back(streams);
+                },
+                [this](int delayMs)
+                {
+                    scheduled.push_back(delayMs);
+                },
+                settings)
+        {}
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void addEvents(std::initializer_list<EventIdType> ids)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ChangedEvents events;
+
+            for (EventIdType id : ids)
+                events.eventIds.insert(id);
+
+            coalescer.add(events, ChangedStreams());
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void addStreams(std::initializer_list<char const*> keys)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ChangedStreams streams;
+
+            for (char const* key : keys)
+                streams.streamKeys.insert(ali::string(ali::c_string_const_ref(key)));
+
+            coalescer.add(ChangedEvents(), streams);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void rename(char const* from,
+                    char const* to)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            ChangedStreams streams;
+            streams.streamKeyChanges.set(ali::string(ali::c_string_const_ref(from)),
+                                         ali::string(ali::c_string_const_ref(to)));
+            coalescer.add(ChangedEvents(), streams);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ChangedEvents const& lastEvents() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return deliveredEvents.back();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ChangedStreams const& lastStreams() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return deliveredStreams.back();
+        }
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testWindow()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        ChangeCoalescer::Settings settings;
+        settings.latencyBudgetMs = 40;
+
+        Harness h(settings);
+
+        // Flushing with nothing pending delivers nothing.
+        h.coalescer.flush();
+        CHECK(h.deliveredEvents.empty());
+        CHECK(!h.coalescer.isPending());
+
+        // The first change opens a window, the rest of the burst joins it.
+        h.addEvents({1, 2});
+        CHECK(h.coalescer.isPending());
+        CHECK(h.scheduled.size() == 1 && h.scheduled[0] == 40);
+
+        h.addEvents({2, 3});
+        h.addStreams({"s:a"});
+        CHECK(h.scheduled.size() == 1);
+        CHECK(h.deliveredEvents.empty());
+
+        h.coalescer.flush();
+        CHECK(!h.coalescer.isPending());
+        CHECK(h.deliveredEvents.size() == 1);
+        CHECK(!h.lastEvents().many);
+        CHECK(h.lastEvents().eventIds.size() == 3);
+        CHECK(h.lastEvents().eventIds.contains(EventIdType(1)));
+        CHECK(h.lastEvents().eventIds.contains(EventIdType(3)));
+        CHECK(h.lastStreams().streamKeys.size() == 1);
+        CHECK(h.lastStreams().streamKeys.contains("s:a"_s));
+
+        // A second flush for the same window is a no-op.
+        h.coalescer.flush();
+        CHECK(h.deliveredEvents.size() == 1);
+
+        // The next change opens a new window with an empty delta.
+        h.addEvents({7});
+        CHECK(h.scheduled.size() == 2);
+        h.coalescer.flush();
+        CHECK(h.deliveredEvents.size() == 2);
+        CHECK(h.lastEvents().eventIds.size() == 1);
+        CHECK(h.lastEvents().eventIds.contains(EventIdType(7)));
+        CHECK(h.lastStreams().streamKeys.is_empty());
+
+        ChangeCoalescer::Counters const& counters = h.coalescer.counters();
+        CHECK(counters.received == 4);
+        CHECK(counters.coalesced == 2);
+        CHECK(counters.delivered == 2);
+        CHECK(counters.capped == 0);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testAddDuringDelivery()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        std::vector<int> scheduled;
+        int delivered = 0;
+        ChangeCoalescer * self = nullptr;
+
+        ChangeCoalescer coalescer(
+            [&](ChangedEvents const& events, ChangedStreams const&)
+            {
+                // The first delivery causes another change, which
+                // must open a new window instead of being lost.
+                if (++delivered == 1)
+                {
+                    ChangedEvents more;
+                    more.eventIds.insert(events.eventIds.at(0) + 1);
+                    self->add(more, ChangedStreams());
+                }
+            },
+            [&](int delayMs)
+            {
+                scheduled.push_back(delayMs);
+            });
+
+        self = &coalescer;
+
+        ChangedEvents events;
+        events.eventIds.insert(1);
+        coalescer.add(events, ChangedStreams());
+
+        coalescer.flush();
+        CHECK(delivered == 1);
+        CHECK(coalescer.isPending());
+        CHECK(scheduled.size() == 2);
+
+        coalescer.flush();
+        CHECK(delivered == 2);
+        CHECK(!coalescer.isPending());
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testRenames()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        Harness h;
+
+        // a -> b -> c collapses to a -> c; x -> y is kept alongside.
+        h.rename("s:a", "s:b");
+        h.rename("s:x", "s:y");
+        h.rename("s:b", "s:c");
+        h.coalescer.flush();
+
+        auto const& changes = h.lastStreams().streamKeyChanges;
+        CHECK(changes.size() == 2);
+        CHECK(changes.find("s:a"_s) != nullptr && *changes.find("s:a"_s) == "s:c"_s);
+        CHECK(changes.find("s:x"_s) != nullptr && *changes.find("s:x"_s) == "s:y"_s);
+        CHECK(changes.find("s:b"_s) == nullptr);
+
+        // A rename that is undone within the window disappears.
+        h.rename("s:c", "s:d");
+        h.rename("s:d", "s:c");
+        h.coalescer.flush();
+        CHECK(h.lastStreams().streamKeyChanges.is_empty());
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testCaps()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        ChangeCoalescer::Settings settings;
+        settings.maxEventIds = 4;
+        settings.maxStreamKeys = 2;
+
+        Harness h(settings);
+
+        // Up to the cap the ids are kept.
+        h.addEvents({1, 2});
+        h.addEvents({3, 4});
+        h.coalescer.flush();
+        CHECK(!h.lastEvents().many);
+        CHECK(h.lastEvents().eventIds.size() == 4);
+        CHECK(h.coalescer.counters().capped == 0);
+
+        // Growing over it turns the delta into many, and later
+        // changes in the same window leave it that way.
+        h.addEvents({1, 2, 3});
+        h.addEvents({4, 5});
+        h.addEvents({6});
+        h.coalescer.flush();
+        CHECK(h.lastEvents().many);
+        CHECK(h.lastEvents().eventIds.is_empty());
+        CHECK(h.coalescer.counters().capped == 1);
+
+        // Streams over the cap become many, but renames survive.
+        h.addStreams({"s:a", "s:b"});
+        h.rename("s:a", "s:z");
+        h.addStreams({"s:c"});
+        h.coalescer.flush();
+        CHECK(h.lastStreams().many);
+        CHECK(h.lastStreams().streamKeys.is_empty());
+        CHECK(h.lastStreams().streamKeyChanges.size() == 1);
+        CHECK(h.coalescer.counters().capped == 2);
+
+        // A source that already reports many is passed through,
+        // it was not capped here.
+        ChangedEvents many;
+        many.many = true;
+        h.coalescer.add(many, ChangedStreams());
+        h.coalescer.flush();
+        CHECK(h.lastEvents().many);
+        CHECK(h.coalescer.counters().capped == 2);
+
+        // The next window starts from scratch.
+        h.addEvents({9});
+        h.coalescer.flush();
+        CHECK(!h.lastEvents().many);
+        CHECK(h.lastEvents().eventIds.size() == 1);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testAttach()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        TestStorage storage;
+        EventStream::Pointer stream = TestStorage::createEventStream("s:a"_s);
+        storage.saveEventStream(*stream);
+
+        Harness h;
+        h.coalescer.attach(storage);
+
+        Event::Pointer first = MessageEvent::create();
+        first->setStream(stream);
+        storage.saveEvent(*first);
+
+        Event::Pointer second = MessageEvent::create();
+        second->setStream(stream);
+        storage.saveEvent(*second);
+
+        CHECK(h.coalescer.isPending());
+        CHECK(h.scheduled.size() == 1);
+        CHECK(h.coalescer.counters().received >= 2);
+
+        h.coalescer.flush();
+        CHECK(h.deliveredEvents.size() == 1);
+        CHECK(h.lastEvents().many
+              || (h.lastEvents().eventIds.contains(first->getEventId())
+                  && h.lastEvents().eventIds.contains(second->getEventId())));
+
+        // Once detached, the storage's changes no longer arrive.
+        h.coalescer.detach();
+
+        Event::Pointer third = MessageEvent::create();
+        third->setStream(stream);
+        storage.saveEvent(*third);
+
+        CHECK(!h.coalescer.isPending());
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main()
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    struct
+    {
+        char const* name;
+        void (*run)();
+    } const tests[] =
+    {
+        {"coalescing window", testWindow},
+        {"add during delivery", testAddDuringDelivery},
+        {"stream key renames", testRenames},
+        {"caps", testCaps},
+        {"attach", testAttach},
+    };
+
+    for (auto const& test : tests)
+    {
+        int const failures = sFailures;
+        test.run();
+        std::printf("%s %s\n", sFailures == failures ? "ok  " : "FAIL", test.name);
+    }
+
+    return sFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,401 @@
+/*
+ *  EventHistory/EventArchiveTests.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#include "Softphone/EventHistory/EventArchive.h"
+#include "Softphone/EventHistory/MemoryStorage.h"
+#include "Softphone/EventHistory/MessageEvent.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using namespace Softphone::EventHistory;
+using ali::operator""_s;
+
+namespace
+{
+    int sFailures = 0;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void check(bool ok,
+               char const* expression,
+               int line)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (ok)
+            return;
+
+        ++sFailures;
+        std::printf("  line %d: %s\n", line, expression);
+    }
+
+    #define CHECK(expression) check((expression), #expression, __LINE__)
+
+    using Times = std::vector<double>;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class TestStorage
+        : public MemoryStorage
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+    public:
+        using Storage::createEventStream;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct History
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// A storage and an archive directory, with partitions of 100 seconds
+    /// and events archived once they are 1000 seconds old:
+    ///
+    ///   time  stream  remote user
+    ///     10  s:a     sip:alice@example.com
+    ///     20  s:b     sip:bob@example.com
+    ///    150  s:a     sip:alice@example.com
+    ///    250  s:b     tel:123
+    ///   5000  s:a     sip:alice@example.com
+    ///
+    /// The encoder keeps the events of s:keep in the storage.
+    {
+        std::string                 directory;
+        TestStorage                 storage;
+        EventStream::Pointer        a;
+        EventStream::Pointer        b;
+        EventStream::Pointer        keep;
+        EventArchive::Options       options;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        History()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            char temp[] = "/tmp/event-archive-XXXXXX";
+            directory = ::mkdtemp(temp);
+
+            a = stream("s:a"_s);
+            b = stream("s:b"_s);
+            keep = stream("s:keep"_s);
+
+            add(a, 10, "sip:alice@example.com"_s);
+            add(b, 20, "sip:bob@example.com"_s);
+            add(a, 150, "sip:alice@example.com"_s);
+            add(b, 250, "tel:123"_s);
+            add(a, 5000, "sip:alice@example.com"_s);
+
+            options.maxAge = 1000;
+            options.partitionSpan = 100;
+            options.batchSize = 2;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ~History()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            std::filesystem::remove_all(directory);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        EventStream::Pointer stream(ali::string_const_ref key)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            EventStream::Pointer stream = TestStorage::createEventStream(key);
+            storage.saveEventStream(*stream);
+            return stream;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        EventIdType add(EventStream::Pointer const& stream,
+                        double timestamp,
+                        ali::string_const_ref uri)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Event::Pointer event = MessageEvent::create();
+            event->setStream(stream);
+            event->setTimestamp(TimestampType(timestamp));
+
+            RemoteUser user;
+            user.setGenericUri(uri);
+            user.setTransportUri(uri);
+            event->addRemoteUser(ali::move(user));
+
+            storage.saveEvent(*event);
+            return event->getEventId();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        ali::filesystem2::path path() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return ali::filesystem2::path(ali::string(ali::c_string_const_ref(directory.c_str())));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        bool exists(ali::string const& file) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return std::filesystem::exists(directory + "/" + std::string(file.data(), file.size()));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        int remaining() const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Events still in the storage.
+        {
+            FetchResult result;
+            storage.fetchEvents(result, Query(), Paging());
+            return result.items.size();
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static bool encode(Event const& event,
+                           ali::xml::tree & data)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            if (event.getStreamKey() == "s:keep"_s)
+                return false;
+
+            data.attrs.set("id"_s, static_cast<long long>(event.getEventId()));
+            return true;
+        }
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    Times find(EventArchive const& archive,
+               ArchiveQuery const& query)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Timestamps of the events found, after checking each kept its encoded data.
+    {
+        ali::array<ArchivedEvent> found;
+        Times times;
+
+        CHECK(archive.find(found, query) == found.size());
+
+        for (int i = 0; i < found.size(); ++i)
+        {
+            long long id = 0;
+            auto const* attr = found[i].data.attrs.find("id"_s);
+
+            CHECK(found[i].data.name == "data"_s);
+            CHECK(attr != nullptr && attr->parse_value(id) && id == static_cast<long long>(found[i].eventId));
+
+            times.push_back(found[i].timestamp.value);
+        }
+
+        return times;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testRollover()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+
+        EventArchive archive(h.path(), &History::encode);
+        archive.setOptions(h.options);
+        CHECK(archive.getSegments().is_empty());
+
+        // The four old events fall into partitions 0, 0, 1 and 2; the
+        // batches of two do not line up with them.
+        CHECK(archive.archive(h.storage, TimestampType(5000)) == 4);
+        CHECK(h.remaining() == 1);
+
+        ali::array<ArchiveSegment> const& segments = archive.getSegments();
+        CHECK(segments.size() == 3);
+
+        if (segments.size() == 3)
+        {
+            CHECK(segments[0].file == "segment-0-0.bin"_s);
+            CHECK(segments[0].partition == 0);
+            CHECK(segments[0].from.value == 10);
+            CHECK(segments[0].to.value == 20);
+            CHECK(segments[0].events == 2);
+            CHECK(segments[0].streamKeys.size() == 2);
+
+            CHECK(segments[1].file == "segment-1-1.bin"_s);
+            CHECK(segments[1].partition == 1);
+            CHECK(segments[1].events == 1);
+            CHECK(segments[1].streamKeys.contains("s:a"_s));
+            CHECK(!segments[1].streamKeys.contains("s:b"_s));
+
+            CHECK(segments[2].file == "segment-2-2.bin"_s);
+            CHECK(segments[2].partition == 2);
+            CHECK(segments[2].from.value == 250);
+
+            for (int i = 0; i < segments.size(); ++i)
+                CHECK(h.exists(segments[i].file));
+        }
+
+        CHECK(h.exists("manifest.xml"_s));
+        CHECK(archive.getMetrics().segments == 3);
+        CHECK(archive.getMetrics().events == 4);
+
+        // Nothing is old enough yet the second time.
+        CHECK(archive.archive(h.storage, TimestampType(5000)) == 0);
+        CHECK(archive.getSegments().size() == 3);
+
+        // More old events for partition 0 go into a segment of their own,
+        // ordered by its oldest event; the encoder may refuse events.
+        h.add(h.a, 50, "sip:alice@example.com"_s);
+        h.add(h.keep, 60, "sip:alice@example.com"_s);
+
+        CHECK(archive.archive(h.storage, TimestampType(5000)) == 1);
+        CHECK(h.remaining() == 2);
+        CHECK(segments.size() == 4);
+
+        if (segments.size() == 4)
+        {
+            CHECK(segments[1].file == "segment-0-3.bin"_s);
+            CHECK(segments[1].partition == 0);
+            CHECK(segments[1].events == 1);
+        }
+
+        CHECK(archive.getMetrics().events == 5);
+        CHECK((find(archive, ArchiveQuery()) == Times{10, 20, 50, 150, 250}));
+
+        // Later runs archive what has grown old since.
+        CHECK(archive.archive(h.storage, TimestampType(6100)) == 1);
+        CHECK(segments.size() == 5);
+        CHECK(segments.back().partition == 50);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testFind()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+
+        EventArchive archive(h.path(), &History::encode);
+        archive.setOptions(h.options);
+        archive.archive(h.storage, TimestampType(5000));
+
+        ArchiveQuery range;
+        range.newerThan = TimestampType(20);
+        range.olderThan = TimestampType(250);
+        CHECK((find(archive, range) == Times{20, 150}));
+
+        // The segment of partition 1 has no s:b events and is not read.
+        ArchiveQuery stream;
+        stream.streamKey = "s:b"_s;
+        CHECK((find(archive, stream) == Times{20, 250}));
+        CHECK(archive.getMetrics().segmentsSkipped >= 1);
+
+        ali::array<ArchivedEvent> found;
+        ArchiveQuery user;
+        user.remoteUser = "sip:bob@example.com"_s;
+        CHECK(archive.find(found, user) == 1);
+
+        if (found.size() == 1)
+        {
+            CHECK(found[0].timestamp.value == 20);
+            CHECK(found[0].streamKey == "s:b"_s);
+            CHECK(found[0].remoteUsers.size() == 1);
+            CHECK(found[0].remoteUsers[0] == "sip:bob@example.com"_s);
+        }
+
+        ArchiveQuery nobody;
+        nobody.remoteUser = "sip:nobody@example.com"_s;
+        CHECK(find(archive, nobody).empty());
+
+        // The oldest events first, up to the limit.
+        ArchiveQuery limited;
+        limited.limit = 3;
+        CHECK((find(archive, limited) == Times{10, 20, 150}));
+
+        limited.limit = 0;
+        CHECK(find(archive, limited).empty());
+
+        EventArchive::Metrics const& metrics = archive.getMetrics();
+        CHECK(metrics.segmentsRead > 0);
+        CHECK(metrics.segmentsSkipped > 0);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testReload()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+
+        {
+            // An empty directory is an empty archive.
+            EventArchive archive(h.path(), &History::encode);
+            CHECK(archive.getSegments().is_empty());
+            CHECK(archive.getMetrics().events == 0);
+
+            archive.setOptions(h.options);
+            CHECK(archive.archive(h.storage, TimestampType(5000)) == 4);
+        }
+
+        EventArchive archive(h.path(), &History::encode);
+        archive.setOptions(h.options);
+
+        ali::array<ArchiveSegment> const& segments = archive.getSegments();
+        CHECK(segments.size() == 3);
+        CHECK(archive.getMetrics().segments == 3);
+        CHECK(archive.getMetrics().events == 4);
+
+        if (segments.size() == 3)
+        {
+            CHECK(segments[0].file == "segment-0-0.bin"_s);
+            CHECK(segments[0].from.value == 10);
+            CHECK(segments[0].to.value == 20);
+            CHECK(segments[0].events == 2);
+            CHECK(segments[0].streamKeys.contains("s:a"_s));
+            CHECK(segments[0].streamKeys.contains("s:b"_s));
+            CHECK(segments[2].partition == 2);
+            CHECK(segments[2].remoteUsers.mightContain("tel:123"_s));
+        }
+
+        // The summaries still filter, and the segments still read back.
+        CHECK((find(archive, ArchiveQuery()) == Times{10, 20, 150, 250}));
+
+        ArchiveQuery user;
+        user.remoteUser = "tel:123"_s;
+        CHECK((find(archive, user) == Times{250}));
+
+        ArchiveQuery stream;
+        stream.streamKey = "s:a"_s;
+        ali::int64 const skipped = archive.getMetrics().segmentsSkipped;
+        CHECK((find(archive, stream) == Times{10, 150}));
+        CHECK(archive.getMetrics().segmentsSkipped == skipped + 1);
+
+        // New segments continue the sequence rather than overwrite old files.
+        h.add(h.b, 30, "tel:123"_s);
+        CHECK(archive.archive(h.storage, TimestampType(5000)) == 1);
+        CHECK(segments.size() == 4);
+
+        if (segments.size() == 4)
+            CHECK(segments[1].file == "segment-0-3.bin"_s);
+
+        CHECK((find(archive, ArchiveQuery()) == Times{10, 20, 30, 150, 250}));
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main()
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    struct
+    {
+        char const* name;
+        void (*run)();
+    } const tests[] =
+    {
+        {"segment rollover", testRollover},
+        {"find", testFind},
+        {"reload", testReload},
+    };
+
+    for (auto const& test : tests)
+    {
+        int const failures = sFailures;
+        test.run();
+        std::printf("%s %s\n", sFailures == failures ? "ok  " : "FAIL", test.name);
+    }
+
+    return sFailures == 0 ? 0 : 1;
+}
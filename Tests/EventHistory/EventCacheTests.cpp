@@ -0,0 +1,280 @@
+/*
+ *  EventHistory/EventCacheTests.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#include "Softphone/EventHistory/EventCache.h"
+#include "Softphone/EventHistory/MemoryStorage.h"
+#include "Softphone/EventHistory/MessageEvent.h"
+
+#include <cstdio>
+#include <vector>
+
+using namespace Softphone::EventHistory;
+using ali::operator""_s;
+
+namespace
+{
+    int sFailures = 0;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void check(bool ok,
+               char const* expression,
+               int line)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (ok)
+            return;
+
+        ++sFailures;
+        std::printf("  line %d: %s\n", line, expression);
+    }
+
+    #define CHECK(expression) check((expression), #expression, __LINE__)
+
+    using Ids = std::vector<EventIdType>;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class TestStorage
+        : public MemoryStorage
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+    public:
+        using Storage::createEventStream;
+        using Storage::setEventIdDirect;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    Event::Pointer event(EventIdType id)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Events of the same shape, so that they all have the same estimated size.
+    {
+        Event::Pointer event = MessageEvent::create();
+        TestStorage::setEventIdDirect(*event, id);
+        return event;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    Ids cachedIds(EventCache & cache)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Most recently used first.
+    {
+        Ids ids;
+
+        cache.forEachEvent([&ids](Event & event)
+        {
+            ids.push_back(event.getEventId());
+        });
+
+        return ids;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testFetch()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        EventCache cache;
+        int loads = 0;
+
+        EventCache::EventLoader const load = [&loads](EventIdType id)
+        {
+            ++loads;
+            return id == 99 ? Event::Pointer() : event(id);
+        };
+
+        FetchItem first = cache.fetch(1, load);
+        CHECK(!first.cached);
+        CHECK(first.event->getEventId() == 1);
+        CHECK(loads == 1);
+
+        FetchItem again = cache.fetch(1, load);
+        CHECK(again.cached);
+        CHECK(again.event.get() == first.event.get());
+        CHECK(loads == 1);
+
+        // Nothing found is not cached; the next fetch asks again.
+        CHECK(cache.fetch(99, load).event.is_null());
+        CHECK(cache.fetch(99, load).event.is_null());
+        CHECK(loads == 3);
+        CHECK(cache.getEventCount() == 1);
+
+        EventCache::Statistics const& stats = cache.getEventStatistics();
+        CHECK(stats.hits == 1);
+        CHECK(stats.misses == 3);
+        CHECK(stats.evicted == 0);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testEviction()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        ali::int64 const bytes = EventCache::estimateBytes(*event(1));
+
+        EventCache::Settings settings;
+        settings.maxEventBytes = 3 * bytes;
+
+        EventCache cache(settings);
+
+        Event::Pointer held = event(1);
+        cache.insertEvent(held);
+        cache.insertEvent(event(2));
+        cache.insertEvent(event(3));
+        CHECK(cache.getEventCount() == 3);
+        CHECK(cache.getEventBytes() == 3 * bytes);
+
+        // Using 1 makes 2 the least recently used, so it goes first.
+        CHECK(!cache.findEvent(1).is_null());
+        cache.insertEvent(event(4));
+        CHECK((cachedIds(cache) == Ids{4, 1, 3}));
+        CHECK(cache.findEvent(2).is_null());
+        CHECK(cache.getEventBytes() <= settings.maxEventBytes);
+        CHECK(cache.getEventStatistics().evicted == 1);
+
+        // Eviction only drops the cache's reference.
+        cache.insertEvent(event(5));
+        cache.insertEvent(event(6));
+        CHECK(cache.findEvent(1).is_null());
+        CHECK(held->getEventId() == 1);
+
+        // Re-inserting a grown event re-estimates it and makes room.
+        ali::string note;
+
+        for (ali::int64 i = 0; i < bytes / 2; ++i)
+            note.push_back('x');
+
+        Event::Pointer grown = cache.findEvent(6);
+        grown->setAttribute("note"_s, note);
+        cache.insertEvent(grown);
+        CHECK((cachedIds(cache) == Ids{6, 5}));
+        CHECK(cache.getEventBytes() == EventCache::estimateBytes(*grown) + bytes);
+
+        // Shrinking the budget evicts at once.
+        settings.maxEventBytes = EventCache::estimateBytes(*grown);
+        cache.setSettings(settings);
+        CHECK((cachedIds(cache) == Ids{6}));
+
+        // An entry over the budget by itself is kept rather than thrashed.
+        settings.maxEventBytes = bytes;
+        cache.setSettings(settings);
+        cache.insertEvent(grown);
+        CHECK(!cache.findEvent(6).is_null());
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testRemoved()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        ali::int64 const bytes = EventCache::estimateBytes(*event(1));
+
+        EventCache::Settings settings;
+        settings.maxEventBytes = 3 * bytes;
+
+        EventCache cache(settings);
+
+        for (EventIdType id = 1; id <= 3; ++id)
+            cache.insertEvent(event(id));
+
+        // Removed events are hidden but still counted until purged.
+        CHECK(cache.markEventRemoved(1));
+        CHECK(!cache.markEventRemoved(1));
+        CHECK(!cache.markEventRemoved(42));
+        CHECK(cache.findEvent(1).is_null());
+        CHECK((cachedIds(cache) == Ids{3, 2}));
+        CHECK(cache.getEventCount() == 3);
+
+        // Under pressure they are dropped before live entries,
+        // even though 2 is older than 1's removal.
+        cache.insertEvent(event(4));
+        CHECK((cachedIds(cache) == Ids{4, 3, 2}));
+        CHECK(cache.getEventStatistics().evicted == 0);
+
+        CHECK(cache.markEventRemoved(2));
+        CHECK(cache.markEventRemoved(3));
+        CHECK(cache.purgeRemoved() == 2);
+        CHECK(cache.purgeRemoved() == 0);
+        CHECK(cache.getEventCount() == 1);
+        CHECK(cache.getEventBytes() == bytes);
+
+        // Re-inserting a removed event brings it back.
+        cache.insertEvent(event(5));
+        CHECK(cache.markEventRemoved(5));
+        cache.insertEvent(event(5));
+        CHECK(!cache.findEvent(5).is_null());
+
+        cache.eraseEvent(4);
+        CHECK((cachedIds(cache) == Ids{5}));
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testStreams()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        EventStream::Pointer a = TestStorage::createEventStream("s:a"_s);
+        EventStream::Pointer b = TestStorage::createEventStream("s:b"_s);
+        EventStream::Pointer c = TestStorage::createEventStream("s:c"_s);
+
+        EventCache::Settings settings;
+        settings.maxStreamBytes = EventCache::estimateBytes(*a) * 2;
+
+        EventCache cache(settings);
+        cache.insertStream(a);
+        cache.insertStream(b);
+        CHECK(cache.findStream("s:a"_s).get() == a.get());
+
+        cache.insertStream(c);
+        CHECK(cache.getStreamCount() == 2);
+        CHECK(cache.findStream("s:b"_s).is_null());
+        CHECK(cache.getStreamStatistics().evicted == 1);
+
+        // The event side has its own budget.
+        cache.insertEvent(event(1));
+        CHECK(cache.getStreamCount() == 2);
+        CHECK(cache.getEventCount() == 1);
+
+        CHECK(cache.markStreamRemoved("s:a"_s));
+        CHECK(cache.findStream("s:a"_s).is_null());
+        CHECK(cache.markEventRemoved(1));
+        CHECK(cache.purgeRemoved() == 2);
+
+        int visited = 0;
+        cache.forEachStream([&visited](EventStream & stream)
+        {
+            ++visited;
+            CHECK(stream.key == "s:c"_s);
+        });
+        CHECK(visited == 1);
+
+        cache.clear();
+        CHECK(cache.getStreamCount() == 0);
+        CHECK(cache.getEventCount() == 0);
+        CHECK(cache.getStreamBytes() == 0);
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main()
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    struct
+    {
+        char const* name;
+        void (*run)();
+    } const tests[] =
+    {
+        {"fetch", testFetch},
+        {"eviction", testEviction},
+        {"removed entries", testRemoved},
+        {"streams", testStreams},
+    };
+
+    for (auto const& test : tests)
+    {
+        int const failures = sFailures;
+        test.run();
+        std::printf("%s %s\n", sFailures == failures ? "ok  " : "FAIL", test.name);
+    }
+
+    return sFailures == 0 ? 0 : 1;
+}
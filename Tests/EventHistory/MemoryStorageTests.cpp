@@ -0,0 +1,1159 @@
+/*
+ *  EventHistory/MemoryStorageTests.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+#include "Softphone/EventHistory/AsyncFetch.h"
+#include "Softphone/EventHistory/CallEvent.h"
+#include "Softphone/EventHistory/MemoryStorage.h"
+#include "Softphone/EventHistory/MessageEvent.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace Softphone::EventHistory;
+using ali::operator""_s;
+
+namespace
+{
+    int sFailures = 0;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void check(bool ok,
+               char const* expression,
+               int line)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (ok)
+            return;
+
+        ++sFailures;
+        std::printf("  line %d: %s\n", line, expression);
+    }
+
+    #define CHECK(expression) check((expression), #expression, __LINE__)
+
+    using Ids = std::vector<EventIdType>;
+    using Keys = std::vector<char const*>;
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void checkIds(Ids const& actual,
+                  Ids const& expected,
+                  char const* what,
+                  int line)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (actual == expected)
+            return;
+
+        ++sFailures;
+        std::printf("  line %d: %s returned", line, what);
+
+        for (EventIdType id : actual)
+            std::printf(" %lu", static_cast<unsigned long>(id));
+
+        std::printf(", expected");
+
+        for (EventIdType id : expected)
+            std::printf(" %lu", static_cast<unsigned long>(id));
+
+        std::printf("\n");
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    Ids idsOf(FetchResult const& result)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        Ids ids;
+
+        for (int i = 0; i < result.items.size(); ++i)
+            ids.push_back(result.items[i].event->getEventId());
+
+        return ids;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    bool sameKeys(StreamFetchResult const& result,
+                  Keys const& expected)
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        if (result.items.size() != static_cast<int>(expected.size()))
+            return false;
+
+        for (int i = 0; i < result.items.size(); ++i)
+            if (result.items[i].stream->key != ali::c_string_const_ref(expected[i]))
+                return false;
+
+        return true;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    class TestStorage
+        : public MemoryStorage
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+    public:
+        using Storage::createEventStream;
+    };
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    struct History
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Two streams with three events each and an empty closed stream:
+    ///
+    ///   id  stream  type     time  direction  account  other
+    ///    1  s:a     message  10    incoming   acc1     tag=red, sip:alice@example.com
+    ///    2  s:a     message  20    outgoing   acc1     tag=blue
+    ///    3  s:b     call     30    incoming   acc2     hidden
+    ///    4  s:b     message  40    incoming   acc2     attachment kind=image/png, tel:123
+    ///    5  s:a     message  50    incoming   acc1     attachment kind=video/mp4
+    ///    6  s:b     message  50    outgoing   acc2
+    ///
+    /// s:a has party sip:alice@example.com and color=red, s:b has party
+    /// tel:123 and color=blue, s:c is closed. Unread are 1, 4 and 5.
+    {
+        TestStorage                 storage;
+        EventStream::Pointer        a;
+        EventStream::Pointer        b;
+        EventStream::Pointer        c;
+        ali::array<Event::Pointer>  events;
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        History()
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            a = stream("s:a"_s, "sip:alice@example.com"_s, "red"_s);
+            b = stream("s:b"_s, "tel:123"_s, "blue"_s);
+            c = TestStorage::createEventStream("s:c"_s);
+            c->setOpen(false);
+            storage.saveEventStream(*c);
+
+            Event::Pointer e1 = message(a, 10, Direction::Incoming, "acc1"_s);
+            e1->setAttribute("tag"_s, "red"_s);
+            addRemoteUser(*e1, "sip:alice@example.com"_s);
+
+            Event::Pointer e2 = message(a, 20, Direction::Outgoing, "acc1"_s);
+            e2->setAttribute("tag"_s, "blue"_s);
+
+            Event::Pointer e3 = CallEvent::create();
+            setup(*e3, b, 30, Direction::Incoming, "acc2"_s);
+            e3->setHidden(true);
+
+            Event::Pointer e4 = message(b, 40, Direction::Incoming, "acc2"_s);
+            addAttachment(*e4, "image/png"_s);
+            addRemoteUser(*e4, "tel:123"_s);
+
+            Event::Pointer e5 = message(a, 50, Direction::Incoming, "acc1"_s);
+            addAttachment(*e5, "video/mp4"_s);
+
+            Event::Pointer e6 = message(b, 50, Direction::Outgoing, "acc2"_s);
+
+            for (Event::Pointer const& event : {e1, e2, e3, e4, e5, e6})
+            {
+                storage.saveEvent(*event);
+                events.push_back(event);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        EventStream::Pointer stream(ali::string_const_ref key,
+                                    ali::string_const_ref party,
+                                    ali::string_const_ref color)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            EventStream::Pointer stream = TestStorage::createEventStream(key);
+
+            StreamParty streamParty;
+            streamParty.genericUri = party;
+            stream->addStreamParty(streamParty);
+            stream->setAttribute("color"_s, color);
+
+            storage.saveEventStream(*stream);
+            return stream;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static Event::Pointer message(EventStream::Pointer const& stream,
+                                      double timestamp,
+                                      Direction::Type direction,
+                                      ali::string_const_ref accountId)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            Event::Pointer event = MessageEvent::create();
+            setup(*event, stream, timestamp, direction, accountId);
+            return event;
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void setup(Event & event,
+                          EventStream::Pointer const& stream,
+                          double timestamp,
+                          Direction::Type direction,
+                          ali::string_const_ref accountId)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            event.setStream(stream);
+            event.setTimestamp(TimestampType(timestamp));
+            event.setDirection(direction);
+            event.setAccount(accountId);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void addRemoteUser(Event & event,
+                                  ali::string_const_ref uri)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            RemoteUser user;
+            user.setGenericUri(uri);
+            user.setTransportUri(uri);
+            event.addRemoteUser(ali::move(user));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        static void addAttachment(Event & event,
+                                  ali::string_const_ref kind)
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            EventAttachment attachment(ali::mime::content_type{},
+                                       Attribute::Value("media"_s));
+            attachment.setAttribute("kind"_s, kind);
+            event.addEventAttachment(ali::move(attachment));
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        Event::Pointer const& event(EventIdType id) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            return events[static_cast<int>(id) - 1];
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void expect(Query const& query,
+                    Paging const& paging,
+                    Ids const& expected,
+                    int line) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        /// Fetches with and without the total count, which take different paths.
+        {
+            FetchResult counted;
+            storage.fetchEvents(counted, query, paging, true);
+            checkIds(idsOf(counted), expected, "fetchEvents counted", line);
+
+            FetchResult uncounted;
+            storage.fetchEvents(uncounted, query, paging, false);
+            checkIds(idsOf(uncounted), expected, "fetchEvents uncounted", line);
+            check(uncounted.totalCount == -1, "totalCount == -1", line);
+
+            bool const unbounded = paging.limit.is_null() && paging.offset.is_null()
+                && paging.newerThan.is_null() && paging.olderThan.is_null()
+                && paging.before.is_null() && paging.after.is_null();
+
+            if (unbounded)
+            {
+                check(counted.totalCount == static_cast<int>(expected.size()),
+                      "totalCount == expected.size()", line);
+                check(storage.getEventCount(query) == static_cast<int>(expected.size()),
+                      "getEventCount == expected.size()", line);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void expect(Query const& query,
+                    Ids const& expected,
+                    int line) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            expect(query, Paging(), expected, line);
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void expect(StreamQuery const& query,
+                    StreamPaging const& paging,
+                    Keys const& expected,
+                    int line) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            StreamFetchResult counted;
+            storage.fetchEventStreams(counted, query, paging, true);
+            check(sameKeys(counted, expected), "fetchEventStreams counted", line);
+
+            StreamFetchResult uncounted;
+            storage.fetchEventStreams(uncounted, query, paging, false);
+            check(sameKeys(uncounted, expected), "fetchEventStreams uncounted", line);
+
+            if (paging.limit.is_null() && paging.offset.is_null())
+            {
+                check(counted.totalCount == static_cast<int>(expected.size()),
+                      "totalCount == expected.size()", line);
+                check(storage.getStreamCount(query) == static_cast<int>(expected.size()),
+                      "getStreamCount == expected.size()", line);
+            }
+        }
+
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        void expect(StreamQuery const& query,
+                    Keys const& expected,
+                    int line) const
+        //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+        {
+            expect(query, StreamPaging(), expected, line);
+        }
+    };
+
+    #define EXPECT(history, ...) (history).expect(__VA_ARGS__, __LINE__)
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testQueryFields()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+
+        EXPECT(h, Query(), Ids{6, 5, 4, 3, 2, 1});
+
+        {
+            Query q;
+            q.streamKey = ali::string("s:a"_s);
+            EXPECT(h, q, Ids{5, 2, 1});
+        }
+        {
+            Query q;
+            q.eventType = EventType::Call;
+            EXPECT(h, q, Ids{3});
+            q.eventType = EventType::Message;
+            EXPECT(h, q, Ids{6, 5, 4, 2, 1});
+        }
+        {
+            Query q;
+            q.newerThan = TimestampType(30.0);
+            EXPECT(h, q, Ids{6, 5, 4, 3});
+        }
+        {
+            Query q;
+            q.olderThan = TimestampType(30.0);
+            EXPECT(h, q, Ids{2, 1});
+        }
+        {
+            Query q;
+            q.eventIds.insert(2);
+            q.eventIds.insert(4);
+            EXPECT(h, q, Ids{4, 2});
+        }
+        {
+            Query q;
+            q.accountId = ali::string("acc2"_s);
+            EXPECT(h, q, Ids{6, 4, 3});
+        }
+        {
+            Query q;
+            q.directionMask = static_cast<int>(Direction::Outgoing);
+            EXPECT(h, q, Ids{6, 2});
+            q.directionMask = static_cast<int>(Direction::all);
+            EXPECT(h, q, Ids{6, 5, 4, 3, 2, 1});
+        }
+        {
+            Query q;
+            q.hidden = true;
+            EXPECT(h, q, Ids{3});
+            q.hidden = false;
+            EXPECT(h, q, Ids{6, 5, 4, 2, 1});
+        }
+        {
+            Query q;
+            q.withAttributes.insert(Query::Attr("tag"_s));
+            EXPECT(h, q, Ids{2, 1});
+            q.withAttributes.erase();
+            q.withAttributes.insert(Query::Attr("tag"_s, "red"_s));
+            EXPECT(h, q, Ids{1});
+        }
+        {
+            Query q;
+            q.withoutAttributes.insert(Query::Attr("tag"_s));
+            EXPECT(h, q, Ids{6, 5, 4, 3});
+            q.withoutAttributes.erase();
+            q.withoutAttributes.insert(Query::Attr("tag"_s, "red"_s));
+            EXPECT(h, q, Ids{6, 5, 4, 3, 2});
+        }
+        {
+            Query q;
+            q.withEventAttachmentAttributes.insert(Query::Attr("kind"_s));
+            EXPECT(h, q, Ids{5, 4});
+            q.withEventAttachmentAttributes.erase();
+            q.withEventAttachmentAttributes.insert(Query::Attr("kind"_s, "image/png"_s));
+            EXPECT(h, q, Ids{4});
+        }
+        {
+            Query q;
+            q.withEventAttachmentAttributesStartingWith.insert(Query::Attr("kind"_s, "video/"_s));
+            EXPECT(h, q, Ids{5});
+        }
+        {
+            Query q;
+            q.withRemoteUser.prefix = "sip:"_s;
+            EXPECT(h, q, Ids{1});
+            q.withRemoteUser.prefix.erase();
+            q.withRemoteUser.pattern = "12"_s;
+            EXPECT(h, q, Ids{4});
+            q.withRemoteUser.prefix = "sip:"_s;
+            EXPECT(h, q, Ids{});
+        }
+        {
+            // All conditions together.
+            Query q;
+            q.streamKey = ali::string("s:b"_s);
+            q.eventType = EventType::Message;
+            q.directionMask = static_cast<int>(Direction::Incoming);
+            q.newerThan = TimestampType(40.0);
+            q.accountId = ali::string("acc2"_s);
+            q.hidden = false;
+            EXPECT(h, q, Ids{4});
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testPagingFields()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+        Query all;
+
+        {
+            Paging p;
+            p.limit = 2;
+            EXPECT(h, all, p, Ids{6, 5});
+
+            FetchResult result;
+            h.storage.fetchEvents(result, all, p, true);
+            CHECK(result.totalCount == 6);
+        }
+        {
+            Paging p;
+            p.offset = 2;
+            p.limit = 2;
+            EXPECT(h, all, p, Ids{4, 3});
+        }
+        {
+            Paging p;
+            p.order = SortOrder::Ascending;
+            EXPECT(h, all, p, Ids{1, 2, 3, 4, 5, 6});
+        }
+        {
+            Paging p;
+            p.newerThan = TimestampType(30.0);
+            EXPECT(h, all, p, Ids{6, 5, 4, 3});
+        }
+        {
+            Paging p;
+            p.olderThan = TimestampType(30.0);
+            EXPECT(h, all, p, Ids{2, 1});
+        }
+        {
+            // Events are ordered by timestamp and ID, 5 and 6 share a timestamp.
+            Paging p;
+            p.before = h.event(6);
+            EXPECT(h, all, p, Ids{5, 4, 3, 2, 1});
+            p.before = h.event(5);
+            EXPECT(h, all, p, Ids{4, 3, 2, 1});
+        }
+        {
+            Paging p;
+            p.order = SortOrder::Ascending;
+            p.after = h.event(4);
+            EXPECT(h, all, p, Ids{5, 6});
+            p.after = h.event(5);
+            EXPECT(h, all, p, Ids{6});
+        }
+        {
+            Query q;
+            q.streamKey = ali::string("s:a"_s);
+
+            Paging p;
+            p.limit = 1;
+            p.offset = 1;
+            p.order = SortOrder::Ascending;
+            EXPECT(h, q, p, Ids{2});
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testStreamQueryFields()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+
+        // s:a and s:b share their last activity and are ordered by key.
+        EXPECT(h, StreamQuery(), Keys{"s:b", "s:a", "s:c"});
+
+        {
+            StreamQuery q;
+            q.withStreamKeys.insert("s:a"_s);
+            EXPECT(h, q, Keys{"s:a"});
+        }
+        {
+            StreamQuery q;
+            q.withoutStreamKeys.insert("s:a"_s);
+            EXPECT(h, q, Keys{"s:b", "s:c"});
+        }
+        {
+            StreamQuery q;
+            q.lastActivityAfter = TimestampType(10.0);
+            EXPECT(h, q, Keys{"s:b", "s:a"});
+            q.lastActivityAfter = TimestampType(50.0);
+            EXPECT(h, q, Keys{});
+        }
+        {
+            StreamQuery q;
+            q.lastActivityBefore = TimestampType(50.0);
+            EXPECT(h, q, Keys{"s:c"});
+            q.lastActivityAfter = TimestampType(10.0);
+            EXPECT(h, q, Keys{});
+            q.lastActivityBefore = TimestampType(60.0);
+            EXPECT(h, q, Keys{"s:b", "s:a"});
+        }
+        {
+            StreamQuery q;
+            q.withParties.insert("sip:alice@example.com"_s);
+            EXPECT(h, q, Keys{"s:a"});
+        }
+        {
+            StreamQuery q;
+            q.withAttributes.insert(StreamQuery::Attr("color"_s));
+            EXPECT(h, q, Keys{"s:b", "s:a"});
+            q.withAttributes.erase();
+            q.withAttributes.insert(StreamQuery::Attr("color"_s, "red"_s));
+            EXPECT(h, q, Keys{"s:a"});
+        }
+        {
+            StreamQuery q;
+            q.withoutAttributes.insert(StreamQuery::Attr("color"_s, "red"_s));
+            EXPECT(h, q, Keys{"s:b", "s:c"});
+        }
+        {
+            StreamQuery q;
+            q.state = StreamQuery::StreamState::OnlyClosed;
+            EXPECT(h, q, Keys{"s:c"});
+            q.state = StreamQuery::StreamState::OnlyOpen;
+            EXPECT(h, q, Keys{"s:b", "s:a"});
+        }
+        {
+            StreamPaging p;
+            p.limit = 2;
+            EXPECT(h, StreamQuery(), p, Keys{"s:b", "s:a"});
+            p.offset = 1;
+            EXPECT(h, StreamQuery(), p, Keys{"s:a", "s:c"});
+
+            StreamFetchResult result;
+            h.storage.fetchEventStreams(result, StreamQuery(), p, true);
+            CHECK(result.totalCount == 3);
+        }
+        {
+            StreamPaging p;
+            p.order = SortOrder::Ascending;
+            EXPECT(h, StreamQuery(), p, Keys{"s:c", "s:a", "s:b"});
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testCachedPlans()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Queries of one shape share a plan, which must not depend on the values
+    /// of the first query planned: from time 40 on every event is a message,
+    /// from time 0 on the call 3 must still be filtered out.
+    {
+        for (bool countTotal : {true, false})
+        {
+            History h;
+
+            Query q;
+            q.eventType = EventType::Message;
+            q.newerThan = TimestampType(40.0);
+
+            FetchResult result;
+            h.storage.fetchEvents(result, q, Paging(), countTotal);
+            checkIds(idsOf(result), Ids{6, 5, 4}, "first query", __LINE__);
+
+            ali::int64 const hits = h.storage.getPlanCacheStatistics().hits;
+
+            q.newerThan = TimestampType(0.0);
+            h.storage.fetchEvents(result, q, Paging(), countTotal);
+            checkIds(idsOf(result), Ids{6, 5, 4, 2, 1}, "second query", __LINE__);
+            CHECK(h.storage.getPlanCacheStatistics().hits == hits + 1);
+
+            // The same with a direction mask.
+            Query d;
+            d.directionMask = static_cast<int>(Direction::Incoming);
+            d.olderThan = TimestampType(15.0);
+            h.storage.fetchEvents(result, d, Paging(), countTotal);
+            checkIds(idsOf(result), Ids{1}, "first query", __LINE__);
+
+            d.olderThan = TimestampType(100.0);
+            h.storage.fetchEvents(result, d, Paging(), countTotal);
+            checkIds(idsOf(result), Ids{5, 4, 3, 1}, "second query", __LINE__);
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testEventCursor()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        for (bool countTotal : {true, false})
+        {
+            for (SortOrder::Type order : {SortOrder::Descending, SortOrder::Ascending})
+            {
+                History h;
+
+                Paging paging;
+                paging.limit = 4;
+                paging.order = order;
+
+                FetchResult page;
+                h.storage.fetchEvents(page, Query(), paging, countTotal);
+                EventCursor cursor = page.nextCursor(paging);
+
+                Ids all = idsOf(page);
+                CHECK(!cursor.isEnd());
+                CHECK(cursor.getLastEvent() == page.items.back().event);
+
+                while (!cursor.isEnd())
+                {
+                    Paging next = paging;
+                    cursor.seek(next);
+                    CHECK(next.offset.is_null());
+
+                    h.storage.fetchEvents(page, Query(), next, countTotal);
+                    cursor = page.nextCursor(next);
+
+                    Ids const ids = idsOf(page);
+                    all.insert(all.end(), ids.begin(), ids.end());
+                }
+
+                checkIds(all, order == SortOrder::Descending
+                    ? Ids{6, 5, 4, 3, 2, 1} : Ids{1, 2, 3, 4, 5, 6},
+                    "paging with EventCursor", __LINE__);
+            }
+        }
+
+        {
+            // The cursor holds its last event, deleting it does not lose the position.
+            History h;
+
+            Query q;
+            q.streamKey = ali::string("s:a"_s);
+
+            Paging paging;
+            paging.limit = 1;
+
+            FetchResult page;
+            h.storage.fetchEvents(page, q, paging, false);
+            checkIds(idsOf(page), Ids{5}, "first page", __LINE__);
+
+            EventCursor cursor = page.nextCursor(paging);
+            h.storage.deleteEvent(5);
+
+            Paging next = paging;
+            cursor.seek(next);
+            h.storage.fetchEvents(page, q, next, false);
+            checkIds(idsOf(page), Ids{2}, "page after deleting the cursor's event", __LINE__);
+        }
+
+        {
+            // A full last page is followed by an empty one.
+            History h;
+
+            Query q;
+            q.streamKey = ali::string("s:b"_s);
+
+            Paging paging;
+            paging.limit = 3;
+
+            FetchResult page;
+            h.storage.fetchEvents(page, q, paging, false);
+            EventCursor cursor = page.nextCursor(paging);
+            CHECK(!cursor.isEnd());
+
+            Paging next = paging;
+            cursor.seek(next);
+            h.storage.fetchEvents(page, q, next, false);
+            CHECK(page.items.is_empty());
+            CHECK(page.nextCursor(next).isEnd());
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testStreamCursor()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        for (bool countTotal : {true, false})
+        {
+            for (SortOrder::Type order : {SortOrder::Descending, SortOrder::Ascending})
+            {
+                History h;
+
+                StreamQuery query;
+                StreamPaging paging;
+                paging.limit = 1;
+                paging.order = order;
+
+                StreamFetchResult page;
+                StreamCursor cursor;
+                ali::array<ali::string> keys;
+
+                // One stream per page walks through the tie of s:a and s:b.
+                do
+                {
+                    StreamQuery q = query;
+                    StreamPaging p = paging;
+                    cursor.seek(q, p);
+
+                    h.storage.fetchEventStreams(page, q, p, countTotal);
+                    cursor = page.nextCursor(p, cursor);
+
+                    for (int i = 0; i < page.items.size(); ++i)
+                        keys.push_back(page.items[i].stream->key);
+                }
+                while (!cursor.isEnd());
+
+                bool const descending = order == SortOrder::Descending;
+
+                CHECK(keys.size() == 3);
+                CHECK(keys.size() == 3 && keys[0] == (descending ? "s:b"_s : "s:c"_s));
+                CHECK(keys.size() == 3 && keys[1] == "s:a"_s);
+                CHECK(keys.size() == 3 && keys[2] == (descending ? "s:c"_s : "s:b"_s));
+            }
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testUnreadCounts()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        History h;
+        MemoryStorage & s = h.storage;
+
+        // Outgoing and hidden events are never unread.
+        CHECK(s.getTotalUnreadEventCount() == 3);
+        CHECK(s.getStreamUnreadEventCount("s:a"_s) == 2);
+        CHECK(s.getStreamUnreadEventCount("s:b"_s) == 1);
+        CHECK(s.getStreamUnreadEventCount("s:c"_s) == 0);
+        CHECK(s.getAccountUnreadEventCount("acc1"_s) == 2);
+        CHECK(s.getAccountUnreadEventCount("acc2"_s) == 1);
+        CHECK(h.a->getUnreadCount() == 2);
+        CHECK(h.b->getUnreadCount() == 1);
+        CHECK(s.checkUnreadCounters());
+
+        {
+            StreamQuery q;
+            CHECK(s.getUnreadEventCount(q) == 3);
+            q.withStreamKeys.insert("s:b"_s);
+            CHECK(s.getUnreadEventCount(q) == 1);
+        }
+        {
+            StreamQuery q;
+            q.withAttributes.insert(StreamQuery::Attr("color"_s, "red"_s));
+            CHECK(s.getUnreadEventCount(q) == 2);
+        }
+
+        // Seeing s:a up to event 1, inclusive.
+        h.a->setLastSeenTimestamp(TimestampType(10.0));
+        s.saveEventStream(*h.a);
+
+        CHECK(s.getTotalUnreadEventCount() == 2);
+        CHECK(s.getStreamUnreadEventCount("s:a"_s) == 1);
+        CHECK(s.getAccountUnreadEventCount("acc1"_s) == 1);
+        CHECK(h.a->getUnreadCount() == 1);
+        CHECK(s.checkUnreadCounters());
+
+        // Moving the last seen timestamp back makes events unread again.
+        h.a->setLastSeenTimestamp(TimestampType(0.0));
+        s.saveEventStream(*h.a);
+        CHECK(s.getStreamUnreadEventCount("s:a"_s) == 2);
+        CHECK(s.checkUnreadCounters());
+
+        // Events change their unread state when saved again.
+        h.event(5)->setHidden(true);
+        s.saveEvent(*h.event(5));
+        CHECK(s.getStreamUnreadEventCount("s:a"_s) == 1);
+
+        h.event(2)->setDirection(Direction::Incoming);
+        s.saveEvent(*h.event(2));
+        CHECK(s.getStreamUnreadEventCount("s:a"_s) == 2);
+        CHECK(s.checkUnreadCounters());
+
+        // Deleted events are no longer counted.
+        s.deleteEvent(4);
+        CHECK(s.getStreamUnreadEventCount("s:b"_s) == 0);
+        CHECK(s.getAccountUnreadEventCount("acc2"_s) == 0);
+        CHECK(s.getTotalUnreadEventCount() == 2);
+        CHECK(s.checkUnreadCounters());
+
+        s.deleteEventStream("s:a"_s);
+        CHECK(s.getTotalUnreadEventCount() == 0);
+        CHECK(s.checkUnreadCounters());
+
+        // A transaction updates the counters as it goes.
+        {
+            MemoryStorage::Transaction transaction(s);
+
+            Event::Pointer event = History::message(h.b, 60, Direction::Incoming, "acc2"_s);
+            s.saveEvent(*event);
+            CHECK(s.getStreamUnreadEventCount("s:b"_s) == 1);
+        }
+
+        CHECK(h.b->getUnreadCount() == 1);
+        CHECK(s.checkUnreadCounters());
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testRemoteUserIndex()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        using Match = RemoteUserIndex::Match;
+
+        // Compares every kind of lookup with matching the addresses one by one.
+        auto verify = [](RemoteUserIndex const& index,
+                         std::vector<ali::string> const& live,
+                         int line)
+        {
+            char const* const texts[] = {"1", "12", "23", "123", "sip:", "@b.c", "a", "x", "3@b.c"};
+
+            for (char const* t : texts)
+            {
+                ali::string const text{ali::c_string_const_ref(t)};
+
+                for (Match match : {Match::Exact, Match::Prefix, Match::Suffix, Match::Contains})
+                {
+                    ali::array_set<ali::string> expected;
+
+                    for (ali::string const& address : live)
+                    {
+                        bool const found = match == Match::Exact ? address == text
+                            : match == Match::Prefix ? address.begins_with(text)
+                            : match == Match::Suffix ? address.ref().ends_with_n(text.ref())
+                            : address.find(text) != ali::string::npos;
+
+                        if (found)
+                            expected.insert(address);
+                    }
+
+                    ali::array_set<ali::string> actual;
+                    index.findAddresses(actual, text, match);
+                    check(actual == expected, t, line);
+                }
+            }
+
+            check(index.getAddressCount() == static_cast<int>(live.size()), "getAddressCount", line);
+        };
+
+        RemoteUserIndex index;
+        std::vector<ali::string> live;
+
+        auto add = [&](EventIdType id, char const* t)
+        {
+            ali::string const address{ali::c_string_const_ref(t)};
+            index.add(id, address);
+
+            for (ali::string const& a : live)
+                if (a == address)
+                    return;
+
+            live.push_back(address);
+        };
+
+        auto remove = [&](EventIdType id, char const* t)
+        {
+            ali::string const address{ali::c_string_const_ref(t)};
+            index.remove(id, address);
+
+            ali::array_set<EventIdType> ids;
+            index.find(ids, address, Match::Exact);
+
+            if (ids.is_empty())
+                for (int i = 0; i < static_cast<int>(live.size()); ++i)
+                    if (live[i] == address)
+                        live.erase(live.begin() + i);
+        };
+
+        add(1, "sip:123@b.c");
+        add(2, "tel:123");
+        add(3, "sip:a@b.c");
+        add(4, "1231");
+        verify(index, live, __LINE__);
+
+        // Both events keep the address, the second one removes it.
+        add(5, "tel:123");
+        remove(2, "tel:123");
+        verify(index, live, __LINE__);
+        remove(5, "tel:123");
+        verify(index, live, __LINE__);
+
+        // Removed addresses are skipped before they are dropped, and their
+        // slots are reused once they are.
+        remove(4, "1231");
+        verify(index, live, __LINE__);
+        remove(3, "sip:a@b.c");
+        verify(index, live, __LINE__);
+        add(6, "23");
+        add(7, "sip:a@b.c");
+        add(8, "x123");
+        verify(index, live, __LINE__);
+
+        ali::array_set<EventIdType> ids;
+        index.find(ids, "123"_s, Match::Contains);
+        checkIds(std::vector<EventIdType>(ids.begin(), ids.end()), Ids{1, 8}, "contains 123", __LINE__);
+        CHECK(index.count(""_s, "123"_s) == 2);
+        CHECK(index.count("sip:"_s, "@b"_s) == 2);
+
+        index.find(ids, "s?p:*@b.c"_s, Match::Wildcard);
+        checkIds(std::vector<EventIdType>(ids.begin(), ids.end()), Ids{1, 7}, "wildcard", __LINE__);
+
+        index.clear();
+        live.clear();
+        verify(index, live, __LINE__);
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testAsyncFetch()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    {
+        for (bool prefetchNext : {false, true})
+        {
+            History h;
+
+            // One worker takes the tasks submitted from it LIFO.
+            ali::thread_pool pool(1);
+
+            AsyncEventFetcher fetcher([&h](Query const& query, Paging const& paging)
+            {
+                FetchResult result;
+                h.storage.fetchEvents(result, query, paging, false);
+                return result;
+            }, {}, pool);
+
+            std::mutex mutex;
+            std::condition_variable changed;
+            ali::array<ali::auto_ptr<ali::handle>> handles;
+            Ids ids;
+            int pages = 0;
+            bool end = false;
+
+            AsyncEventFetcher::OnChunk onChunk;
+            onChunk = [&](AsyncEventFetcher::Chunk const& chunk)
+            {
+                std::lock_guard<std::mutex> const lock(mutex);
+
+                for (int i = 0; i < chunk.items.size(); ++i)
+                    ids.push_back(chunk.items[i].event->getEventId());
+
+                if (chunk.last && ++pages == 1)
+                {
+                    // Asking for more pages while the first one is being
+                    // delivered, on the pool thread; the last request finds
+                    // the listing at its end.
+                    for (int i = 0; i < 4; ++i)
+                        handles.push_back(fetcher.fetchNext(onChunk));
+                }
+
+                end = chunk.end;
+                changed.notify_all();
+            };
+
+            AsyncEventFetcher::Options options;
+            options.chunkSize = 1;
+            options.prefetchNext = prefetchNext;
+
+            Paging paging;
+            paging.limit = 2;
+
+            ali::auto_ptr<ali::handle> first = fetcher.fetch(Query(), paging, onChunk, options);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait_for(lock, std::chrono::seconds(10), [&] {return pages == 5;});
+
+                CHECK(pages == 5);
+                CHECK(end);
+                checkIds(ids, Ids{6, 5, 4, 3, 2, 1}, "fetch and fetchNext", __LINE__);
+            }
+
+            // Destroying the handles waits for the request being served.
+            first.reset();
+            handles.erase();
+            CHECK(fetcher.isEnd());
+            CHECK(fetcher.fetchNext(onChunk).is_null());
+        }
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    void testBatchDeletion()
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+    /// Deletes by each access path in batches of 4 and compares with the
+    /// events fetchEvents finds; every query also has a condition its
+    /// driving index does not check, so some candidates are skipped.
+    {
+        using Access = QueryPlan::Access;
+
+        auto fill = [](TestStorage & storage)
+        {
+            EventStream::Pointer streams[3];
+
+            for (int i = 0; i < 3; ++i)
+            {
+                char key[8];
+                std::snprintf(key, sizeof(key), "s:%d", i);
+                streams[i] = TestStorage::createEventStream(ali::string{ali::c_string_const_ref(key)});
+                storage.saveEventStream(*streams[i]);
+            }
+
+            for (int i = 1; i <= 120; ++i)
+            {
+                Event::Pointer event = i % 4 == 0 ? Event::Pointer(CallEvent::create()) : Event::Pointer(MessageEvent::create());
+                History::setup(*event, streams[i % 3], i,
+                               i % 2 != 0 ? Direction::Incoming : Direction::Outgoing, "acc1"_s);
+
+                if (i % 5 == 0)
+                    event->setAttribute("tag"_s, "red"_s);
+
+                if (i % 3 == 0)
+                    event->setAttribute("note"_s, "x"_s);
+
+                if (i % 7 == 0)
+                    History::addRemoteUser(*event, "sip:bob@example.com"_s);
+
+                storage.saveEvent(*event);
+            }
+        };
+
+        Query time;
+        time.newerThan = TimestampType(30.0);
+        time.withoutAttributes.insert(Query::Attr("note"_s));
+
+        Query stream;
+        stream.streamKey = "s:1"_s;
+        stream.withoutAttributes.insert(Query::Attr("note"_s));
+
+        Query kind;
+        kind.eventType = EventType::Call;
+        kind.withoutAttributes.insert(Query::Attr("note"_s));
+
+        Query attribute;
+        attribute.withAttributes.insert(Query::Attr("tag"_s, "red"_s));
+        attribute.withoutAttributes.insert(Query::Attr("note"_s));
+
+        Query remoteUser;
+        remoteUser.withRemoteUser.prefix = "sip:bob"_s;
+        remoteUser.withoutAttributes.insert(Query::Attr("note"_s));
+
+        Query ids;
+        for (EventIdType id = 10; id <= 100; id += 6)
+            ids.eventIds.insert(id);
+        ids.withoutAttributes.insert(Query::Attr("note"_s));
+
+        struct
+        {
+            Query const& query;
+            Access access;
+        } const cases[] =
+        {
+            {time, Access::Time},
+            {stream, Access::Stream},
+            {kind, Access::Kind},
+            {attribute, Access::Attribute},
+            {remoteUser, Access::RemoteUser},
+            {ids, Access::EventIds},
+        };
+
+        for (auto const& c : cases)
+        {
+            TestStorage storage;
+            fill(storage);
+
+            CHECK(storage.explain(c.query).access == c.access);
+
+            FetchResult result;
+            storage.fetchEvents(result, Query());
+            Ids const before = idsOf(result);
+
+            storage.fetchEvents(result, c.query);
+            Ids const doomed = idsOf(result);
+            CHECK(!doomed.empty());
+
+            Ids expected;
+            for (EventIdType id : before)
+                if (std::find(doomed.begin(), doomed.end(), id) == doomed.end())
+                    expected.push_back(id);
+
+            int batches = 0;
+            int reported = 0;
+            bool bounded = true;
+
+            storage.wantEventsRemovedCallback(&batches, [&](MemoryStorage::RemovedEvents const& removed)
+            {
+                ++batches;
+                reported += removed.eventIds.size();
+                bounded = bounded && removed.eventIds.size() <= 4;
+            });
+
+            int const deleted = storage.deleteEventsInBatches(c.query, 4);
+
+            CHECK(deleted == static_cast<int>(doomed.size()));
+            CHECK(reported == deleted);
+            CHECK(batches == (deleted + 3) / 4);
+            CHECK(bounded);
+
+            storage.fetchEvents(result, Query());
+            checkIds(idsOf(result), expected, "remaining events", __LINE__);
+        }
+
+        // Whole streams go in one sweep.
+        {
+            TestStorage storage;
+            fill(storage);
+
+            CHECK(storage.deleteEventStream("s:1"_s));
+
+            Query q;
+            q.streamKey = "s:1"_s;
+            CHECK(storage.getEventCount(q) == 0);
+            CHECK(storage.getEventCount(Query()) == 80);
+        }
+    }
+}
+
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+int main()
+//*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+{
+    struct
+    {
+        char const* name;
+        void (*run)();
+    } const tests[] =
+    {
+        {"query fields", testQueryFields},
+        {"paging fields", testPagingFields},
+        {"stream query fields", testStreamQueryFields},
+        {"cached plans", testCachedPlans},
+        {"event cursor", testEventCursor},
+        {"stream cursor", testStreamCursor},
+        {"unread counts", testUnreadCounts},
+        {"remote user index", testRemoteUserIndex},
+        {"async fetch", testAsyncFetch},
+        {"batch deletion", testBatchDeletion},
+    };
+
+    for (auto const& test : tests)
+    {
+        int const failures = sFailures;
+        test.run();
+        std::printf("%s %s\n", sFailures == failures ? "ok  " : "FAIL", test.name);
+    }
+
+    return sFailures == 0 ? 0 : 1;
+}
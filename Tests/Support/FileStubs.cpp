@@ -0,0 +1,829 @@
+/*
+ *  Support/FileStubs.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+// Host definitions of the ali file system and XML symbols used by the
+// event history components that keep files (AttachmentCollector,
+// EventArchive). Files are real POSIX files, so tests work in a
+// temporary directory. Paths are POSIX paths: an absolute path has the
+// root "/", segments are separated by '/'. The XML parser reads what
+// ali::xml::writer writes (elements, attributes, character data and the
+// five predefined entities) and skips declarations and comments. The
+// binary XML format comes from the headers; only the little-endian
+// writers and deserializer::read_all it uses are defined here.
+
+#include "ali/ali_filesystem2.h"
+#include "ali/ali_string_map.h"
+#include "ali/ali_xml_parser2_interface.h"
+#include "ali/ali_xml_tree2.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ali
+{
+
+namespace hidden
+{
+
+// ******************************************************************
+common_string_map_entry& common_string_map_entry::set_value(
+    long long another_value )
+// ******************************************************************
+{
+    char buf[32];
+    int const n = std::snprintf(buf, sizeof(buf), "%lld", another_value);
+    return set_value(string_const_ref{buf, n});
+}
+
+// ******************************************************************
+bool common_string_map_entry::parse_value( long long& t ) const
+// ******************************************************************
+{
+    std::string const str(value.data(), value.size());
+
+    if ( str.empty() )
+        return false;
+
+    char* end = nullptr;
+    errno = 0;
+    long long const parsed = std::strtoll(str.c_str(), &end, 10);
+
+    if ( errno != 0 || end != str.c_str() + str.size() )
+        return false;
+
+    t = parsed;
+    return true;
+}
+
+// ******************************************************************
+bool common_string_map_entry::parse_value( long& t ) const
+// ******************************************************************
+{
+    long long parsed = 0;
+
+    if ( !parse_value(parsed) )
+        return false;
+
+    t = static_cast<long>(parsed);
+    return true;
+}
+
+}   //  namespace hidden
+
+// ******************************************************************
+array_ref<ali::uint8> const& array_ref<ali::uint8>::set_int_le_at(
+    int pos, ali::uint32 value, int byte_count ) const noexcept
+// ******************************************************************
+{
+    for ( int i = 0; i < byte_count; ++i, value >>= 8 )
+        this->data()[pos + i] = static_cast<ali::uint8>(value);
+
+    return *this;
+}
+
+// ******************************************************************
+array_ref<ali::uint8> const& array_ref<ali::uint8>::set_long_le_at(
+    int pos, ali::uint64 value, int byte_count ) const noexcept
+// ******************************************************************
+{
+    for ( int i = 0; i < byte_count; ++i, value >>= 8 )
+        this->data()[pos + i] = static_cast<ali::uint8>(value);
+
+    return *this;
+}
+
+// ******************************************************************
+bool deserializer::read_all( blob& buf )
+// ******************************************************************
+{
+    ali::uint8 chunk[4096];
+
+    for ( ;; )
+    {
+        int const n = read(blob_ref(chunk, sizeof chunk));
+
+        if ( n < 0 )
+            return false;
+
+        if ( n == 0 )
+            return true;
+
+        buf.append(blob_const_ref(chunk, n));
+    }
+}
+
+// ******************************************************************
+blob deserializer::read_all( void )
+// ******************************************************************
+{
+    blob buf;
+
+    if ( !read_all(buf) )
+        buf.erase();
+
+    return buf;
+}
+
+namespace filesystem2
+{
+
+// ******************************************************************
+bool path::parse_platform_string( tstring_const_ref platform_string )
+// ******************************************************************
+{
+    using ali::operator""_s;
+
+    erase();
+
+    int from = 0;
+
+    if ( !platform_string.is_empty() && platform_string[0] == '/' )
+    {
+        root = path_root{"/"_s};
+        from = 1;
+    }
+
+    for ( int i = from; i <= platform_string.size(); ++i )
+    {
+        if ( i < platform_string.size() && platform_string[i] != '/' )
+            continue;
+
+        if ( i > from )
+            segments.push_back(path_segment{platform_string.ref(from, i - from)});
+
+        from = i + 1;
+    }
+
+    return true;
+}
+
+// ******************************************************************
+ali::string& path::format_platform_string(
+    ali::string& platform_string,
+    int segment_count ) const
+// ******************************************************************
+{
+    platform_string.append(root._value);
+
+    for ( int i = 0; i < segment_count; ++i )
+    {
+        if ( i != 0 )
+            platform_string.push_back('/');
+
+        platform_string.append(segments[i].value);
+    }
+
+    return platform_string;
+}
+
+namespace file
+{
+
+// ******************************************************************
+void wrapper::handle_traits::destroy( native_handle h )
+// ******************************************************************
+{
+    ::close(h);
+}
+
+// ******************************************************************
+ali::int64 wrapper::size( void ) const
+// ******************************************************************
+{
+    struct stat st;
+    return ::fstat(_fd, &st) == 0 ? st.st_size : -1;
+}
+
+// ******************************************************************
+ali::int64 wrapper::pos( void ) const
+// ******************************************************************
+{
+    return ::lseek(_fd, 0, SEEK_CUR);
+}
+
+// ******************************************************************
+ali::int64 wrapper::set_pos_from_begin( ali::int64 offset )
+// ******************************************************************
+{
+    return ::lseek(_fd, offset, SEEK_SET);
+}
+
+// ******************************************************************
+ali::int64 wrapper::set_pos_from_end( ali::int64 offset )
+// ******************************************************************
+{
+    return ::lseek(_fd, offset, SEEK_END);
+}
+
+// ******************************************************************
+ali::int64 wrapper::set_pos_from_current( ali::int64 offset )
+// ******************************************************************
+{
+    return ::lseek(_fd, offset, SEEK_CUR);
+}
+
+// ******************************************************************
+int wrapper::read( void* buf, int bufSize )
+// ******************************************************************
+{
+    ssize_t const n = ::read(_fd, buf, bufSize);
+    return n < 0 ? 0 : static_cast<int>(n);
+}
+
+// ******************************************************************
+int wrapper::write( void const* buf, int bufSize )
+// ******************************************************************
+{
+    ssize_t const n = ::write(_fd, buf, bufSize);
+    return n < 0 ? 0 : static_cast<int>(n);
+}
+
+// ******************************************************************
+void wrapper::flush( void )
+// ******************************************************************
+{
+    ::fsync(_fd);
+}
+
+// ******************************************************************
+file::auto_handle try_open(
+    c_string_const_ref path,
+    unsigned mode,
+    open_result* result )
+// ******************************************************************
+{
+    namespace flag = open_mode::hidden::flag;
+
+    int flags = 0;
+
+    switch ( mode & flag::create_mask )
+    {
+    case flag::create_new:      flags |= O_CREAT | O_EXCL;  break;
+    case flag::create_always:   flags |= O_CREAT | O_TRUNC; break;
+    case flag::open_always:     flags |= O_CREAT;           break;
+    default:                                                break;
+    }
+
+    switch ( mode & flag::access_mask )
+    {
+    case flag::access_read:     flags |= O_RDONLY;          break;
+    case flag::access_write:    flags |= O_WRONLY;          break;
+    case flag::access_mask:     flags |= O_RDWR;            break;
+    default:
+        if ( result != nullptr )
+            *result = open_result::invalid_mode;
+        return file::auto_handle{};
+    }
+
+    int const fd = ::open(path.data(), flags | O_CLOEXEC, 0644);
+
+    if ( result != nullptr )
+    {
+        if ( fd >= 0 )
+            *result = open_result::success;
+        else if ( errno == ENOENT )
+            *result = open_result::not_found;
+        else if ( errno == EEXIST )
+            *result = open_result::already_exists;
+        else if ( errno == EACCES || errno == EPERM )
+            *result = open_result::access_denied;
+        else
+            *result = open_result::general_error;
+    }
+
+    return fd < 0 ? file::auto_handle{} : file::auto_handle{fd};
+}
+
+// ******************************************************************
+close_result try_close( file::auto_handle file )
+// ******************************************************************
+{
+    if ( file.is_null() )
+        return close_result::success;
+
+    return ::close(file.release()) == 0
+        ? close_result::success
+        : close_result::general_error;
+}
+
+// ******************************************************************
+remove_result try_remove( c_string_const_ref path )
+// ******************************************************************
+//  Like the SDK, fails on directories (unlink gives EISDIR).
+// ******************************************************************
+{
+    if ( ::unlink(path.data()) == 0 )
+        return remove_result::success;
+
+    switch ( errno )
+    {
+    case ENOENT:    return remove_result::not_found;
+    case EACCES:
+    case EPERM:     return remove_result::access_denied;
+    default:        return remove_result::general_error;
+    }
+}
+
+// ******************************************************************
+move_result try_move(
+    c_string_const_ref existing_path,
+    c_string_const_ref new_path,
+    overwrite::type owt )
+// ******************************************************************
+{
+    struct stat st;
+
+    if ( owt == overwrite::no && ::stat(new_path.data(), &st) == 0 )
+        return move_result::already_exists;
+
+    if ( ::rename(existing_path.data(), new_path.data()) == 0 )
+        return move_result::success;
+
+    switch ( errno )
+    {
+    case ENOENT:    return move_result::not_found;
+    case EACCES:
+    case EPERM:     return move_result::access_denied;
+    default:        return move_result::general_error;
+    }
+}
+
+// ******************************************************************
+ali::int64 get_size_result::size( void ) const
+// ******************************************************************
+{
+    ali_assert(is_success());
+    return _size;
+}
+
+// ******************************************************************
+get_size_result try_get_size( c_string_const_ref path )
+// ******************************************************************
+{
+    struct stat st;
+
+    if ( ::stat(path.data(), &st) != 0 )
+        return errno == ENOENT
+            ? get_size_result::not_found
+            : get_size_result::general_error;
+
+    if ( !S_ISREG(st.st_mode) )
+        return get_size_result::not_file;
+
+    return get_size_result{get_size_result::success, st.st_size};
+}
+
+}   //  namespace file
+
+}   //  namespace filesystem2
+
+namespace xml
+{
+
+// ******************************************************************
+trees::trees( void )
+// ******************************************************************
+{}
+
+// ******************************************************************
+trees::trees( trees const& b )
+// ******************************************************************
+{
+    for ( int i = 0; i != b.size(); ++i )
+        add(b[i]);
+}
+
+// ******************************************************************
+trees::trees( trees&& b )
+// ******************************************************************
+{
+    swap(b);
+}
+
+// ******************************************************************
+trees::~trees( void )
+// ******************************************************************
+{}
+
+// ******************************************************************
+tree& trees::add( void )
+// ******************************************************************
+{
+    return add(ali::new_auto_ptr<tree>());
+}
+
+// ******************************************************************
+tree& trees::add( stable_string const& name )
+// ******************************************************************
+{
+    return add(ali::new_auto_ptr<tree>(name));
+}
+
+// ******************************************************************
+tree& trees::add( stable_string const& name, stable_string const& data )
+// ******************************************************************
+{
+    return add(ali::new_auto_ptr<tree>(name, data));
+}
+
+// ******************************************************************
+tree& trees::add( tree const& t )
+// ******************************************************************
+{
+    return add(ali::new_auto_ptr<tree>(t));
+}
+
+// ******************************************************************
+tree& trees::add( ali::auto_ptr<tree> t )
+// ******************************************************************
+{
+    _trees.push_back(ali::move(t));
+    return *_trees.back();
+}
+
+// ******************************************************************
+tree& trees::add_swap( tree& t )
+// ******************************************************************
+{
+    tree& added = add();
+    added.swap(t);
+    return added;
+}
+
+// ******************************************************************
+trees& trees::erase( void )
+// ******************************************************************
+{
+    _trees.erase();
+    return *this;
+}
+
+// ******************************************************************
+bool trees::operator==( trees const& b ) const
+// ******************************************************************
+{
+    if ( size() != b.size() )
+        return false;
+
+    for ( int i = 0; i != size(); ++i )
+        if ( (*this)[i] != b[i] )
+            return false;
+
+    return true;
+}
+
+// ******************************************************************
+tree::tree( void )
+// ******************************************************************
+{}
+
+// ******************************************************************
+tree::tree( tree const& b )
+// ******************************************************************
+:   name{b.name},
+    data{b.data},
+    nodes{b.nodes},
+    attrs{b.attrs}
+{}
+
+// ******************************************************************
+tree::tree( tree&& b )
+// ******************************************************************
+{
+    swap(b);
+}
+
+// ******************************************************************
+tree::tree( stable_string const& name )
+// ******************************************************************
+:   name{name}
+{}
+
+// ******************************************************************
+tree::tree( stable_string const& name, stable_string const& data )
+// ******************************************************************
+:   name{name},
+    data{data}
+{}
+
+// ******************************************************************
+tree::~tree( void )
+// ******************************************************************
+{}
+
+namespace
+{
+
+// ******************************************************************
+class parser
+// ******************************************************************
+{
+public:
+    parser( char const* str, int size )
+    :   _str{str},
+        _end{str + size}
+    {}
+
+    bool parse( tree& root )
+    {
+        skip_prolog();
+
+        if ( !element(root) )
+            return false;
+
+        skip_prolog();
+        return true;
+    }
+
+    int processed( void ) const
+    {
+        return static_cast<int>(_pos - _str);
+    }
+
+private:
+    bool element( tree& t )
+    {
+        if ( !take('<') )
+            return false;
+
+        ali::string name;
+
+        if ( !read_name(name) )
+            return false;
+
+        t.name = name;
+
+        for ( ;; )
+        {
+            skip_space();
+
+            if ( take('/') )
+                return take('>');
+
+            if ( take('>') )
+                break;
+
+            ali::string attr;
+            ali::string value;
+
+            if ( !read_name(attr) )
+                return false;
+
+            skip_space();
+
+            if ( !take('=') )
+                return false;
+
+            skip_space();
+
+            if ( !read_quoted(value) )
+                return false;
+
+            t.attrs[attr].set_value(value);
+        }
+
+        ali::string data;
+
+        for ( ;; )
+        {
+            if ( _pos == _end )
+                return false;
+
+            if ( *_pos != '<' )
+            {
+                if ( !read_char(data) )
+                    return false;
+
+                continue;
+            }
+
+            if ( starts_with("<!--") )
+            {
+                if ( !skip_past("-->") )
+                    return false;
+
+                continue;
+            }
+
+            if ( starts_with("</") )
+            {
+                _pos += 2;
+
+                ali::string closing;
+
+                if ( !read_name(closing) || closing != name )
+                    return false;
+
+                skip_space();
+
+                if ( !take('>') )
+                    return false;
+
+                break;
+            }
+
+            if ( !element(t.nodes.add()) )
+                return false;
+        }
+
+        // Indentation between child elements is not data.
+        if ( !is_space(data) )
+            t.data = data;
+
+        return true;
+    }
+
+    bool read_name( ali::string& name )
+    {
+        char const* const begin = _pos;
+
+        while ( _pos != _end && !is_space(*_pos)
+                && *_pos != '=' && *_pos != '>'
+                && *_pos != '/' && *_pos != '<' )
+            ++_pos;
+
+        name.assign(string_const_ref{begin, static_cast<int>(_pos - begin)});
+        return !name.is_empty();
+    }
+
+    bool read_quoted( ali::string& value )
+    {
+        if ( _pos == _end || (*_pos != '"' && *_pos != '\'') )
+            return false;
+
+        char const quote = *_pos++;
+
+        while ( _pos != _end && *_pos != quote )
+            if ( !read_char(value) )
+                return false;
+
+        return take(quote);
+    }
+
+    bool read_char( ali::string& str )
+    //  Appends one character, decoding an entity.
+    {
+        if ( *_pos != '&' )
+        {
+            str.push_back(*_pos++);
+            return true;
+        }
+
+        static struct
+        {
+            char const* name;
+            char        c;
+        } const entities[] =
+        {
+            {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'},
+            {"&quot;", '"'}, {"&apos;", '\''},
+        };
+
+        for ( auto const& e : entities )
+        {
+            if ( !starts_with(e.name) )
+                continue;
+
+            _pos += std::char_traits<char>::length(e.name);
+            str.push_back(e.c);
+            return true;
+        }
+
+        return false;
+    }
+
+    void skip_prolog( void )
+    {
+        for ( ;; )
+        {
+            skip_space();
+
+            if ( starts_with("<?") )
+            {
+                if ( !skip_past("?>") )
+                    return;
+            }
+            else if ( starts_with("<!") )
+            {
+                if ( !skip_past(">") )
+                    return;
+            }
+            else
+            {
+                return;
+            }
+        }
+    }
+
+    bool skip_past( char const* str )
+    {
+        for ( ; _pos != _end; ++_pos )
+        {
+            if ( !starts_with(str) )
+                continue;
+
+            _pos += std::char_traits<char>::length(str);
+            return true;
+        }
+
+        return false;
+    }
+
+    void skip_space( void )
+    {
+        while ( _pos != _end && is_space(*_pos) )
+            ++_pos;
+    }
+
+    bool starts_with( char const* str ) const
+    {
+        int const n = static_cast<int>(std::char_traits<char>::length(str));
+        return _end - _pos >= n && std::char_traits<char>::compare(_pos, str, n) == 0;
+    }
+
+    bool take( char c )
+    {
+        if ( _pos == _end || *_pos != c )
+            return false;
+
+        ++_pos;
+        return true;
+    }
+
+    static bool is_space( char c )
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static bool is_space( string_const_ref str )
+    {
+        for ( int i = 0; i != str.size(); ++i )
+            if ( !is_space(str[i]) )
+                return false;
+
+        return true;
+    }
+
+private:
+    char const* const   _str;
+    char const* const   _end;
+    char const*         _pos{_str};
+};
+
+}   //  namespace
+
+// ******************************************************************
+bool parse( ali::xml::tree& root, char const* str, int size, int* processed )
+// ******************************************************************
+{
+    parser p{str, size};
+    tree t;
+
+    bool const success = p.parse(t);
+
+    if ( processed != nullptr )
+        *processed = p.processed();
+
+    if ( success )
+        root = ali::move(t);
+
+    return success;
+}
+
+// ******************************************************************
+bool load(
+    ali::xml::tree& root,
+    ali::tstring const& fileName )
+// ******************************************************************
+{
+    std::FILE* const f = std::fopen(fileName.data(), "rb");
+
+    if ( f == nullptr )
+        return false;
+
+    std::string text;
+    char buf[4096];
+    size_t n;
+
+    while ( (n = std::fread(buf, 1, sizeof(buf), f)) > 0 )
+        text.append(buf, n);
+
+    bool const failed = std::ferror(f) != 0;
+    std::fclose(f);
+
+    return !failed && parse(root, text.data(), static_cast<int>(text.size()));
+}
+
+}   //  namespace xml
+
+}   //  namespace ali
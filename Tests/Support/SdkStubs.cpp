@@ -0,0 +1,669 @@
+/*
+ *  Support/SdkStubs.cpp
+ *  libsoftphone tests
+ *
+ *  Copyright (c) 2013 - 2018 Acrobits, s.r.o. All rights reserved.
+ */
+
+// Minimal definitions of the ali and SDK symbols the header-only
+// event history code links against. The real ones live in the prebuilt
+// frameworks, which are built for Apple platforms only. Objects keep
+// their storage status like in the SDK; Event::save and EventStream::save
+// do nothing, tests save through the storage under test. Change callbacks
+// are delivered synchronously from postChangeCallbacks.
+
+#include "ali/ali_exception_if.h"
+#include "ali/ali_json.h"
+#include "ali/ali_printf.h"
+#include "ali/ali_stable_string.h"
+#include "ali/ali_string.h"
+
+#include "Softphone/EventHistory/CallEvent.h"
+#include "Softphone/EventHistory/EventHistoryStorage.h"
+#include "Softphone/EventHistory/MessageEvent.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace ali
+{
+
+// ******************************************************************
+void out_of_memory( ali::location )
+// ******************************************************************
+{
+    std::fputs("out of memory\n", stderr);
+    std::abort();
+}
+
+// ******************************************************************
+void general_error(
+    string_const_ref descr,
+    ali::location )
+// ******************************************************************
+{
+    std::fprintf(stderr, "general error: %.*s\n", descr.size(), descr.data());
+    std::abort();
+}
+
+// ******************************************************************
+void optional_is_null( ali::location )
+// ******************************************************************
+{
+    std::fputs("optional is null\n", stderr);
+    std::abort();
+}
+
+namespace hidden
+{
+
+// ******************************************************************
+string_data_sso::string_data_sso(
+    string_data_sso const& b,
+    int pos, int n )
+// ******************************************************************
+{
+    _begin[_size] = '\0';
+    assign(b, pos, ali::mini(n, b._size - pos));
+}
+
+// ******************************************************************
+string_data_sso::string_data_sso(
+    string_const_ref str )
+// ******************************************************************
+{
+    _begin[_size] = '\0';
+    assign(str);
+}
+
+// ******************************************************************
+string_data_sso::~string_data_sso( void ) noexcept
+// ******************************************************************
+{
+    release();
+}
+
+// ******************************************************************
+void string_data_sso::release( void ) noexcept
+// ******************************************************************
+{
+    if ( !is_small() )
+        delete[] _begin;
+
+    _begin = _small.begin;
+    _size = 0;
+    _begin[_size] = '\0';
+}
+
+// ******************************************************************
+void string_data_sso::private_reserve(
+    int min_capacity,
+    int retained_size )
+// ******************************************************************
+{
+    if ( min_capacity <= capacity() )
+        return;
+
+    E* const begin = new E[min_capacity + 1];
+    std::memcpy(begin, _begin, retained_size);
+    begin[retained_size] = '\0';
+
+    release();
+
+    _begin = begin;
+    _size = retained_size;
+    _capacity = min_capacity;
+}
+
+// ******************************************************************
+void string_data_sso::assign( string_const_ref b )
+// ******************************************************************
+{
+    //  b may point into this string.
+    std::string const copy(b.data(), b.size());
+
+    private_reserve(b.size(), 0);
+
+    std::memcpy(_begin, copy.data(), copy.size());
+    _size = b.size();
+    _begin[_size] = '\0';
+}
+
+// ******************************************************************
+void string_data_sso::assign( int n, E c )
+// ******************************************************************
+{
+    private_reserve(n, 0);
+
+    std::memset(_begin, c, n);
+    _size = n;
+    _begin[_size] = '\0';
+}
+
+// ******************************************************************
+void string_data_sso::resize( int n, E c )
+// ******************************************************************
+{
+    if ( n > capacity() )
+        private_reserve(ali::maxi(n, 2 * capacity()), _size);
+
+    if ( n > _size )
+        std::memset(_begin + _size, c, n - _size);
+
+    _size = n;
+    _begin[_size] = '\0';
+}
+
+// ******************************************************************
+void string_data_sso::swap_ls(
+    string_data_sso& a,
+    string_data_sso& b ) noexcept
+// ******************************************************************
+{
+    ali_assert(!a.is_small());
+    ali_assert(b.is_small());
+
+    E* const begin = a._begin;
+    int const size = a._size;
+    int const capacity = a._capacity;
+
+    a._small = b._small;
+    a._begin = a._small.begin;
+    a._size = b._size;
+
+    b._begin = begin;
+    b._size = size;
+    b._capacity = capacity;
+}
+
+// ******************************************************************
+void string_data_sso::swap( string_data_sso& b ) noexcept
+// ******************************************************************
+{
+    if ( is_small() && b.is_small() )
+        swap_ss(*this, b);
+    else if ( !is_small() && !b.is_small() )
+        swap_ll(*this, b);
+    else if ( is_small() )
+        swap_ls(b, *this);
+    else
+        swap_ls(*this, b);
+}
+
+// ******************************************************************
+bool printf_partition(
+    string_const_ptr& prefix,
+    string_const_ptr& value_format,
+    string_const_ptr& suffix,
+    string_const_ptr format_string )
+// ******************************************************************
+{
+    char const* const str = format_string->data();
+    int const n = format_string->size();
+
+    for ( int i = 0; i + 1 < n; ++i )
+    {
+        if ( str[i] != '%' )
+            continue;
+
+        if ( str[i + 1] == '%' )
+        {
+            ++i;
+            continue;
+        }
+
+        if ( str[i + 1] != '{' )
+            continue;
+
+        int end = i + 2;
+
+        while ( end < n && str[end] != '}' )
+            ++end;
+
+        prefix = string_const_ptr{str, i};
+        value_format = string_const_ptr{str + i + 2, end - i - 2};
+        suffix = end < n
+            ? string_const_ptr{str + end + 1, n - end - 1}
+            : string_const_ptr{str + n, 0};
+        return true;
+    }
+
+    prefix = format_string;
+    value_format = string_const_ptr{str + n, 0};
+    suffix = string_const_ptr{str + n, 0};
+    return false;
+}
+
+// ******************************************************************
+ali::string& printf_append_prefix(
+    ali::string& str, string_const_ptr prefix )
+// ******************************************************************
+{
+    char const* const begin = prefix->data();
+    int const n = prefix->size();
+
+    for ( int i = 0; i < n; ++i )
+    {
+        str.append_(begin[i]);
+
+        if ( begin[i] == '%' && i + 2 < n
+                && begin[i + 1] == '%' && begin[i + 2] == '{' )
+            ++i;
+    }
+
+    return str;
+}
+
+// ******************************************************************
+ali::string& printf(
+    ali::string& str, string_const_ptr& format_string )
+// ******************************************************************
+{
+    printf_append_prefix(str, format_string);
+    format_string = string_const_ptr{
+        format_string->data() + format_string->size(), 0};
+    return str;
+}
+
+// ******************************************************************
+ali::string& format(
+    ali::string& str,
+    unsigned long long value,
+    bool is_negative,
+    int /*original_size*/,
+    string_const_ref /*format_string*/ )
+// ******************************************************************
+{
+    char buf[32];
+    int const n = std::snprintf(buf, sizeof(buf), "%s%llu",
+        is_negative ? "-" : "", value);
+    return str.append(string_const_ref{buf, n});
+}
+
+}   //  namespace hidden
+
+// ******************************************************************
+ali::string& format(
+    ali::string& str,
+    string_const_ref value,
+    string_const_ref /*format_string*/ )
+// ******************************************************************
+{
+    return str.append(value);
+}
+
+// ******************************************************************
+stable_string::empty const stable_string::_empty{};
+// ******************************************************************
+
+// ******************************************************************
+stable_string::E const* stable_string::construct( string_const_ref str )
+// ******************************************************************
+//  No pool of frequent strings; every string gets its own copy.
+// ******************************************************************
+{
+    if ( str.is_empty() )
+        return &_empty.begin;
+
+    char* const block = new char[sizeof(header) + str.size() + 1];
+    new (block) header{str.size()};
+
+    E* const begin = block + sizeof(header);
+    std::memcpy(begin, str.data(), str.size());
+    begin[str.size()] = '\0';
+
+    return begin;
+}
+
+// ******************************************************************
+void json::object::clear( void )
+// ******************************************************************
+{
+    switch ( _type )
+    {
+    case String:
+        is_string()->~string();
+        break;
+
+    case Array:
+        is_array()->~array();
+        break;
+
+    case Dict:
+        is_dict()->~dict();
+        break;
+
+    default:
+        break;
+    }
+
+    _type = Null;
+}
+
+// ******************************************************************
+string& string::assign(
+    string const& b,
+    int pos,
+    int n )
+// ******************************************************************
+{
+    hidden::string_data::assign(b, pos, ali::mini(n, b.size() - pos));
+    return *this;
+}
+
+// ******************************************************************
+string& string::assign(
+    string&& b,
+    int pos,
+    int n ) noexcept
+// ******************************************************************
+{
+    if ( pos == 0 && n >= b.size() )
+        hidden::string_data::swap(b);
+    else
+        hidden::string_data::assign(b, pos, ali::mini(n, b.size() - pos));
+
+    return *this;
+}
+
+// ******************************************************************
+string& string::assign( string_const_ref b )
+// ******************************************************************
+{
+    hidden::string_data::assign(b);
+    return *this;
+}
+
+// ******************************************************************
+string& string::assign_( E c, int n )
+// ******************************************************************
+{
+    hidden::string_data::assign(n, c);
+    return *this;
+}
+
+// ******************************************************************
+string& string::reserve( int n )
+// ******************************************************************
+{
+    hidden::string_data::reserve(n);
+    return *this;
+}
+
+// ******************************************************************
+string& string::resize( int n, E c )
+// ******************************************************************
+{
+    hidden::string_data::resize(n, c);
+    return *this;
+}
+
+// ******************************************************************
+string& string::append(
+    string const& str,
+    int pos,
+    int n )
+// ******************************************************************
+{
+    return append(string_const_ref{
+        str.data() + pos, ali::mini(n, str.size() - pos)});
+}
+
+// ******************************************************************
+string& string::append( string_const_ref str )
+// ******************************************************************
+{
+    //  str may point into this string.
+    std::string const copy(str.data(), str.size());
+    int const size = this->size();
+
+    hidden::string_data::resize(size + str.size(), '\0');
+    std::memcpy(begin() + size, copy.data(), copy.size());
+    return *this;
+}
+
+// ******************************************************************
+string& string::append_( E c, int n )
+// ******************************************************************
+{
+    hidden::string_data::resize(size() + n, c);
+    return *this;
+}
+
+// ******************************************************************
+int string::find( string_const_ref str, int pos1 ) const noexcept
+// ******************************************************************
+{
+    for ( int i = pos1; i + str.size() <= size(); ++i )
+        if ( std::memcmp(data() + i, str.data(), str.size()) == 0 )
+            return i;
+
+    return npos;
+}
+
+// ******************************************************************
+int string::find( E c, int pos1 ) const noexcept
+// ******************************************************************
+{
+    for ( int i = pos1; i < size(); ++i )
+        if ( data()[i] == c )
+            return i;
+
+    return npos;
+}
+
+}   //  namespace ali
+
+namespace Softphone
+{
+namespace EventHistory
+{
+    Attribute::Value const Attribute::EMPTY;
+
+    ali::string_literal const MessageEvent::Attributes::subject{"subject"};
+    ali::string_literal const MessageEvent::Attributes::body{"body"};
+
+    ali::string_literal const EventAttachment::Attributes::contentPath{"contentPath"};
+    ali::string_literal const EventAttachment::Attributes::contentType{"contentType"};
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+
+    void EventAttachment::setContentType(ali::mime::content_type const&)
+    {
+        using ali::operator""_s;
+        setAttribute(Attributes::contentType, "application/octet-stream"_s);
+    }
+
+    void EventAttachment::setPath(ali::string_const_ref key, Attribute::Value path)
+    {
+        setFullAttribute(key, path);
+    }
+
+    void EventAttachment::setDirty()
+    {
+        if (mStorageStatus == StorageStatus::Stored)
+            mStorageStatus = StorageStatus::Dirty;
+    }
+
+    void RemoteUser::setDirty()
+    {
+        if (mStorageStatus == StorageStatus::Stored)
+            mStorageStatus = StorageStatus::Dirty;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+
+    EventStream::Cache EventStream::sCache;
+
+    EventStream::EventStream(ali::string_const_ref key,
+                             EventIdType lastEvent)
+        : key(key)
+        , mLastEventId(lastEvent)
+    {
+        sCache.set(this->key, this);
+    }
+
+    EventStream::~EventStream()
+    {
+        EventStream ** cached = sCache.find(key);
+
+        if (cached != nullptr && *cached == this)
+            sCache.erase(key);
+    }
+
+    void EventStream::save()
+    {}
+
+    void EventStream::setDirty()
+    {
+        if (mStorageStatus != StorageStatus::Removed)
+            mStorageStatus = StorageStatus::Dirty;
+    }
+
+    void EventStream::setRemoved(bool eraseFromCache)
+    {
+        mStorageStatus = StorageStatus::Removed;
+
+        if (eraseFromCache)
+            sCache.erase(key);
+    }
+
+    void EventStream::addStreamParty(StreamParty party)
+    {
+        mStreamParties.insert(ali::move(party));
+        setDirty();
+    }
+
+    void EventStream::setLastSeenTimestamp(TimestampType timestamp)
+    {
+        mLastSeenTimestamp = timestamp;
+        setDirty();
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+
+    Event::Cache Event::sCache;
+
+    Event::Event(EventType::Type eventType)
+        : eventType(eventType)
+    {}
+
+    Event::~Event()
+    {
+        Event ** cached = sCache.find(mEventId);
+
+        if (cached != nullptr && *cached == this)
+            sCache.erase(mEventId);
+    }
+
+    StorageStatus::Type Event::getStorageStatus() const
+    {
+        return mStorageStatus;
+    }
+
+    bool Event::isStored() const
+    {
+        return mStorageStatus == StorageStatus::Stored;
+    }
+
+    bool Event::isDirty() const
+    {
+        return mStorageStatus == StorageStatus::Dirty;
+    }
+
+    void Event::setAccount(ali::string_const_ref accountId)
+    {
+        mAccountId = accountId;
+        setDirty();
+    }
+
+    void Event::save()
+    {}
+
+    void Event::setDirty()
+    {
+        if (mStorageStatus == StorageStatus::Stored)
+            mStorageStatus = StorageStatus::Dirty;
+    }
+
+    void Event::setEventId(EventIdType eventId)
+    {
+        mEventId = eventId;
+        sCache.set(eventId, this);
+    }
+
+    void Event::setStored()
+    {
+        mStorageStatus = StorageStatus::Stored;
+    }
+
+    void Event::setRemoved(bool eraseFromCache)
+    {
+        mStorageStatus = StorageStatus::Removed;
+
+        if (eraseFromCache)
+            sCache.erase(mEventId);
+    }
+
+    void Event::setBeingRemoved()
+    {
+        mStorageStatus = StorageStatus::BeingRemoved;
+    }
+
+    ali::string& Event::formatEventPart(
+        ali::string& str,
+        Event const& value,
+        ali::string_const_ref formatString)
+    {
+        return ali::format(str, value.mEventId, formatString);
+    }
+
+    CallResult::Type CallEvent::getCallResult() const
+    {
+        return CallResult::Missed;
+    }
+
+    //*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-
+
+    Storage::Storage(bool useLegacyStream)
+        : mUseLegacyStream(useLegacyStream)
+        , mLastModified(0)
+        , mChangeCallbackMessage(0)
+    {}
+
+    ali::string Storage::matchStreamParties(ali::string const& streamKey)
+    {
+        return streamKey;
+    }
+
+    void Storage::postChangeCallbacks()
+    {
+        fireChangeCallbacks();
+    }
+
+    void Storage::fireChangeCallbacks()
+    {
+        auto const callbacks = mChangeCallbacks;
+
+        for (int i = 0; i < callbacks.size(); ++i)
+            callbacks.at(i).second(*this);
+
+        clearChanges();
+    }
+
+    void Storage::fireEventRemovedCallbacks(Event const& removedEvent) const
+    {
+        for (int i = 0; i < mEventRemovedCallbacks.size(); ++i)
+            mEventRemovedCallbacks.at(i).second(removedEvent);
+    }
+
+    void Storage::fireEventAttachmentRemovedCallbacks(Event const& event,
+                                                      EventAttachmentIdType attachmentId) const
+    {
+        for (int i = 0; i < mEventAttachmentRemovedCallbacks.size(); ++i)
+            mEventAttachmentRemovedCallbacks.at(i).second(event, attachmentId);
+    }
+}
+}
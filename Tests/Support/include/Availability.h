@@ -0,0 +1,6 @@
+/*
+ *  Availability.h
+ *  Platform stub for building the SDK headers on Linux
+ */
+
+#pragma once
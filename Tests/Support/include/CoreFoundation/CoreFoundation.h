@@ -0,0 +1,10 @@
+/*
+ *  CoreFoundation/CoreFoundation.h
+ *  Platform stub for building the SDK headers on Linux
+ */
+
+#pragma once
+
+typedef struct __CFString const* CFStringRef;
+typedef double CFAbsoluteTime;
+typedef double CFTimeInterval;
@@ -0,0 +1,16 @@
+/*
+ *  mach/clock.h
+ *  Platform stub for building the SDK headers on Linux
+ */
+
+#pragma once
+
+typedef int clock_serv_t;
+
+typedef struct
+{
+    unsigned int tv_sec;
+    int tv_nsec;
+} mach_timespec_t;
+
+int clock_get_time(clock_serv_t clock_serv, mach_timespec_t* cur_time);